@@ -0,0 +1,489 @@
+/*
+ * jeux-bench: load generator for the Jeux server.
+ *
+ * Usage: jeux-bench [-h <host>] -p <port> [-n <pairs>] [-t <seconds>]
+ *                   [-U <users_pct>] [-R <resign_pct>] [-W <withdraw_pct>]
+ *        jeux-bench -u <socket_path> [-n <pairs>] ...
+ *
+ * Each worker thread drives one pair of users over two connections.
+ * Both users log in, and then the pair repeatedly plays a game: the first
+ * user optionally lists the users (USERS, with probability users_pct),
+ * invites the second (INVITE), the second accepts (ACCEPT), and then the
+ * game is either resigned right away (RESIGN, with probability
+ * resign_pct) or played to the end (MOVE).  With probability
+ * withdraw_pct the invitation is not accepted but withdrawn instead, in
+ * one of three ways: the first user revokes it (REVOKE), the second
+ * declines it (DECLINE), or the first user disconnects, which must revoke
+ * it, and logs in again.  The time from sending each
+ * request until its ACK or NACK arrives is recorded per packet type.
+ * At the end, throughput and latency percentiles are printed.
+ *
+ * With -u the clients connect to the server's local Unix domain socket
+ * (its -l option) instead of a TCP port, so the two transports can be
+ * compared.
+ *
+ * Any NACK, unexpected packet, or timeout counts as an error; the pair
+ * then reconnects and starts over.  The exit status is nonzero if any
+ * error occurred, so runs against a local server double as a regression
+ * check of the protocol flow.
+ *
+ * Build: gcc -O2 -I<include dir> -I. -o jeux-bench bench/jeux_bench.c histogram.c csapp.c \
+ *            -lpthread
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+
+#include "csapp.h"
+#include "protocol.h"
+#include "histogram.h"
+
+#define RECV_TIMEOUT_SEC 5
+#define MAX_PAYLOAD 65536
+
+// Latency histogram in microseconds, with the buckets of histogram.h
+
+typedef struct histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+} HISTOGRAM;
+
+typedef enum {
+    M_LOGIN, M_USERS, M_INVITE, M_ACCEPT, M_MOVE, M_RESIGN, M_REVOKE, M_DECLINE
+} MEASURED;
+
+static const JEUX_PACKET_TYPE measured_types[] = {
+    JEUX_LOGIN_PKT, JEUX_USERS_PKT, JEUX_INVITE_PKT,
+    JEUX_ACCEPT_PKT, JEUX_MOVE_PKT, JEUX_RESIGN_PKT, JEUX_REVOKE_PKT, JEUX_DECLINE_PKT
+};
+static const char *measured_names[] = {
+    "LOGIN", "USERS", "INVITE", "ACCEPT", "MOVE", "RESIGN", "REVOKE", "DECLINE"
+};
+#define NUM_MEASURED (int)(sizeof(measured_types) / sizeof(measured_types[0]))
+
+typedef struct worker {
+    int index;
+    pthread_t tid;
+    unsigned int seed;
+    HISTOGRAM hist[NUM_MEASURED];
+    unsigned long games;
+    unsigned long errors;
+} WORKER;
+
+/*
+ * One connection, plus at most one notification that arrived while
+ * waiting for something else.
+ */
+typedef struct conn {
+    int fd;
+    JEUX_PACKET_HEADER pending;
+    int has_pending;
+    char name[64];
+} CONN;
+
+static char *host = "localhost";
+static char *port;
+static char *local_path;
+static int pairs = 8;
+static int duration = 10;
+static int users_pct = 20;
+static int resign_pct = 10;
+static int withdraw_pct = 0;
+static volatile int running = 1;
+
+static unsigned long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int send_pkt(CONN *c, JEUX_PACKET_TYPE type, int id, int role, char *payload)
+{
+    JEUX_PACKET_HEADER hdr = {0};
+    size_t len = payload == NULL ? 0 : strlen(payload);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.type = type;
+    hdr.id = id;
+    hdr.role = role;
+    hdr.size = htons(len);
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    if (rio_writen(c->fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+    {
+        return -1;
+    }
+    if (len > 0 && rio_writen(c->fd, payload, len) != (ssize_t)len)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Read one packet, discarding its payload. */
+static int recv_pkt(CONN *c, JEUX_PACKET_HEADER *hdr)
+{
+    static __thread char payload[MAX_PAYLOAD];
+    if (rio_readn(c->fd, hdr, sizeof(*hdr)) != sizeof(*hdr))
+    {
+        return -1;
+    }
+    size_t size = ntohs(hdr->size);
+    if (size > 0 && rio_readn(c->fd, payload, size) != (ssize_t)size)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait for the ACK or NACK answering a request.  A single notification
+ * arriving in the meantime is kept for wait_for().
+ *
+ * @return 0 for an ACK, -1 for a NACK or error.
+ */
+static int wait_reply(CONN *c, JEUX_PACKET_HEADER *reply)
+{
+    while (1)
+    {
+        JEUX_PACKET_HEADER hdr;
+        if (recv_pkt(c, &hdr) != 0)
+        {
+            return -1;
+        }
+        if (hdr.type == JEUX_ACK_PKT || hdr.type == JEUX_NACK_PKT)
+        {
+            if (reply != NULL)
+            {
+                *reply = hdr;
+            }
+            return hdr.type == JEUX_ACK_PKT ? 0 : -1;
+        }
+        c->pending = hdr;
+        c->has_pending = 1;
+    }
+}
+
+/* Wait for a notification of a specified type. */
+static int wait_for(CONN *c, JEUX_PACKET_TYPE type, JEUX_PACKET_HEADER *out)
+{
+    JEUX_PACKET_HEADER hdr;
+    if (c->has_pending)
+    {
+        hdr = c->pending;
+        c->has_pending = 0;
+    }
+    else if (recv_pkt(c, &hdr) != 0)
+    {
+        return -1;
+    }
+    if (hdr.type != type)
+    {
+        return -1;
+    }
+    if (out != NULL)
+    {
+        *out = hdr;
+    }
+    return 0;
+}
+
+/* Send a request and time it until its reply. */
+static int request(WORKER *w, CONN *c, MEASURED measured, int id, int role, char *payload,
+                   JEUX_PACKET_HEADER *reply)
+{
+    unsigned long start = now_us();
+    if (send_pkt(c, measured_types[measured], id, role, payload) != 0)
+    {
+        return -1;
+    }
+    int ret = wait_reply(c, reply);
+    HISTOGRAM *h = &w->hist[measured];
+    h->counts[hist_index(now_us() - start)]++;
+    h->total++;
+    return ret;
+}
+
+static int open_localfd(char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static int connect_user(CONN *c, WORKER *w, int which)
+{
+    c->has_pending = 0;
+    c->fd = local_path != NULL ? open_localfd(local_path) : open_clientfd(host, port);
+    if (c->fd < 0)
+    {
+        return -1;
+    }
+    struct timeval tv = {RECV_TIMEOUT_SEC, 0};
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // Header and payload are written separately; don't let Nagle hold the payload
+    if (local_path == NULL)
+    {
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    snprintf(c->name, sizeof(c->name), "bench%d_%d_%c", getpid(), w->index, which);
+    return request(w, c, M_LOGIN, 0, 0, c->name, NULL);
+}
+
+/*
+ * Withdraw an open invitation from user a to user b, whose IDs for it
+ * are a_id and b_id, in a randomly chosen way.
+ */
+static int withdraw(WORKER *w, CONN *a, CONN *b, int a_id, int b_id)
+{
+    switch (rand_r(&w->seed) % 3)
+    {
+    case 0:
+        if (request(w, a, M_REVOKE, a_id, 0, NULL, NULL) != 0 ||
+            wait_for(b, JEUX_REVOKED_PKT, NULL) != 0)
+        {
+            return -1;
+        }
+        return 0;
+    case 1:
+        if (request(w, b, M_DECLINE, b_id, 0, NULL, NULL) != 0 ||
+            wait_for(a, JEUX_DECLINED_PKT, NULL) != 0)
+        {
+            return -1;
+        }
+        return 0;
+    default:
+        close(a->fd);
+        a->fd = -1;
+        if (wait_for(b, JEUX_REVOKED_PKT, NULL) != 0)
+        {
+            return -1;
+        }
+        // The old session may not have finished logging out yet
+        for (int i = 0; i < 50; i++)
+        {
+            if (a->fd >= 0)
+            {
+                close(a->fd);
+            }
+            if (connect_user(a, w, 'a') == 0)
+            {
+                return 0;
+            }
+            usleep(10000);
+        }
+        return -1;
+    }
+}
+
+/*
+ * Play one game between the two users of a pair.
+ * The invited user moves first, and wins with the top row.
+ */
+static int play_game(WORKER *w, CONN *a, CONN *b)
+{
+    JEUX_PACKET_HEADER reply, invited;
+
+    if ((int)(rand_r(&w->seed) % 100) < users_pct && request(w, a, M_USERS, 0, 0, NULL, NULL) != 0)
+    {
+        return -1;
+    }
+    if (request(w, a, M_INVITE, 0, 1, b->name, &reply) != 0)
+    {
+        return -1;
+    }
+    int a_id = reply.id;
+    if (wait_for(b, JEUX_INVITED_PKT, &invited) != 0)
+    {
+        return -1;
+    }
+    int b_id = invited.id;
+    if ((int)(rand_r(&w->seed) % 100) < withdraw_pct)
+    {
+        return withdraw(w, a, b, a_id, b_id);
+    }
+    if (request(w, b, M_ACCEPT, b_id, 0, NULL, NULL) != 0 ||
+        wait_for(a, JEUX_ACCEPTED_PKT, NULL) != 0)
+    {
+        return -1;
+    }
+
+    if ((int)(rand_r(&w->seed) % 100) < resign_pct)
+    {
+        if (request(w, a, M_RESIGN, a_id, 0, NULL, NULL) != 0 ||
+            wait_for(b, JEUX_RESIGNED_PKT, NULL) != 0)
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    static char *moves[] = {"1", "4", "2", "5", "3"};
+    for (int i = 0; i < 5; i++)
+    {
+        CONN *mover = i % 2 == 0 ? b : a;
+        CONN *other = i % 2 == 0 ? a : b;
+        if (request(w, mover, M_MOVE, mover == a ? a_id : b_id, 0, moves[i], NULL) != 0 ||
+            wait_for(other, JEUX_MOVED_PKT, NULL) != 0)
+        {
+            return -1;
+        }
+    }
+    if (wait_for(a, JEUX_ENDED_PKT, NULL) != 0 || wait_for(b, JEUX_ENDED_PKT, NULL) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+    WORKER *w = arg;
+    while (running)
+    {
+        CONN a = {.fd = -1}, b = {.fd = -1};
+        if (connect_user(&a, w, 'a') == 0 && connect_user(&b, w, 'b') == 0)
+        {
+            while (running && play_game(w, &a, &b) == 0)
+            {
+                w->games++;
+            }
+        }
+        if (running)
+        {
+            w->errors++;
+        }
+        if (a.fd >= 0)
+        {
+            close(a.fd);
+        }
+        if (b.fd >= 0)
+        {
+            close(b.fd);
+        }
+        if (running)
+        {
+            usleep(100000);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:n:t:U:R:W:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'u':
+            local_path = optarg;
+            break;
+        case 'n':
+            pairs = atoi(optarg);
+            break;
+        case 't':
+            duration = atoi(optarg);
+            break;
+        case 'U':
+            users_pct = atoi(optarg);
+            break;
+        case 'R':
+            resign_pct = atoi(optarg);
+            break;
+        case 'W':
+            withdraw_pct = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-h host] -p port | -u path [-n pairs] [-t seconds] "
+                            "[-U users_pct] [-R resign_pct] [-W withdraw_pct]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((port == NULL && local_path == NULL) || pairs <= 0 || duration <= 0)
+    {
+        fprintf(stderr, "%s: a port or socket path, and positive pair count and duration, are required\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    WORKER *workers = calloc(pairs, sizeof(WORKER));
+    if (workers == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    unsigned long start = now_us();
+    for (int i = 0; i < pairs; i++)
+    {
+        workers[i].index = i;
+        workers[i].seed = start + i;
+        pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+    }
+    sleep(duration);
+    running = 0;
+    for (int i = 0; i < pairs; i++)
+    {
+        // A worker blocked on a lost reply gives up after RECV_TIMEOUT_SEC.
+        pthread_join(workers[i].tid, NULL);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+
+    HISTOGRAM total[NUM_MEASURED] = {0};
+    unsigned long games = 0, errors = 0;
+    for (int i = 0; i < pairs; i++)
+    {
+        games += workers[i].games;
+        errors += workers[i].errors;
+        for (int t = 0; t < NUM_MEASURED; t++)
+        {
+            for (int b = 0; b < HIST_BUCKETS; b++)
+            {
+                total[t].counts[b] += workers[i].hist[t].counts[b];
+            }
+            total[t].total += workers[i].hist[t].total;
+        }
+    }
+
+    printf("%d pairs, %.1f s, %lu games (%.1f/s), %lu errors\n",
+           pairs, elapsed, games, games / elapsed, errors);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "packet", "count", "per sec",
+           "p50 us", "p99 us", "p999 us");
+    for (int t = 0; t < NUM_MEASURED; t++)
+    {
+        if (total[t].total == 0)
+        {
+            continue;
+        }
+        printf("%-8s %10lu %10.1f %10lu %10lu %10lu\n", measured_names[t],
+               total[t].total, total[t].total / elapsed,
+               hist_percentile(total[t].counts, total[t].total, 50.0),
+               hist_percentile(total[t].counts, total[t].total, 99.0),
+               hist_percentile(total[t].counts, total[t].total, 99.9));
+    }
+    free(workers);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
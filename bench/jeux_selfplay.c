@@ -0,0 +1,320 @@
+/*
+ * jeux-selfplay: headless self-play driver for the game module.
+ *
+ * Usage: jeux-selfplay [-n <games>] [-t <threads>] [-c <chunk>] [-s <seed>] [-S]
+ *
+ * Plays games against the game module directly, with no server or
+ * sockets: each game is made by game_create(), and each move is chosen
+ * at random among the empty squares, parsed by game_parse_move() and
+ * applied by game_apply_move(), until game_is_over() reports that the
+ * game has ended (game_apply_move() runs the game module's own end of
+ * game check).  The result is taken from game_get_winner().
+ *
+ * The games are numbered, and the moves of each game are drawn from a
+ * generator seeded by its number, so the tally of results depends only
+ * on the seed and the number of games, never on the thread count or
+ * scheduling.  A run therefore doubles as a regression check: the same
+ * arguments must always give the same tally.
+ *
+ * The games are shared out by work stealing.  Each thread starts with
+ * an equal range of game numbers and plays them a chunk at a time from
+ * the front; a thread whose range is empty steals the back half of the
+ * range of another thread, trying each in turn, and stops when none has
+ * work left.
+ *
+ * At the end, throughput is printed as games per second of wall time,
+ * per thread, and per CPU-second actually used by the threads, which is
+ * the per-core rate.  With -S the run is repeated for 1, 2, 4, ... up
+ * to the given number of threads, to show how the game module scales.
+ * The exit status is nonzero if the game module refused any move.
+ *
+ * Build: gcc -O2 -I<include dir> -o jeux-selfplay bench/jeux_selfplay.c game.c jlog.c lock_profile.c -lpthread
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "global.h"
+
+#define DEFAULT_GAMES 1000000
+#define DEFAULT_CHUNK 256
+
+typedef struct worker {
+    pthread_t tid;
+    int index;
+    pthread_mutex_t lock;               // Guards next and end
+    unsigned long next;                 // Game numbers not yet played:
+    unsigned long end;                  // [next, end)
+    unsigned long games;
+    unsigned long steals;
+    unsigned long refused;
+    unsigned long results[3];           // Draws, first and second player wins
+    double cpu;                         // Seconds
+    char pad[64];                       // Keep neighbours off this cache line
+} WORKER;
+
+static WORKER *workers;
+static int nworkers;
+static unsigned long chunk = DEFAULT_CHUNK;
+static uint64_t seed;
+
+static double now_sec(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// splitmix64, so that nearby game numbers give unrelated move sequences
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Play game number "number" with random moves.
+ *
+ * @return the result index (0 draw, 1 first player, 2 second player),
+ * or -1 if the game module refused a move.
+ */
+static int play_game(WORKER *w, unsigned long number)
+{
+    uint64_t state = seed ^ (number * 0xd1b54a32d192ed03ULL);
+    GAME *game = game_create();
+    if (game == NULL)
+    {
+        return -1;
+    }
+
+    char str[2] = { 0, 0 };
+    while (!game_is_over(game))
+    {
+        int empty[9];
+        int n = 0;
+        for (int k = 0; k < 9; k++)
+        {
+            if (game->game_board[k / 3][k % 3] == 0)
+            {
+                empty[n++] = k + 1;
+            }
+        }
+        str[0] = '0' + empty[next_random(&state) % n];
+        GAME_MOVE *move = game_parse_move(game, game->current_role, str);
+        if (move == NULL || game_apply_move(game, move) != 0)
+        {
+            free(move);
+            game_unref(game, "self-play refused");
+            return -1;
+        }
+        free(move);
+    }
+
+    GAME_ROLE winner = game_get_winner(game);
+    game_unref(game, "self-play over");
+    return winner == FIRST_PLAYER_ROLE ? 1 : winner == SECOND_PLAYER_ROLE ? 2 : 0;
+}
+
+// Take up to a chunk of this worker's own range
+static int take(WORKER *w, unsigned long *first, unsigned long *last)
+{
+    pthread_mutex_lock(&w->lock);
+    *first = w->next;
+    *last = w->end - w->next > chunk ? w->next + chunk : w->end;
+    w->next = *last;
+    pthread_mutex_unlock(&w->lock);
+    return *first < *last;
+}
+
+// Move the back half of some other worker's range to this one
+static int steal(WORKER *w)
+{
+    for (int i = 1; i < nworkers; i++)
+    {
+        WORKER *victim = &workers[(w->index + i) % nworkers];
+        pthread_mutex_lock(&victim->lock);
+        unsigned long left = victim->end - victim->next;
+        if (left == 0)
+        {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        unsigned long mid = victim->end - (left + 1) / 2;
+        unsigned long end = victim->end;
+        victim->end = mid;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&w->lock);
+        w->next = mid;
+        w->end = end;
+        pthread_mutex_unlock(&w->lock);
+        w->steals++;
+        return 1;
+    }
+    return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+    WORKER *w = arg;
+    double start = now_sec(CLOCK_THREAD_CPUTIME_ID);
+    unsigned long first, last;
+    do
+    {
+        while (take(w, &first, &last))
+        {
+            for (unsigned long number = first; number < last; number++)
+            {
+                int result = play_game(w, number);
+                if (result < 0)
+                {
+                    w->refused++;
+                    continue;
+                }
+                w->results[result]++;
+                w->games++;
+            }
+        }
+    } while (steal(w));
+    w->cpu = now_sec(CLOCK_THREAD_CPUTIME_ID) - start;
+    return NULL;
+}
+
+/*
+ * Play "games" games on "threads" threads and print one line of results.
+ *
+ * @return the number of refused games, or -1 if out of memory.
+ */
+static long run(unsigned long games, int threads, double *ratep)
+{
+    nworkers = threads;
+    workers = calloc(threads, sizeof(WORKER));
+    if (workers == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].index = i;
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].next = games * i / threads;
+        workers[i].end = games * (i + 1) / threads;
+    }
+
+    double start = now_sec(CLOCK_MONOTONIC);
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]) != 0)
+        {
+            fprintf(stderr, "cannot start thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
+    }
+    double elapsed = now_sec(CLOCK_MONOTONIC) - start;
+
+    unsigned long played = 0, steals = 0, refused = 0;
+    unsigned long results[3] = { 0, 0, 0 };
+    double cpu = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        played += workers[i].games;
+        steals += workers[i].steals;
+        refused += workers[i].refused;
+        cpu += workers[i].cpu;
+        for (int r = 0; r < 3; r++)
+        {
+            results[r] += workers[i].results[r];
+        }
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+    free(workers);
+
+    double rate = played / elapsed;
+    printf("%3d %12lu %8.3f %12.0f %12.0f %12.0f %8lu %6.2f %6.2f %6.2f %8lu\n",
+           threads, played, elapsed, rate, rate / threads, cpu > 0 ? played / cpu : 0,
+           steals, played ? 100.0 * results[1] / played : 0,
+           played ? 100.0 * results[2] / played : 0,
+           played ? 100.0 * results[0] / played : 0, refused);
+    if (ratep != NULL)
+    {
+        *ratep = rate;
+    }
+    return refused;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long games = DEFAULT_GAMES;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int sweep = 0;
+    seed = time(NULL);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:c:s:S")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            games = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            chunk = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            sweep = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n games] [-t threads] [-c chunk] [-s seed] [-S]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (games == 0 || threads <= 0 || chunk == 0)
+    {
+        fprintf(stderr, "%s: games, threads and chunk must be positive\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("seed %llu, %lu games per run, chunk %lu\n",
+           (unsigned long long)seed, games, chunk);
+    printf("%3s %12s %8s %12s %12s %12s %8s %6s %6s %6s %8s\n", "thr", "games", "sec",
+           "games/s", "per thread", "per core", "steals", "1st %", "2nd %", "draw %",
+           "refused");
+    long refused = 0;
+    double base = 0, rate;
+    for (int t = sweep ? 1 : threads; t <= threads; t = t < threads && 2 * t > threads ? threads : 2 * t)
+    {
+        long r = run(games, t, &rate);
+        if (r < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        refused += r;
+        if (t == 1)
+        {
+            base = rate;
+        }
+        if (sweep && t > 1)
+        {
+            printf("    speedup %.2f on %d threads (efficiency %.0f%%)\n",
+                   rate / base, t, 100.0 * rate / base / t);
+        }
+    }
+    return refused == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
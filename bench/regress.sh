@@ -0,0 +1,201 @@
+#!/bin/bash
+#
+# Regression suite: runs jeux-bench against a local server.
+#
+# Usage: bench/regress.sh [<jeux binary>]
+#
+# Run from the top of the tree.  The script builds jeux-bench into a
+# temporary directory (CC, CFLAGS and INCLUDE, the directory holding
+# protocol.h and csapp.h, may be set in the environment), then, for each
+# event loop in LOOPS (default "epoll uring"):
+#
+#   - starts the server on a free TCP port, with a local Unix domain
+#     socket, a handoff socket, and data and game log directories, all
+#     in the temporary directory;
+#   - runs fixed mixes of games over TCP and over the local socket,
+#     including invitations that are revoked, declined, or left open by
+#     a user who disconnects;
+#   - checks that the server has closed the connections of those runs;
+#   - starts a successor with the same handoff socket while a run is in
+#     progress, checks that the old server exits, and runs again against
+#     the successor;
+#   - stops the successor with SIGHUP and checks that it exits cleanly.
+#
+# A run fails if jeux-bench reports any error, or if the p99 latency of
+# any packet type exceeds P99_MAX_US microseconds (default 50000).  The
+# exit status is nonzero if any run failed.
+#
+# Example: INCLUDE=include bench/regress.sh bin/jeux
+#
+
+JEUX=${1:-bin/jeux}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+INCLUDE=${INCLUDE:-include}
+LOOPS=${LOOPS:-"epoll uring"}
+P99_MAX_US=${P99_MAX_US:-50000}
+PAIRS=${PAIRS:-8}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-3}
+
+if [ ! -x "$JEUX" ]; then
+    echo "regress: no server binary at $JEUX" >&2
+    exit 2
+fi
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/jeux-regress.XXXXXX") || exit 2
+SERVER_PIDS=
+trap 'for p in $SERVER_PIDS; do kill -9 $p 2>/dev/null; done; rm -rf "$TMP"' EXIT
+trap 'exit 2' INT TERM
+
+BENCH=$TMP/jeux-bench
+if ! $CC $CFLAGS -I"$INCLUDE" -I. -o "$BENCH" bench/jeux_bench.c histogram.c csapp.c \
+         -lpthread; then
+    echo "regress: cannot build jeux-bench" >&2
+    exit 2
+fi
+
+FAILED=0
+
+fail()
+{
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+# Pick a port that nothing is listening on.
+free_port()
+{
+    while :; do
+        port=$(awk 'BEGIN { srand(); print 20000 + int(rand() * 40000) }')
+        if ! (echo -n > /dev/tcp/127.0.0.1/$port) 2>/dev/null; then
+            echo $port
+            return
+        fi
+        sleep 1
+    done
+}
+
+# Wait up to five seconds for a server to accept connections on a port.
+wait_listening()
+{
+    i=0
+    while [ $i -lt 50 ]; do
+        if (echo -n > /dev/tcp/127.0.0.1/$1) 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+        i=$((i + 1))
+    done
+    return 1
+}
+
+# Wait up to $2 seconds for process $1 to exit; return its status.
+wait_exit()
+{
+    i=0
+    while kill -0 $1 2>/dev/null && [ $i -lt $(($2 * 10)) ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    if kill -0 $1 2>/dev/null; then
+        return 255
+    fi
+    wait $1
+}
+
+# Check the output of one jeux-bench run: no errors, and every p99 under
+# the limit.
+check()
+{
+    name=$1
+    status=$2
+    out=$3
+    sed "s/^/  /" "$out"
+    if [ $status -ne 0 ]; then
+        fail "$name: jeux-bench exited with status $status"
+    fi
+    awk -v max=$P99_MAX_US -v name="$name" '
+        NR == 1 { games = $5 }
+        NR > 2 && $5 + 0 > max { print "FAIL: " name ": " $1 " p99 " $5 " us"; bad = 1 }
+        END { if (games == 0) { print "FAIL: " name ": no games"; bad = 1 }; exit bad }
+    ' "$out" || FAILED=1
+}
+
+# Run jeux-bench with arguments $2...; $1 names the run.
+run()
+{
+    name=$1
+    shift
+    echo "== $name"
+    "$BENCH" "$@" -n $PAIRS -t $SECONDS_PER_RUN > "$TMP/out" 2>&1
+    check "$name" $? "$TMP/out"
+}
+
+for loop in $LOOPS; do
+    PORT=$(free_port)
+    DIR=$TMP/$loop
+    mkdir -p "$DIR/data" "$DIR/games"
+    LOCAL=$DIR/local.sock
+    HANDOFF=$DIR/handoff.sock
+    ARGS="-p $PORT -l $LOCAL -u $HANDOFF -d $DIR/data -g $DIR/games -i $loop -t 5"
+
+    "$JEUX" $ARGS > "$DIR/server1.log" 2>&1 &
+    OLD=$!
+    SERVER_PIDS="$SERVER_PIDS $OLD"
+    if ! wait_listening $PORT; then
+        fail "$loop: server did not start"
+        continue
+    fi
+
+    run "$loop tcp, moves only" -p $PORT -U 0 -R 0
+    run "$loop tcp, users and resigns" -p $PORT -U 50 -R 50
+    run "$loop local socket" -u $LOCAL -U 20 -R 20
+    run "$loop tcp, withdrawn invitations" -p $PORT -U 0 -R 20 -W 50
+
+    # Every client of the finished runs must have been freed, closing its
+    # connection.
+    sleep 1
+    if [ -d /proc/$OLD/fd ]; then
+        fds=$(ls /proc/$OLD/fd | wc -l)
+        if [ $fds -gt 32 ]; then
+            fail "$loop: $fds descriptors still open after the runs"
+        fi
+    fi
+
+    # Hot restart in the middle of a run: no exchange may fail.
+    echo "== $loop hot restart"
+    "$BENCH" -p $PORT -U 20 -R 20 -n $PAIRS -t $((SECONDS_PER_RUN * 2)) \
+        > "$TMP/out" 2>&1 &
+    BENCH_PID=$!
+    sleep 1
+    "$JEUX" $ARGS > "$DIR/server2.log" 2>&1 &
+    NEW=$!
+    SERVER_PIDS="$SERVER_PIDS $NEW"
+    wait $BENCH_PID
+    check "$loop hot restart" $? "$TMP/out"
+    wait_exit $OLD 10
+    status=$?
+    if [ $status -ne 0 ]; then
+        fail "$loop hot restart: old server exit status $status"
+    fi
+    if ! kill -0 $NEW 2>/dev/null; then
+        fail "$loop hot restart: successor is not running"
+        continue
+    fi
+
+    run "$loop after hot restart" -p $PORT -U 20 -R 20
+
+    kill -HUP $NEW
+    wait_exit $NEW 15
+    status=$?
+    if [ $status -ne 0 ]; then
+        fail "$loop shutdown: exit status $status"
+    fi
+done
+
+if [ $FAILED -ne 0 ]; then
+    echo "regress: FAILED"
+    exit 1
+fi
+echo "regress: passed"
+exit 0
@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bot.h"
+#include "jeux_globals.h"
+#include "global.h"
+#include "jlog.h"
+
+typedef enum { BOT_START, BOT_MOVE, BOT_QUIT } BOT_JOB_TYPE;
+
+typedef struct bot_job {
+    BOT_JOB_TYPE type;
+    CLIENT *bot;
+    CLIENT *opponent;               // BOT_START only
+    GAME_ROLE role;                 // BOT_START only: the bot's role
+    struct bot_job *next;
+} BOT_JOB;
+
+static struct {
+    signed char value[BOT_POSITIONS];   // For the side to move
+    unsigned char move[BOT_POSITIONS];  // Best move, 1-9, or 0
+    unsigned char solved[BOT_POSITIONS];
+    PLAYER *player;
+    BOT_JOB *head;
+    BOT_JOB *tail;
+    int running;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+} bots = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static const int pow3[9] = { 1, 3, 9, 27, 81, 243, 729, 2187, 6561 };
+
+static const int lines[8][3] = {
+    { 0, 1, 2 }, { 3, 4, 5 }, { 6, 7, 8 },
+    { 0, 3, 6 }, { 1, 4, 7 }, { 2, 5, 8 },
+    { 0, 4, 8 }, { 2, 4, 6 }
+};
+
+/*
+ * Solve a position by negamax.  A cell is 0 if empty, 1 for X and 2 for
+ * O; X moves when the counts are equal.  A win scores 10 less the number
+ * of cells filled when it happens, so that quicker wins and slower
+ * losses are preferred.
+ *
+ * @return the value of the position for the side to move.
+ */
+static int solve(int index)
+{
+    if (bots.solved[index])
+    {
+        return bots.value[index];
+    }
+    int cells[9];
+    int filled = 0;
+    int xs = 0;
+    for (int k = 0, rest = index; k < 9; k++, rest /= 3)
+    {
+        cells[k] = rest % 3;
+        filled += cells[k] != 0;
+        xs += cells[k] == 1;
+    }
+
+    int best = -100;
+    int best_move = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        int c = cells[lines[i][0]];
+        if (c != 0 && c == cells[lines[i][1]] && c == cells[lines[i][2]])
+        {
+            // The side that has just moved has won
+            best = -(10 - filled);
+            break;
+        }
+    }
+    if (best == -100 && filled == 9)
+    {
+        best = 0;
+    }
+    if (best == -100)
+    {
+        int side = 2 * xs == filled ? 1 : 2;
+        for (int k = 0; k < 9; k++)
+        {
+            if (cells[k] == 0)
+            {
+                int v = -solve(index + side * pow3[k]);
+                if (v > best)
+                {
+                    best = v;
+                    best_move = k + 1;
+                }
+            }
+        }
+    }
+    bots.value[index] = best;
+    bots.move[index] = best_move;
+    bots.solved[index] = 1;
+    return best;
+}
+
+static void enqueue(BOT_JOB_TYPE type, CLIENT *bot, CLIENT *opponent, GAME_ROLE role)
+{
+    BOT_JOB *job = malloc(sizeof(BOT_JOB));
+    if (job == NULL)
+    {
+        return;
+    }
+    job->type = type;
+    job->bot = bot;
+    job->opponent = opponent;
+    job->role = role;
+    job->next = NULL;
+
+    pthread_mutex_lock(&bots.mutex);
+    if (bots.tail != NULL)
+    {
+        bots.tail->next = job;
+    }
+    else
+    {
+        bots.head = job;
+    }
+    bots.tail = job;
+    pthread_cond_signal(&bots.cond);
+    pthread_mutex_unlock(&bots.mutex);
+}
+
+// Make the bot's move in its game, if it is the bot's turn
+static void move(CLIENT *bot)
+{
+    int id = -1;
+    GAME *game = NULL;
+    GAME_ROLE role = NULL_ROLE;
+    pthread_mutex_lock(&bot->lock);
+    for (INVITATION_NODE *node = bot->invitations; node != NULL; node = node->next)
+    {
+        GAME *g = inv_get_game(node->invitation);
+        if (g != NULL && !game_is_over(g))
+        {
+            id = node->id;
+            game = game_ref(g, "bot to move");
+            role = node->invitation->source == bot ?
+                node->invitation->source_role : node->invitation->target_role;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bot->lock);
+    if (game == NULL)
+    {
+        return;
+    }
+
+    int index = 0;
+    int square = 0;
+    pthread_mutex_lock(&game->mutex);
+    int turn = !game->game_over && game->current_role == role;
+    for (int k = 0; k < 9; k++)
+    {
+        int cell = game->game_board[k / 3][k % 3];
+        index += (cell == 1 ? 1 : cell == -1 ? 2 : 0) * pow3[k];
+        if (cell == 0 && square == 0)
+        {
+            square = k + 1;
+        }
+    }
+    pthread_mutex_unlock(&game->mutex);
+
+    if (turn && square != 0)
+    {
+        if (bots.move[index] != 0)
+        {
+            square = bots.move[index];
+        }
+        char str[2] = { '0' + square, '\0' };
+        if (client_make_move(bot, id, str) != 0)
+        {
+            jlog_warn("bot move %s refused", str);
+        }
+    }
+    game_unref(game, "bot moved");
+}
+
+static void *bot_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&bots.mutex);
+        while (!bots.stop && bots.head == NULL)
+        {
+            pthread_cond_wait(&bots.cond, &bots.mutex);
+        }
+        if (bots.stop)
+        {
+            pthread_mutex_unlock(&bots.mutex);
+            break;
+        }
+        BOT_JOB *job = bots.head;
+        bots.head = job->next;
+        if (bots.head == NULL)
+        {
+            bots.tail = NULL;
+        }
+        pthread_mutex_unlock(&bots.mutex);
+
+        switch (job->type)
+        {
+        case BOT_START:
+            if (client_start_game(job->role == FIRST_PLAYER_ROLE ? job->bot : job->opponent,
+                                  job->role == FIRST_PLAYER_ROLE ? job->opponent : job->bot,
+                                  NULL) != 0)
+            {
+                enqueue(BOT_QUIT, job->bot, NULL, NULL_ROLE);
+            }
+            client_unref(job->opponent, "bot game started");
+            break;
+        case BOT_MOVE:
+            move(job->bot);
+            break;
+        case BOT_QUIT:
+            client_logout(job->bot);
+            client_unref(job->bot, "bot finished");
+            break;
+        }
+        free(job);
+    }
+    return NULL;
+}
+
+/*
+ * Solve every position and start the bot thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int bot_init(void)
+{
+    solve(0);
+    bots.player = preg_register(player_registry, BOT_NAME);
+    if (bots.player == NULL)
+    {
+        return -1;
+    }
+    if (pthread_create(&bots.thread, NULL, bot_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    bots.running = 1;
+    return 0;
+}
+
+/*
+ * Stop the bot thread.  Bots still playing are abandoned.
+ */
+void bot_fini(void)
+{
+    if (!bots.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&bots.mutex);
+    bots.stop = 1;
+    pthread_cond_signal(&bots.cond);
+    pthread_mutex_unlock(&bots.mutex);
+    pthread_join(bots.thread, NULL);
+    bots.running = 0;
+
+    while (bots.head != NULL)
+    {
+        BOT_JOB *job = bots.head;
+        bots.head = job->next;
+        if (job->type == BOT_START)
+        {
+            client_unref(job->opponent, "bot stopped");
+        }
+        free(job);
+    }
+    bots.tail = NULL;
+    preg_release(player_registry, bots.player, "bots stopped");
+    bots.player = NULL;
+}
+
+/*
+ * @return nonzero if "name" is the name under which bots play.
+ */
+int bot_is_name(char *name)
+{
+    return name != NULL && strcmp(name, BOT_NAME) == 0;
+}
+
+/*
+ * Start a game between a logged-in client and a new bot.  The game is
+ * started by the bot thread, after the caller has answered the INVITE.
+ *
+ * @param client  The CLIENT that is to play the bot.
+ * @param role  The GAME_ROLE that the bot is to play.
+ * @return 0 if the game will be started, otherwise -1.
+ */
+int bot_play(CLIENT *client, GAME_ROLE role)
+{
+    if (!bots.running || client_get_player(client) == NULL)
+    {
+        return -1;
+    }
+    CLIENT *bot = client_create(client_registry, -1);
+    if (bot == NULL)
+    {
+        return -1;
+    }
+    if (client_login(bot, bots.player) != 0)
+    {
+        client_unref(bot, "bot not logged in");
+        return -1;
+    }
+    enqueue(BOT_START, bot, client_ref(client, "playing a bot"), role);
+    return 0;
+}
+
+/*
+ * Take a packet addressed to a bot, in place of writing it to a
+ * connection.  Called by client_send_packet(), possibly with client
+ * locks held, so the bot only queues its answer.
+ *
+ * @return 0.
+ */
+int bot_deliver(CLIENT *bot, JEUX_PACKET_HEADER *hdr)
+{
+    switch (hdr->type)
+    {
+    case JEUX_ACCEPTED_PKT:
+        if (hdr->role == FIRST_PLAYER_ROLE)
+        {
+            enqueue(BOT_MOVE, bot, NULL, NULL_ROLE);
+        }
+        break;
+    case JEUX_MOVED_PKT:
+        enqueue(BOT_MOVE, bot, NULL, NULL_ROLE);
+        break;
+    case JEUX_ENDED_PKT:
+    case JEUX_RESIGNED_PKT:
+        enqueue(BOT_QUIT, bot, NULL, NULL_ROLE);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
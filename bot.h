@@ -0,0 +1,34 @@
+#ifndef BOT_H
+#define BOT_H
+
+#include "global.h"
+
+/*
+ * Computer opponents.
+ *
+ * An INVITE whose target is BOT_NAME starts a game at once against an
+ * in-process bot, with the roles requested in the INVITE; the inviter is
+ * sent ACK and then ACCEPTED as for a game found by SEEK.  Each such game
+ * gets its own bot: a CLIENT logged in as the player BOT_NAME, with no
+ * connection (its fd is -1) and not in the client registry.  Packets
+ * sent to a bot are handed to bot_deliver() instead of being written,
+ * and a worker thread answers them: ACCEPTED as the first player and
+ * MOVED with a move, ENDED and RESIGNED by logging the bot out.
+ *
+ * The bot plays perfectly.  Its move in every one of the 3^9 board
+ * positions, indexed by the cells of the GAME board in base 3, is solved
+ * by minimax into a table when the server starts, so a reply is a table
+ * lookup.  No one may log in as BOT_NAME.  Bot games are not carried
+ * across a hot restart.
+ */
+
+#define BOT_NAME "computer"
+#define BOT_POSITIONS 19683             // 3^9
+
+int bot_init(void);
+void bot_fini(void);
+int bot_is_name(char *name);
+int bot_play(CLIENT *client, GAME_ROLE role);
+int bot_deliver(CLIENT *bot, JEUX_PACKET_HEADER *hdr);
+
+#endif
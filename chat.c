@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "chat.h"
+#include "jeux_globals.h"
+#include "global.h"
+#include "jlog.h"
+
+/*
+ * A packet to be sent to every member of a room, shared by reference.
+ * The header is in network byte order.
+ */
+typedef struct chat_buffer {
+    int refs;
+    JEUX_PACKET_HEADER hdr;
+    char payload[];
+} CHAT_BUFFER;
+
+typedef struct room {
+    int id;
+    char name[CHAT_MAX_NAME + 1];
+    CLIENT **members;
+    int nmembers;
+    int capacity;
+    CHAT_BUFFER *history[CHAT_HISTORY]; // Ring of the last messages
+    int first;                          // Oldest message in history
+    int count;
+} ROOM;
+
+static struct {
+    pthread_mutex_t mutex;
+    ROOM *rooms[CHAT_MAX_ROOMS];        // Indexed by ID
+} chat = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static CHAT_BUFFER *buffer_new(JEUX_PACKET_TYPE type, int id, const char *sender,
+                               const char *text)
+{
+    size_t len = strlen(sender) + 1 + strlen(text);
+    CHAT_BUFFER *buf = malloc(sizeof(CHAT_BUFFER) + len + 1);
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+    buf->refs = 1;
+    memset(&buf->hdr, 0, sizeof(buf->hdr));
+    buf->hdr.type = type;
+    buf->hdr.id = id;
+    buf->hdr.size = htons(len);
+    snprintf(buf->payload, len + 1, "%s\t%s", sender, text);
+    return buf;
+}
+
+static CHAT_BUFFER *buffer_ref(CHAT_BUFFER *buf)
+{
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+static void buffer_unref(CHAT_BUFFER *buf)
+{
+    if (buf != NULL && __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(buf);
+    }
+}
+
+// Called with chat.mutex held
+static int member_index(ROOM *room, CLIENT *client)
+{
+    for (int i = 0; i < room->nmembers; i++)
+    {
+        if (room->members[i] == client)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Called with chat.mutex held
+static void room_free(ROOM *room)
+{
+    for (int i = 0; i < room->nmembers; i++)
+    {
+        client_unref(room->members[i], "room closed");
+    }
+    for (int i = 0; i < room->count; i++)
+    {
+        buffer_unref(room->history[(room->first + i) % CHAT_HISTORY]);
+    }
+    chat.rooms[room->id] = NULL;
+    free(room->members);
+    free(room);
+}
+
+/*
+ * Remove a member from a room, freeing the room if it was the last.
+ * Called with chat.mutex held.
+ */
+static void member_remove(ROOM *room, int index)
+{
+    client_unref(room->members[index], "left room");
+    room->members[index] = room->members[--room->nmembers];
+    if (room->nmembers == 0)
+    {
+        room_free(room);
+    }
+}
+
+/*
+ * Write a shared buffer to each of a number of clients whose sockets are
+ * writable, then drop the references to the clients.  A small packet
+ * sent to a socket that polls writable does not block.
+ */
+static void fan_out(CLIENT **clients, int n, CHAT_BUFFER *buf)
+{
+    struct pollfd *fds = malloc(n * sizeof(struct pollfd));
+    if (fds != NULL)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            fds[i].fd = client_get_fd(clients[i]);
+            fds[i].events = POLLOUT;
+            fds[i].revents = 0;
+        }
+        poll(fds, n, 0);
+        for (int i = 0; i < n; i++)
+        {
+            if (fds[i].revents == POLLOUT)
+            {
+                proto_send_packet(fds[i].fd, &buf->hdr, buf->payload);
+            }
+            else
+            {
+                jlog_debug("chat message not sent to fd %d", fds[i].fd);
+            }
+        }
+        free(fds);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        client_unref(clients[i], "chat sent");
+    }
+}
+
+/*
+ * Free every room.
+ */
+void chat_fini(void)
+{
+    pthread_mutex_lock(&chat.mutex);
+    for (int i = 0; i < CHAT_MAX_ROOMS; i++)
+    {
+        if (chat.rooms[i] != NULL)
+        {
+            room_free(chat.rooms[i]);
+        }
+    }
+    pthread_mutex_unlock(&chat.mutex);
+}
+
+/*
+ * Join a room, creating it if necessary.  The client is sent an ACK with
+ * the room's ID and then the room's history.
+ *
+ * @param client  The logged-in CLIENT that is to join.
+ * @param name  The name of the room.
+ * @return the room's ID, or -1 if the name is not valid, the client is
+ * already in the room, or there is no room for another room.
+ */
+int chat_join(CLIENT *client, char *name)
+{
+    if (client_get_player(client) == NULL || name == NULL || name[0] == '\0' ||
+        strlen(name) > CHAT_MAX_NAME || strpbrk(name, "\t\n") != NULL)
+    {
+        return -1;
+    }
+
+    CHAT_BUFFER *history[CHAT_HISTORY];
+    int count = 0;
+    int id = -1;
+    pthread_mutex_lock(&chat.mutex);
+    ROOM *room = NULL;
+    int free_id = -1;
+    for (int i = 0; i < CHAT_MAX_ROOMS && room == NULL; i++)
+    {
+        if (chat.rooms[i] == NULL)
+        {
+            free_id = free_id < 0 ? i : free_id;
+        }
+        else if (strcmp(chat.rooms[i]->name, name) == 0)
+        {
+            room = chat.rooms[i];
+        }
+    }
+    if (room == NULL && free_id >= 0 && (room = calloc(1, sizeof(ROOM))) != NULL)
+    {
+        room->id = free_id;
+        strcpy(room->name, name);
+        chat.rooms[free_id] = room;
+    }
+    if (room != NULL && member_index(room, client) < 0)
+    {
+        if (room->nmembers == room->capacity)
+        {
+            int capacity = room->capacity ? 2 * room->capacity : 4;
+            CLIENT **members = realloc(room->members, capacity * sizeof(CLIENT *));
+            if (members != NULL)
+            {
+                room->members = members;
+                room->capacity = capacity;
+            }
+        }
+        if (room->nmembers < room->capacity)
+        {
+            room->members[room->nmembers++] = client_ref(client, "joined room");
+            id = room->id;
+            for (count = 0; count < room->count; count++)
+            {
+                history[count] = buffer_ref(room->history[(room->first + count) % CHAT_HISTORY]);
+            }
+        }
+    }
+    if (room != NULL && room->nmembers == 0)
+    {
+        room_free(room);
+    }
+    pthread_mutex_unlock(&chat.mutex);
+
+    if (id < 0)
+    {
+        return -1;
+    }
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_ACK_PKT;
+    hdr.id = id;
+    client_send_packet(client, &hdr, NULL);
+    for (int i = 0; i < count; i++)
+    {
+        proto_send_packet(client_get_fd(client), &history[i]->hdr, history[i]->payload);
+        buffer_unref(history[i]);
+    }
+    return id;
+}
+
+/*
+ * Leave a room.
+ *
+ * @param client  The CLIENT that is to leave.
+ * @param id  The room's ID.
+ * @return 0 if successful, or -1 if the client was not in the room.
+ */
+int chat_leave(CLIENT *client, int id)
+{
+    int ret = -1;
+    pthread_mutex_lock(&chat.mutex);
+    ROOM *room = id >= 0 && id < CHAT_MAX_ROOMS ? chat.rooms[id] : NULL;
+    int index;
+    if (room != NULL && (index = member_index(room, client)) >= 0)
+    {
+        member_remove(room, index);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&chat.mutex);
+    return ret;
+}
+
+/*
+ * Say something in a room: send it to every member and keep it in the
+ * room's history.
+ *
+ * @param client  The CLIENT that is speaking, which must be in the room.
+ * @param id  The room's ID.
+ * @param text  What is said.
+ * @return 0 if successful, otherwise -1.
+ */
+int chat_say(CLIENT *client, int id, char *text)
+{
+    PLAYER *player = client_get_player(client);
+    if (player == NULL || text == NULL || text[0] == '\0' || strlen(text) > CHAT_MAX_TEXT)
+    {
+        return -1;
+    }
+    CHAT_BUFFER *buf = buffer_new(JEUX_SAY_PKT, id, player_get_name(player), text);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+
+    CLIENT **members = NULL;
+    int n = 0;
+    pthread_mutex_lock(&chat.mutex);
+    ROOM *room = id >= 0 && id < CHAT_MAX_ROOMS ? chat.rooms[id] : NULL;
+    if (room != NULL && member_index(room, client) >= 0 &&
+        (members = malloc(room->nmembers * sizeof(CLIENT *))) != NULL)
+    {
+        for (n = 0; n < room->nmembers; n++)
+        {
+            members[n] = client_ref(room->members[n], "chat to send");
+        }
+        if (room->count == CHAT_HISTORY)
+        {
+            buffer_unref(room->history[room->first]);
+            room->first = (room->first + 1) % CHAT_HISTORY;
+            room->count--;
+        }
+        room->history[(room->first + room->count++) % CHAT_HISTORY] = buffer_ref(buf);
+    }
+    pthread_mutex_unlock(&chat.mutex);
+
+    if (members == NULL)
+    {
+        buffer_unref(buf);
+        return -1;
+    }
+    fan_out(members, n, buf);
+    free(members);
+    buffer_unref(buf);
+    return 0;
+}
+
+/*
+ * Send something to one logged-in user.
+ *
+ * @param client  The CLIENT that is whispering.
+ * @param payload  "<username>\t<text>".
+ * @return 0 if successful, otherwise -1.
+ */
+int chat_whisper(CLIENT *client, char *payload)
+{
+    PLAYER *player = client_get_player(client);
+    char *text = payload == NULL ? NULL : strchr(payload, '\t');
+    if (player == NULL || text == NULL || text[1] == '\0' || strlen(text + 1) > CHAT_MAX_TEXT)
+    {
+        return -1;
+    }
+    *text++ = '\0';
+    CLIENT *target = creg_lookup(client_registry, payload);
+    if (target == NULL)
+    {
+        return -1;
+    }
+
+    int ret = -1;
+    CHAT_BUFFER *buf = buffer_new(JEUX_WHISPER_PKT, 0, player_get_name(player), text);
+    if (buf != NULL)
+    {
+        ret = proto_send_packet(client_get_fd(target), &buf->hdr, buf->payload);
+        buffer_unref(buf);
+    }
+    client_unref(target, "whispered to");
+    return ret;
+}
+
+/*
+ * Remove a client that is logging out from every room.
+ */
+void chat_client_gone(CLIENT *client)
+{
+    pthread_mutex_lock(&chat.mutex);
+    for (int i = 0; i < CHAT_MAX_ROOMS; i++)
+    {
+        int index;
+        if (chat.rooms[i] != NULL && (index = member_index(chat.rooms[i], client)) >= 0)
+        {
+            member_remove(chat.rooms[i], index);
+        }
+    }
+    pthread_mutex_unlock(&chat.mutex);
+}
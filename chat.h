@@ -0,0 +1,50 @@
+#ifndef CHAT_H
+#define CHAT_H
+
+#include "global.h"
+#include "tournament.h"
+
+/*
+ * Chat.
+ *
+ * A logged-in client sends ROOM with the name of a room as the payload
+ * to join it; the room is created if it does not exist.  It is sent an
+ * ACK whose ID identifies the room, followed by the room's last
+ * CHAT_HISTORY messages as SAY packets.  ROOM with no payload leaves the
+ * room whose ID is in the header.  SAY with a room's ID and some text
+ * sends the text to every member of the room, the sender included, as
+ * SAY with that ID and "<username>\t<text>" as the payload.  WHISPER
+ * with "<username>\t<text>" as the payload sends the text to that user
+ * alone, as WHISPER with "<sender>\t<text>".  Each is answered with an
+ * ACK, or a NACK if the user is not logged in, the client is not in
+ * the room, or the text is empty or longer than CHAT_MAX_TEXT.
+ *
+ * A message said in a room is encoded once, as a complete packet in a
+ * reference-counted buffer, which is kept in the room's ring of recent
+ * messages and written as is to each member, so the cost of a message
+ * to the sending thread is one allocation and a write per member.  A
+ * member whose socket is not writable is skipped rather than waited
+ * for, so one slow member cannot stall a room.  Messages said while a
+ * joining client is being sent the history may arrive among it.
+ *
+ * A room and its history are freed when its last member leaves.  Rooms
+ * are not carried across a hot restart.
+ */
+
+#define JEUX_SAY_PKT (JEUX_TOURNEY_PKT + 1)
+#define JEUX_WHISPER_PKT (JEUX_SAY_PKT + 1)
+#define JEUX_ROOM_PKT (JEUX_WHISPER_PKT + 1)
+
+#define CHAT_MAX_ROOMS 256              // Room IDs fit the header's ID field
+#define CHAT_MAX_NAME 32
+#define CHAT_MAX_TEXT 512
+#define CHAT_HISTORY 32
+
+void chat_fini(void);
+int chat_join(CLIENT *client, char *name);
+int chat_leave(CLIENT *client, int id);
+int chat_say(CLIENT *client, int id, char *text);
+int chat_whisper(CLIENT *client, char *payload);
+void chat_client_gone(CLIENT *client);
+
+#endif
@@ -1,11 +1,24 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <unistd.h>
 #include "global.h"
+#include "jeux_globals.h"
 
 #include "client.h"
+#include "game_log.h"
+#include "rating_worker.h"
+#include "reaper.h"
+#include "game_clock.h"
+#include "matchmaking.h"
+#include "spectate.h"
+#include "tournament.h"
+#include "chat.h"
+#include "bot.h"
+#include "io_loop.h"
 // #include "invitation.h"
-#include "debug.h"
+#include "jlog.h"
+#include "lock_profile.h"
 #include <string.h>
 
 /*
@@ -22,7 +35,7 @@
 
 CLIENT *client_create(CLIENT_REGISTRY *creg, int fd)
 {
-    debug("client.c");
+    jlog_trace("enter");
     CLIENT *client = malloc(sizeof(CLIENT));
     if (client == NULL)
     {
@@ -52,11 +65,11 @@ CLIENT *client_create(CLIENT_REGISTRY *creg, int fd)
  */
 CLIENT *client_ref(CLIENT *client, char *why)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
-    client->refcount++;
+    __atomic_add_fetch(&client->refcount, 1, __ATOMIC_RELAXED);
 
-    debug("client_ref returned");
+    jlog_debug("client_ref returned");
     return client;
 }
 
@@ -72,20 +85,18 @@ CLIENT *client_ref(CLIENT *client, char *why)
  */
 void client_unref(CLIENT *client, char *why)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
-    pthread_mutex_lock(&client->lock);
-    client->refcount--;
-    if (client->refcount == 0)
+    // By the last reference, the client has logged out and been unregistered
+    if (__atomic_sub_fetch(&client->refcount, 1, __ATOMIC_ACQ_REL) == 0)
     {
-        // free client object and release any resources it holds
-        client_logout(client);
-
-        creg_unregister(client->registry, client);
+        if (client->fd >= 0)
+        {
+            close(client->fd);
+        }
         pthread_mutex_destroy(&client->lock);
         free(client);
     }
-    pthread_mutex_unlock(&client->lock);
 }
 
 /*
@@ -105,57 +116,56 @@ void client_unref(CLIENT *client, char *why)
 int client_login(CLIENT *client, PLAYER *player)
 {
 
-    debug("client_login");
-    debug("client addr: %p", client);
+    jlog_debug("client_login");
+    jlog_debug("client addr: %p", client);
     if (player == NULL)
     {
-        debug("player is NULL");
+        jlog_debug("player is NULL");
         return -1;
     }
 
     pthread_mutex_lock(&client->lock);
 
-    debug("client_login");
+    jlog_debug("client_login");
 
     // check if client is already logged in
     if (client->player != NULL)
     {
         pthread_mutex_unlock(&client->lock);
-        debug("already logged in");
+        jlog_debug("already logged in");
         return -1;
     }
 
-    debug("client_login");
-    debug("client_registry == NULL: %d", client->registry == NULL);
-    debug("player == NULL: %d", player == NULL);
-    debug("player name: %s", player->name);
-    debug("BEFORE ASIGNMENT: player == NULL: %d", client->player == NULL);
+    jlog_debug("client_login");
+    jlog_debug("client_registry == NULL: %d", client->registry == NULL);
+    jlog_debug("player == NULL: %d", player == NULL);
+    jlog_debug("player name: %s", player->name);
+    jlog_debug("BEFORE ASIGNMENT: player == NULL: %d", client->player == NULL);
 
     // check if the specified player is already logged in by some other client
     CLIENT *other_client = creg_lookup(client->registry, player_get_name(player));
 
-    debug("123");
     if (other_client != NULL && other_client != client)
     {
 
         pthread_mutex_unlock(&client->lock);
         client_unref(other_client, "player is already logged in by some other client");
-        debug("player is already logged in by some other client");
-        debug("other client addr: %p", other_client);
+        jlog_debug("player is already logged in by some other client");
+        jlog_debug("other client addr: %p", other_client);
         return -1;
     }
 
-    debug("client_login");
+    jlog_debug("client_login");
 
     // login is successful
     client->player = player;
-    debug("AFTER ASIGNMENT: player == NULL: %d", client->player == NULL);
+    jlog_debug("AFTER ASIGNMENT: player == NULL: %d", client->player == NULL);
 
-    debug("player name: %s", player_get_name(client->player));
+    jlog_debug("player name: %s", player_get_name(client->player));
     player_ref(player, "logging in client");
     pthread_mutex_unlock(&client->lock);
 
-    debug("client_login");
+    jlog_debug("client_login");
 
     return 0;
 }
@@ -175,49 +185,48 @@ int client_login(CLIENT *client, PLAYER *player)
 
 int client_logout(CLIENT *client)
 {
-    debug("client.c");
+    jlog_trace("enter");
+
+    mm_cancel(client);
+    spect_client_gone(client);
+    chat_client_gone(client);
 
     pthread_mutex_lock(&client->lock);
 
     // check if the client is logged in
-    if (client_get_player(client) == NULL)
+    if (client->player == NULL)
     {
         pthread_mutex_unlock(&client->lock);
         return -1;
     }
 
-    INVITATION_NODE *inv_node = client->invitations;
-    while (inv_node != NULL)
+    // Each invitation is handled without the lock, which the revoke,
+    // decline and resign functions take themselves.  The player is only
+    // released once the list is empty, so that no invitation can be added
+    // behind this loop.
+    while (client->invitations != NULL)
     {
-        // revoke or decline any invitations
+        INVITATION *inv = inv_ref(client->invitations->invitation, "logging out");
+        int id = client->invitations->id;
+        pthread_mutex_unlock(&client->lock);
 
-        if (inv_get_game(inv_node->invitation) == NULL)
+        if (inv_get_game(inv) == NULL)
         {
-            if (inv_get_source((inv_node->invitation)) == client)
-            {
-
-                client_revoke_invitation(client, inv_node->id);
-            }
-            else if (inv_node->invitation->target == client)
-            {
-                client_remove_invitation(client, inv_node->invitation);
-            }
-            else
-            {
-                debug("THE CLINE IS NOT SOURCE AND NOT TARGET!!");
-            }
+            client_withdraw_invitation(inv, client);
         }
         else
         {
-            game_resign(inv_node->invitation->game, inv_node->invitation->source == client ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE);
+            client_resign_game(client, id);
         }
+        // In case the invitation was already being closed by someone else
+        client_remove_invitation(client, inv);
+        inv_unref(inv, "logging out");
 
-        // move on to the next invitation
-        inv_node = inv_node->next;
+        pthread_mutex_lock(&client->lock);
     }
 
     // release the reference to the player
-    player_unref(client->player, "logging out client");
+    preg_release(player_registry, client->player, "logging out client");
     client->player = NULL;
 
     pthread_mutex_unlock(&client->lock);
@@ -237,22 +246,21 @@ int client_logout(CLIENT *client)
 
 PLAYER *client_get_player(CLIENT *client)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
     // pthread_mutex_lock(&client->lock);
-    debug("client.c");
+    jlog_trace("enter");
 
-    debug("client addr: %p", client);
+    jlog_debug("client addr: %p", client);
 
     PLAYER *player = client->player;
     // pthread_mutex_unlock(&client->lock);
 
     if (player == NULL)
     {
-        debug("123");
         return NULL;
     }
-    debug("player name: %s", player_get_name(player));
+    jlog_debug("player name: %s", player_get_name(player));
     return player;
 }
 
@@ -266,7 +274,7 @@ PLAYER *client_get_player(CLIENT *client)
  */
 int client_get_fd(CLIENT *client)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
     pthread_mutex_lock(&client->lock);
     int fd = client->fd;
@@ -290,8 +298,14 @@ int client_get_fd(CLIENT *client)
 
 int client_send_packet(CLIENT *player, JEUX_PACKET_HEADER *pkt, void *data)
 {
-    debug("client.c");
-    debug("data: %s", (char*)data);
+    jlog_trace("enter");
+    jlog_debug("data: %s", (char*)data);
+
+    // A bot has no connection: it is handed the packet instead
+    if (player->fd < 0)
+    {
+        return bot_deliver(player, pkt);
+    }
 
     // Send the packet
     pkt->size = htons(pkt->size);
@@ -314,16 +328,16 @@ int client_send_packet(CLIENT *player, JEUX_PACKET_HEADER *pkt, void *data)
  */
 int client_send_ack(CLIENT *client, void *data, size_t datalen)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
     int res;
     JEUX_PACKET_HEADER pkt = {0};
     pkt.type = JEUX_ACK_PKT;
     pkt.size = datalen;
     res = client_send_packet(client, &pkt, data);
-    debug("client send ack return");
-    debug("client fd: %d", client->fd);
-    debug("%s", (char *)data);
+    jlog_debug("client send ack return");
+    jlog_debug("client fd: %d", client->fd);
+    jlog_debug("%s", (char *)data);
     return res;
 }
 
@@ -337,7 +351,7 @@ int client_send_ack(CLIENT *client, void *data, size_t datalen)
 
 int client_send_nack(CLIENT *client)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
     int res;
     pthread_mutex_lock(&client->lock);
@@ -365,41 +379,42 @@ int client_send_nack(CLIENT *client)
  */
 int client_add_invitation(CLIENT *client, INVITATION *inv)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
-    debug("123");
-    INVITATION_NODE *invitation_node = malloc(sizeof(invitation_node));
+    INVITATION_NODE *invitation_node = malloc(sizeof(INVITATION_NODE));
+    if (invitation_node == NULL)
+    {
+        return -1;
+    }
     invitation_node->next = NULL;
     invitation_node->invitation = inv;
 
-    if (client->invitations == NULL)
-    {
-        client->invitations = invitation_node;
-        invitation_node->id = 0;
-    }
-    else
+    // The lowest ID not already in use
+    int id = 0;
+    INVITATION_NODE *iter = client->invitations;
+    while (iter != NULL)
     {
-        INVITATION_NODE *iter = client->invitations;
-        int id = 0;
-        int gap_flag = 0;
-        while (iter->next != NULL)
+        if (iter->id == id)
+        {
+            id++;
+            iter = client->invitations;
+        }
+        else
         {
-            if (!gap_flag && iter->id != id)
-            {
-                gap_flag = 1;
-            }
-            else
-            {
-                id++;
-            }
             iter = iter->next;
         }
-        iter->next = invitation_node;
-        invitation_node->id = id;
     }
+    invitation_node->id = id;
+
+    INVITATION_NODE **link = &client->invitations;
+    while (*link != NULL)
+    {
+        link = &(*link)->next;
+    }
+    *link = invitation_node;
     inv_ref(invitation_node->invitation, "client_add_invitation");
 
-    return 0;
+    return id;
 }
 
 /*
@@ -414,36 +429,30 @@ int client_add_invitation(CLIENT *client, INVITATION *inv)
  */
 int client_remove_invitation(CLIENT *client, INVITATION *inv)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
     pthread_mutex_lock(&client->lock);
 
-    if (client->invitations->invitation == inv)
+    INVITATION_NODE **link = &client->invitations;
+    while (*link != NULL && (*link)->invitation != inv)
     {
-        client->invitations = NULL;
-        inv_unref(inv, "client remove invitation");
+        link = &(*link)->next;
     }
-
-    INVITATION_NODE *inv_node = client->invitations;
-    INVITATION_NODE *prev = inv_node;
-
-    while (inv_node != NULL && inv_node->invitation != inv)
+    if (*link == NULL)
     {
-        prev = inv_node;
-        inv_node = inv_node->next;
-    }
-    if (inv_node == NULL)
-    {
-        debug("ERROR!");
+        pthread_mutex_unlock(&client->lock);
         return -1;
     }
-    prev->next = inv_node->next;
-    inv_unref(inv_node->invitation, "client_remove_invitation");
+    INVITATION_NODE *inv_node = *link;
+    int id = inv_node->id;
+    *link = inv_node->next;
+    free(inv_node);
 
     pthread_mutex_unlock(&client->lock);
 
-    return 0;
-};
+    inv_unref(inv, "client_remove_invitation");
+    return id;
+}
 
 /*
  * Make a new invitation from a specified "source" CLIENT to a specified
@@ -463,22 +472,44 @@ int client_remove_invitation(CLIENT *client, INVITATION *inv)
 int client_make_invitation(CLIENT *source, CLIENT *target,
                            GAME_ROLE source_role, GAME_ROLE target_role)
 {
-    debug("client.c");
+    return client_make_timed_invitation(source, target, source_role, target_role, NULL);
+}
 
-    pthread_mutex_lock(&source->lock);
-    pthread_mutex_lock(&target->lock);
+/*
+ * Make a new invitation, as by client_make_invitation(), whose game is
+ * played with clocks (see game_clock.h).
+ *
+ * @param tc  The time control for the game, or NULL for an untimed game.
+ * @return the ID assigned by the source to the INVITATION, if the operation
+ * is successful, otherwise -1.
+ */
+int client_make_timed_invitation(CLIENT *source, CLIENT *target,
+                                 GAME_ROLE source_role, GAME_ROLE target_role,
+                                 TIME_CONTROL *tc)
+{
+    jlog_trace("enter");
 
-    // Check that both clients are logged in
-    if (!source->player || !target->player)
+    if (source == NULL || target == NULL || source == target)
     {
         return -1;
     }
+    // Lock in a fixed order, since the target may be inviting the source
+    CLIENT *lower = source < target ? source : target;
+    CLIENT *upper = source < target ? target : source;
+    pthread_mutex_lock(&lower->lock);
+    pthread_mutex_lock(&upper->lock);
 
-    // Create a new invitation
-    INVITATION *invitation = inv_create(source, target,
-                                        source_role, target_role);
+    // Check that both clients are logged in
+    INVITATION *invitation = NULL;
+    if (source->player && target->player)
+    {
+        // Create a new invitation
+        invitation = inv_create(source, target, source_role, target_role);
+    }
     if (!invitation)
     {
+        pthread_mutex_unlock(&upper->lock);
+        pthread_mutex_unlock(&lower->lock);
         return -1;
     }
 
@@ -486,44 +517,57 @@ int client_make_invitation(CLIENT *source, CLIENT *target,
     int source_inv_id = client_add_invitation(source, invitation);
     int target_inv_id = client_add_invitation(target, invitation);
 
-    if (target_inv_id == -1)
+    if (target_inv_id == -1 || source_inv_id == -1)
     {
-        client_remove_invitation(source, invitation);
+        pthread_mutex_unlock(&upper->lock);
+        pthread_mutex_unlock(&lower->lock);
+        if (target_inv_id != -1)
+        {
+            client_remove_invitation(target, invitation);
+        }
+        if (source_inv_id != -1)
+        {
+            client_remove_invitation(source, invitation);
+        }
+        inv_unref(invitation, "not added");
         return -1;
     }
-    if (source_inv_id == -1)
+
+    // Before INVITED, which the target may answer at once
+    if (tc != NULL)
     {
-        client_remove_invitation(target, invitation);
-        return -1;
+        gclock_offer(invitation, tc);
     }
-
-    // Increase the invitation's reference count
-    inv_ref(invitation, "client_make_invitation");
+    reaper_watch_invitation(invitation);
 
     // Send an INVITED packet to the target
 
-    JEUX_PACKET_HEADER *hdr = malloc(sizeof(JEUX_PACKET_HEADER));
-
-    // TODO: double check invite vs invited
-    hdr->type = JEUX_INVITED_PKT;
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_INVITED_PKT;
+    hdr.id = target_inv_id;
+    hdr.role = target_role;
 
-    int res = client_send_packet(target, hdr, NULL);
+    int res = client_send_packet(target, &hdr, NULL);
+    pthread_mutex_unlock(&upper->lock);
+    pthread_mutex_unlock(&lower->lock);
     if (res != 0)
     {
         // Failed to send the packet, so we need to clean up
+        reaper_forget_invitation(invitation);
+        gclock_stop(invitation);
         client_remove_invitation(source, invitation);
         client_remove_invitation(target, invitation);
-        inv_unref(invitation, "ERROR");
+        inv_unref(invitation, "INVITED not sent");
         return -1;
     }
 
+    // The clients' lists now hold the invitation
+    inv_unref(invitation, "invitation made");
+
     // Assign the invitation ID and return it
 
     int inv_id = source_inv_id;
 
-    pthread_mutex_unlock(&source->lock);
-    pthread_mutex_unlock(&target->lock);
-
     return inv_id;
 };
 
@@ -547,30 +591,30 @@ int client_make_invitation(CLIENT *source, CLIENT *target,
 
 INVITATION *client_find_invitation(CLIENT *client, int id)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
     INVITATION_NODE *inv_node;
     INVITATION *inv;
     inv_node = client->invitations;
     while (inv_node != NULL)
     {
-        debug("inside the while loop");
+        jlog_debug("inside the while loop");
         inv = inv_node->invitation;
         if (inv_node->id == id)
         {
-            debug("exit");
+            jlog_debug("exit");
             return inv;
         }
         inv_node = inv_node->next;
     }
 
-    debug("exit");
+    jlog_debug("exit");
     return NULL;
 }
 
 int client_get_inv_id(CLIENT *client, INVITATION *invitation)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
     INVITATION_NODE *inv_node;
     INVITATION *inv;
@@ -580,7 +624,6 @@ int client_get_inv_id(CLIENT *client, INVITATION *invitation)
         inv = inv_node->invitation;
         if (inv == invitation)
         {
-            pthread_mutex_unlock(&(inv->mutex)); // Unlock the invitation
             return inv_node->id;
         }
         inv_node = inv_node->next;
@@ -588,54 +631,70 @@ int client_get_inv_id(CLIENT *client, INVITATION *invitation)
     return -1;
 }
 
-int client_revoke_invitation(CLIENT *client, int id)
+/*
+ * Withdraw an INVITATION that is still open: it is closed, removed from
+ * the lists of invitations of both its source and target, and its clock
+ * and timeout are stopped.  The target is sent REVOKED and the source
+ * is sent DECLINED, each containing that CLIENT's ID of the invitation,
+ * except that nothing is sent to the CLIENT (if any) that withdrew it.
+ * No CLIENT lock may be held by the caller.
+ *
+ * @param inv  The INVITATION to be withdrawn.
+ * @param by  The CLIENT withdrawing the invitation, or NULL.
+ * @return 0 if the invitation was open and has been withdrawn,
+ * otherwise -1.
+ */
+int client_withdraw_invitation(INVITATION *inv, CLIENT *by)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
-    // Lock the mutex to ensure thread safety
-    pthread_mutex_lock(&client->lock);
-
-    // Look for the invitation in the source client's list of invitations
-    INVITATION *invitation = client_find_invitation(client, id);
-    if (invitation == NULL)
+    if (inv_close(inv, NULL_ROLE) != 0)
     {
-        pthread_mutex_unlock(&client->lock);
-        return -1; // Invitation not found
+        return -1;
     }
+    reaper_forget_invitation(inv);
+    gclock_stop(inv);
 
-    if (inv_get_source(invitation) != client)
+    int source_id = client_remove_invitation(inv->source, inv);
+    int target_id = client_remove_invitation(inv->target, inv);
+
+    JEUX_PACKET_HEADER hdr = {0};
+    if (inv->target != by && target_id >= 0)
     {
-        pthread_mutex_unlock(&client->lock);
-        return -1;
+        hdr.type = JEUX_REVOKED_PKT;
+        hdr.id = target_id;
+        client_send_packet(inv->target, &hdr, NULL);
     }
-
-    // Make sure the invitation is in the "open" state
-    if (inv_get_game(invitation) != NULL)
+    if (inv->source != by && source_id >= 0)
     {
-        pthread_mutex_unlock(&client->lock);
-        return -1; // Invitation not in "open" state
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.type = JEUX_DECLINED_PKT;
+        hdr.id = source_id;
+        client_send_packet(inv->source, &hdr, NULL);
     }
+    return 0;
+}
 
-    // Remove the invitation from the source client's list of invitations
-    client_remove_invitation(client, invitation);
-
-    inv_unref(invitation, "client_revoke_invitation");
-
-    JEUX_PACKET_HEADER *hdr = {0};
-    hdr->type = JEUX_REVOKE_PKT;
-    hdr->id = client_remove_invitation(
-        invitation->target,
-        invitation);
+int client_revoke_invitation(CLIENT *client, int id)
+{
+    jlog_trace("enter");
 
-    if (client_send_packet(invitation->target, hdr, NULL))
+    // Look for the invitation in the source client's list of invitations
+    pthread_mutex_lock(&client->lock);
+    INVITATION *invitation = client_find_invitation(client, id);
+    if (invitation == NULL || inv_get_source(invitation) != client)
     {
-        return -1;
+        pthread_mutex_unlock(&client->lock);
+        return -1; // Invitation not found, or not made by this client
     }
-
-    // Unlock the mutex
+    inv_ref(invitation, "revoking");
     pthread_mutex_unlock(&client->lock);
 
-    return 0; // Successfully revoked invitation
+    // Fails unless the invitation is in the "open" state
+    int ret = client_withdraw_invitation(invitation, client);
+
+    inv_unref(invitation, "revoking");
+    return ret;
 }
 
 /*
@@ -658,52 +717,24 @@ int client_revoke_invitation(CLIENT *client, int id)
 
 int client_decline_invitation(CLIENT *client, int id)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
-    // Lock the mutex to ensure thread safety
+    // Look for the invitation in the target client's list of invitations
     pthread_mutex_lock(&client->lock);
-
-    // Look for the invitation in the source client's list of invitations
     INVITATION *invitation = client_find_invitation(client, id);
-    if (invitation == NULL)
-    {
-        pthread_mutex_unlock(&client->lock);
-        return -1; // Invitation not found
-    }
-
-    if (inv_get_target(invitation) != client)
-    {
-        pthread_mutex_unlock(&client->lock);
-        return -1;
-    }
-
-    // Make sure the invitation is in the "open" state
-    if (inv_get_game(invitation) != NULL)
+    if (invitation == NULL || inv_get_target(invitation) != client)
     {
         pthread_mutex_unlock(&client->lock);
-        return -1; // Invitation not in "open" state
+        return -1; // Invitation not found, or not made to this client
     }
-
-    // Remove the invitation from the source client's list of invitations
-    client_remove_invitation(client, invitation);
-
-    inv_unref(invitation, "client_decline_invitation");
-
-    JEUX_PACKET_HEADER *hdr = {0};
-    hdr->type = JEUX_REVOKE_PKT;
-    hdr->id = client_remove_invitation(
-        invitation->source,
-        invitation);
-
-    if (client_send_packet(invitation->source, hdr, NULL))
-    {
-        return -1;
-    }
-
-    // Unlock the mutex
+    inv_ref(invitation, "declining");
     pthread_mutex_unlock(&client->lock);
 
-    return 0; // Successfully revoked invitation
+    // Fails unless the invitation is in the "open" state
+    int ret = client_withdraw_invitation(invitation, client);
+
+    inv_unref(invitation, "declining");
+    return ret;
 }
 
 /*
@@ -732,7 +763,7 @@ int client_decline_invitation(CLIENT *client, int id)
 
 int client_accept_invitation(CLIENT *client, int id, char **strp)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
     pthread_mutex_lock(&client->lock);
     INVITATION *inv = client_find_invitation(client, id);
@@ -743,18 +774,31 @@ int client_accept_invitation(CLIENT *client, int id, char **strp)
         return -1; // Invitation not found or not in open state
     }
 
-    debug("here");
-
     if (inv_accept(inv) == -1)
     {
+        pthread_mutex_unlock(&client->lock);
         return -1;
     }
-    debug("here");
+
+    PLAYER *source_player = client_get_player(inv_get_source(inv));
+    PLAYER *target_player = client_get_player(inv_get_target(inv));
+    if (inv_get_source_role(inv) == FIRST_PLAYER_ROLE)
+    {
+        glog_game_started(inv_get_game(inv), player_get_name(source_player), player_get_name(target_player));
+    }
+    else
+    {
+        glog_game_started(inv_get_game(inv), player_get_name(target_player), player_get_name(source_player));
+    }
+    reaper_forget_invitation(inv);
+    gclock_start(inv);
+    // Handle both players' moves on this client's event loop shard.  The
+    // descriptors never change, so they are read without the locks.
+    ioloop_colocate(client->fd, inv_get_source(inv)->fd);
 
     // Send the ACCEPTED packet to the source client
     JEUX_PACKET_HEADER hdr = {0};
     hdr.type = JEUX_ACCEPTED_PKT;
-    debug("here");
 
     char *unparse_state = game_unparse_state(inv_get_game(inv));
 
@@ -764,12 +808,11 @@ int client_accept_invitation(CLIENT *client, int id, char **strp)
         hdr.size = strlen(unparse_state) + 1;
 
 
-        debug("here");
-
         hdr.id = client_get_inv_id(inv_get_source(inv), inv);
-        debug("here");
         if (client_send_packet(inv_get_source(inv), &hdr, unparse_state) == -1)
         {
+            free(unparse_state);
+            pthread_mutex_unlock(&client->lock);
             return -1;
         }
         *strp = NULL;
@@ -778,21 +821,106 @@ int client_accept_invitation(CLIENT *client, int id, char **strp)
     // invite b 1
     else
     {
-        debug("enter else");
+        jlog_debug("enter else");
 
-        *strp = malloc(strlen(unparse_state) + 1);
-        strcpy(*strp, unparse_state);
+        *strp = unparse_state;
+        unparse_state = NULL;
 
         hdr.size = 0;
         client_send_packet(inv_get_source(inv), &hdr, NULL);
     }
-
-    debug("here");
+    free(unparse_state);
 
     pthread_mutex_unlock(&client->lock);
     return 0;
 };
 
+// Get a CLIENT's ID for an INVITATION in its list, with the CLIENT locked
+static int invitation_node_id(CLIENT *client, INVITATION *inv)
+{
+    for (INVITATION_NODE *node = client->invitations; node != NULL; node = node->next)
+    {
+        if (node->invitation == inv)
+        {
+            return node->id;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Start a game between two CLIENTs that have been paired by the
+ * matchmaker (see matchmaking.h) or a tournament (see tournament.h),
+ * without INVITE and ACCEPT.  An
+ * INVITATION from the first CLIENT to the second is created and accepted
+ * at once.  Each CLIENT is sent an ACCEPTED packet containing its own ID
+ * for the invitation and the role it plays; the first player's packet
+ * also carries the initial game state, as when the source of an
+ * invitation plays first.
+ *
+ * @param first  The CLIENT that is to play first.
+ * @param second  The CLIENT that is to play second.
+ * @param gamep  If not NULL, set to a new reference to the GAME.
+ * @return 0 if the game was started, or -1 if either CLIENT is no longer
+ * logged in or the game could not be created.
+ */
+int client_start_game(CLIENT *first, CLIENT *second, GAME **gamep)
+{
+    jlog_trace("enter");
+
+    // Lock in a fixed order, since neither client's thread is involved
+    CLIENT *lower = first < second ? first : second;
+    CLIENT *upper = first < second ? second : first;
+    pthread_mutex_lock(&lower->lock);
+    pthread_mutex_lock(&upper->lock);
+
+    INVITATION *inv = NULL;
+    if (first->player != NULL && second->player != NULL)
+    {
+        inv = inv_create(first, second, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+    }
+    if (inv == NULL || inv_accept(inv) != 0)
+    {
+        pthread_mutex_unlock(&upper->lock);
+        pthread_mutex_unlock(&lower->lock);
+        inv_unref(inv, "game not started");
+        return -1;
+    }
+    client_add_invitation(first, inv);
+    client_add_invitation(second, inv);
+    int first_id = invitation_node_id(first, inv);
+    int second_id = invitation_node_id(second, inv);
+    GAME *game = inv_get_game(inv);
+    glog_game_started(game, player_get_name(first->player),
+                      player_get_name(second->player));
+    if (gamep != NULL)
+    {
+        *gamep = game_ref(game, "started by client_start_game");
+    }
+    char *state = game_unparse_state(game);
+    // The clients' lists now hold the invitation
+    inv_unref(inv, "game started");
+
+    pthread_mutex_unlock(&upper->lock);
+    pthread_mutex_unlock(&lower->lock);
+    ioloop_colocate(client_get_fd(first), client_get_fd(second));
+
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_ACCEPTED_PKT;
+    hdr.id = first_id;
+    hdr.role = FIRST_PLAYER_ROLE;
+    hdr.size = state != NULL ? strlen(state) + 1 : 0;
+    client_send_packet(first, &hdr, state);
+    free(state);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = JEUX_ACCEPTED_PKT;
+    hdr.id = second_id;
+    hdr.role = SECOND_PLAYER_ROLE;
+    client_send_packet(second, &hdr, NULL);
+    return 0;
+}
+
 /*
  * Resign a game in progress.  This function may be called by a CLIENT
  * that is either source or the target of the INVITATION containing the
@@ -811,61 +939,102 @@ int client_accept_invitation(CLIENT *client, int id, char **strp)
 
 int client_resign_game(CLIENT *client, int id)
 {
-    debug("client.c");
+    jlog_trace("enter");
 
     pthread_mutex_lock(&client->lock);
     INVITATION *inv = client_find_invitation(client, id);
+    if (inv != NULL)
+    {
+        inv_ref(inv, "resigning");
+    }
     pthread_mutex_unlock(&client->lock);
 
-    pthread_mutex_lock(&inv->source->lock);
-    pthread_mutex_lock(&inv->target->lock);
-
-    CLIENT *opponent = inv->source == client ? inv->target : inv->source;
-
     if (inv == NULL)
     {
         return -1; // Invitation not found
     }
 
+    CLIENT *opponent = inv->source == client ? inv->target : inv->source;
+    GAME_ROLE role = inv->source == client ? inv->source_role : inv->target_role;
+    GAME_ROLE winner = inv->source == client ? inv->target_role : inv->source_role;
+
     // Check if the invitation is in the ACCEPTED state
-    if (inv_get_game(inv) == NULL)
+    GAME *game = inv_get_game(inv);
+    if (game == NULL || game_is_over(game) || inv_close(inv, role) != 0)
     {
+        inv_unref(inv, "not resigned");
         return -1; // Invitation not in ACCEPTED state
     }
 
-    // Get the opponent's fd
-    // int opponent_fd = (inv_get_source(inv) == client) ? client_get_fd(inv_get_target(inv))
-    //                                                   : client_get_fd(inv_get_source(inv));
-
     // Remove the invitation from the lists of both the source and target clients
-
-    client_remove_invitation(inv->source, inv);
-
-    client_remove_invitation(inv->target, inv);
-    pthread_mutex_unlock(&inv->target->lock);
+    client_remove_invitation(client, inv);
+    int opponent_id = client_remove_invitation(opponent, inv);
+    rworker_post_result(client_get_player(inv->source), client_get_player(inv->target),
+                        winner == inv->source_role ? 1 : 2);
 
     // Send a RESIGNED packet containing the opponent's ID to the opponent
-
     JEUX_PACKET_HEADER hdr = {0};
-    hdr.id = client_get_inv_id(client, inv);
+    hdr.id = opponent_id;
     hdr.type = JEUX_RESIGNED_PKT;
     hdr.size = 0;
 
     client_send_packet(opponent, &hdr, NULL);
 
-    // Decrement the reference count of the invitation
+    glog_game_ended(game, winner, GLOG_END_RESIGNED);
+    spect_ended(game, winner);
+    tourney_game_ended(game, winner);
+    gclock_stop(inv);
 
     inv_unref(inv, "client_resign_game");
+    return 0;
+}
+
+/*
+ * Finish a game that is over: its INVITATION is removed from the lists
+ * of both the source and target, the result is queued for the rating
+ * worker, each player is sent an ENDED packet containing that player's
+ * ID for the INVITATION and the winner, and the end of the game is
+ * recorded.  No CLIENT lock may be held by the caller.
+ *
+ * @param inv  The INVITATION containing the GAME that is over.
+ * @param winner  The role of the winner, or NULL_ROLE for a draw.
+ * @param reason  How the game ended, for the game log.
+ */
+void client_end_game(INVITATION *inv, GAME_ROLE winner, GLOG_END_REASON reason)
+{
+    jlog_trace("enter");
+
+    CLIENT *source = inv_get_source(inv);
+    CLIENT *target = inv_get_target(inv);
+    GAME *game = inv_get_game(inv);
+    int source_id = client_remove_invitation(source, inv);
+    int target_id = client_remove_invitation(target, inv);
 
-    // If the game has no other references, free its memory
-    if (inv->game->refcount == 0)
+    // Before ENDED, on which a bot logs out
+    rworker_post_result(client_get_player(source), client_get_player(target),
+                        winner == NULL_ROLE ? 0 : winner == inv->source_role ? 1 : 2);
+
+    JEUX_PACKET_HEADER hdr = {0};
+    if (source_id >= 0)
+    {
+        hdr.type = JEUX_ENDED_PKT;
+        hdr.id = source_id;
+        hdr.role = winner;
+        client_send_packet(source, &hdr, NULL);
+    }
+    if (target_id >= 0)
     {
-        free(inv->game);
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.type = JEUX_ENDED_PKT;
+        hdr.id = target_id;
+        hdr.role = winner;
+        client_send_packet(target, &hdr, NULL);
     }
-    pthread_mutex_unlock(&inv->source->lock);
-    pthread_mutex_unlock(&inv->target->lock);
 
-    return 0;
+    glog_game_ended(game, winner, reason);
+    spect_ended(game, winner);
+    tourney_game_ended(game, winner);
+    gclock_stop(inv);
 }
 
 /*
@@ -882,8 +1051,8 @@ int client_resign_game(CLIENT *client, int id)
  * ENDED packet containing the appropriate game ID and the game result
  * is sent to each of the players participating in the game, and the
  * INVITATION containing the now-terminated game is removed from the lists
- * of both the source and target.  The result of the game is posted in
- * order to update both players' ratings.
+ * of both the source and target.  The result of the game is queued for
+ * the rating worker in order to update both players' ratings.
  *
  * @param client  The CLIENT that is making the move.
  * @param id  The ID assigned by the CLIENT to the GAME in which the move
@@ -894,27 +1063,28 @@ int client_resign_game(CLIENT *client, int id)
 
 int client_make_move(CLIENT *client, int id, char *move)
 {
-    debug("client.c");
+    jlog_trace("enter");
     pthread_mutex_lock(&client->lock);
 
-    debug("client_make_move");
+    jlog_debug("client_make_move");
 
     INVITATION *inv = client_find_invitation(client, id);
     if (!inv || inv_get_game(inv) == NULL)
     {
-        debug("exit");
+        jlog_debug("exit");
 
+        pthread_mutex_unlock(&client->lock);
         return -1; // invalid game ID or game not in progress
     }
 
-    debug("client_make_move");
+    jlog_debug("client_make_move");
 
     GAME *game = inv_get_game(inv);
 
     GAME_ROLE role;
     CLIENT *opponent;
 
-    debug("client_make_move");
+    jlog_debug("client_make_move");
 
     if (inv_get_source(inv) == client)
     {
@@ -927,20 +1097,35 @@ int client_make_move(CLIENT *client, int id, char *move)
         opponent = inv_get_source(inv);
     }
 
-    debug("client_make_move");
+    jlog_debug("client_make_move");
 
 
-    GAME_MOVE *game_move = game_parse_move(game, role, move);
-    if(game_apply_move(game, game_move)){
+    // a player whose time has run out can no longer move
+    if (gclock_flagged(inv, role))
+    {
+        pthread_mutex_unlock(&client->lock);
         return -1;
     }
 
+    GAME_MOVE *game_move = game_parse_move(game, role, move);
     if (game_move == NULL)
     {
+        pthread_mutex_unlock(&client->lock);
         return -1; // move parsing failed
     }
+    if (game_apply_move(game, game_move))
+    {
+        free(game_move);
+        pthread_mutex_unlock(&client->lock);
+        return -1;
+    }
+    glog_move(game, role, game_move->value);
+    gclock_moved(inv, role);
 
-    debug("client_make_move");
+    // Decided now, since the opponent may move as soon as it is sent MOVED
+    int over = game_is_over(game);
+
+    jlog_debug("client_make_move");
 
 
     JEUX_PACKET_HEADER header = {0};
@@ -949,15 +1134,16 @@ int client_make_move(CLIENT *client, int id, char *move)
     char* unparse_state = game_unparse_state(game);
     header.size = strlen(unparse_state);
 
-    debug("unparse_state: %s", unparse_state);
+    jlog_debug("unparse_state: %s", unparse_state);
     client_send_packet(opponent, &header, unparse_state);
+    spect_moved(game, unparse_state);
+    free(unparse_state);
 
-    debug("client_make_move");
+    jlog_debug("client_make_move");
 
-    if (game_is_over(game))
+    if (over)
     {
-        debug("client_make_move");
-        
+        jlog_debug("client_make_move");
 
         /*In addition, if
          * the move that has been made results in the game being over, then an
@@ -966,35 +1152,21 @@ int client_make_move(CLIENT *client, int id, char *move)
          * INVITATION containing the now-terminated game is removed from the lists
          * of both the source and target.
          * */
-        JEUX_PACKET_HEADER header2 = {0};
-
-        header2.type = JEUX_ENDED_PKT;
-        header2.id = client_get_inv_id(client, inv);
-        header2.role = game_get_winner(game);
-        header2.size = 0;
-        
-
-        client_send_packet(inv->source, &header2, NULL);
-        client_send_packet(inv->target, &header2, NULL);
-        debug("client_make_move");
-
-
-        client_remove_invitation(inv->source, inv);
-        client_remove_invitation(inv->target, inv);
-
-        player_post_result(client_get_player(inv_get_source(inv)),
-        client_get_player(inv_get_target(inv)), 
-        game_get_winner(game));
+        // Removing the invitation takes each client's lock, this one's included
+        inv_ref(inv, "game over");
+        pthread_mutex_unlock(&client->lock);
 
-    debug("client_make_move");
+        client_end_game(inv, game_get_winner(game), GLOG_END_NORMAL);
 
+        free(game_move);
+        inv_unref(inv, "game over");
+        jlog_debug("client_make_move exit");
+        return 0;
     }
 
     free(game_move);
     pthread_mutex_unlock(&client->lock);
-    debug("client_make_move exit");
-
-
+    jlog_debug("client_make_move exit");
 
     return 0; // success
 }
@@ -5,7 +5,8 @@
 #include "global.h"
 #include "client_registry.h"
 #include <string.h>
-#include "debug.h"
+#include "jlog.h"
+#include "lock_profile.h"
 
 
 
@@ -20,7 +21,7 @@
 
 CLIENT_REGISTRY *creg_init()
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
     CLIENT_REGISTRY *registry = malloc(sizeof(CLIENT_REGISTRY));
     if (registry == NULL)
     {
@@ -49,7 +50,7 @@ CLIENT_REGISTRY *creg_init()
 
 CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     if (cr->client_count >= MAX_CLIENTS)
     {
@@ -61,8 +62,6 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd)
     new_node->client->fd = fd;
     new_node->next = NULL;
 
-    debug("Enter here: %d", __LINE__);
-
     pthread_mutex_lock(&cr->mutex);
     if (cr->head == NULL)
     {
@@ -83,7 +82,7 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd)
     CLIENT_NODE *iter = cr->head;
     while (iter != NULL)
     {
-        debug("fd: %d", iter->client->fd);
+        jlog_debug("fd: %d", iter->client->fd);
         iter = iter->next;
     }
 
@@ -105,16 +104,16 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd)
  */
 int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client)
 {
-    debug("%d", __LINE__);
-
-    int fd = client_get_fd(client);
+    jlog_trace("enter");
 
     pthread_mutex_lock(&cr->mutex);
     CLIENT_NODE *p = cr->head;
     CLIENT_NODE *prev = NULL;
     while (p != NULL)
     {
-        if (client_get_fd(p->client) == fd)
+        // Not by descriptor: that would take each client's lock under
+        // the registry's, and bots have none
+        if (p->client == client)
         {
             if (prev == NULL)
             {
@@ -125,6 +124,10 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client)
                 prev->next = p->next;
             }
             cr->client_count--;
+            if (cr->client_count == 0)
+            {
+                sem_post(&cr->sem);
+            }
             free(p);
             break;
         }
@@ -133,7 +136,7 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client)
     }
     pthread_mutex_unlock(&cr->mutex);
 
-    free(client);
+    client_unref(client, "unregistered");
     return 0;
 }
 
@@ -149,26 +152,17 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client)
  */
 void creg_shutdown_all(CLIENT_REGISTRY *cr)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     pthread_mutex_lock(&cr->mutex);
     CLIENT_NODE *p = cr->head;
     while (p != NULL)
     {
+        // Only reading is shut down, so that a response being sent
+        // by the service thread is still delivered
         shutdown(p->client->fd, SHUT_RD);
-        CLIENT_NODE *tmp = p;
         p = p->next;
-
-        if (client_get_player(p->client) != NULL)
-        {
-            client_logout(p->client);
-        }
-        free(tmp->client);
-        free(tmp);
     }
-    cr->head = NULL;
-    cr->client_count = 0;
-    sem_post(&cr->sem);
     pthread_mutex_unlock(&cr->mutex);
 }
 
@@ -183,18 +177,19 @@ void creg_shutdown_all(CLIENT_REGISTRY *cr)
 
 void creg_wait_for_empty(CLIENT_REGISTRY *cr)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
-    sem_wait(&cr->sem);
     pthread_mutex_lock(&cr->mutex);
-    while (cr->head != NULL)
+    while (cr->client_count > 0)
     {
-        shutdown(client_get_fd(cr->head->client), SHUT_RD);
-        CLIENT_NODE *tmp = cr->head;
-        cr->head = cr->head->next;
-        free(tmp);
+        pthread_mutex_unlock(&cr->mutex);
+        sem_wait(&cr->sem);
+        pthread_mutex_lock(&cr->mutex);
     }
     pthread_mutex_unlock(&cr->mutex);
+
+    // Pass the wakeup on to any other waiting thread
+    sem_post(&cr->sem);
 }
 
 int creg_client_count(CLIENT_REGISTRY *cr)
@@ -213,7 +208,7 @@ int creg_client_count(CLIENT_REGISTRY *cr)
 
 void creg_fini(CLIENT_REGISTRY *cr)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     creg_wait_for_empty(cr);
 
@@ -237,7 +232,7 @@ void creg_fini(CLIENT_REGISTRY *cr)
 
 PLAYER **creg_all_players(CLIENT_REGISTRY *cr)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     // Lock the mutex to prevent concurrent modification of player data
     pthread_mutex_lock(&(cr->mutex));
@@ -247,7 +242,7 @@ PLAYER **creg_all_players(CLIENT_REGISTRY *cr)
 
     // Copy the players array from the client registry to the player list array
     CLIENT_NODE *iter = cr->head;
-    debug("client_count: %d", cr->client_count);
+    jlog_debug("client_count: %d", cr->client_count);
     int idx = 0;
     for (int i = 0; i < cr->client_count; i++)
     {
@@ -257,7 +252,7 @@ PLAYER **creg_all_players(CLIENT_REGISTRY *cr)
             player_list[idx] = p;
             // Increment reference count since we are returning a pointer to each player
             player_ref(player_list[idx], "reference being added to players list");
-            debug("idx: %d, addr: %p, iter_addr: %p, name: %s", idx, player_list[idx], iter, player_get_name(player_list[idx]));
+            jlog_debug("idx: %d, addr: %p, iter_addr: %p, name: %s", idx, player_list[idx], iter, player_get_name(player_list[idx]));
             idx++;
         }
         iter = iter->next;
@@ -292,16 +287,16 @@ CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user)
     // Lock the mutex to prevent concurrent modification of player data
     pthread_mutex_lock(&(cr->mutex));
 
-    debug("%d", __LINE__);
+    jlog_trace("locked");
 
     CLIENT_NODE *iter = cr->head;
-    while (iter != NULL && client_get_player(iter->client) != NULL && strcmp(player_get_name(client_get_player(iter->client)), user) != 0)
+    while (iter != NULL && (client_get_player(iter->client) == NULL || strcmp(player_get_name(client_get_player(iter->client)), user) != 0))
     {
         iter = iter->next;
     }
 
     if (iter == NULL){
-        debug("NULL ERROR");
+        pthread_mutex_unlock(&(cr->mutex));
         return NULL;
     }
     client_ref(iter->client, "creg_lookup");
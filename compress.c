@@ -0,0 +1,235 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+/*
+ * An LZ4 block is a series of sequences.  Each starts with a token byte
+ * whose high nibble is the number of literals and low nibble the length
+ * of the match less LZ4_MIN_MATCH, either being extended by following
+ * bytes (each 255 adds 255 and ends the extension otherwise) when the
+ * nibble is 15.  The literals follow, then the match's offset back into
+ * the output as two bytes, little-endian.  The last sequence has only
+ * literals; the last LZ4_LAST_LITERALS bytes of a block are always
+ * literals, and no match starts within LZ4_MATCH_LIMIT bytes of the end.
+ */
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+static unsigned char compress_fds[PROTO_COMPRESS_FDS];
+
+/*
+ * Record whether payloads sent on a descriptor may be compressed.
+ */
+void proto_set_compression(int fd, int enabled)
+{
+    if (fd >= 0 && fd < PROTO_COMPRESS_FDS)
+    {
+        __atomic_store_n(&compress_fds[fd], enabled != 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * @return nonzero if payloads sent on a descriptor may be compressed.
+ */
+int proto_compression(int fd)
+{
+    return fd >= 0 && fd < PROTO_COMPRESS_FDS &&
+           __atomic_load_n(&compress_fds[fd], __ATOMIC_RELAXED);
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int hash4(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Room for a sequence with "lit" literals and a match of "mlen" extra bytes
+static size_t sequence_size(size_t lit, size_t mlen)
+{
+    return 1 + (lit >= 15 ? (lit - 15) / 255 + 1 : 0) + lit + 2 +
+           (mlen >= 15 ? (mlen - 15) / 255 + 1 : 0);
+}
+
+/*
+ * Compress a buffer into an LZ4 block, using greedy matching against a
+ * hash table of 4-byte sequences.
+ *
+ * @return the size of the block, or 0 if it does not fit in "capacity".
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t capacity)
+{
+    const uint8_t *base = src;
+    const uint8_t *end = base + len;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    uint8_t *op = dst;
+    uint8_t *oend = op + capacity;
+    uint32_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    if (len > LZ4_MATCH_LIMIT)
+    {
+        const uint8_t *match_limit = end - LZ4_MATCH_LIMIT;
+        const uint8_t *extend_limit = end - LZ4_LAST_LITERALS;
+        while (ip < match_limit)
+        {
+            uint32_t seq = read32(ip);
+            unsigned int h = hash4(seq);
+            const uint8_t *ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq)
+            {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *mp = ip + LZ4_MIN_MATCH;
+            const uint8_t *rp = ref + LZ4_MIN_MATCH;
+            while (mp < extend_limit && *mp == *rp)
+            {
+                mp++;
+                rp++;
+            }
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+
+            size_t lit = ip - anchor;
+            size_t mlen = mp - ip - LZ4_MIN_MATCH;
+            if (sequence_size(lit, mlen) > (size_t)(oend - op))
+            {
+                return 0;
+            }
+            uint8_t *token = op++;
+            *token = (lit >= 15 ? 15 : lit) << 4;
+            if (lit >= 15)
+            {
+                op = put_length(op, lit - 15);
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+            size_t offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            *token |= mlen >= 15 ? 15 : mlen;
+            if (mlen >= 15)
+            {
+                op = put_length(op, mlen - 15);
+            }
+            ip = anchor = mp;
+        }
+    }
+
+    size_t lit = end - anchor;
+    if (sequence_size(lit, 0) - 2 > (size_t)(oend - op))
+    {
+        return 0;
+    }
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15)
+    {
+        op = put_length(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - (uint8_t *)dst;
+}
+
+// Read a length extension, adding it to *lenp
+static int get_length(const uint8_t **ipp, const uint8_t *iend, size_t *lenp)
+{
+    unsigned int b;
+    do
+    {
+        if (*ipp >= iend)
+        {
+            return -1;
+        }
+        b = *(*ipp)++;
+        *lenp += b;
+    } while (b == 255);
+    return 0;
+}
+
+/*
+ * Decompress an LZ4 block, checking every length and offset against the
+ * bounds of both buffers.
+ *
+ * @return the size of the decompressed data, or -1 if the block is
+ * malformed or does not fit in "capacity".
+ */
+long lz4_decompress(const void *src, size_t len, void *dst, size_t capacity)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *ostart = dst;
+    uint8_t *op = ostart;
+    uint8_t *oend = op + capacity;
+
+    while (ip < iend)
+    {
+        unsigned int token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, iend, &lit) != 0)
+        {
+            return -1;
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+        {
+            break;                      // The last sequence has no match
+        }
+
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, iend, &mlen) != 0)
+        {
+            return -1;
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - ostart) || mlen > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        // The match may overlap what it produces, so copy a byte at a time
+        const uint8_t *ref = op - offset;
+        while (mlen-- > 0)
+        {
+            *op++ = *ref++;
+        }
+    }
+    return op - ostart;
+}
@@ -0,0 +1,43 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Payload compression.
+ *
+ * A client that can decompress payloads sets JEUX_LOGIN_COMPRESS in the
+ * ID of its LOGIN packet.  If the login succeeds, the ACK has the same
+ * bit set in its ID, and from then on the server may compress the
+ * payload of any packet it sends on that connection whose payload is at
+ * least PROTO_COMPRESS_THRESHOLD bytes, such as the reply to USERS.  A
+ * compressed packet has JEUX_COMPRESSED_FLAG set in its type, and its
+ * payload is the size of the original payload, as two bytes in network
+ * byte order, followed by the original payload compressed as an LZ4
+ * block (the format of LZ4_compress_default(), so a client may use the
+ * LZ4 library to decompress it).  A payload is sent compressed only if
+ * that makes it smaller.  Packets received with the flag set are
+ * decompressed before the payload is returned, whether or not
+ * compression was negotiated.
+ *
+ * This is done by proto_send_packet() and proto_recv_payload(), which
+ * keep the negotiated setting for each descriptor below
+ * PROTO_COMPRESS_FDS.  The codec is the one in this module; it needs no
+ * library.
+ */
+
+#define JEUX_COMPRESSED_FLAG 0x80       // In the type of a packet
+#define JEUX_LOGIN_COMPRESS 0x01        // In the ID of LOGIN and its ACK
+
+#define PROTO_COMPRESS_THRESHOLD 256
+#define PROTO_COMPRESS_FDS 65536
+
+void proto_set_compression(int fd, int enabled);
+int proto_compression(int fd);
+
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t capacity);
+long lz4_decompress(const void *src, size_t len, void *dst, size_t capacity);
+
+#endif
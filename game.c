@@ -5,7 +5,8 @@
 #include "game.h"
 #include "global.h"
 #include <pthread.h>
-#include "debug.h"
+#include "jlog.h"
+#include "lock_profile.h"
 
 #define MAX_MOVE_STRING_LENGTH 256
 
@@ -19,7 +20,7 @@
  */
 static int check_game_over(GAME *game)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     // Check if either player has resigned
     if (game->first_player_resigned || game->second_player_resigned)
@@ -105,6 +106,9 @@ static int check_game_over(GAME *game)
     return 0;
 }
 
+// IDs of games, in order of creation
+static int next_game_id;
+
 /**
  * Create a new game in an initial state.  The returned game has a
  * reference count of one.
@@ -114,7 +118,7 @@ static int check_game_over(GAME *game)
  */
 GAME *game_create(void)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     GAME *game = malloc(sizeof(GAME));
     if (game == NULL)
@@ -129,7 +133,7 @@ GAME *game_create(void)
     game->second_player_resigned = 0;
     game->last_move = NULL;
     game->refcount = 1;
-    game->id = 0;
+    game->id = __atomic_add_fetch(&next_game_id, 1, __ATOMIC_RELAXED);
 
     // initialize game board to all zeroes
     memset(game->game_board, 0, sizeof(game->game_board));
@@ -148,7 +152,7 @@ GAME *game_create(void)
  */
 GAME *game_ref(GAME *game, char *why)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
     
     game->refcount++;
     return game;
@@ -166,7 +170,7 @@ GAME *game_ref(GAME *game, char *why)
  */
 void game_unref(GAME *game, char *why)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     pthread_mutex_lock(&game->mutex);
 
@@ -200,7 +204,7 @@ void game_unref(GAME *game, char *why)
  */
 int game_apply_move(GAME *game, GAME_MOVE *move)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     if (game->game_over)
     {
@@ -216,6 +220,14 @@ int game_apply_move(GAME *game, GAME_MOVE *move)
     }
     
 
+    // The GAME keeps its own copy; the caller still owns "move"
+    GAME_MOVE *last = malloc(sizeof(GAME_MOVE));
+    if (last == NULL)
+    {
+        return -1;
+    }
+    *last = *move;
+
     pthread_mutex_lock(&game->mutex);
 
     int r = (move->value - 1) / 3;
@@ -227,9 +239,11 @@ int game_apply_move(GAME *game, GAME_MOVE *move)
         if (game->first_player_resigned)
         {
             pthread_mutex_unlock(&game->mutex);
+            free(last);
             return -1; // game over due to resignation
         }
-        game->last_move = move;
+        free(game->last_move);
+        game->last_move = last;
         game->current_role = SECOND_PLAYER_ROLE;
         game->game_board[r][c] = 1;
     }
@@ -238,12 +252,18 @@ int game_apply_move(GAME *game, GAME_MOVE *move)
         if (game->second_player_resigned)
         {
             pthread_mutex_unlock(&game->mutex);
+            free(last);
             return -1; // game over due to resignation
         }
-        game->last_move = move;
+        free(game->last_move);
+        game->last_move = last;
         game->current_role = FIRST_PLAYER_ROLE;
         game->game_board[r][c] = -1;
     }
+    else
+    {
+        free(last);
+    }
 
     check_game_over(game);
 
@@ -260,7 +280,7 @@ Determine whether the game is over.
 */
 int game_is_over(GAME *game)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     pthread_mutex_lock(&(game->mutex));
     int game_over = game->game_over;
@@ -278,7 +298,7 @@ int game_is_over(GAME *game)
  */
 GAME_ROLE game_get_winner(GAME *game)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     if (game->first_player_resigned){
         return SECOND_PLAYER_ROLE;
@@ -315,7 +335,7 @@ GAME_ROLE game_get_winner(GAME *game)
         return NULL_ROLE;
     }
 
-    debug("ERROR: %d", __LINE__);
+    jlog_warn("unexpected game state %d", game_res);
     return NULL_ROLE;
 }
 
@@ -326,7 +346,7 @@ Free all memory associated with a GAME.
 */
 void game_free(GAME *game)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     free(game->last_move);
     free(game);
@@ -342,7 +362,7 @@ void game_free(GAME *game)
  */
 int game_resign(GAME *game, GAME_ROLE role)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     pthread_mutex_lock(&game->mutex);
 
@@ -365,7 +385,7 @@ int game_resign(GAME *game, GAME_ROLE role)
     else
     {
         // Invalid role
-        debug("INVALID ROLE");
+        jlog_debug("INVALID ROLE");
         pthread_mutex_unlock(&game->mutex);
         return -1;
     }
@@ -374,7 +394,7 @@ int game_resign(GAME *game, GAME_ROLE role)
     if (game->first_player_resigned || game->second_player_resigned)
     {
         game->game_over = 1;
-        debug("GAME OVER!");
+        jlog_debug("GAME OVER!");
     }
 
     pthread_mutex_unlock(&game->mutex);
@@ -393,7 +413,7 @@ int game_resign(GAME *game, GAME_ROLE role)
  */
 char *game_unparse_state(GAME *game)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     char *state_str = malloc(sizeof(char) * 5000);
     if (state_str == NULL)
@@ -461,7 +481,7 @@ char *game_unparse_state(GAME *game)
  */
 GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     GAME_MOVE *move = malloc(sizeof(GAME_MOVE));
     move->value = atoi(str);
@@ -478,7 +498,7 @@ GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str)
     // {
     //     int r = (move->value - 1) / 3;
     //     int c = (move->value - 1) % 3;
-    //     debug("r: %d, c: %d", r, c);
+    //     jlog_debug("r: %d, c: %d", r, c);
 
     //     if (game->game_board[r][c] != 0){
     //         free(move);
@@ -515,7 +535,7 @@ GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str)
  */
 char *game_unparse_move(GAME_MOVE *move)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
 
     if (move == NULL)
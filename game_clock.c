@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "game_clock.h"
+#include "timer_wheel.h"
+#include "game_log.h"
+#include "global.h"
+#include "jlog.h"
+
+typedef enum {
+    GCLOCK_OFFERED,                 // Invitation not yet accepted
+    GCLOCK_RUNNING,
+    GCLOCK_DONE
+} GCLOCK_STATE;
+
+/*
+ * The clocks of one invitation.  An entry is referenced by the table
+ * (until the game ends or the invitation goes away) and by its timer
+ * (until the timer's callback returns 0); it holds a reference to the
+ * invitation.
+ */
+typedef struct gclock {
+    INVITATION *inv;
+    TIME_CONTROL tc;
+    GCLOCK_STATE state;
+    GAME_ROLE turn;
+    unsigned long remaining[3];     // Indexed by GAME_ROLE, in ms
+    unsigned long turn_started;     // twheel_now() when the turn began
+    TWHEEL_TIMER *timer;
+    int refs;
+    struct gclock *next;
+} GCLOCK;
+
+static struct {
+    GCLOCK *buckets[GCLOCK_BUCKETS];
+    pthread_mutex_t mutex;
+} clocks = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static GCLOCK **bucket(INVITATION *inv)
+{
+    uintptr_t h = (uintptr_t)inv;
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return &clocks.buckets[(h >> 32) & (GCLOCK_BUCKETS - 1)];
+}
+
+static GCLOCK *lookup(INVITATION *inv)
+{
+    GCLOCK *gc = *bucket(inv);
+    while (gc != NULL && gc->inv != inv)
+    {
+        gc = gc->next;
+    }
+    return gc;
+}
+
+static void remove_entry(GCLOCK *gc)
+{
+    GCLOCK **link = bucket(gc->inv);
+    while (*link != NULL && *link != gc)
+    {
+        link = &(*link)->next;
+    }
+    if (*link != NULL)
+    {
+        *link = gc->next;
+    }
+}
+
+// Drop references to a clock, with clocks.mutex held
+static void release(GCLOCK *gc, int refs)
+{
+    if ((gc->refs -= refs) == 0)
+    {
+        inv_unref(gc->inv, "clock released");
+        free(gc);
+    }
+}
+
+static GAME_ROLE other_role(GAME_ROLE role)
+{
+    return role == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+}
+
+/*
+ * Parse a time control of the form "<base>+<increment>", in seconds.
+ * "<base>" alone means no increment.
+ *
+ * @return 0 if the time control is valid, otherwise -1.
+ */
+int gclock_parse(char *spec, TIME_CONTROL *tc)
+{
+    char *end;
+    unsigned long base = strtoul(spec, &end, 10);
+    unsigned long increment = 0;
+    if (end == spec || base == 0 || base > GCLOCK_MAX_BASE_SECONDS)
+    {
+        return -1;
+    }
+    if (*end == '+')
+    {
+        char *inc = end + 1;
+        increment = strtoul(inc, &end, 10);
+        if (end == inc || increment > GCLOCK_MAX_INCREMENT_SECONDS)
+        {
+            return -1;
+        }
+    }
+    if (*end != '\0')
+    {
+        return -1;
+    }
+    tc->base_ms = base * 1000;
+    tc->increment_ms = increment * 1000;
+    return 0;
+}
+
+/*
+ * Attach a time control to a new invitation.  Its clocks start when
+ * the invitation is accepted.
+ */
+void gclock_offer(INVITATION *inv, TIME_CONTROL *tc)
+{
+    GCLOCK *gc = calloc(1, sizeof(GCLOCK));
+    if (gc == NULL)
+    {
+        return;
+    }
+    gc->inv = inv_ref(inv, "clock offered");
+    gc->tc = *tc;
+    gc->state = GCLOCK_OFFERED;
+    gc->refs = 1;
+
+    pthread_mutex_lock(&clocks.mutex);
+    GCLOCK **head = bucket(inv);
+    gc->next = *head;
+    *head = gc;
+    pthread_mutex_unlock(&clocks.mutex);
+}
+
+/*
+ * Resolve a game whose player has run out of time, in the same way as a
+ * resignation by that player: the invitation is closed (which resigns
+ * the game), and the game is finished by client_end_game(), which sends
+ * both players ENDED and has the result rated.
+ */
+static void flag_fell(INVITATION *inv, GAME_ROLE loser)
+{
+    GAME *game = inv_get_game(inv);
+    if (game == NULL || game_is_over(game) || inv_close(inv, loser) != 0)
+    {
+        return;
+    }
+    jlog_info("invitation %p: flag fell for role %d", (void *)inv, loser);
+    client_end_game(inv, other_role(loser), GLOG_END_TIME_FORFEIT);
+}
+
+/*
+ * Timer callback for the clock of the player to move.
+ */
+static unsigned long clock_timeout(void *arg)
+{
+    GCLOCK *gc = arg;
+
+    pthread_mutex_lock(&clocks.mutex);
+    if (gc->state != GCLOCK_RUNNING)
+    {
+        release(gc, 1);
+        pthread_mutex_unlock(&clocks.mutex);
+        return 0;
+    }
+    unsigned long elapsed = twheel_now() - gc->turn_started;
+    if (elapsed < gc->remaining[gc->turn])
+    {
+        unsigned long left = gc->remaining[gc->turn] - elapsed;
+        pthread_mutex_unlock(&clocks.mutex);
+        return left;
+    }
+
+    INVITATION *inv = inv_ref(gc->inv, "flag fell");
+    GAME_ROLE loser = gc->turn;
+    gc->state = GCLOCK_DONE;
+    gc->remaining[loser] = 0;
+    remove_entry(gc);
+    release(gc, 2);                 // The table's reference and the timer's
+    pthread_mutex_unlock(&clocks.mutex);
+
+    flag_fell(inv, loser);
+    inv_unref(inv, "flag fell");
+    return 0;
+}
+
+/*
+ * Start the first player's clock when a timed invitation is accepted.
+ */
+void gclock_start(INVITATION *inv)
+{
+    pthread_mutex_lock(&clocks.mutex);
+    GCLOCK *gc = lookup(inv);
+    if (gc != NULL && gc->state == GCLOCK_OFFERED)
+    {
+        gc->remaining[FIRST_PLAYER_ROLE] = gc->tc.base_ms;
+        gc->remaining[SECOND_PLAYER_ROLE] = gc->tc.base_ms;
+        gc->turn = FIRST_PLAYER_ROLE;
+        gc->turn_started = twheel_now();
+        gc->state = GCLOCK_RUNNING;
+        gc->refs++;
+        gc->timer = twheel_start(gc->tc.base_ms, clock_timeout, gc);
+        if (gc->timer == NULL)
+        {
+            gc->refs--;
+            gc->state = GCLOCK_DONE;
+        }
+    }
+    pthread_mutex_unlock(&clocks.mutex);
+}
+
+/*
+ * @return nonzero if it is the given player's turn in a timed game and
+ * that player has no time left, so that a move by the player must be
+ * refused.  The game itself is resolved by the clock's timer.
+ */
+int gclock_flagged(INVITATION *inv, GAME_ROLE role)
+{
+    int flagged = 0;
+    pthread_mutex_lock(&clocks.mutex);
+    GCLOCK *gc = lookup(inv);
+    if (gc != NULL && gc->turn == role &&
+        (gc->state == GCLOCK_DONE ||
+         (gc->state == GCLOCK_RUNNING &&
+          twheel_now() - gc->turn_started >= gc->remaining[role])))
+    {
+        flagged = 1;
+    }
+    pthread_mutex_unlock(&clocks.mutex);
+    return flagged;
+}
+
+/*
+ * Charge the time taken for a move, add the increment, and start the
+ * opponent's clock.
+ */
+void gclock_moved(INVITATION *inv, GAME_ROLE role)
+{
+    pthread_mutex_lock(&clocks.mutex);
+    GCLOCK *gc = lookup(inv);
+    if (gc != NULL && gc->state == GCLOCK_RUNNING && gc->turn == role)
+    {
+        unsigned long now = twheel_now();
+        unsigned long elapsed = now - gc->turn_started;
+        gc->remaining[role] = (elapsed < gc->remaining[role] ? gc->remaining[role] - elapsed : 0) +
+                              gc->tc.increment_ms;
+        gc->turn = other_role(role);
+        gc->turn_started = now;
+        twheel_timer_schedule(gc->timer, gc->remaining[gc->turn]);
+    }
+    pthread_mutex_unlock(&clocks.mutex);
+}
+
+/*
+ * Stop the clocks of an invitation whose game has ended, or which has
+ * been revoked, declined or withdrawn.
+ */
+void gclock_stop(INVITATION *inv)
+{
+    pthread_mutex_lock(&clocks.mutex);
+    GCLOCK *gc = lookup(inv);
+    if (gc != NULL)
+    {
+        remove_entry(gc);
+        if (gc->state == GCLOCK_RUNNING)
+        {
+            // Let the timer fire now, so that it drops its reference
+            gc->state = GCLOCK_DONE;
+            twheel_timer_schedule(gc->timer, 0);
+        }
+        gc->state = GCLOCK_DONE;
+        release(gc, 1);
+    }
+    pthread_mutex_unlock(&clocks.mutex);
+}
+
+/*
+ * Get the clocks of an invitation, so that they can be handed to a
+ * successor server (see handoff.h).  The time of the player to move is
+ * charged up to now.
+ *
+ * @return -1 if the invitation is untimed, 0 if its clocks have not
+ * started and 1 if they are running.
+ */
+int gclock_export(INVITATION *inv, TIME_CONTROL *tc, unsigned long remaining[3],
+                  GAME_ROLE *turnp)
+{
+    int running = -1;
+    pthread_mutex_lock(&clocks.mutex);
+    GCLOCK *gc = lookup(inv);
+    if (gc != NULL && gc->state != GCLOCK_DONE)
+    {
+        *tc = gc->tc;
+        memcpy(remaining, gc->remaining, sizeof(gc->remaining));
+        *turnp = gc->turn;
+        running = gc->state == GCLOCK_RUNNING;
+        if (running)
+        {
+            unsigned long elapsed = twheel_now() - gc->turn_started;
+            remaining[gc->turn] = elapsed < remaining[gc->turn] ? remaining[gc->turn] - elapsed : 0;
+        }
+    }
+    pthread_mutex_unlock(&clocks.mutex);
+    return running;
+}
+
+/*
+ * Recreate the clocks of an invitation received from a predecessor
+ * server, as returned by gclock_export().
+ */
+void gclock_restore(INVITATION *inv, TIME_CONTROL *tc, unsigned long remaining[3],
+                    GAME_ROLE turn, int running)
+{
+    gclock_offer(inv, tc);
+    if (!running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&clocks.mutex);
+    GCLOCK *gc = lookup(inv);
+    if (gc != NULL)
+    {
+        memcpy(gc->remaining, remaining, sizeof(gc->remaining));
+        gc->turn = turn;
+        gc->turn_started = twheel_now();
+        gc->state = GCLOCK_RUNNING;
+        gc->refs++;
+        gc->timer = twheel_start(remaining[turn], clock_timeout, gc);
+        if (gc->timer == NULL)
+        {
+            gc->refs--;
+            gc->state = GCLOCK_DONE;
+        }
+    }
+    pthread_mutex_unlock(&clocks.mutex);
+}
@@ -0,0 +1,40 @@
+#ifndef GAME_CLOCK_H
+#define GAME_CLOCK_H
+
+#include "global.h"
+
+/*
+ * Chess-style clocks for games.
+ *
+ * The source of an invitation may choose a time control by appending
+ * a TAB and "<base>+<increment>" (in seconds) to the username in the
+ * payload of INVITE, e.g. "bob\t300+5".  Each player then starts with
+ * the base time, the clock of the player to move runs, and the increment
+ * is added after each move.  The clock of the player to move is a timer
+ * on the shared timer wheel, rescheduled on each move.  When a player's
+ * time runs out the game is resigned on that player's behalf, as by
+ * game_resign(), and both players are sent ENDED.  Invitations without
+ * a time control are untimed.
+ */
+
+#define GCLOCK_MAX_BASE_SECONDS (24 * 60 * 60)
+#define GCLOCK_MAX_INCREMENT_SECONDS (60 * 60)
+#define GCLOCK_BUCKETS 1024
+
+typedef struct time_control {
+    unsigned long base_ms;
+    unsigned long increment_ms;
+} TIME_CONTROL;
+
+int gclock_parse(char *spec, TIME_CONTROL *tc);
+void gclock_offer(INVITATION *inv, TIME_CONTROL *tc);
+void gclock_start(INVITATION *inv);
+int gclock_flagged(INVITATION *inv, GAME_ROLE role);
+void gclock_moved(INVITATION *inv, GAME_ROLE role);
+void gclock_stop(INVITATION *inv);
+int gclock_export(INVITATION *inv, TIME_CONTROL *tc, unsigned long remaining[3],
+                  GAME_ROLE *turnp);
+void gclock_restore(INVITATION *inv, TIME_CONTROL *tc, unsigned long remaining[3],
+                    GAME_ROLE turn, int running);
+
+#endif
@@ -0,0 +1,454 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "game_log.h"
+#include "jlog.h"
+
+#define GAME_TABLE_SIZE 1024
+#define MAX_LOGGED_MOVES 64
+
+typedef enum {
+    GLOG_EVENT_START,
+    GLOG_EVENT_MOVE,
+    GLOG_EVENT_END
+} GLOG_EVENT_TYPE;
+
+/*
+ * An event pushed by a service thread.  Events are linked into an
+ * intrusive multi-producer, single-consumer queue: producers swap
+ * themselves in at "queue_head" with one atomic exchange and the writer
+ * thread consumes from "queue_tail".
+ */
+typedef struct glog_event {
+    _Atomic(struct glog_event *) next;
+    GLOG_EVENT_TYPE type;
+    int game_id;
+    struct timespec time;
+    GAME_ROLE role;                 // Mover for MOVE, winner for END
+    int square;
+    GLOG_END_REASON reason;
+    char names[];                   // "first\0second\0" for START
+} GLOG_EVENT;
+
+/* A game in progress, as seen by the writer thread. */
+typedef struct logged_game {
+    int game_id;
+    uint64_t serial;
+    struct timespec start;
+    char *first_name;
+    char *second_name;
+    int move_count;
+    GLOG_MOVE_ENTRY moves[MAX_LOGGED_MOVES];
+    struct logged_game *next;
+} LOGGED_GAME;
+
+static struct {
+    int enabled;
+    int stop;
+    char *dir;
+    FILE *segment;
+    unsigned long segment_number;
+    long segment_size;
+    uint64_t next_serial;
+    GLOG_EVENT stub;
+    _Atomic(GLOG_EVENT *) queue_head;
+    GLOG_EVENT *queue_tail;
+    sem_t items;
+    pthread_t writer;
+    LOGGED_GAME *games[GAME_TABLE_SIZE];    // Owned by the writer thread
+} glog;
+
+static void push_event(GLOG_EVENT *event)
+{
+    atomic_store_explicit(&event->next, NULL, memory_order_relaxed);
+    GLOG_EVENT *prev = atomic_exchange_explicit(&glog.queue_head, event, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, event, memory_order_release);
+}
+
+/*
+ * Remove the oldest event from the queue.  Returns NULL if the queue is
+ * empty, or if a producer is halfway through linking in the next event;
+ * that producer posts the semaphore once it is done, so the writer will
+ * come back for it.
+ */
+static GLOG_EVENT *pop_event(void)
+{
+    GLOG_EVENT *tail = glog.queue_tail;
+    GLOG_EVENT *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &glog.stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        glog.queue_tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next != NULL)
+    {
+        glog.queue_tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&glog.queue_head, memory_order_acquire))
+    {
+        return NULL;
+    }
+    push_event(&glog.stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL)
+    {
+        glog.queue_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static GLOG_EVENT *new_event(GLOG_EVENT_TYPE type, GAME *game, size_t names_len)
+{
+    GLOG_EVENT *event = malloc(sizeof(GLOG_EVENT) + names_len);
+    if (event == NULL)
+    {
+        return NULL;
+    }
+    event->type = type;
+    event->game_id = game->id;
+    clock_gettime(CLOCK_REALTIME, &event->time);
+    return event;
+}
+
+static void enqueue(GLOG_EVENT *event)
+{
+    push_event(event);
+    sem_post(&glog.items);
+}
+
+/*
+ * Games are looked up by ID rather than by address, since the address of
+ * a GAME that has been freed may be reused before its END event has been
+ * handled.
+ */
+static LOGGED_GAME **game_slot(int game_id)
+{
+    LOGGED_GAME **slot = &glog.games[(unsigned int)game_id % GAME_TABLE_SIZE];
+    while (*slot != NULL && (*slot)->game_id != game_id)
+    {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+/*
+ * Start a new segment if there is none yet or the current one is full.
+ */
+static FILE *current_segment(void)
+{
+    if (glog.segment != NULL && glog.segment_size < GLOG_SEGMENT_SIZE)
+    {
+        return glog.segment;
+    }
+    if (glog.segment != NULL)
+    {
+        fclose(glog.segment);
+    }
+
+    size_t len = strlen(glog.dir) + 32;
+    char *path = malloc(len);
+    if (path == NULL)
+    {
+        glog.segment = NULL;
+        return NULL;
+    }
+    snprintf(path, len, "%s/games-%06lu.log", glog.dir, ++glog.segment_number);
+    glog.segment = fopen(path, "w");
+    glog.segment_size = 0;
+    if (glog.segment == NULL)
+    {
+        jlog_error("cannot create game log segment %s: %s", path, strerror(errno));
+    }
+    free(path);
+    return glog.segment;
+}
+
+static void write_record(LOGGED_GAME *lg, struct timespec *end, GAME_ROLE winner,
+                         GLOG_END_REASON reason)
+{
+    FILE *f = current_segment();
+    if (f == NULL)
+    {
+        return;
+    }
+
+    GLOG_RECORD_HEADER hdr = {0};
+    size_t first_len = strlen(lg->first_name);
+    size_t second_len = strlen(lg->second_name);
+    hdr.magic = GLOG_RECORD_MAGIC;
+    hdr.first_name_len = first_len > 255 ? 255 : first_len;
+    hdr.second_name_len = second_len > 255 ? 255 : second_len;
+    hdr.move_count = lg->move_count;
+    hdr.length = sizeof(hdr) + hdr.first_name_len + hdr.second_name_len +
+                 lg->move_count * sizeof(GLOG_MOVE_ENTRY);
+    hdr.serial = lg->serial;
+    hdr.start_sec = lg->start.tv_sec;
+    hdr.start_nsec = lg->start.tv_nsec;
+    hdr.end_sec = end->tv_sec;
+    hdr.end_nsec = end->tv_nsec;
+    hdr.winner = winner;
+    hdr.end_reason = reason;
+
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(lg->first_name, 1, hdr.first_name_len, f);
+    fwrite(lg->second_name, 1, hdr.second_name_len, f);
+    fwrite(lg->moves, sizeof(GLOG_MOVE_ENTRY), lg->move_count, f);
+    glog.segment_size += hdr.length;
+}
+
+static void free_logged_game(LOGGED_GAME *lg)
+{
+    free(lg->first_name);
+    free(lg->second_name);
+    free(lg);
+}
+
+static void handle_event(GLOG_EVENT *event)
+{
+    LOGGED_GAME **slot = game_slot(event->game_id);
+    LOGGED_GAME *lg = *slot;
+
+    switch (event->type)
+    {
+    case GLOG_EVENT_START:
+        if (lg != NULL)
+        {
+            jlog_warn("game %d started twice; ignoring the second start", event->game_id);
+            break;
+        }
+        lg = calloc(1, sizeof(LOGGED_GAME));
+        if (lg == NULL)
+        {
+            break;
+        }
+        lg->game_id = event->game_id;
+        lg->serial = glog.next_serial++;
+        lg->start = event->time;
+        lg->first_name = strdup(event->names);
+        lg->second_name = strdup(event->names + strlen(event->names) + 1);
+        if (lg->first_name == NULL || lg->second_name == NULL)
+        {
+            free_logged_game(lg);
+            break;
+        }
+        *slot = lg;
+        break;
+
+    case GLOG_EVENT_MOVE:
+        if (lg == NULL || lg->move_count == MAX_LOGGED_MOVES)
+        {
+            break;
+        }
+        GLOG_MOVE_ENTRY *move = &lg->moves[lg->move_count++];
+        move->offset_ms = (event->time.tv_sec - lg->start.tv_sec) * 1000 +
+                          (event->time.tv_nsec - lg->start.tv_nsec) / 1000000;
+        move->role = event->role;
+        move->square = event->square;
+        break;
+
+    case GLOG_EVENT_END:
+        if (lg == NULL)
+        {
+            break;
+        }
+        write_record(lg, &event->time, event->role, event->reason);
+        *slot = lg->next;
+        free_logged_game(lg);
+        break;
+    }
+}
+
+/*
+ * Thread function for the game log writer.
+ */
+static void *writer_thread(void *arg)
+{
+    while (1)
+    {
+        sem_wait(&glog.items);
+
+        GLOG_EVENT *event;
+        while ((event = pop_event()) != NULL)
+        {
+            handle_event(event);
+            free(event);
+        }
+        if (glog.segment != NULL)
+        {
+            fflush(glog.segment);
+        }
+
+        if (__atomic_load_n(&glog.stop, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start recording games into a specified directory.  Recording continues
+ * with a new segment after the highest-numbered one already present.
+ *
+ * @param dir  The directory in which the game log segments are kept.
+ * @return 0 if recording was started, otherwise -1.
+ */
+int glog_init(char *dir)
+{
+    jlog_trace("enter");
+
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        return -1;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        unsigned long n;
+        if (sscanf(ent->d_name, "games-%lu.log", &n) == 1 && n > glog.segment_number)
+        {
+            glog.segment_number = n;
+        }
+    }
+    closedir(d);
+
+    glog.dir = strdup(dir);
+    if (glog.dir == NULL)
+    {
+        return -1;
+    }
+    // Serial numbers stay unique across restarts, since every run starts
+    // a new segment.
+    glog.next_serial = (uint64_t)(glog.segment_number + 1) << 32;
+    atomic_store(&glog.stub.next, NULL);
+    atomic_store(&glog.queue_head, &glog.stub);
+    glog.queue_tail = &glog.stub;
+    sem_init(&glog.items, 0, 0);
+    __atomic_store_n(&glog.enabled, 1, __ATOMIC_RELEASE);
+    pthread_create(&glog.writer, NULL, writer_thread, NULL);
+    return 0;
+}
+
+/*
+ * Write out all queued events, record any games still in progress as
+ * unfinished, and close the game log.
+ */
+void glog_fini(void)
+{
+    jlog_trace("enter");
+
+    if (!__atomic_load_n(&glog.enabled, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    __atomic_store_n(&glog.enabled, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&glog.stop, 1, __ATOMIC_RELEASE);
+    sem_post(&glog.items);
+    pthread_join(glog.writer, NULL);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; i < GAME_TABLE_SIZE; i++)
+    {
+        while (glog.games[i] != NULL)
+        {
+            LOGGED_GAME *lg = glog.games[i];
+            write_record(lg, &now, NULL_ROLE, GLOG_END_UNFINISHED);
+            glog.games[i] = lg->next;
+            free_logged_game(lg);
+        }
+    }
+    if (glog.segment != NULL)
+    {
+        fclose(glog.segment);
+    }
+    sem_destroy(&glog.items);
+    free(glog.dir);
+}
+
+/*
+ * Note that a game has started.
+ *
+ * @param game  The GAME that has been created.
+ * @param first_player  The username of the player who moves first.
+ * @param second_player  The username of the other player.
+ */
+void glog_game_started(GAME *game, char *first_player, char *second_player)
+{
+    if (!__atomic_load_n(&glog.enabled, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    size_t first_len = strlen(first_player) + 1;
+    size_t second_len = strlen(second_player) + 1;
+    GLOG_EVENT *event = new_event(GLOG_EVENT_START, game, first_len + second_len);
+    if (event == NULL)
+    {
+        return;
+    }
+    memcpy(event->names, first_player, first_len);
+    memcpy(event->names + first_len, second_player, second_len);
+    enqueue(event);
+}
+
+/*
+ * Note that a move has been applied to a game.
+ *
+ * @param game  The GAME in which the move was made.
+ * @param role  The GAME_ROLE of the player who moved.
+ * @param square  The square that was occupied.
+ */
+void glog_move(GAME *game, GAME_ROLE role, int square)
+{
+    if (!__atomic_load_n(&glog.enabled, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    GLOG_EVENT *event = new_event(GLOG_EVENT_MOVE, game, 0);
+    if (event == NULL)
+    {
+        return;
+    }
+    event->role = role;
+    event->square = square;
+    enqueue(event);
+}
+
+/*
+ * Note that a game has ended.  The record of the game is written to the
+ * log by the writer thread.
+ *
+ * @param game  The GAME that has ended.
+ * @param winner  The GAME_ROLE of the winner, or NULL_ROLE for a draw.
+ * @param reason  How the game ended.
+ */
+void glog_game_ended(GAME *game, GAME_ROLE winner, GLOG_END_REASON reason)
+{
+    if (!__atomic_load_n(&glog.enabled, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    GLOG_EVENT *event = new_event(GLOG_EVENT_END, game, 0);
+    if (event == NULL)
+    {
+        return;
+    }
+    event->role = winner;
+    event->reason = reason;
+    enqueue(event);
+}
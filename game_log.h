@@ -0,0 +1,62 @@
+#ifndef GAME_LOG_H
+#define GAME_LOG_H
+
+#include <stdint.h>
+#include "global.h"
+
+/*
+ * Recording of finished games.
+ *
+ * Service threads only push small events (game started, move made, game
+ * ended) onto a lock-free queue.  A single writer thread assembles the
+ * events of each game and, once it has ended, appends one record for it
+ * to the current segment of the game log.  Segments are files named
+ * "games-<number>.log", and a new one is started when the current one
+ * reaches GLOG_SEGMENT_SIZE bytes.
+ *
+ * Record layout (all integers in host byte order):
+ *   GLOG_RECORD_HEADER
+ *   first player's name   (first_name_len bytes, not NUL-terminated)
+ *   second player's name  (second_name_len bytes)
+ *   move_count x GLOG_MOVE_ENTRY
+ */
+
+#define GLOG_SEGMENT_SIZE (16 << 20)
+#define GLOG_RECORD_MAGIC 0x5247584a     // "JXGR"
+
+typedef enum {
+    GLOG_END_NORMAL,        // Game ended by a move
+    GLOG_END_RESIGNED,      // A player resigned (or logged out)
+    GLOG_END_UNFINISHED,    // Still in progress when the server shut down
+    GLOG_END_TIME_FORFEIT   // A player ran out of time
+} GLOG_END_REASON;
+
+typedef struct glog_record_header {
+    uint32_t magic;
+    uint32_t length;                // Total length of the record in bytes
+    uint64_t serial;                // Game number, unique within the log
+    uint32_t start_sec;
+    uint32_t start_nsec;
+    uint32_t end_sec;
+    uint32_t end_nsec;
+    uint8_t winner;                 // GAME_ROLE of the winner, NULL_ROLE if drawn
+    uint8_t end_reason;             // GLOG_END_REASON
+    uint8_t first_name_len;
+    uint8_t second_name_len;
+    uint16_t move_count;
+    uint16_t reserved;
+} GLOG_RECORD_HEADER;
+
+typedef struct glog_move_entry {
+    uint32_t offset_ms;             // Time of the move since the game started
+    uint8_t role;                   // GAME_ROLE of the player who moved
+    uint8_t square;                 // Square (1-9) that was occupied
+} __attribute__((packed)) GLOG_MOVE_ENTRY;
+
+int glog_init(char *dir);
+void glog_fini(void);
+void glog_game_started(GAME *game, char *first_player, char *second_player);
+void glog_move(GAME *game, GAME_ROLE role, int square);
+void glog_game_ended(GAME *game, GAME_ROLE winner, GLOG_END_REASON reason);
+
+#endif
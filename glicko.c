@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "glicko.h"
+#include "player_store.h"
+#include "rating_journal.h"
+#include "global.h"
+#include "jeux_globals.h"
+#include "jlog.h"
+
+#define GLICKO_SCALE 173.7178
+#define VOLATILITY_EPSILON 0.000001
+
+/*
+ * Glicko-2 state of the players with results in the current rating
+ * period, as parallel arrays indexed by a per-player slot.  Ratings and
+ * deviations are on the Glicko-2 scale.  "slot_keys" and "slot_values"
+ * form an open-addressed table from PLAYER pointers to slots; every
+ * player with a slot is kept alive by a reference held here until the
+ * period is closed, after which its state lives only in the player store.
+ */
+static struct {
+    int enabled;
+    int stop;
+    unsigned long period;   // Index of the current period since the epoch
+    int count;
+    int capacity;
+    PLAYER **players;
+    double *mu;
+    double *phi;
+    double *sigma;
+    double *v_inv;          // Sum of g(phi_j)^2 * E * (1 - E) this period
+    double *delta_sum;      // Sum of g(phi_j) * (s - E) this period
+    PLAYER **slot_keys;
+    int *slot_values;
+    int slot_capacity;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+} glicko = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static int slot_index(PLAYER *player)
+{
+    return ((uintptr_t)player >> 4) & (glicko.slot_capacity - 1);
+}
+
+static int grow_arrays(void)
+{
+    int capacity = glicko.capacity == 0 ? 1024 : glicko.capacity * 2;
+    PLAYER **players = realloc(glicko.players, capacity * sizeof(PLAYER *));
+    if (players != NULL)
+    {
+        glicko.players = players;
+    }
+    double **fields[] = {&glicko.mu, &glicko.phi, &glicko.sigma, &glicko.v_inv, &glicko.delta_sum};
+    for (unsigned int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        double *p = realloc(*fields[i], capacity * sizeof(double));
+        if (p == NULL)
+        {
+            return -1;
+        }
+        *fields[i] = p;
+    }
+    if (players == NULL)
+    {
+        return -1;
+    }
+    glicko.capacity = capacity;
+
+    // Keep the slot map at most half full.
+    free(glicko.slot_keys);
+    free(glicko.slot_values);
+    glicko.slot_capacity = capacity * 2;
+    glicko.slot_keys = calloc(glicko.slot_capacity, sizeof(PLAYER *));
+    glicko.slot_values = malloc(glicko.slot_capacity * sizeof(int));
+    if (glicko.slot_keys == NULL || glicko.slot_values == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < glicko.count; i++)
+    {
+        int h = slot_index(glicko.players[i]);
+        while (glicko.slot_keys[h] != NULL)
+        {
+            h = (h + 1) & (glicko.slot_capacity - 1);
+        }
+        glicko.slot_keys[h] = glicko.players[i];
+        glicko.slot_values[h] = i;
+    }
+    return 0;
+}
+
+/*
+ * Find the slot of a player, loading its state from the player store if
+ * it has no results yet in the current period.  The stored deviation is
+ * widened for each period that has passed without the player being
+ * rated, phi' = sqrt(phi^2 + n * sigma^2), as if it had been updated at
+ * the end of each of them.  The glicko mutex must be held by the caller.
+ *
+ * @return the slot of the player, or -1 if it could not be created.
+ */
+static int player_slot(PLAYER *player)
+{
+    if (glicko.slot_capacity > 0)
+    {
+        int h = slot_index(player);
+        while (glicko.slot_keys[h] != NULL)
+        {
+            if (glicko.slot_keys[h] == player)
+            {
+                return glicko.slot_values[h];
+            }
+            h = (h + 1) & (glicko.slot_capacity - 1);
+        }
+    }
+
+    if (glicko.count == glicko.capacity && grow_arrays() != 0)
+    {
+        return -1;
+    }
+    int i = glicko.count++;
+    double deviation = GLICKO_INITIAL_DEVIATION;
+    double volatility = GLICKO_INITIAL_VOLATILITY;
+    unsigned long rated;
+    if (pstore_get_glicko(player_get_name(player), &deviation, &volatility, &rated) == 0 &&
+        rated + 1 < glicko.period)
+    {
+        double idle = glicko.period - 1 - rated;
+        double growth = volatility * GLICKO_SCALE;
+        deviation = fmin(sqrt(deviation * deviation + idle * growth * growth),
+                         GLICKO_INITIAL_DEVIATION);
+    }
+    glicko.players[i] = player_ref(player, "rated by glicko");
+    glicko.mu[i] = (player_get_rating(player) - PLAYER_INITIAL_RATING) / GLICKO_SCALE;
+    glicko.phi[i] = deviation / GLICKO_SCALE;
+    glicko.sigma[i] = volatility;
+    glicko.v_inv[i] = 0.0;
+    glicko.delta_sum[i] = 0.0;
+
+    int h = slot_index(player);
+    while (glicko.slot_keys[h] != NULL)
+    {
+        h = (h + 1) & (glicko.slot_capacity - 1);
+    }
+    glicko.slot_keys[h] = player;
+    glicko.slot_values[h] = i;
+    return i;
+}
+
+static double g(double phi)
+{
+    return 1.0 / sqrt(1.0 + 3.0 * phi * phi / (M_PI * M_PI));
+}
+
+/*
+ * Accumulate one game for the player in slot i against the opponent in
+ * slot j.  The glicko mutex must be held by the caller.
+ */
+static void accumulate(int i, int j, double score)
+{
+    double gj = g(glicko.phi[j]);
+    double e = 1.0 / (1.0 + exp(-gj * (glicko.mu[i] - glicko.mu[j])));
+    glicko.v_inv[i] += gj * gj * e * (1.0 - e);
+    glicko.delta_sum[i] += gj * (score - e);
+}
+
+static double volatility_f(double x, double delta2, double phi2, double v, double a)
+{
+    double ex = exp(x);
+    double d = phi2 + v + ex;
+    return ex * (delta2 - phi2 - v - ex) / (2.0 * d * d) - (x - a) / (GLICKO_TAU * GLICKO_TAU);
+}
+
+/*
+ * Compute the new volatility of a player (step 5 of the Glicko-2
+ * algorithm, using the Illinois variant of regula falsi).
+ */
+static double new_volatility(double sigma, double phi, double v, double delta)
+{
+    double a = log(sigma * sigma);
+    double delta2 = delta * delta;
+    double phi2 = phi * phi;
+    double A = a;
+    double B;
+    if (delta2 > phi2 + v)
+    {
+        B = log(delta2 - phi2 - v);
+    }
+    else
+    {
+        int k = 1;
+        while (volatility_f(a - k * GLICKO_TAU, delta2, phi2, v, a) < 0.0)
+        {
+            k++;
+        }
+        B = a - k * GLICKO_TAU;
+    }
+    double fA = volatility_f(A, delta2, phi2, v, a);
+    double fB = volatility_f(B, delta2, phi2, v, a);
+    while (fabs(B - A) > VOLATILITY_EPSILON)
+    {
+        double C = A + (A - B) * fA / (fB - fA);
+        double fC = volatility_f(C, delta2, phi2, v, a);
+        if (fC * fB <= 0.0)
+        {
+            A = B;
+            fA = fB;
+        }
+        else
+        {
+            fA /= 2.0;
+        }
+        B = C;
+        fB = fC;
+    }
+    return exp(A / 2.0);
+}
+
+/*
+ * Close the current rating period: recompute every player that played
+ * in it, publish their new ratings, persist and journal their deviation
+ * and volatility together with the period, and release them.  Players
+ * who did not play are not touched; their deviation grows the next time
+ * they are loaded.
+ */
+void glicko_end_period(void)
+{
+    jlog_trace("enter");
+
+    pthread_mutex_lock(&glicko.mutex);
+
+    double *phi = glicko.phi;
+    double *sigma = glicko.sigma;
+    int n = glicko.count;
+    for (int i = 0; i < n; i++)
+    {
+        double v = 1.0 / glicko.v_inv[i];
+        double new_sigma = new_volatility(sigma[i], phi[i], v, v * glicko.delta_sum[i]);
+        double phi_star2 = phi[i] * phi[i] + new_sigma * new_sigma;
+        phi[i] = 1.0 / sqrt(1.0 / phi_star2 + 1.0 / v);
+        sigma[i] = new_sigma;
+        glicko.mu[i] += phi[i] * phi[i] * glicko.delta_sum[i];
+
+        PLAYER *player = glicko.players[i];
+        char *name = player_get_name(player);
+        int rating = (int)round(glicko.mu[i] * GLICKO_SCALE + PLAYER_INITIAL_RATING);
+        pthread_mutex_lock(&player->lock);
+        __atomic_store_n(&player->rating, rating, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&player->lock);
+        pstore_update(name, rating, 0);
+        pstore_set_glicko(name, phi[i] * GLICKO_SCALE, sigma[i], glicko.period);
+        rjournal_append_glicko(name, rating, phi[i] * GLICKO_SCALE, sigma[i], glicko.period);
+        preg_release(player_registry, player, "rating period closed");
+    }
+    glicko.count = 0;
+    if (glicko.slot_keys != NULL)
+    {
+        memset(glicko.slot_keys, 0, glicko.slot_capacity * sizeof(PLAYER *));
+    }
+
+    // Periods are aligned to the clock, so that a restarted server
+    // continues the same sequence.
+    unsigned long closed = glicko.period;
+    unsigned long now = time(NULL) / GLICKO_PERIOD_SECONDS;
+    glicko.period = now > closed ? now : closed + 1;
+    jlog_info("rating period %lu closed, %d players updated", closed, n);
+
+    pthread_mutex_unlock(&glicko.mutex);
+
+    if (rjournal_commit_all() != 0)
+    {
+        jlog_warn("rating period closed but not durable: the journal has failed");
+    }
+}
+
+/*
+ * Thread function that closes each rating period when the clock reaches
+ * its end.
+ */
+static void *period_thread(void *arg)
+{
+    pthread_mutex_lock(&glicko.mutex);
+    while (!glicko.stop)
+    {
+        struct timespec deadline = {0};
+        deadline.tv_sec = (time_t)(glicko.period + 1) * GLICKO_PERIOD_SECONDS;
+        int rc = 0;
+        while (!glicko.stop && rc != ETIMEDOUT)
+        {
+            rc = pthread_cond_timedwait(&glicko.cond, &glicko.mutex, &deadline);
+        }
+        pthread_mutex_unlock(&glicko.mutex);
+        glicko_end_period();
+        pthread_mutex_lock(&glicko.mutex);
+    }
+    pthread_mutex_unlock(&glicko.mutex);
+    return NULL;
+}
+
+/*
+ * Select the Glicko-2 engine for rating updates and start the timer
+ * for rating periods.  The player store must be open, as it holds the
+ * deviation and volatility of every player between periods.
+ *
+ * @return 0 if the engine was started, otherwise -1.
+ */
+int glicko_init(void)
+{
+    jlog_trace("enter");
+
+    if (!pstore_enabled())
+    {
+        jlog_error("Glicko-2 ratings need a player store (-d <data_dir>)");
+        return -1;
+    }
+    glicko.period = time(NULL) / GLICKO_PERIOD_SECONDS;
+    if (pthread_create(&glicko.thread, NULL, period_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    glicko.enabled = 1;
+    return 0;
+}
+
+/*
+ * Close the current rating period and stop the engine.
+ */
+void glicko_fini(void)
+{
+    jlog_trace("enter");
+
+    if (!glicko.enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&glicko.mutex);
+    glicko.stop = 1;
+    pthread_cond_signal(&glicko.cond);
+    pthread_mutex_unlock(&glicko.mutex);
+    pthread_join(glicko.thread, NULL);
+    glicko.enabled = 0;
+
+    free(glicko.players);
+    free(glicko.mu);
+    free(glicko.phi);
+    free(glicko.sigma);
+    free(glicko.v_inv);
+    free(glicko.delta_sum);
+    free(glicko.slot_keys);
+    free(glicko.slot_values);
+}
+
+/*
+ * @return nonzero if ratings are maintained by the Glicko-2 engine.
+ */
+int glicko_enabled(void)
+{
+    return glicko.enabled;
+}
+
+/*
+ * Record the result of a game for the current rating period.
+ *
+ * @param player1  One of the PLAYERs that played the game.
+ * @param player2  The other PLAYER.
+ * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
+ */
+void glicko_post_result(PLAYER *player1, PLAYER *player2, int result)
+{
+    double score1 = result == 0 ? 0.5 : (result == 1 ? 1.0 : 0.0);
+
+    pthread_mutex_lock(&glicko.mutex);
+    int i = player_slot(player1);
+    int j = player_slot(player2);
+    if (i >= 0 && j >= 0)
+    {
+        accumulate(i, j, score1);
+        accumulate(j, i, 1.0 - score1);
+    }
+    pthread_mutex_unlock(&glicko.mutex);
+}
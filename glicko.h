@@ -0,0 +1,32 @@
+#ifndef GLICKO_H
+#define GLICKO_H
+
+#include "player.h"
+
+/*
+ * Glicko-2 rating engine.
+ *
+ * Results are accumulated per player during a rating period, using each
+ * opponent's rating as of the start of the period.  Only the players with
+ * results in the current period are held in memory, as structure-of-arrays
+ * state (rating, deviation, volatility and the period accumulators); when
+ * the period ends they are recomputed in one pass, journaled, and
+ * released.  Between periods a player's deviation and volatility live in
+ * the player store with the period they were computed in, and the growth
+ * of the deviation over the periods without games is applied when the
+ * player next plays.  Periods are aligned to multiples of
+ * GLICKO_PERIOD_SECONDS since the epoch.
+ */
+
+#define GLICKO_PERIOD_SECONDS 600
+#define GLICKO_INITIAL_DEVIATION 350.0
+#define GLICKO_INITIAL_VOLATILITY 0.06
+#define GLICKO_TAU 0.5
+
+int glicko_init(void);
+void glicko_fini(void);
+int glicko_enabled(void);
+void glicko_post_result(PLAYER *player1, PLAYER *player2, int result);
+void glicko_end_period(void);
+
+#endif
@@ -0,0 +1,743 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "io_loop.h"
+#include "compress.h"
+#include "game_clock.h"
+#include "reaper.h"
+#include "timer_wheel.h"
+#include "jeux_globals.h"
+#include "global.h"
+#include "jlog.h"
+
+/*
+ * The handoff is a sequence of records, one per SOCK_SEQPACKET message:
+ * the successor sends HELLO, the old server sends LISTENER, LOCAL_LISTENER
+ * if it accepts clients on a Unix domain socket, a CLIENT for each
+ * connection, an INVITATION for each open or accepted invitation and
+ * END, and the successor answers END with ACK.  The records are in host
+ * byte order, since both servers run on the same machine.
+ */
+typedef enum {
+    HANDOFF_HELLO = 1,
+    HANDOFF_LISTENER,
+    HANDOFF_CLIENT,
+    HANDOFF_INVITATION,
+    HANDOFF_END,
+    HANDOFF_ACK,
+    HANDOFF_LOCAL_LISTENER
+} HANDOFF_RECORD_TYPE;
+
+typedef struct handoff_hello {
+    uint32_t type;
+    uint32_t magic;
+    uint32_t version;
+} HANDOFF_HELLO_RECORD;
+
+/*
+ * A client connection, whose socket is attached to the record.  The
+ * username follows the record, and is empty if the client has not
+ * logged in; after its NUL come the "pending" bytes of a packet that
+ * had been partly received from the client.
+ */
+typedef struct handoff_client {
+    uint32_t type;
+    uint32_t index;                 // Referred to by INVITATION records
+    int32_t invitation_id;
+    uint32_t flags;
+    uint32_t pending;
+} HANDOFF_CLIENT_RECORD;
+
+#define HANDOFF_CLIENT_COMPRESS 0x1     // Compression was negotiated
+
+typedef struct handoff_invitation {
+    uint32_t type;
+    uint32_t source;                // Index of the source client
+    uint32_t target;
+    int32_t source_id;              // ID of the invitation for the source
+    int32_t target_id;
+    uint8_t source_role;
+    uint8_t target_role;
+    uint8_t state;
+    uint8_t has_game;
+    // The game, if the invitation has been accepted
+    int8_t board[3][3];
+    uint8_t current_role;
+    uint8_t first_player_resigned;
+    uint8_t second_player_resigned;
+    uint8_t last_move_role;
+    int32_t last_move;              // 0 if there has been no move
+    // The clocks, if the game is timed
+    int8_t clock;                   // As returned by gclock_export()
+    uint8_t turn;
+    uint64_t base_ms;
+    uint64_t increment_ms;
+    uint64_t remaining[3];
+} HANDOFF_INVITATION_RECORD;
+
+#define HANDOFF_MAX_RECORD (sizeof(HANDOFF_CLIENT_RECORD) + UINT16_MAX + 1 + IOLOOP_MAX_PENDING)
+
+typedef struct handoff_received {
+    void *data;
+    size_t len;
+    int fd;
+    struct handoff_received *next;
+} HANDOFF_RECEIVED;
+
+static struct {
+    int enabled;
+    char *path;
+    int sock;                       // Listening Unix domain socket
+    int listenfd;                   // The server's listening socket
+    int localfd;                    // Its Unix domain listener, or -1
+    int pending[2];                 // Readable once a handoff has started
+    int started;
+    int accept_stopped;
+    void (*flush)(void);
+    pthread_t thread;
+    HANDOFF_RECEIVED *received;
+    HANDOFF_RECEIVED **received_tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} handoff = {
+    .sock = -1,
+    .listenfd = -1,
+    .localfd = -1,
+    .pending = {-1, -1},
+    .received_tail = &handoff.received,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static int send_record(int sock, void *data, size_t len, int fd)
+{
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    struct msghdr msg = {0};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Receive one record, and the descriptor attached to it, if any.
+ *
+ * @return the length of the record, or -1 on error or EOF.
+ */
+static ssize_t recv_record(int sock, void *buf, size_t size, int *fdp)
+{
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    struct msghdr msg = {0};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    *fdp = -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(fdp, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (n < (ssize_t)sizeof(uint32_t) || (msg.msg_flags & MSG_TRUNC))
+    {
+        if (*fdp >= 0)
+        {
+            close(*fdp);
+        }
+        return -1;
+    }
+    return n;
+}
+
+static int make_address(char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * Take over from a server that is listening for a successor on a Unix
+ * domain socket, if there is one.  The state received is kept until
+ * handoff_restore() is called, which must be done once the modules have
+ * been initialized; this function returns only after the old server has
+ * flushed its ratings and game log.
+ *
+ * @param path  The path of the socket.
+ * @param listenfdp  Set to the listening socket received.
+ * @param localfdp  Set to the Unix domain listening socket received, if
+ * the old server had one.
+ * @return 0 if the state of an old server was received, 1 if no server
+ * is listening on the socket, or -1 if the handoff failed.
+ */
+int handoff_receive(char *path, int *listenfdp, int *localfdp)
+{
+    struct sockaddr_un addr;
+    if (make_address(path, &addr) != 0)
+    {
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return errno == ENOENT || errno == ECONNREFUSED ? 1 : -1;
+    }
+
+    HANDOFF_HELLO_RECORD hello = {HANDOFF_HELLO, HANDOFF_MAGIC, HANDOFF_VERSION};
+    char *buf = malloc(HANDOFF_MAX_RECORD);
+    if (buf == NULL || send_record(sock, &hello, sizeof(hello), -1) != 0)
+    {
+        free(buf);
+        close(sock);
+        return -1;
+    }
+
+    int done = 0;
+    while (!done)
+    {
+        int fd;
+        ssize_t len = recv_record(sock, buf, HANDOFF_MAX_RECORD, &fd);
+        if (len < 0)
+        {
+            break;
+        }
+        switch (*(uint32_t *)buf)
+        {
+        case HANDOFF_LISTENER:
+            *listenfdp = fd;
+            break;
+        case HANDOFF_LOCAL_LISTENER:
+            *localfdp = fd;
+            break;
+        case HANDOFF_CLIENT:
+        case HANDOFF_INVITATION:;
+            HANDOFF_RECEIVED *rec = malloc(sizeof(HANDOFF_RECEIVED));
+            if (rec == NULL || (rec->data = malloc(len + 1)) == NULL)
+            {
+                free(rec);
+                len = -1;
+                break;
+            }
+            memcpy(rec->data, buf, len);
+            ((char *)rec->data)[len] = '\0';
+            rec->len = len;
+            rec->fd = fd;
+            rec->next = NULL;
+            *handoff.received_tail = rec;
+            handoff.received_tail = &rec->next;
+            break;
+        case HANDOFF_END:
+            done = 1;
+            break;
+        default:
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            break;
+        }
+        if (len < 0)
+        {
+            break;
+        }
+    }
+    free(buf);
+
+    if (!done || *listenfdp < 0)
+    {
+        jlog_error("handoff from %s failed", path);
+        close(sock);
+        return -1;
+    }
+    uint32_t ack = HANDOFF_ACK;
+    send_record(sock, &ack, sizeof(ack), -1);
+    close(sock);
+    jlog_info("took over from the server at %s", path);
+    return 0;
+}
+
+/*
+ * Add an invitation to a client's list under the ID it had for it in
+ * the old server.
+ */
+static void restore_node(CLIENT *client, INVITATION *inv, int id)
+{
+    INVITATION_NODE *node = malloc(sizeof(INVITATION_NODE));
+    if (node == NULL)
+    {
+        return;
+    }
+    node->invitation = inv;
+    node->id = id;
+    node->next = NULL;
+    INVITATION_NODE **link = &client->invitations;
+    while (*link != NULL)
+    {
+        link = &(*link)->next;
+    }
+    *link = node;
+}
+
+static void restore_invitation(HANDOFF_INVITATION_RECORD *rec, CLIENT **clients, size_t nclients)
+{
+    if (rec->source >= nclients || rec->target >= nclients ||
+        clients[rec->source] == NULL || clients[rec->target] == NULL)
+    {
+        return;
+    }
+    CLIENT *source = clients[rec->source];
+    CLIENT *target = clients[rec->target];
+    INVITATION *inv = inv_create(source, target, rec->source_role, rec->target_role);
+    if (inv == NULL)
+    {
+        return;
+    }
+    inv->state = rec->state;
+    if (rec->has_game)
+    {
+        GAME *game = game_create();
+        if (game == NULL)
+        {
+            inv_unref(inv, "handoff failed");
+            return;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                game->game_board[i][j] = rec->board[i][j];
+            }
+        }
+        game->current_role = rec->current_role;
+        game->first_player_resigned = rec->first_player_resigned;
+        game->second_player_resigned = rec->second_player_resigned;
+        if (rec->last_move != 0 && (game->last_move = malloc(sizeof(GAME_MOVE))) != NULL)
+        {
+            game->last_move->value = rec->last_move;
+            game->last_move->role = rec->last_move_role;
+        }
+        inv->game = game;
+    }
+
+    // One reference for each client's list
+    restore_node(source, inv, rec->source_id);
+    restore_node(target, inv_ref(inv, "handoff"), rec->target_id);
+
+    if (rec->clock >= 0)
+    {
+        TIME_CONTROL tc = {rec->base_ms, rec->increment_ms};
+        unsigned long remaining[3] = {rec->remaining[0], rec->remaining[1], rec->remaining[2]};
+        gclock_restore(inv, &tc, remaining, rec->turn, rec->clock);
+    }
+    if (inv->state == INV_OPEN_STATE)
+    {
+        reaper_watch_invitation(inv);
+    }
+}
+
+/*
+ * Recreate the clients, invitations and games received by
+ * handoff_receive(), and give each client to the event loop.
+ */
+void handoff_restore(void)
+{
+    if (handoff.received == NULL)
+    {
+        return;
+    }
+    size_t nclients = 0;
+    for (HANDOFF_RECEIVED *rec = handoff.received; rec != NULL; rec = rec->next)
+    {
+        if (*(uint32_t *)rec->data == HANDOFF_CLIENT)
+        {
+            nclients++;
+        }
+    }
+    CLIENT **clients = calloc(nclients + 1, sizeof(CLIENT *));
+
+    while (handoff.received != NULL)
+    {
+        HANDOFF_RECEIVED *rec = handoff.received;
+        handoff.received = rec->next;
+
+        if (*(uint32_t *)rec->data == HANDOFF_CLIENT && rec->len >= sizeof(HANDOFF_CLIENT_RECORD))
+        {
+            HANDOFF_CLIENT_RECORD *crec = rec->data;
+            char *name = (char *)(crec + 1);
+            // The data is NUL-terminated, so the name is too
+            size_t used = sizeof(*crec) + strlen(name) + 1;
+            CLIENT *client = rec->fd >= 0 && clients != NULL && crec->index < nclients &&
+                             used <= rec->len && crec->pending <= rec->len - used &&
+                             crec->pending <= IOLOOP_MAX_PENDING ?
+                             creg_register(client_registry, rec->fd) : NULL;
+            if (client == NULL)
+            {
+                if (rec->fd >= 0)
+                {
+                    close(rec->fd);
+                }
+            }
+            else
+            {
+                client->invitation_id = crec->invitation_id;
+                proto_set_compression(rec->fd, crec->flags & HANDOFF_CLIENT_COMPRESS);
+                if (*name != '\0')
+                {
+                    PLAYER *player = preg_register(player_registry, name);
+                    client_login(client, player);
+                    if (player != NULL)
+                    {
+                        preg_release(player_registry, player, "handed-off client logged in");
+                    }
+                }
+                // The loop does not run until the state has been restored
+                if (ioloop_adopt(client, (char *)rec->data + used, crec->pending) == 0)
+                {
+                    clients[crec->index] = client;
+                }
+            }
+        }
+        else if (*(uint32_t *)rec->data == HANDOFF_INVITATION &&
+                 rec->len >= sizeof(HANDOFF_INVITATION_RECORD) && clients != NULL)
+        {
+            restore_invitation(rec->data, clients, nclients);
+        }
+        free(rec->data);
+        free(rec);
+    }
+    handoff.received_tail = &handoff.received;
+    jlog_info("restored %zu clients", nclients);
+    free(clients);
+}
+
+static int index_of(CLIENT **clients, size_t nclients, CLIENT *client)
+{
+    for (size_t i = 0; i < nclients; i++)
+    {
+        if (clients[i] == client)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int send_invitation(int sock, INVITATION *inv, int source_id,
+                           CLIENT **clients, size_t nclients)
+{
+    HANDOFF_INVITATION_RECORD rec = {0};
+    int source = index_of(clients, nclients, inv->source);
+    int target = index_of(clients, nclients, inv->target);
+    INVITATION_NODE *node = inv->target->invitations;
+    while (node != NULL && node->invitation != inv)
+    {
+        node = node->next;
+    }
+    if (source < 0 || target < 0 || node == NULL)
+    {
+        return 0;
+    }
+
+    rec.type = HANDOFF_INVITATION;
+    rec.source = source;
+    rec.target = target;
+    rec.source_id = source_id;
+    rec.target_id = node->id;
+    rec.source_role = inv->source_role;
+    rec.target_role = inv->target_role;
+    rec.state = inv->state;
+    GAME *game = inv->game;
+    if (game != NULL)
+    {
+        rec.has_game = 1;
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                rec.board[i][j] = game->game_board[i][j];
+            }
+        }
+        rec.current_role = game->current_role;
+        rec.first_player_resigned = game->first_player_resigned;
+        rec.second_player_resigned = game->second_player_resigned;
+        if (game->last_move != NULL)
+        {
+            rec.last_move = game->last_move->value;
+            rec.last_move_role = game->last_move->role;
+        }
+    }
+
+    TIME_CONTROL tc;
+    unsigned long remaining[3];
+    GAME_ROLE turn;
+    rec.clock = gclock_export(inv, &tc, remaining, &turn);
+    if (rec.clock >= 0)
+    {
+        rec.turn = turn;
+        rec.base_ms = tc.base_ms;
+        rec.increment_ms = tc.increment_ms;
+        for (int i = 0; i < 3; i++)
+        {
+            rec.remaining[i] = remaining[i];
+        }
+    }
+    return send_record(sock, &rec, sizeof(rec), -1);
+}
+
+/*
+ * Send the listening socket, the clients and their invitations.  Called
+ * once the event loop has let go of every client and the timer wheel
+ * has been stopped, so that nothing else changes the state being sent.
+ */
+static int send_state(int sock)
+{
+    if (send_record(sock, &(uint32_t){HANDOFF_LISTENER}, sizeof(uint32_t), handoff.listenfd) != 0)
+    {
+        return -1;
+    }
+    if (handoff.localfd >= 0 &&
+        send_record(sock, &(uint32_t){HANDOFF_LOCAL_LISTENER}, sizeof(uint32_t), handoff.localfd) != 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&client_registry->mutex);
+    size_t nclients = client_registry->client_count;
+    CLIENT **clients = calloc(nclients + 1, sizeof(CLIENT *));
+    char *buf = malloc(HANDOFF_MAX_RECORD);
+    int rc = clients == NULL || buf == NULL ? -1 : 0;
+
+    size_t n = 0;
+    for (CLIENT_NODE *p = client_registry->head; p != NULL && n < nclients && rc == 0; p = p->next)
+    {
+        CLIENT *client = p->client;
+        HANDOFF_CLIENT_RECORD *rec = (HANDOFF_CLIENT_RECORD *)buf;
+        char *name = (char *)(rec + 1);
+        rec->type = HANDOFF_CLIENT;
+        rec->index = n;
+        rec->invitation_id = client->invitation_id;
+        rec->flags = proto_compression(client->fd) ? HANDOFF_CLIENT_COMPRESS : 0;
+        name[0] = '\0';
+        if (client->player != NULL)
+        {
+            strncpy(name, player_get_name(client->player), UINT16_MAX);
+            name[UINT16_MAX] = '\0';
+        }
+        size_t len = sizeof(*rec) + strlen(name) + 1;
+        rec->pending = ioloop_pending_input(client->fd, buf + len);
+        rc = send_record(sock, buf, len + rec->pending, client->fd);
+        clients[n++] = client;
+    }
+
+    for (size_t i = 0; i < n && rc == 0; i++)
+    {
+        for (INVITATION_NODE *node = clients[i]->invitations; node != NULL && rc == 0; node = node->next)
+        {
+            INVITATION *inv = node->invitation;
+            if (inv->source == clients[i] && inv->state != INV_CLOSED_STATE)
+            {
+                rc = send_invitation(sock, inv, node->id, clients, n);
+            }
+        }
+    }
+    pthread_mutex_unlock(&client_registry->mutex);
+
+    jlog_info("handing off %zu clients", n);
+    free(clients);
+    free(buf);
+    return rc;
+}
+
+/*
+ * Hand everything over to a successor that has connected and said
+ * HELLO.  Does not return.
+ */
+static void hand_off(int sock)
+{
+    jlog_info("successor connected, handing off");
+    pthread_mutex_lock(&handoff.mutex);
+    handoff.started = 1;
+    pthread_mutex_unlock(&handoff.mutex);
+    if (write(handoff.pending[1], "", 1) < 0)
+    {
+        jlog_error("cannot stop the event loop");
+    }
+
+    pthread_mutex_lock(&handoff.mutex);
+    while (!handoff.accept_stopped)
+    {
+        pthread_cond_wait(&handoff.cond, &handoff.mutex);
+    }
+    pthread_mutex_unlock(&handoff.mutex);
+    twheel_fini();
+
+    int rc = send_state(sock);
+    handoff.flush();
+    uint32_t end = HANDOFF_END;
+    if (rc == 0 && send_record(sock, &end, sizeof(end), -1) == 0)
+    {
+        int fd;
+        uint32_t ack = 0;
+        if (recv_record(sock, &ack, sizeof(ack), &fd) == sizeof(ack) && ack == HANDOFF_ACK)
+        {
+            jlog_info("handoff complete");
+            jlog_fini();
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    jlog_error("handoff failed, exiting");
+    jlog_fini();
+    _exit(EXIT_FAILURE);
+}
+
+static void *listener_thread(void *arg)
+{
+    while (1)
+    {
+        int sock = accept(handoff.sock, NULL, NULL);
+        if (sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            jlog_error("handoff listener failed");
+            return NULL;
+        }
+        int fd;
+        HANDOFF_HELLO_RECORD hello;
+        if (recv_record(sock, &hello, sizeof(hello), &fd) == sizeof(hello) &&
+            hello.type == HANDOFF_HELLO && hello.magic == HANDOFF_MAGIC &&
+            hello.version == HANDOFF_VERSION)
+        {
+            hand_off(sock);
+        }
+        jlog_warn("rejected a successor with a bad HELLO");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        close(sock);
+    }
+}
+
+/*
+ * Listen for a successor on a Unix domain socket, replacing any stale
+ * socket at the path.
+ *
+ * @param path  The path of the socket.
+ * @param listenfd  The server's listening socket, to be handed over.
+ * @param localfd  Its Unix domain listening socket, also to be handed
+ * over, or -1 if it has none.
+ * @param flush  Called once the state has been sent, to make ratings
+ * and game records durable before the successor loads them.
+ * @return 0 if successful, otherwise -1.
+ */
+int handoff_listen(char *path, int listenfd, int localfd, void (*flush)(void))
+{
+    struct sockaddr_un addr;
+    if (make_address(path, &addr) != 0 || pipe(handoff.pending) != 0)
+    {
+        return -1;
+    }
+    handoff.sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (handoff.sock < 0)
+    {
+        return -1;
+    }
+    unlink(path);
+    if (bind(handoff.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(handoff.sock, 1) < 0)
+    {
+        close(handoff.sock);
+        return -1;
+    }
+    handoff.path = path;
+    handoff.listenfd = listenfd;
+    handoff.localfd = localfd;
+    handoff.flush = flush;
+    handoff.enabled = 1;
+    if (pthread_create(&handoff.thread, NULL, listener_thread, NULL) != 0)
+    {
+        handoff.enabled = 0;
+        close(handoff.sock);
+        return -1;
+    }
+    pthread_detach(handoff.thread);
+    return 0;
+}
+
+/*
+ * @return a descriptor that becomes readable when a handoff starts, for
+ * the accept loop to poll, or -1 if there is no handoff listener.
+ */
+int handoff_pending_fd(void)
+{
+    return handoff.enabled ? handoff.pending[0] : -1;
+}
+
+/*
+ * @return nonzero if a handoff has started.
+ */
+int handoff_started(void)
+{
+    pthread_mutex_lock(&handoff.mutex);
+    int started = handoff.started;
+    pthread_mutex_unlock(&handoff.mutex);
+    return started;
+}
+
+/*
+ * Called by the main thread when, because a handoff has started, the
+ * event loop has stopped accepting connections and let go of every
+ * client (ioloop_hand_off()).
+ */
+void handoff_accept_stopped(void)
+{
+    pthread_mutex_lock(&handoff.mutex);
+    handoff.accept_stopped = 1;
+    pthread_cond_broadcast(&handoff.cond);
+    pthread_mutex_unlock(&handoff.mutex);
+}
@@ -0,0 +1,35 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+/*
+ * Hot restart.
+ *
+ * A server started with "-u <path>" listens for a successor on the Unix
+ * domain socket <path>.  A new server started with the same option first
+ * connects to that socket.  The old server then stops accepting, lets
+ * the event loop finish the packets it has received and write their
+ * replies, and sends the new server its listening sockets and every
+ * client connection (as SCM_RIGHTS ancillary data), together with the
+ * bytes of any packet partly received from the client, the logged-in
+ * players, their open invitations and games in progress, and the clocks
+ * of timed games.  It then flushes ratings and
+ * the game log and exits, and the new server, which waits for that
+ * before loading its own state, recreates the clients and carries on
+ * serving their connections.  Clients see no disconnect.
+ *
+ * Once a handoff has started there is no way back: if it fails, the old
+ * server exits anyway.  Games in progress at a handoff are recorded in
+ * the game log as unfinished.
+ */
+
+#define HANDOFF_MAGIC 0x4a455558        // "JEUX"
+#define HANDOFF_VERSION 4
+
+int handoff_receive(char *path, int *listenfdp, int *localfdp);
+void handoff_restore(void);
+int handoff_listen(char *path, int listenfd, int localfd, void (*flush)(void));
+int handoff_pending_fd(void);
+int handoff_started(void);
+void handoff_accept_stopped(void);
+
+#endif
@@ -0,0 +1,60 @@
+#include "histogram.h"
+
+/*
+ * Find the bucket for a value.
+ *
+ * @param value  The value to be counted.
+ * @return  Its bucket, between 0 and HIST_BUCKETS - 1.
+ */
+int hist_index(unsigned long value)
+{
+    if (value < HIST_SUB_BUCKETS)
+    {
+        return value;
+    }
+    int msb = 63 - __builtin_clzl(value);
+    int shift = msb - HIST_SUB_BUCKET_BITS;
+    int index = (shift + 1) * HIST_SUB_BUCKETS + ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+/*
+ * Find the smallest value counted in a bucket.
+ *
+ * @param index  The bucket.
+ * @return  The lower bound of the values in it.
+ */
+unsigned long hist_value(int index)
+{
+    if (index < HIST_SUB_BUCKETS)
+    {
+        return index;
+    }
+    int shift = index / HIST_SUB_BUCKETS - 1;
+    return ((unsigned long)(HIST_SUB_BUCKETS + index % HIST_SUB_BUCKETS)) << shift;
+}
+
+/*
+ * Find a percentile in a histogram.  A histogram that is updated
+ * concurrently should have its counts copied and summed first, so the
+ * result is taken from a consistent (if slightly stale) set of counts.
+ *
+ * @param counts  HIST_BUCKETS bucket counts.
+ * @param total  Sum of the counts.
+ * @param pct  The percentile, between 0 and 100.
+ * @return  The lower bound of the bucket holding the percentile.
+ */
+unsigned long hist_percentile(const unsigned long *counts, unsigned long total, double pct)
+{
+    unsigned long target = (unsigned long)(total * pct / 100.0);
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen > target)
+        {
+            return hist_value(i);
+        }
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
@@ -0,0 +1,22 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/*
+ * Log-linear latency histogram buckets, shared by the server's packet
+ * statistics and the load generator.
+ *
+ * Values below HIST_SUB_BUCKETS have a bucket each; above that every
+ * power of two is split into HIST_SUB_BUCKETS buckets, which keeps the
+ * relative error under 1/HIST_SUB_BUCKETS.  Values too large for the
+ * last bucket are counted in it.  The unit is up to the caller.
+ */
+
+#define HIST_SUB_BUCKET_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BUCKET_BITS)
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * 40)
+
+int hist_index(unsigned long value);
+unsigned long hist_value(int index);
+unsigned long hist_percentile(const unsigned long *counts, unsigned long total, double pct);
+
+#endif
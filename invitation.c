@@ -3,7 +3,8 @@
 #include "global.h"
 #include "invitation.h"
 #include <pthread.h>
-#include "debug.h"
+#include "jlog.h"
+#include "lock_profile.h"
 
 
 /*
@@ -26,7 +27,7 @@
 INVITATION *inv_create(CLIENT *source, CLIENT *target,
 		       GAME_ROLE source_role, GAME_ROLE target_role){
 
-    debug("invitation.c");
+    jlog_trace("enter");
     // Check that source and target are different
     if (source == target) {
         return NULL;
@@ -62,7 +63,7 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target,
  * @return  The same INVITATION object that was passed as a parameter.
  */
 INVITATION *inv_ref(INVITATION *inv, char *why){
-    debug("invitation.c");
+    jlog_trace("enter");
 
     pthread_mutex_lock(&inv->mutex);
     inv->ref_count++;
@@ -83,7 +84,7 @@ INVITATION *inv_ref(INVITATION *inv, char *why){
  */
 
 void inv_unref(INVITATION *inv, char *why){
-    debug("invitation.c");
+    jlog_trace("enter");
 
     if (inv == NULL) {
         return;
@@ -94,6 +95,13 @@ void inv_unref(INVITATION *inv, char *why){
 
     if (inv->ref_count == 0) {
         pthread_mutex_unlock(&inv->mutex);
+        // Release what inv_create() and inv_accept() retained
+        if (inv->game != NULL) {
+            game_unref(inv->game, "invitation freed");
+        }
+        client_unref(inv->source, "invitation freed");
+        client_unref(inv->target, "invitation freed");
+        pthread_mutex_destroy(&inv->mutex);
         free(inv);
     } else {
         pthread_mutex_unlock(&inv->mutex);
@@ -109,7 +117,7 @@ void inv_unref(INVITATION *inv, char *why){
  * @return the CLIENT that is the source of the INVITATION.
  */
 CLIENT *inv_get_source(INVITATION *inv){
-    debug("invitation.c");
+    jlog_trace("enter");
 
     if (inv == NULL) {
         return NULL;
@@ -130,7 +138,7 @@ CLIENT *inv_get_source(INVITATION *inv){
  * @return the CLIENT that is the target of the INVITATION.
  */
 CLIENT *inv_get_target(INVITATION *inv){
-    debug("invitation.c");
+    jlog_trace("enter");
 
     if (inv == NULL) {
         return NULL;
@@ -148,7 +156,7 @@ CLIENT *inv_get_target(INVITATION *inv){
  * @return the GAME_ROLE played by the source of the INVITATION.
  */
 GAME_ROLE inv_get_source_role(INVITATION *inv){
-    debug("invitation.c");
+    jlog_trace("enter");
 
     if (inv == NULL) {
         return NULL_ROLE;
@@ -166,7 +174,7 @@ GAME_ROLE inv_get_source_role(INVITATION *inv){
  * @return the GAME_ROLE played by the target of the INVITATION.
  */
 GAME_ROLE inv_get_target_role(INVITATION *inv){
-    debug("invitation.c");
+    jlog_trace("enter");
 
     if (inv == NULL) {
         return NULL_ROLE;
@@ -188,7 +196,7 @@ GAME_ROLE inv_get_target_role(INVITATION *inv){
  * otherwise NULL.
  */
 GAME *inv_get_game(INVITATION *inv){
-    debug("invitation.c");
+    jlog_trace("enter");
 
     if (inv == NULL) {
         return NULL;
@@ -208,7 +216,7 @@ GAME *inv_get_game(INVITATION *inv){
  * @return 0 if the INVITATION was successfully accepted, otherwise -1.
  */
 int inv_accept(INVITATION *inv){
-    debug("invitation.c");
+    jlog_trace("enter");
 
     pthread_mutex_lock(&inv->mutex);
     if (inv->state != INV_OPEN_STATE) {
@@ -242,19 +250,18 @@ int inv_accept(INVITATION *inv){
  * @return 0 if the INVITATION was successfully closed, otherwise -1.
  */
 int inv_close(INVITATION *inv, GAME_ROLE role){
-    debug("invitation.c");
+    jlog_trace("enter");
 
     int ret = -1;
     pthread_mutex_lock(&inv->mutex);
 
     if (role == NULL_ROLE){
-        if (inv->game == NULL){
+        if (inv->state == INV_OPEN_STATE){
             inv->state = INV_CLOSED_STATE;
             pthread_mutex_unlock(&inv->mutex);
             return 0;
         }
         else{
-            debug("ERROR");
             pthread_mutex_unlock(&inv->mutex);
             return -1;
         }
@@ -268,7 +275,7 @@ int inv_close(INVITATION *inv, GAME_ROLE role){
         // resign game if there is one in progress
         if (inv->game != NULL) {
 
-            debug("RESIGNING THE GAME");
+            jlog_debug("RESIGNING THE GAME");
 
             // resign the game
             game_resign(inv->game, role);
@@ -0,0 +1,1869 @@
+#define _GNU_SOURCE                     // For CPU affinity
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "io_loop.h"
+#include "jeux_globals.h"
+#include "global.h"
+#include "jlog.h"
+
+#define IOLOOP_MAX_LISTENERS 2
+#define IOLOOP_RING_ENTRIES 1024
+#define IOLOOP_CQ_ENTRIES 8192
+#define IOLOOP_BGID 0                   // Provided buffer group
+#define IOLOOP_EPOLL_EVENTS 256
+#define IOLOOP_QUEUE_SIZE 1024          // Messages in a shard-to-shard queue, a power of 2
+#define IOLOOP_CONN_LOCKS 256
+#define IOLOOP_CACHE_LINE 64
+
+/*
+ * What an io_uring completion or epoll event is for.  The kind is kept
+ * in the low bits of the user data, above which is the pointer to the
+ * listener or connection.
+ */
+typedef enum {
+    OP_ACCEPT,
+    OP_RECV,                        // For epoll, any event on a connection
+    OP_SEND,
+    OP_WAKE,
+    OP_CANCEL
+} IOLOOP_OP;
+
+#define OP_BITS 3
+
+typedef struct ioloop_listener {
+    int fd;
+} IOLOOP_LISTENER;
+
+/*
+ * A connection owned by a shard.  Only the thread of that shard touches
+ * it, except for the fields from "shard" on, which are guarded by the
+ * lock for its descriptor, conn_locks[fd % IOLOOP_CONN_LOCKS].
+ */
+typedef struct ioloop_conn {
+    int fd;
+    unsigned gen;                   // Tells it from earlier connections on the descriptor
+    JEUX_SESSION *session;
+    JEUX_PACKET_HEADER hdr;         // The packet being received
+    size_t hdr_len;
+    char *data;
+    size_t data_len;
+    char *sending;                  // Output being written
+    size_t send_len;
+    size_t send_off;
+    int ops;                        // io_uring operations in flight
+    int closing;
+    int want_out;                   // epoll: waiting for EPOLLOUT
+    int migrate_to;                 // The shard it is moving to, or -1
+    int handed;                     // Let go of for a handoff
+    struct ioloop_conn *prev;       // In its shard's list
+    struct ioloop_conn *next;
+    struct ioloop_conn *next_handed;
+    int shard;                      // Owner; changed only by the owner
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    int ready;                      // The owner has been sent MSG_READY
+    int failed;                     // Its output overflowed
+} IOLOOP_CONN;
+
+/*
+ * What a shard is told by other threads.
+ */
+typedef enum {
+    MSG_READY,                      // A connection has output to write
+    MSG_MIGRATE,                    // Move a connection to another shard
+    MSG_ADOPT                       // Take over a connection moved from another shard
+} IOLOOP_MSG_TYPE;
+
+typedef struct ioloop_msg {
+    IOLOOP_MSG_TYPE type;
+    int fd;                         // MSG_READY, MSG_MIGRATE
+    unsigned gen;
+    int shard;                      // MSG_MIGRATE: where to
+    IOLOOP_CONN *conn;              // MSG_ADOPT
+} IOLOOP_MSG;
+
+/*
+ * A queue of messages from one shard to another, with one producer and
+ * one consumer, so that it needs no lock.  The indexes are on cache
+ * lines of their own, as each is written by only one of the two.
+ */
+typedef struct ioloop_spsc {
+    unsigned head __attribute__((aligned(IOLOOP_CACHE_LINE)));  // Next to take
+    unsigned tail __attribute__((aligned(IOLOOP_CACHE_LINE)));  // Next to fill
+    IOLOOP_MSG msgs[IOLOOP_QUEUE_SIZE] __attribute__((aligned(IOLOOP_CACHE_LINE)));
+} IOLOOP_SPSC;
+
+typedef struct ioloop_uring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;         // Tail including SQEs not yet published
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint16_t br_tail;
+    char *buffers;
+    uint64_t wake_value;
+} IOLOOP_URING;
+
+/*
+ * An event loop with a thread of its own, pinned to a CPU.  Everything
+ * but the inbox and the asleep flag is touched only by that thread once
+ * it runs.
+ */
+typedef struct ioloop_shard {
+    int index;
+    pthread_t thread;
+    int wakefd;                     // eventfd that wakes it
+    int epfd;
+    IOLOOP_URING ring;
+    int handing_off;
+    int cancelled;                  // Its accepts have been cancelled
+    IOLOOP_CONN *conns;             // The connections it owns
+    IOLOOP_MSG *local;              // Messages from its own thread
+    size_t nlocal;
+    size_t local_cap;
+    IOLOOP_SPSC **from;             // from[i] holds the messages from shard i
+    IOLOOP_MSG *spare;              // Swapped with the inbox
+    size_t spare_cap;
+    // Messages from other threads, or from a shard whose queue was full
+    pthread_mutex_t inbox_mutex;
+    IOLOOP_MSG *inbox;
+    size_t ninbox;
+    size_t inbox_cap;
+    int asleep __attribute__((aligned(IOLOOP_CACHE_LINE)));    // Must be woken through wakefd
+} IOLOOP_SHARD;
+
+static struct {
+    int started;
+    int running;                    // The shard threads have been created
+    int uring;                      // Otherwise epoll
+    IOLOOP_SHARD *shards;
+    int nshards;
+    int next_shard;                 // The shard to give the next client
+    unsigned next_gen;
+    IOLOOP_LISTENER listeners[IOLOOP_MAX_LISTENERS];
+    int nlisteners;
+    int stop_accepting;
+    int hand_off;
+    int quit;
+    int nconns;
+    // Guarded by mutex
+    int armed;                      // Accepts still armed, one per shard and listener
+    IOLOOP_CONN *handed;            // Let go of for a handoff
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            // Broadcast when accepting stops or the last connection goes
+    // Guarded by conn_locks
+    IOLOOP_CONN *conns[IOLOOP_MAX_FDS];
+} loop = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static pthread_mutex_t conn_locks[IOLOOP_CONN_LOCKS];
+
+static __thread IOLOOP_SHARD *self;     // The shard whose thread this is, if any
+
+static uint64_t op_data(void *p, IOLOOP_OP op)
+{
+    return (uint64_t)(uintptr_t)p << OP_BITS | op;
+}
+
+static void *op_ptr(uint64_t data)
+{
+    return (void *)(uintptr_t)(data >> OP_BITS);
+}
+
+static pthread_mutex_t *conn_lock(int fd)
+{
+    return &conn_locks[fd % IOLOOP_CONN_LOCKS];
+}
+
+static void conn_open(int fd);
+static void conn_close(IOLOOP_CONN *c);
+static void conn_release(IOLOOP_CONN *c);
+static void conn_move(IOLOOP_CONN *c);
+static void conn_migrate(IOLOOP_CONN *c, int to);
+static void conn_adopt(IOLOOP_SHARD *s, IOLOOP_CONN *c);
+static void conn_send(IOLOOP_CONN *c);
+
+/*
+ * Split received bytes into packets and hand each to the session.
+ *
+ * @return 0, or -1 if the connection must be closed.
+ */
+static int conn_feed(IOLOOP_CONN *c, char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n;
+        if (c->hdr_len < sizeof(JEUX_PACKET_HEADER))
+        {
+            n = sizeof(JEUX_PACKET_HEADER) - c->hdr_len;
+            n = n < len ? n : len;
+            memcpy((char *)&c->hdr + c->hdr_len, buf, n);
+            c->hdr_len += n;
+            buf += n;
+            len -= n;
+            if (c->hdr_len < sizeof(JEUX_PACKET_HEADER))
+            {
+                break;
+            }
+            uint16_t size = ntohs(c->hdr.size);
+            if (size > PROTO_MAX_PAYLOAD)
+            {
+                jlog_warn("%hu-byte payload from fd %d is over the limit", size, c->fd);
+                return -1;
+            }
+            if (size > 0)
+            {
+                // One more byte for the NUL, as for proto_recv_payload()
+                if ((c->data = malloc(size + 1)) == NULL)
+                {
+                    return -1;
+                }
+                c->data_len = 0;
+                continue;
+            }
+        }
+        else
+        {
+            size_t size = ntohs(c->hdr.size);
+            n = size - c->data_len < len ? size - c->data_len : len;
+            memcpy(c->data + c->data_len, buf, n);
+            c->data_len += n;
+            buf += n;
+            len -= n;
+            if (c->data_len < size)
+            {
+                break;
+            }
+        }
+
+        JEUX_PACKET_HEADER hdr = c->hdr;
+        JEUX_PAYLOAD payload;
+        char *data = c->data;
+        c->data = NULL;
+        c->hdr_len = 0;
+        if (proto_take_payload(c->fd, &hdr, data, &payload) != 0)
+        {
+            return -1;
+        }
+        jeux_session_packet(c->session, &hdr, &payload);
+    }
+    return 0;
+}
+
+/*
+ * Take a connection's output for writing, with its lock held.  Not while
+ * it is moving, as the shard it moves to writes the output.
+ */
+static int conn_take_output(IOLOOP_CONN *c)
+{
+    if (c->sending != NULL || c->out_len == 0 || c->closing || c->migrate_to >= 0)
+    {
+        return 0;
+    }
+    c->sending = c->out;
+    c->send_len = c->out_len;
+    c->send_off = 0;
+    c->out = NULL;
+    c->out_len = 0;
+    c->out_cap = 0;
+    return 1;
+}
+
+// Start writing a connection's output, if there is any to take
+static void conn_flush(IOLOOP_CONN *c)
+{
+    pthread_mutex_lock(conn_lock(c->fd));
+    int send = conn_take_output(c);
+    pthread_mutex_unlock(conn_lock(c->fd));
+    if (send)
+    {
+        conn_send(c);
+    }
+}
+
+static void conn_link(IOLOOP_SHARD *s, IOLOOP_CONN *c)
+{
+    c->prev = NULL;
+    c->next = s->conns;
+    if (s->conns != NULL)
+    {
+        s->conns->prev = c;
+    }
+    s->conns = c;
+}
+
+static void conn_unlink(IOLOOP_SHARD *s, IOLOOP_CONN *c)
+{
+    if (c->prev != NULL)
+    {
+        c->prev->next = c->next;
+    }
+    else
+    {
+        s->conns = c->next;
+    }
+    if (c->next != NULL)
+    {
+        c->next->prev = c->prev;
+    }
+    c->prev = c->next = NULL;
+}
+
+// Drop a connection from the table and its shard
+static void conn_forget(IOLOOP_CONN *c)
+{
+    conn_unlink(&loop.shards[c->shard], c);
+    pthread_mutex_lock(conn_lock(c->fd));
+    loop.conns[c->fd] = NULL;
+    pthread_mutex_unlock(conn_lock(c->fd));
+    if (__atomic_sub_fetch(&loop.nconns, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        pthread_mutex_lock(&loop.mutex);
+        pthread_cond_broadcast(&loop.cond);
+        pthread_mutex_unlock(&loop.mutex);
+    }
+}
+
+/*
+ * Messages between shards
+ */
+
+static void shard_wake(IOLOOP_SHARD *s)
+{
+    if (write(s->wakefd, &(uint64_t){1}, sizeof(uint64_t)) < 0)
+    {
+        // The counter is saturated, so the shard will wake anyway
+    }
+}
+
+static int msg_append(IOLOOP_MSG **msgs, size_t *n, size_t *cap, IOLOOP_MSG *msg)
+{
+    if (*n == *cap)
+    {
+        size_t new_cap = *cap ? *cap * 2 : 64;
+        IOLOOP_MSG *grown = realloc(*msgs, new_cap * sizeof(IOLOOP_MSG));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        *msgs = grown;
+        *cap = new_cap;
+    }
+    (*msgs)[(*n)++] = *msg;
+    return 0;
+}
+
+static int spsc_push(IOLOOP_SPSC *q, IOLOOP_MSG *msg)
+{
+    unsigned tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == IOLOOP_QUEUE_SIZE)
+    {
+        return -1;
+    }
+    q->msgs[tail & (IOLOOP_QUEUE_SIZE - 1)] = *msg;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Send a message to a shard: to itself without synchronization, from
+ * another shard through the queue between the two, and from any other
+ * thread through the shard's inbox.  The shard is woken only if it is
+ * waiting.
+ */
+static void post(int to, IOLOOP_MSG *msg)
+{
+    IOLOOP_SHARD *s = &loop.shards[to];
+    int failed = 0;
+    if (self == s)
+    {
+        failed = msg_append(&s->local, &s->nlocal, &s->local_cap, msg);
+    }
+    else if (self == NULL || spsc_push(s->from[self->index], msg) != 0)
+    {
+        pthread_mutex_lock(&s->inbox_mutex);
+        failed = msg_append(&s->inbox, &s->ninbox, &s->inbox_cap, msg);
+        pthread_mutex_unlock(&s->inbox_mutex);
+    }
+    if (failed)
+    {
+        // A lost message would strand a connection
+        jlog_error("no memory for a message to event loop %d", to);
+        abort();
+    }
+    if (self != s)
+    {
+        // Pairs with the fence in shard_idle()
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&s->asleep, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&s->asleep, 0, __ATOMIC_RELAXED))
+        {
+            shard_wake(s);
+        }
+    }
+}
+
+static void shard_handle(IOLOOP_SHARD *s, IOLOOP_MSG *msg)
+{
+    if (msg->type == MSG_ADOPT)
+    {
+        conn_adopt(s, msg->conn);
+        return;
+    }
+    // The connection may since have gone, or moved to another shard
+    pthread_mutex_lock(conn_lock(msg->fd));
+    IOLOOP_CONN *c = loop.conns[msg->fd];
+    if (c == NULL || c->gen != msg->gen || c->shard != s->index)
+    {
+        pthread_mutex_unlock(conn_lock(msg->fd));
+        return;
+    }
+    int send = 0;
+    if (msg->type == MSG_READY)
+    {
+        c->ready = 0;
+        send = conn_take_output(c);
+    }
+    pthread_mutex_unlock(conn_lock(msg->fd));
+
+    if (msg->type == MSG_MIGRATE)
+    {
+        conn_migrate(c, msg->shard);
+    }
+    else if (send)
+    {
+        conn_send(c);
+    }
+}
+
+// Handle the messages sent to a shard since the last round
+static void shard_drain(IOLOOP_SHARD *s)
+{
+    // Handling a message may send the shard another, which is handled too
+    for (size_t i = 0; i < s->nlocal; i++)
+    {
+        IOLOOP_MSG msg = s->local[i];
+        shard_handle(s, &msg);
+    }
+    s->nlocal = 0;
+
+    for (int i = 0; i < loop.nshards; i++)
+    {
+        IOLOOP_SPSC *q = s->from[i];
+        if (q == NULL)
+        {
+            continue;
+        }
+        unsigned head = q->head;
+        unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            shard_handle(s, &q->msgs[head & (IOLOOP_QUEUE_SIZE - 1)]);
+        }
+        __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_lock(&s->inbox_mutex);
+    IOLOOP_MSG *inbox = s->inbox;
+    size_t n = s->ninbox;
+    size_t cap = s->inbox_cap;
+    s->inbox = s->spare;
+    s->ninbox = 0;
+    s->inbox_cap = s->spare_cap;
+    pthread_mutex_unlock(&s->inbox_mutex);
+    for (size_t i = 0; i < n; i++)
+    {
+        shard_handle(s, &inbox[i]);
+    }
+    s->spare = inbox;
+    s->spare_cap = cap;
+}
+
+/*
+ * Mark a shard as about to wait, unless messages have arrived since it
+ * last handled them.
+ *
+ * @return 1 if it may wait, otherwise 0.
+ */
+static int shard_idle(IOLOOP_SHARD *s)
+{
+    __atomic_store_n(&s->asleep, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int pending = s->nlocal > 0;
+    for (int i = 0; i < loop.nshards && !pending; i++)
+    {
+        IOLOOP_SPSC *q = s->from[i];
+        pending = q != NULL && __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) != q->head;
+    }
+    if (!pending)
+    {
+        pthread_mutex_lock(&s->inbox_mutex);
+        pending = s->ninbox > 0;
+        pthread_mutex_unlock(&s->inbox_mutex);
+    }
+    if (pending)
+    {
+        __atomic_store_n(&s->asleep, 0, __ATOMIC_RELAXED);
+    }
+    return !pending;
+}
+
+/*
+ * io_uring
+ */
+
+static int uring_enter(IOLOOP_SHARD *s, unsigned wait)
+{
+    IOLOOP_URING *ring = &s->ring;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait == 0)
+    {
+        return 0;
+    }
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// Get a cleared SQE, submitting the queued ones first if there is no room
+static struct io_uring_sqe *uring_sqe(IOLOOP_SHARD *s)
+{
+    IOLOOP_URING *ring = &s->ring;
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+    {
+        if (uring_enter(s, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            jlog_error("cannot submit to io_uring");
+            abort();
+        }
+    }
+    unsigned index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static void uring_accept(IOLOOP_SHARD *s, IOLOOP_LISTENER *l)
+{
+    struct io_uring_sqe *sqe = uring_sqe(s);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = op_data(l, OP_ACCEPT);
+}
+
+static void uring_recv(IOLOOP_SHARD *s, IOLOOP_CONN *c)
+{
+    struct io_uring_sqe *sqe = uring_sqe(s);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IOLOOP_BGID;
+    sqe->user_data = op_data(c, OP_RECV);
+    c->ops++;
+}
+
+static void uring_send(IOLOOP_SHARD *s, IOLOOP_CONN *c)
+{
+    struct io_uring_sqe *sqe = uring_sqe(s);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)(c->sending + c->send_off);
+    sqe->len = c->send_len - c->send_off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = op_data(c, OP_SEND);
+    c->ops++;
+}
+
+static void uring_wake(IOLOOP_SHARD *s)
+{
+    struct io_uring_sqe *sqe = uring_sqe(s);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s->wakefd;
+    sqe->addr = (uintptr_t)&s->ring.wake_value;
+    sqe->len = sizeof(s->ring.wake_value);
+    sqe->user_data = op_data(NULL, OP_WAKE);
+}
+
+static void uring_cancel(IOLOOP_SHARD *s, uint64_t data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(s);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = data;
+    sqe->user_data = op_data(NULL, OP_CANCEL);
+}
+
+// Give a provided buffer back to the kernel
+static void uring_recycle(IOLOOP_SHARD *s, unsigned bid)
+{
+    IOLOOP_URING *ring = &s->ring;
+    struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (IOLOOP_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(ring->buffers + (size_t)bid * IOLOOP_BUFFER_SIZE);
+    buf->len = IOLOOP_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_teardown(IOLOOP_SHARD *s)
+{
+    IOLOOP_URING *ring = &s->ring;
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->br != NULL)
+    {
+        munmap(ring->br, ring->br_size);
+    }
+    free(ring->buffers);
+    ring->sq_ring = ring->cq_ring = NULL;
+    ring->sqes = NULL;
+    ring->br = NULL;
+    ring->buffers = NULL;
+}
+
+/*
+ * Check that the kernel delivers a multishot receive into a provided
+ * buffer, using a socketpair.
+ */
+static int uring_probe(IOLOOP_SHARD *s)
+{
+    IOLOOP_URING *ring = &s->ring;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+    {
+        return -1;
+    }
+    IOLOOP_CONN probe = {.fd = sv[0]};
+    uring_recv(s, &probe);
+    int ok = write(sv[1], "", 1) == 1;
+    int more = 1;
+    while (ok && more)
+    {
+        if (uring_enter(s, 1) < 0 && errno != EINTR)
+        {
+            ok = 0;
+            break;
+        }
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+            {
+                uring_recycle(s, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                more = 0;
+                ok = ok && cqe->res == 0;
+            }
+            else if (cqe->res == 1)
+            {
+                shutdown(sv[1], SHUT_WR);   // Now end it
+            }
+            else
+            {
+                ok = 0;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return ok ? 0 : -1;
+}
+
+static int uring_init(IOLOOP_SHARD *s)
+{
+    IOLOOP_URING *ring = &s->ring;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = IOLOOP_CQ_ENTRIES;
+    ring->fd = syscall(__NR_io_uring_setup, IOLOOP_RING_ENTRIES, &p);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        uring_teardown(s);
+        return -1;
+    }
+    ring->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring :
+                    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+    {
+        ring->cq_ring = NULL;
+        uring_teardown(s);
+        return -1;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_teardown(s);
+        return -1;
+    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // The provided buffers that multishot receives draw from
+    ring->br_size = IOLOOP_BUFFERS * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED)
+    {
+        ring->br = NULL;
+        uring_teardown(s);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->br;
+    reg.ring_entries = IOLOOP_BUFFERS;
+    reg.bgid = IOLOOP_BGID;
+    ring->buffers = malloc((size_t)IOLOOP_BUFFERS * IOLOOP_BUFFER_SIZE);
+    if (ring->buffers == NULL ||
+        syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        uring_teardown(s);
+        return -1;
+    }
+    ring->br_tail = 0;
+    for (unsigned bid = 0; bid < IOLOOP_BUFFERS; bid++)
+    {
+        uring_recycle(s, bid);
+    }
+
+    if (uring_probe(s) != 0)
+    {
+        uring_teardown(s);
+        return -1;
+    }
+    return 0;
+}
+
+static void uring_complete(IOLOOP_SHARD *s, struct io_uring_cqe *cqe)
+{
+    void *p = op_ptr(cqe->user_data);
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+    IOLOOP_CONN *c = p;
+
+    switch (cqe->user_data & ((1 << OP_BITS) - 1))
+    {
+    case OP_ACCEPT:;
+        IOLOOP_LISTENER *l = p;
+        if (res >= 0)
+        {
+            conn_open(res);
+        }
+        if (!(flags & IORING_CQE_F_MORE))
+        {
+            if (__atomic_load_n(&loop.stop_accepting, __ATOMIC_ACQUIRE))
+            {
+                pthread_mutex_lock(&loop.mutex);
+                if (--loop.armed == 0)
+                {
+                    pthread_cond_broadcast(&loop.cond);
+                }
+                pthread_mutex_unlock(&loop.mutex);
+            }
+            else
+            {
+                if (res < 0)
+                {
+                    jlog_warn("accept on fd %d failed: %s", l->fd, strerror(-res));
+                }
+                uring_accept(s, l);
+            }
+        }
+        break;
+
+    case OP_RECV:
+        if (flags & IORING_CQE_F_BUFFER)
+        {
+            unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (res > 0 && !c->closing &&
+                conn_feed(c, s->ring.buffers + (size_t)bid * IOLOOP_BUFFER_SIZE, res) != 0)
+            {
+                conn_close(c);
+            }
+            uring_recycle(s, bid);
+        }
+        if (!(flags & IORING_CQE_F_MORE))
+        {
+            c->ops--;
+            // Out of buffers only stops the receive, as does cancelling
+            // it to move or let go of the connection; anything else ends it
+            if (c->closing || res == 0 ||
+                (res < 0 && res != -ENOBUFS && !s->handing_off && c->migrate_to < 0))
+            {
+                conn_close(c);
+            }
+            else if (s->handing_off)
+            {
+                conn_release(c);
+            }
+            else if (c->migrate_to >= 0)
+            {
+                conn_move(c);
+            }
+            else
+            {
+                uring_recv(s, c);
+            }
+        }
+        break;
+
+    case OP_SEND:
+        c->ops--;
+        if (res > 0 && !c->closing)
+        {
+            c->send_off += res;
+            if (c->send_off < c->send_len)
+            {
+                uring_send(s, c);
+                break;
+            }
+        }
+        free(c->sending);
+        c->sending = NULL;
+        if (res <= 0 || c->closing)
+        {
+            conn_close(c);
+            break;
+        }
+        conn_flush(c);
+        if (s->handing_off)
+        {
+            conn_release(c);
+        }
+        else if (c->migrate_to >= 0)
+        {
+            conn_move(c);
+        }
+        break;
+
+    case OP_WAKE:
+        uring_wake(s);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void uring_run(IOLOOP_SHARD *s)
+{
+    IOLOOP_URING *ring = &s->ring;
+    uring_wake(s);
+    for (int i = 0; i < loop.nlisteners; i++)
+    {
+        uring_accept(s, &loop.listeners[i]);
+    }
+    while (!__atomic_load_n(&loop.quit, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(&loop.stop_accepting, __ATOMIC_ACQUIRE) && !s->cancelled)
+        {
+            for (int i = 0; i < loop.nlisteners; i++)
+            {
+                uring_cancel(s, op_data(&loop.listeners[i], OP_ACCEPT));
+            }
+            s->cancelled = 1;
+        }
+        if (__atomic_load_n(&loop.hand_off, __ATOMIC_ACQUIRE) && !s->handing_off)
+        {
+            // Stop receiving; the rest of the input stays in the sockets
+            s->handing_off = 1;
+            for (IOLOOP_CONN *c = s->conns; c != NULL; c = c->next)
+            {
+                if (!c->closing)
+                {
+                    uring_cancel(s, op_data(c, OP_RECV));
+                    c->migrate_to = -1;
+                    conn_flush(c);
+                }
+            }
+        }
+        // Start writing the output queued since the last round
+        shard_drain(s);
+
+        int wait = shard_idle(s);
+        if (uring_enter(s, wait) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            jlog_error("io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        __atomic_store_n(&s->asleep, 0, __ATOMIC_RELAXED);
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            uring_complete(s, &ring->cqes[head & ring->cq_mask]);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * epoll
+ */
+
+static void epoll_watch(IOLOOP_CONN *c, int op)
+{
+    IOLOOP_SHARD *s = &loop.shards[c->shard];
+    int receiving = !s->handing_off && c->migrate_to < 0;
+    struct epoll_event ev = {
+        .events = (receiving ? EPOLLIN : 0) | (c->want_out ? EPOLLOUT : 0),
+        .data.u64 = op_data(c, OP_RECV)
+    };
+    epoll_ctl(s->epfd, op, c->fd, &ev);
+}
+
+// Write as much output as the socket takes, then wait for it to take more
+static void epoll_send(IOLOOP_CONN *c)
+{
+    while (c->sending != NULL)
+    {
+        ssize_t n = send(c->fd, c->sending + c->send_off, c->send_len - c->send_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN)
+        {
+            if (!c->want_out)
+            {
+                c->want_out = 1;
+                epoll_watch(c, EPOLL_CTL_MOD);
+            }
+            return;
+        }
+        if (n <= 0)
+        {
+            // The receive side sees the end and closes the connection
+            shutdown(c->fd, SHUT_RDWR);
+            free(c->sending);
+            c->sending = NULL;
+            break;
+        }
+        c->send_off += n;
+        if (c->send_off == c->send_len)
+        {
+            free(c->sending);
+            c->sending = NULL;
+            pthread_mutex_lock(conn_lock(c->fd));
+            conn_take_output(c);
+            pthread_mutex_unlock(conn_lock(c->fd));
+        }
+    }
+    if (c->want_out)
+    {
+        c->want_out = 0;
+        epoll_watch(c, EPOLL_CTL_MOD);
+    }
+    if (loop.shards[c->shard].handing_off)
+    {
+        conn_release(c);
+    }
+}
+
+static int epoll_init(IOLOOP_SHARD *s)
+{
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epfd < 0)
+    {
+        return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = op_data(NULL, OP_WAKE)};
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wakefd, &ev) != 0)
+    {
+        close(s->epfd);
+        s->epfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void epoll_run(IOLOOP_SHARD *s)
+{
+    char *buf = malloc(IOLOOP_BUFFER_SIZE);
+    struct epoll_event *events = malloc(IOLOOP_EPOLL_EVENTS * sizeof(struct epoll_event));
+    if (buf == NULL || events == NULL)
+    {
+        jlog_error("cannot start the event loop");
+        abort();
+    }
+    // Each connection wakes only one of the shards waiting for it
+    for (int i = 0; i < loop.nlisteners; i++)
+    {
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                                 .data.u64 = op_data(&loop.listeners[i], OP_ACCEPT)};
+        epoll_ctl(s->epfd, EPOLL_CTL_ADD, loop.listeners[i].fd, &ev);
+    }
+    while (!__atomic_load_n(&loop.quit, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(&loop.stop_accepting, __ATOMIC_ACQUIRE) && !s->cancelled)
+        {
+            for (int i = 0; i < loop.nlisteners; i++)
+            {
+                epoll_ctl(s->epfd, EPOLL_CTL_DEL, loop.listeners[i].fd, NULL);
+            }
+            s->cancelled = 1;
+            pthread_mutex_lock(&loop.mutex);
+            if ((loop.armed -= loop.nlisteners) == 0)
+            {
+                pthread_cond_broadcast(&loop.cond);
+            }
+            pthread_mutex_unlock(&loop.mutex);
+        }
+        if (__atomic_load_n(&loop.hand_off, __ATOMIC_ACQUIRE) && !s->handing_off)
+        {
+            // Stop receiving; the rest of the input stays in the sockets
+            s->handing_off = 1;
+            IOLOOP_CONN *next;
+            for (IOLOOP_CONN *c = s->conns; c != NULL; c = next)
+            {
+                next = c->next;
+                c->migrate_to = -1;
+                epoll_watch(c, EPOLL_CTL_MOD);
+                conn_flush(c);
+                conn_release(c);
+            }
+        }
+        // Start writing the output queued since the last round
+        shard_drain(s);
+
+        int n = epoll_wait(s->epfd, events, IOLOOP_EPOLL_EVENTS, shard_idle(s) ? -1 : 0);
+        __atomic_store_n(&s->asleep, 0, __ATOMIC_RELAXED);
+        for (int i = 0; i < n; i++)
+        {
+            void *p = op_ptr(events[i].data.u64);
+            uint64_t value;
+            switch (events[i].data.u64 & ((1 << OP_BITS) - 1))
+            {
+            case OP_ACCEPT:;
+                // Another shard may have taken it, as the socket does not block
+                int fd = accept(((IOLOOP_LISTENER *)p)->fd, NULL, NULL);
+                if (fd >= 0)
+                {
+                    conn_open(fd);
+                }
+                break;
+            case OP_WAKE:
+                if (read(s->wakefd, &value, sizeof(value)) < 0)
+                {
+                    // Already read; the shard is awake anyway
+                }
+                break;
+            case OP_RECV:;
+                IOLOOP_CONN *c = p;
+                // During a handoff this also lets go of the connection
+                if ((events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) || s->handing_off)
+                {
+                    epoll_send(c);
+                }
+                if (s->handing_off)
+                {
+                    break;
+                }
+                if (c->migrate_to >= 0)
+                {
+                    conn_move(c);
+                    break;
+                }
+                if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                {
+                    break;
+                }
+                ssize_t len = recv(c->fd, buf, IOLOOP_BUFFER_SIZE, MSG_DONTWAIT);
+                if (len < 0 && (errno == EAGAIN || errno == EINTR))
+                {
+                    break;
+                }
+                if (len <= 0 || conn_feed(c, buf, len) != 0)
+                {
+                    conn_close(c);
+                }
+                break;
+            }
+        }
+    }
+    free(events);
+    free(buf);
+}
+
+static void *shard_run(void *arg)
+{
+    self = arg;
+    if (loop.uring)
+    {
+        uring_run(self);
+    }
+    else
+    {
+        epoll_run(self);
+    }
+    return NULL;
+}
+
+/*
+ * Connections
+ */
+
+static void conn_send(IOLOOP_CONN *c)
+{
+    if (loop.uring)
+    {
+        uring_send(&loop.shards[c->shard], c);
+    }
+    else
+    {
+        epoll_send(c);
+    }
+}
+
+// Start receiving on a connection, unless its shard is handing off
+static void conn_receive(IOLOOP_SHARD *s, IOLOOP_CONN *c)
+{
+    if (!loop.uring)
+    {
+        epoll_watch(c, EPOLL_CTL_ADD);
+    }
+    else if (!s->handing_off)
+    {
+        uring_recv(s, c);
+    }
+}
+
+/*
+ * Serve a registered client from a shard, starting with the bytes of a
+ * partly received packet, if any.  Only the shard's own thread, or any
+ * thread before the shards start, may pass pending bytes.
+ *
+ * @return 0 if successful, otherwise -1, with the client unregistered.
+ */
+static int conn_add(IOLOOP_SHARD *s, CLIENT *client, char *pending, size_t len)
+{
+    int fd = client_get_fd(client);
+    IOLOOP_CONN *c = fd < IOLOOP_MAX_FDS ? calloc(1, sizeof(IOLOOP_CONN)) : NULL;
+    if (c == NULL)
+    {
+        shutdown(fd, SHUT_RDWR);
+        creg_unregister(client_registry, client);
+        return -1;
+    }
+    // This unregisters the client if it fails
+    if ((c->session = jeux_session_open(client, client_get_player(client) != NULL)) == NULL)
+    {
+        free(c);
+        return -1;
+    }
+    c->fd = fd;
+    c->gen = __atomic_add_fetch(&loop.next_gen, 1, __ATOMIC_RELAXED);
+    c->shard = s->index;
+    __atomic_add_fetch(&loop.nconns, 1, __ATOMIC_ACQ_REL);
+    if (self != NULL && self != s)
+    {
+        // Accepted by another shard, so handed over as if it had moved
+        c->migrate_to = s->index;
+        pthread_mutex_lock(conn_lock(fd));
+        loop.conns[fd] = c;
+        pthread_mutex_unlock(conn_lock(fd));
+        IOLOOP_MSG msg = {.type = MSG_ADOPT, .conn = c};
+        post(s->index, &msg);
+        return 0;
+    }
+    c->migrate_to = -1;
+    conn_link(s, c);
+    pthread_mutex_lock(conn_lock(fd));
+    loop.conns[fd] = c;
+    pthread_mutex_unlock(conn_lock(fd));
+
+    if (conn_feed(c, pending, len) != 0)
+    {
+        conn_close(c);
+        return -1;
+    }
+    conn_receive(s, c);
+    return 0;
+}
+
+/*
+ * Take on a newly accepted connection: register a CLIENT for it and
+ * start receiving.  Which shard accepts is up to the kernel, which
+ * mostly wakes the same one, so the connections are dealt out to the
+ * shards in turn.
+ */
+static void conn_open(int fd)
+{
+    // A bot answers at once; its MOVED must not wait behind our ACK.
+    // This fails harmlessly on a Unix domain socket.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    CLIENT *client = fd < IOLOOP_MAX_FDS ? creg_register(client_registry, fd) : NULL;
+    if (client == NULL)
+    {
+        close(fd);
+        return;
+    }
+    int to = __atomic_fetch_add(&loop.next_shard, 1, __ATOMIC_RELAXED) % loop.nshards;
+    conn_add(&loop.shards[to], client, NULL, 0);
+}
+
+/*
+ * Close a connection, once any operations on it have finished.  The
+ * socket is shut down at once, which ends them.
+ */
+static void conn_close(IOLOOP_CONN *c)
+{
+    if (!c->closing)
+    {
+        c->closing = 1;
+        shutdown(c->fd, SHUT_RDWR);
+        if (!loop.uring)
+        {
+            epoll_ctl(loop.shards[c->shard].epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        }
+    }
+    if (c->ops > 0)
+    {
+        return;
+    }
+
+    conn_forget(c);
+
+    // This may close the socket, so it must come after the above
+    jeux_session_close(c->session, 0);
+    free(c->out);
+    free(c->sending);
+    free(c->data);
+    free(c);
+}
+
+/*
+ * During a handoff, let go of a connection once nothing more is being
+ * received from it and all of its output has been written.  Packets
+ * sent to it from then on are written by their senders, and the bytes
+ * of a partly received packet are kept for ioloop_pending_input().
+ */
+static void conn_release(IOLOOP_CONN *c)
+{
+    if (c->handed || c->closing || c->ops > 0 || c->sending != NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(conn_lock(c->fd));
+    size_t out_len = c->out_len;
+    pthread_mutex_unlock(conn_lock(c->fd));
+    if (out_len > 0)
+    {
+        // Its shard has been told to write it, and then calls this again
+        return;
+    }
+    if (!loop.uring)
+    {
+        epoll_ctl(loop.shards[c->shard].epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    c->handed = 1;
+    pthread_mutex_lock(&loop.mutex);
+    c->next_handed = loop.handed;
+    loop.handed = c;
+    pthread_mutex_unlock(&loop.mutex);
+    conn_forget(c);
+
+    jeux_session_close(c->session, 1);
+    c->session = NULL;
+}
+
+/*
+ * Start moving a connection to another shard: stop receiving from it,
+ * and once that has stopped and no output is being written, hand it
+ * over with conn_move().
+ */
+static void conn_migrate(IOLOOP_CONN *c, int to)
+{
+    IOLOOP_SHARD *s = &loop.shards[c->shard];
+    if (c->closing || c->handed || c->migrate_to >= 0 || s->handing_off || to == s->index)
+    {
+        return;
+    }
+    c->migrate_to = to;
+    if (loop.uring)
+    {
+        uring_cancel(s, op_data(c, OP_RECV));
+    }
+    else
+    {
+        epoll_watch(c, EPOLL_CTL_MOD);
+        conn_move(c);
+    }
+}
+
+/*
+ * Hand a connection that is moving over to its new shard, once nothing
+ * is being received or written.  The bytes of a partly received packet
+ * and the output not yet written go with it, so nothing is reordered.
+ */
+static void conn_move(IOLOOP_CONN *c)
+{
+    IOLOOP_SHARD *s = &loop.shards[c->shard];
+    if (c->migrate_to < 0 || c->closing || c->handed || c->ops > 0 || c->sending != NULL)
+    {
+        return;
+    }
+    int to = c->migrate_to;
+    conn_unlink(s, c);
+    if (!loop.uring)
+    {
+        epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    // Output queued from now on wakes the new shard
+    pthread_mutex_lock(conn_lock(c->fd));
+    c->shard = to;
+    c->ready = 0;
+    pthread_mutex_unlock(conn_lock(c->fd));
+    IOLOOP_MSG msg = {.type = MSG_ADOPT, .conn = c};
+    post(to, &msg);
+}
+
+// Take over a connection moved from another shard
+static void conn_adopt(IOLOOP_SHARD *s, IOLOOP_CONN *c)
+{
+    c->migrate_to = -1;
+    conn_link(s, c);
+    conn_receive(s, c);
+    conn_flush(c);
+    if (s->handing_off)
+    {
+        conn_release(c);
+    }
+}
+
+/*
+ * Append a packet to the output of a client owned by the loop, and tell
+ * the shard that owns it unless it has been told already.
+ *
+ * @param fd  The client's socket.
+ * @param iov  The header and payload.
+ * @return 1 if the packet was queued, 0 if the client is not owned by
+ * the loop, so the caller must write the packet itself, or -1 if the
+ * client is being disconnected.
+ */
+int ioloop_queue(int fd, struct iovec *iov, int iovcnt)
+{
+    if (!__atomic_load_n(&loop.started, __ATOMIC_ACQUIRE) || fd < 0 || fd >= IOLOOP_MAX_FDS)
+    {
+        return 0;
+    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+
+    int ret = 1;
+    int notify = 0;
+    IOLOOP_MSG msg = {.type = MSG_READY, .fd = fd};
+    int to = 0;
+    pthread_mutex_lock(conn_lock(fd));
+    IOLOOP_CONN *c = loop.conns[fd];
+    if (c == NULL)
+    {
+        ret = 0;
+    }
+    else if (c->failed || c->out_len + len > IOLOOP_MAX_OUTPUT)
+    {
+        if (!c->failed)
+        {
+            jlog_warn("fd %d is not reading its output, disconnecting", fd);
+            c->failed = 1;
+            shutdown(fd, SHUT_RDWR);
+        }
+        ret = -1;
+    }
+    else
+    {
+        if (c->out_len + len > c->out_cap)
+        {
+            size_t cap = c->out_cap ? c->out_cap : 256;
+            while (cap < c->out_len + len)
+            {
+                cap *= 2;
+            }
+            char *out = realloc(c->out, cap);
+            if (out == NULL)
+            {
+                pthread_mutex_unlock(conn_lock(fd));
+                return -1;
+            }
+            c->out = out;
+            c->out_cap = cap;
+        }
+        for (int i = 0; i < iovcnt; i++)
+        {
+            memcpy(c->out + c->out_len, iov[i].iov_base, iov[i].iov_len);
+            c->out_len += iov[i].iov_len;
+        }
+        if (!c->ready)
+        {
+            c->ready = 1;
+            notify = 1;
+            msg.gen = c->gen;
+            to = c->shard;
+        }
+    }
+    pthread_mutex_unlock(conn_lock(fd));
+
+    if (notify)
+    {
+        post(to, &msg);
+    }
+    return ret;
+}
+
+/*
+ * Have the clients on two sockets served by the same shard, by moving
+ * the second to the shard of the first, so that the packets of a game
+ * between them are handled on one CPU.  Nothing is done unless both are
+ * owned by the loop.
+ *
+ * @param fd  The socket of the client that stays.
+ * @param peer  The socket of the client that moves.
+ */
+void ioloop_colocate(int fd, int peer)
+{
+    if (!__atomic_load_n(&loop.running, __ATOMIC_ACQUIRE) || loop.nshards == 1 ||
+        fd < 0 || fd >= IOLOOP_MAX_FDS || peer < 0 || peer >= IOLOOP_MAX_FDS)
+    {
+        return;
+    }
+    pthread_mutex_lock(conn_lock(fd));
+    int to = loop.conns[fd] != NULL ? loop.conns[fd]->shard : -1;
+    pthread_mutex_unlock(conn_lock(fd));
+
+    IOLOOP_MSG msg = {.type = MSG_MIGRATE, .fd = peer, .shard = to};
+    int from = -1;
+    pthread_mutex_lock(conn_lock(peer));
+    IOLOOP_CONN *c = loop.conns[peer];
+    if (c != NULL)
+    {
+        from = c->shard;
+        msg.gen = c->gen;
+    }
+    pthread_mutex_unlock(conn_lock(peer));
+
+    if (to >= 0 && from >= 0 && to != from)
+    {
+        post(from, &msg);
+    }
+}
+
+// The CPUs this process may run on
+static int online_cpus(int *cpus)
+{
+    cpu_set_t set;
+    int n = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus[n++] = cpu;
+            }
+        }
+    }
+    return n;
+}
+
+static void shard_teardown(IOLOOP_SHARD *s)
+{
+    if (s->ring.fd >= 0)
+    {
+        uring_teardown(s);
+    }
+    if (s->epfd >= 0)
+    {
+        close(s->epfd);
+    }
+    if (s->wakefd >= 0)
+    {
+        close(s->wakefd);
+    }
+    for (int i = 0; s->from != NULL && i < loop.nshards; i++)
+    {
+        free(s->from[i]);
+    }
+    free(s->from);
+    free(s->local);
+    free(s->inbox);
+    free(s->spare);
+    pthread_mutex_destroy(&s->inbox_mutex);
+}
+
+static void shards_teardown(int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        shard_teardown(&loop.shards[i]);
+    }
+    free(loop.shards);
+    loop.shards = NULL;
+}
+
+static int shard_init(IOLOOP_SHARD *s, int index, int *uring)
+{
+    memset(s, 0, sizeof(*s));
+    s->index = index;
+    s->ring.fd = -1;
+    s->epfd = -1;
+    pthread_mutex_init(&s->inbox_mutex, NULL);
+    if ((s->wakefd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+        (s->from = calloc(loop.nshards, sizeof(IOLOOP_SPSC *))) == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < loop.nshards; i++)
+    {
+        if (i != index)
+        {
+            if (posix_memalign((void **)&s->from[i], IOLOOP_CACHE_LINE, sizeof(IOLOOP_SPSC)) != 0)
+            {
+                s->from[i] = NULL;
+                return -1;
+            }
+            memset(s->from[i], 0, sizeof(IOLOOP_SPSC));
+        }
+    }
+    if (*uring && uring_init(s) != 0)
+    {
+        if (index > 0)
+        {
+            return -1;
+        }
+        jlog_warn("io_uring lacks multishot receive or buffer rings here, using epoll");
+        *uring = 0;
+    }
+    if (!*uring && epoll_init(s) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set up the event loop, which does not run until ioloop_start().
+ *
+ * @param backend  "uring" or "epoll".
+ * @param nshards  How many shards to run, or 0 for one per CPU, up to
+ * IOLOOP_MAX_SHARDS.
+ * @return 0 if successful, otherwise -1.
+ */
+int ioloop_init(char *backend, int nshards)
+{
+    int uring;
+    if (strcmp(backend, "uring") == 0)
+    {
+        uring = 1;
+    }
+    else if (strcmp(backend, "epoll") == 0)
+    {
+        uring = 0;
+    }
+    else
+    {
+        return -1;
+    }
+    if (nshards <= 0)
+    {
+        int cpus[CPU_SETSIZE];
+        nshards = online_cpus(cpus);
+    }
+    nshards = nshards < 1 ? 1 : nshards > IOLOOP_MAX_SHARDS ? IOLOOP_MAX_SHARDS : nshards;
+
+    for (int i = 0; i < IOLOOP_CONN_LOCKS; i++)
+    {
+        pthread_mutex_init(&conn_locks[i], NULL);
+    }
+    if (posix_memalign((void **)&loop.shards, IOLOOP_CACHE_LINE,
+                       nshards * sizeof(IOLOOP_SHARD)) != 0)
+    {
+        loop.shards = NULL;
+        return -1;
+    }
+    loop.nshards = nshards;
+    for (int i = 0; i < nshards; i++)
+    {
+        if (shard_init(&loop.shards[i], i, &uring) != 0)
+        {
+            shards_teardown(i + 1);
+            return -1;
+        }
+    }
+    loop.uring = uring;
+    __atomic_store_n(&loop.started, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Serve a client received from a predecessor server (see handoff.h).
+ * Called before ioloop_start().  Clients are dealt out to the shards in
+ * turn; players of a game carried over are not brought onto one shard
+ * until they start another.
+ *
+ * @param client  The CLIENT, already registered and logged in if it was
+ * logged in with the predecessor.
+ * @param pending  The bytes of a packet the predecessor had partly
+ * received from the client.
+ * @param len  How many there are.
+ * @return 0 if successful, otherwise -1, with the client unregistered.
+ */
+int ioloop_adopt(CLIENT *client, char *pending, size_t len)
+{
+    IOLOOP_SHARD *s = &loop.shards[loop.next_shard++ % loop.nshards];
+    return conn_add(s, client, pending, len);
+}
+
+static void wake_shards(void)
+{
+    for (int i = 0; i < loop.nshards; i++)
+    {
+        shard_wake(&loop.shards[i]);
+    }
+}
+
+/*
+ * Start the shards, each on a thread pinned to a CPU, accepting
+ * connections on the listening sockets and serving them and the adopted
+ * clients.
+ *
+ * @param listenfds  The listening sockets.
+ * @param nlisteners  How many there are.
+ * @return 0 if successful, otherwise -1.
+ */
+int ioloop_start(int *listenfds, int nlisteners)
+{
+    if (nlisteners > IOLOOP_MAX_LISTENERS)
+    {
+        return -1;
+    }
+    loop.nlisteners = nlisteners;
+    for (int i = 0; i < nlisteners; i++)
+    {
+        loop.listeners[i].fd = listenfds[i];
+        // Every shard waits to accept, so with epoll a shard may find
+        // nothing; io_uring arms its accepts only on a blocking socket
+        int flags = fcntl(listenfds[i], F_GETFL);
+        if (flags >= 0)
+        {
+            fcntl(listenfds[i], F_SETFL, loop.uring ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+        }
+    }
+    loop.armed = loop.nshards * nlisteners;
+
+    int cpus[CPU_SETSIZE];
+    int ncpus = online_cpus(cpus);
+    for (int i = 0; i < loop.nshards; i++)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (ncpus > 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % ncpus], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        int err = pthread_create(&loop.shards[i].thread, &attr, shard_run, &loop.shards[i]);
+        pthread_attr_destroy(&attr);
+        if (err != 0)
+        {
+            __atomic_store_n(&loop.quit, 1, __ATOMIC_RELEASE);
+            wake_shards();
+            while (--i >= 0)
+            {
+                pthread_join(loop.shards[i].thread, NULL);
+            }
+            return -1;
+        }
+    }
+    __atomic_store_n(&loop.running, 1, __ATOMIC_RELEASE);
+    jlog_info("serving clients on %d %s event loops", loop.nshards,
+              loop.uring ? "io_uring" : "epoll");
+    return 0;
+}
+
+/*
+ * Stop accepting connections, returning once every shard has stopped.
+ * Connections already accepted are still served.
+ */
+void ioloop_stop_accepting(void)
+{
+    if (!__atomic_load_n(&loop.running, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    __atomic_store_n(&loop.stop_accepting, 1, __ATOMIC_RELEASE);
+    wake_shards();
+    pthread_mutex_lock(&loop.mutex);
+    while (loop.armed > 0)
+    {
+        pthread_cond_wait(&loop.cond, &loop.mutex);
+    }
+    pthread_mutex_unlock(&loop.mutex);
+}
+
+/*
+ * Have the shards let go of every connection for a handoff, returning
+ * once they have.  Called after ioloop_stop_accepting().  Packets that
+ * have already been received are handled, and all output is written,
+ * but nothing more is received, and no connection moves.
+ */
+void ioloop_hand_off(void)
+{
+    __atomic_store_n(&loop.hand_off, 1, __ATOMIC_RELEASE);
+    wake_shards();
+    pthread_mutex_lock(&loop.mutex);
+    while (__atomic_load_n(&loop.nconns, __ATOMIC_ACQUIRE) > 0)
+    {
+        pthread_cond_wait(&loop.cond, &loop.mutex);
+    }
+    pthread_mutex_unlock(&loop.mutex);
+}
+
+/*
+ * Get the bytes of a packet partly received from a client the loop has
+ * let go of, to be handed to the successor with the client.
+ *
+ * @param fd  The client's socket.
+ * @param buf  Where to put the bytes, with room for IOLOOP_MAX_PENDING.
+ * @return how many there are.
+ */
+size_t ioloop_pending_input(int fd, char *buf)
+{
+    size_t len = 0;
+    pthread_mutex_lock(&loop.mutex);
+    for (IOLOOP_CONN *c = loop.handed; c != NULL; c = c->next_handed)
+    {
+        if (c->fd == fd)
+        {
+            memcpy(buf, &c->hdr, c->hdr_len);
+            len = c->hdr_len;
+            if (c->data != NULL)
+            {
+                memcpy(buf + len, c->data, c->data_len);
+                len += c->data_len;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loop.mutex);
+    return len;
+}
+
+/*
+ * Stop the loop.  Called once every client has gone.
+ */
+void ioloop_fini(void)
+{
+    if (!__atomic_load_n(&loop.started, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    if (__atomic_load_n(&loop.running, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&loop.quit, 1, __ATOMIC_RELEASE);
+        wake_shards();
+        for (int i = 0; i < loop.nshards; i++)
+        {
+            pthread_join(loop.shards[i].thread, NULL);
+        }
+        __atomic_store_n(&loop.running, 0, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&loop.started, 0, __ATOMIC_RELEASE);
+    shards_teardown(loop.nshards);
+}
@@ -0,0 +1,82 @@
+#ifndef IO_LOOP_H
+#define IO_LOOP_H
+
+#include <sys/uio.h>
+
+#include "payload.h"
+#include "global.h"
+
+/*
+ * Event loop for client connections.
+ *
+ * Clients are not served by a thread each.  A loop thread accepts
+ * connections on the listening sockets, receives from its clients,
+ * splits what it receives into packets and hands each to the session
+ * for the connection (jeux_session_packet() in server.c), which is a
+ * small structure rather than a thread with its own stack: a client
+ * costs the loop its IOLOOP_CONN and JEUX_SESSION, a few hundred bytes
+ * in all, plus buffers only while a packet is partly received or output
+ * is waiting to be written.
+ *
+ * Packets sent to a client are not written by the sending thread:
+ * proto_send_packet() appends them to the client's output with
+ * ioloop_queue(), and the shard that owns the client writes them, in
+ * order, when the socket can take them.  A client that lets more than
+ * IOLOOP_MAX_OUTPUT bytes pile up is disconnected.
+ *
+ * The backend is chosen with "-i" (default "uring").  The "uring"
+ * backend uses io_uring: one multishot accept per listening socket, one
+ * multishot receive per connection drawing from a ring of
+ * IOLOOP_BUFFERS provided buffers of IOLOOP_BUFFER_SIZE bytes, and
+ * sends, so that the completions of a whole batch of packets and the
+ * sends they produce cost a single system call.  It needs multishot
+ * receive and provided buffer rings (Linux 6.0); if the kernel lacks
+ * them, the loop falls back to the "epoll" backend, which waits with
+ * epoll and then receives and sends with one call each.
+ *
+ * The loop is sharded: it runs as one event loop per CPU (or as many as
+ * "-c" asks for, up to IOLOOP_MAX_SHARDS), each on a thread pinned to
+ * its CPU with a ring or epoll instance, buffers and connections of its
+ * own.  Every shard accepts on the listening sockets, and new clients
+ * are dealt out to the shards in turn; a connection is then touched only
+ * by its shard's thread.  When a game starts, ioloop_colocate() moves one
+ * player's connection to the other's shard, so that the moves of a game,
+ * and the game and client locks they take, stay on one CPU.  Shards tell
+ * each other about output to write and connections to move through
+ * lock-free queues, one per pair of shards; other threads use a shard's
+ * inbox.  A shard is only woken through its eventfd when it is waiting.
+ *
+ * For a hot restart (handoff.h), ioloop_hand_off() stops receiving,
+ * writes all output and lets go of every connection, keeping the bytes
+ * of any packet partly received, which are sent to the successor with
+ * the client and given back to the loop there by ioloop_adopt().
+ */
+
+#define IOLOOP_BUFFERS 512              // A power of 2
+#define IOLOOP_BUFFER_SIZE 4096
+#define IOLOOP_MAX_OUTPUT (1 << 20)
+#define IOLOOP_MAX_FDS 65536
+#define IOLOOP_MAX_PENDING (sizeof(JEUX_PACKET_HEADER) + PROTO_MAX_PAYLOAD)
+#define IOLOOP_MAX_SHARDS 16
+
+int ioloop_init(char *backend, int nshards);
+int ioloop_adopt(CLIENT *client, char *pending, size_t len);
+int ioloop_start(int *listenfds, int nlisteners);
+void ioloop_stop_accepting(void);
+void ioloop_hand_off(void);
+size_t ioloop_pending_input(int fd, char *buf);
+void ioloop_fini(void);
+int ioloop_queue(int fd, struct iovec *iov, int iovcnt);
+void ioloop_colocate(int fd, int peer);
+
+/*
+ * The handling of a client connection, in server.c.
+ * jeux_session_packet() frees the payload.
+ */
+typedef struct jeux_session JEUX_SESSION;
+
+JEUX_SESSION *jeux_session_open(CLIENT *client, int logged_in);
+void jeux_session_packet(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, JEUX_PAYLOAD *payload);
+void jeux_session_close(JEUX_SESSION *session, int handed_off);
+
+#endif
@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "jlog.h"
+
+#define JLOG_STRING_SPACE (JLOG_RECORD_SIZE - 16 - JLOG_MAX_ARGS * 8)
+#define JLOG_OUTPUT_BUFFER 65536
+
+typedef union jlog_value {
+    long long i;
+    unsigned long long u;
+    double d;
+    const void *p;
+    unsigned int str;               // Offset of the string in the record
+} JLOG_VALUE;
+
+typedef struct jlog_record {
+    const JLOG_SITE *site;
+    uint64_t timestamp_ns;
+    JLOG_VALUE args[JLOG_MAX_ARGS];
+    char strings[JLOG_STRING_SPACE];
+} JLOG_RECORD;
+
+/*
+ * Single-producer single-consumer ring: only the owning thread advances
+ * head and only the formatter advances tail.  A ring is released when
+ * its thread exits and can then be claimed by a new thread once the
+ * formatter has drained it, so the number of rings is bounded by the
+ * peak number of threads that have logged concurrently.
+ */
+typedef struct jlog_ring {
+    unsigned long head;
+    char pad[64 - sizeof(unsigned long)];
+    unsigned long tail;
+    unsigned long dropped;
+    int owned;
+    long tid;
+    struct jlog_ring *next;
+    JLOG_RECORD records[JLOG_RING_RECORDS];
+} JLOG_RING;
+
+static const char *level_names[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR" };
+
+static JLOG_RING *rings;            // Lock-free list; rings are never removed
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread JLOG_RING *my_ring;
+
+static struct {
+    int running;
+    int stop;
+    pthread_t thread;
+    char buffer[JLOG_OUTPUT_BUFFER];
+    size_t length;
+} formatter;
+
+static void release_ring(void *arg)
+{
+    JLOG_RING *ring = arg;
+    __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/*
+ * Find a ring for the calling thread: a released ring that has been
+ * drained if there is one, otherwise a new ring.
+ */
+static JLOG_RING *claim_ring(void)
+{
+    pthread_once(&key_once, create_key);
+
+    JLOG_RING *ring;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        int expected = 0;
+        if (__atomic_load_n(&ring->owned, __ATOMIC_RELAXED) == 0 &&
+            __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head &&
+            __atomic_compare_exchange_n(&ring->owned, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    if (ring == NULL)
+    {
+        ring = calloc(1, sizeof(JLOG_RING));
+        if (ring == NULL)
+        {
+            return NULL;
+        }
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            ;
+    }
+    ring->tid = syscall(SYS_gettid);
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+/*
+ * Append a record for a log statement to the calling thread's ring.
+ * This is the target of the jlog_*() macros and is not called directly.
+ */
+void jlog_write(const JLOG_SITE *site, ...)
+{
+    JLOG_RING *ring = my_ring;
+    if (ring == NULL && (ring = my_ring = claim_ring()) == NULL)
+    {
+        return;
+    }
+
+    unsigned long head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= JLOG_RING_RECORDS)
+    {
+        ring->dropped++;
+        return;
+    }
+    JLOG_RECORD *rec = &ring->records[head & (JLOG_RING_RECORDS - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->site = site;
+    rec->timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    va_list ap;
+    va_start(ap, site);
+    unsigned int used = 0;
+    for (int i = 0; i < site->nargs; i++)
+    {
+        JLOG_VALUE *v = &rec->args[i];
+        switch (site->types[i])
+        {
+        case JLOG_ARG_INT: v->i = va_arg(ap, int); break;
+        case JLOG_ARG_UINT: v->u = va_arg(ap, unsigned int); break;
+        case JLOG_ARG_LONG: v->i = va_arg(ap, long); break;
+        case JLOG_ARG_ULONG: v->u = va_arg(ap, unsigned long); break;
+        case JLOG_ARG_LLONG: v->i = va_arg(ap, long long); break;
+        case JLOG_ARG_ULLONG: v->u = va_arg(ap, unsigned long long); break;
+        case JLOG_ARG_DOUBLE: v->d = va_arg(ap, double); break;
+        case JLOG_ARG_PTR: v->p = va_arg(ap, void *); break;
+        case JLOG_ARG_STR:
+        {
+            const char *s = va_arg(ap, const char *);
+            if (s == NULL)
+            {
+                s = "(null)";
+            }
+            v->str = used;
+            while (used < JLOG_STRING_SPACE - 1 && *s != '\0')
+            {
+                rec->strings[used++] = *s++;
+            }
+            rec->strings[used] = '\0';
+            if (used < JLOG_STRING_SPACE - 1)
+            {
+                used++;
+            }
+            break;
+        }
+        }
+    }
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void output(const char *data, size_t len)
+{
+    if (formatter.length + len > sizeof(formatter.buffer))
+    {
+        fwrite(formatter.buffer, 1, formatter.length, stderr);
+        formatter.length = 0;
+        if (len > sizeof(formatter.buffer))
+        {
+            fwrite(data, 1, len, stderr);
+            return;
+        }
+    }
+    memcpy(formatter.buffer + formatter.length, data, len);
+    formatter.length += len;
+}
+
+/*
+ * Format one conversion of a record.  Length modifiers in the format
+ * are ignored, since the width of each argument was recorded with it,
+ * and a conversion that does not suit the recorded argument is replaced
+ * by one that does.
+ */
+static void format_arg(char *out, size_t size, const char *spec, size_t spec_len,
+                       char conv, int type, JLOG_VALUE *v, JLOG_RECORD *rec)
+{
+    char fmt[32];
+    if (spec_len > sizeof(fmt) - 4)
+    {
+        spec_len = sizeof(fmt) - 4;
+    }
+    memcpy(fmt, spec, spec_len);
+    switch (type)
+    {
+    case JLOG_ARG_DOUBLE:
+        fmt[spec_len] = strchr("fFeEgGaA", conv) ? conv : 'g';
+        fmt[spec_len + 1] = '\0';
+        snprintf(out, size, fmt, v->d);
+        break;
+    case JLOG_ARG_STR:
+        fmt[spec_len] = 's';
+        fmt[spec_len + 1] = '\0';
+        snprintf(out, size, fmt, rec->strings + v->str);
+        break;
+    case JLOG_ARG_PTR:
+        fmt[spec_len] = 'p';
+        fmt[spec_len + 1] = '\0';
+        snprintf(out, size, fmt, v->p);
+        break;
+    default:
+        fmt[spec_len] = 'l';
+        fmt[spec_len + 1] = 'l';
+        if (strchr("diouxXc", conv) == NULL)
+        {
+            conv = (type == JLOG_ARG_INT || type == JLOG_ARG_LONG || type == JLOG_ARG_LLONG) ? 'd' : 'u';
+        }
+        if (conv == 'c')
+        {
+            fmt[spec_len] = 'c';
+            fmt[spec_len + 1] = '\0';
+            snprintf(out, size, fmt, (int)v->i);
+            break;
+        }
+        fmt[spec_len + 2] = conv;
+        fmt[spec_len + 3] = '\0';
+        snprintf(out, size, fmt, v->i);
+        break;
+    }
+}
+
+static void format_record(JLOG_RING *ring, JLOG_RECORD *rec)
+{
+    const JLOG_SITE *site = rec->site;
+    char line[1024];
+    size_t len = snprintf(line, sizeof(line), "%lu.%06lu %-5s [%ld] %s:%d %s: ",
+                          (unsigned long)(rec->timestamp_ns / 1000000000ULL),
+                          (unsigned long)(rec->timestamp_ns % 1000000000ULL / 1000),
+                          level_names[site->level], ring->tid,
+                          site->file, site->line, site->func);
+
+    const char *p = site->format;
+    int arg = 0;
+    while (*p != '\0' && len < sizeof(line) - 2)
+    {
+        if (*p != '%')
+        {
+            line[len++] = *p++;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            line[len++] = '%';
+            p += 2;
+            continue;
+        }
+        const char *spec = p++;
+        while (*p != '\0' && strchr("-+ #0123456789.", *p))
+        {
+            p++;
+        }
+        size_t spec_len = p - spec;
+        while (*p != '\0' && strchr("hlLqjzt", *p))
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            break;
+        }
+        char conv = *p++;
+        if (arg >= site->nargs)
+        {
+            continue;
+        }
+        format_arg(line + len, sizeof(line) - 1 - len, spec, spec_len, conv,
+                   site->types[arg], &rec->args[arg], rec);
+        arg++;
+        len += strlen(line + len);
+    }
+    line[len++] = '\n';
+    output(line, len);
+}
+
+/*
+ * Format every record available in every ring.
+ *
+ * @return  The number of records formatted.
+ */
+static unsigned long drain(void)
+{
+    unsigned long count = 0;
+    for (JLOG_RING *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
+        for (; tail != head; tail++)
+        {
+            format_record(ring, &ring->records[tail & (JLOG_RING_RECORDS - 1)]);
+            count++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (formatter.length > 0)
+    {
+        fwrite(formatter.buffer, 1, formatter.length, stderr);
+        fflush(stderr);
+        formatter.length = 0;
+    }
+    return count;
+}
+
+static void *formatter_thread(void *arg)
+{
+    while (!__atomic_load_n(&formatter.stop, __ATOMIC_ACQUIRE))
+    {
+        if (drain() == 0)
+        {
+            struct timespec delay = { 0, JLOG_FLUSH_INTERVAL_MS * 1000000L };
+            nanosleep(&delay, NULL);
+        }
+    }
+    drain();
+    return NULL;
+}
+
+/*
+ * Start the thread that formats log records.  Records written before
+ * this is called are kept (up to the capacity of each ring) and output
+ * once it has started.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int jlog_init(void)
+{
+    if (pthread_create(&formatter.thread, NULL, formatter_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    formatter.running = 1;
+    return 0;
+}
+
+/*
+ * Output all remaining records and stop the formatter.  The rings are
+ * not freed, because threads that are still running may log again.
+ */
+void jlog_fini(void)
+{
+    if (!formatter.running)
+    {
+        return;
+    }
+    __atomic_store_n(&formatter.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(formatter.thread, NULL);
+    formatter.running = 0;
+
+    unsigned long dropped = 0;
+    for (JLOG_RING *ring = rings; ring != NULL; ring = ring->next)
+    {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    if (dropped > 0)
+    {
+        fprintf(stderr, "jlog: %lu records dropped\n", dropped);
+    }
+}
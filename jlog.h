@@ -0,0 +1,126 @@
+#ifndef JLOG_H
+#define JLOG_H
+
+#include <stdint.h>
+
+/*
+ * Leveled logging for the hot paths of the server.
+ *
+ * A log statement does not format anything: it copies its arguments,
+ * together with a pointer to a static description of the call site
+ * (level, format, file, function, line), into a fixed-size record in a
+ * ring buffer owned by the calling thread.  A background thread drains
+ * the rings of all threads, formats the records and writes them to
+ * stderr.  If a thread's ring is full the record is dropped and counted,
+ * so logging never blocks the caller.
+ *
+ * Statements below JLOG_LEVEL are removed at compile time.  JLOG_LEVEL
+ * defaults to JLOG_LEVEL_TRACE in a DEBUG build and JLOG_LEVEL_INFO
+ * otherwise.
+ *
+ * Arguments may be integers, doubles, strings (char *, copied into the
+ * record and truncated if necessary) or pointers (printed with %p).
+ * At most JLOG_MAX_ARGS arguments are allowed, and '*' widths and
+ * precisions are not supported.
+ */
+
+#define JLOG_LEVEL_TRACE 0
+#define JLOG_LEVEL_DEBUG 1
+#define JLOG_LEVEL_INFO 2
+#define JLOG_LEVEL_WARN 3
+#define JLOG_LEVEL_ERROR 4
+
+#ifndef JLOG_LEVEL
+#ifdef DEBUG
+#define JLOG_LEVEL JLOG_LEVEL_TRACE
+#else
+#define JLOG_LEVEL JLOG_LEVEL_INFO
+#endif
+#endif
+
+#define JLOG_MAX_ARGS 6
+#define JLOG_RECORD_SIZE 256
+#define JLOG_RING_RECORDS 256         // Per thread; must be a power of two
+#define JLOG_FLUSH_INTERVAL_MS 20
+
+typedef enum {
+    JLOG_ARG_INT, JLOG_ARG_UINT, JLOG_ARG_LONG, JLOG_ARG_ULONG,
+    JLOG_ARG_LLONG, JLOG_ARG_ULLONG, JLOG_ARG_DOUBLE, JLOG_ARG_STR, JLOG_ARG_PTR
+} JLOG_ARG_TYPE;
+
+typedef struct jlog_site {
+    int level;
+    int line;
+    const char *format;
+    const char *file;
+    const char *func;
+    int nargs;
+    unsigned char types[JLOG_MAX_ARGS];
+} JLOG_SITE;
+
+int jlog_init(void);
+void jlog_fini(void);
+void jlog_write(const JLOG_SITE *site, ...);
+
+#define JLOG_TYPE(x) _Generic((x),                                      \
+    _Bool: JLOG_ARG_INT, char: JLOG_ARG_INT,                            \
+    signed char: JLOG_ARG_INT, unsigned char: JLOG_ARG_INT,             \
+    short: JLOG_ARG_INT, unsigned short: JLOG_ARG_INT,                  \
+    int: JLOG_ARG_INT, unsigned int: JLOG_ARG_UINT,                     \
+    long: JLOG_ARG_LONG, unsigned long: JLOG_ARG_ULONG,                 \
+    long long: JLOG_ARG_LLONG, unsigned long long: JLOG_ARG_ULLONG,     \
+    float: JLOG_ARG_DOUBLE, double: JLOG_ARG_DOUBLE,                    \
+    char *: JLOG_ARG_STR, const char *: JLOG_ARG_STR,                   \
+    default: JLOG_ARG_PTR)
+
+#define JLOG_NARGS(...) JLOG_NARGS_(_, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define JLOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, n, ...) n
+
+#define JLOG_TYPES(...) JLOG_TYPES_(JLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+#define JLOG_TYPES_(n, ...) JLOG_TYPES__(n, ##__VA_ARGS__)
+#define JLOG_TYPES__(n, ...) JLOG_TYPES_##n(__VA_ARGS__)
+#define JLOG_TYPES_0()
+#define JLOG_TYPES_1(a) JLOG_TYPE(a)
+#define JLOG_TYPES_2(a, ...) JLOG_TYPE(a), JLOG_TYPES_1(__VA_ARGS__)
+#define JLOG_TYPES_3(a, ...) JLOG_TYPE(a), JLOG_TYPES_2(__VA_ARGS__)
+#define JLOG_TYPES_4(a, ...) JLOG_TYPE(a), JLOG_TYPES_3(__VA_ARGS__)
+#define JLOG_TYPES_5(a, ...) JLOG_TYPE(a), JLOG_TYPES_4(__VA_ARGS__)
+#define JLOG_TYPES_6(a, ...) JLOG_TYPE(a), JLOG_TYPES_5(__VA_ARGS__)
+
+#define JLOG_EMIT(lvl, fmt, ...) do {                                   \
+    static const JLOG_SITE _jlog_site = {                               \
+        lvl, __LINE__, fmt, __FILE__, __func__,                         \
+        JLOG_NARGS(__VA_ARGS__), { JLOG_TYPES(__VA_ARGS__) }            \
+    };                                                                  \
+    jlog_write(&_jlog_site, ##__VA_ARGS__);                             \
+} while (0)
+
+#define JLOG_DISCARD(fmt, ...) do { } while (0)
+
+#if JLOG_LEVEL <= JLOG_LEVEL_TRACE
+#define jlog_trace(fmt, ...) JLOG_EMIT(JLOG_LEVEL_TRACE, fmt, ##__VA_ARGS__)
+#else
+#define jlog_trace(fmt, ...) JLOG_DISCARD(fmt, ##__VA_ARGS__)
+#endif
+
+#if JLOG_LEVEL <= JLOG_LEVEL_DEBUG
+#define jlog_debug(fmt, ...) JLOG_EMIT(JLOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define jlog_debug(fmt, ...) JLOG_DISCARD(fmt, ##__VA_ARGS__)
+#endif
+
+#if JLOG_LEVEL <= JLOG_LEVEL_INFO
+#define jlog_info(fmt, ...) JLOG_EMIT(JLOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+#define jlog_info(fmt, ...) JLOG_DISCARD(fmt, ##__VA_ARGS__)
+#endif
+
+#if JLOG_LEVEL <= JLOG_LEVEL_WARN
+#define jlog_warn(fmt, ...) JLOG_EMIT(JLOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#else
+#define jlog_warn(fmt, ...) JLOG_DISCARD(fmt, ##__VA_ARGS__)
+#endif
+
+#define jlog_error(fmt, ...) JLOG_EMIT(JLOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,244 @@
+#ifdef LOCK_PROFILE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "lock_profile.h"
+#include "jlog.h"
+
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+
+/*
+ * Locks held by the current thread, with the site that acquired each
+ * one and when, so that the hold time can be charged to that site when
+ * the lock is released.
+ */
+typedef struct held_lock {
+    pthread_mutex_t *mutex;
+    LPROF_SITE *site;
+    unsigned long acquired_ns;
+} HELD_LOCK;
+
+static __thread HELD_LOCK held[LPROF_MAX_HELD];
+static __thread int held_count;
+
+static LPROF_SITE *sites;           // Lock-free list of sites seen so far
+static sem_t report_sem;
+static pthread_t report_thread;
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void update_max(unsigned long *maxp, unsigned long value)
+{
+    unsigned long max = __atomic_load_n(maxp, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(maxp, &max, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void register_site(LPROF_SITE *site)
+{
+    if (__atomic_exchange_n(&site->registered, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+    LPROF_SITE *head = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    do
+    {
+        site->next = head;
+    } while (!__atomic_compare_exchange_n(&sites, &head, site, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Acquire a mutex on behalf of a call site.  An uncontended acquisition
+ * costs one trylock and one clock read.
+ */
+int lprof_mutex_lock(pthread_mutex_t *mutex, LPROF_SITE *site)
+{
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE))
+    {
+        register_site(site);
+    }
+
+    int ret = pthread_mutex_trylock(mutex);
+    unsigned long acquired;
+    if (ret == EBUSY)
+    {
+        unsigned long start = now_ns();
+        ret = pthread_mutex_lock(mutex);
+        acquired = now_ns();
+        if (ret != 0)
+        {
+            return ret;
+        }
+        unsigned long wait = acquired - start;
+        __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&site->wait_ns, wait, __ATOMIC_RELAXED);
+        update_max(&site->wait_max_ns, wait);
+    }
+    else if (ret != 0)
+    {
+        return ret;
+    }
+    else
+    {
+        acquired = now_ns();
+    }
+    __atomic_fetch_add(&site->acquisitions, 1, __ATOMIC_RELAXED);
+
+    if (held_count < LPROF_MAX_HELD)
+    {
+        held[held_count].mutex = mutex;
+        held[held_count].site = site;
+        held[held_count].acquired_ns = acquired;
+        held_count++;
+    }
+    return 0;
+}
+
+/*
+ * Release a mutex, charging the time it was held to the site that
+ * acquired it.
+ */
+int lprof_mutex_unlock(pthread_mutex_t *mutex)
+{
+    for (int i = held_count - 1; i >= 0; i--)
+    {
+        if (held[i].mutex == mutex)
+        {
+            unsigned long hold = now_ns() - held[i].acquired_ns;
+            LPROF_SITE *site = held[i].site;
+            __atomic_fetch_add(&site->hold_ns, hold, __ATOMIC_RELAXED);
+            update_max(&site->hold_max_ns, hold);
+            memmove(&held[i], &held[i + 1], (held_count - i - 1) * sizeof(HELD_LOCK));
+            held_count--;
+            break;
+        }
+    }
+    return pthread_mutex_unlock(mutex);
+}
+
+static int compare_wait(const void *a, const void *b)
+{
+    const LPROF_SITE *sa = a;
+    const LPROF_SITE *sb = b;
+    if (sa->wait_ns != sb->wait_ns)
+    {
+        return sa->wait_ns < sb->wait_ns ? 1 : -1;
+    }
+    return sa->hold_ns < sb->hold_ns ? 1 : sa->hold_ns > sb->hold_ns ? -1 : 0;
+}
+
+/*
+ * Write the report to stderr, one line per call site, sorted by total
+ * wait time and then by total hold time.  Times are in microseconds.
+ */
+void lprof_report(void)
+{
+    int count = 0;
+    for (LPROF_SITE *s = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); s != NULL; s = s->next)
+    {
+        count++;
+    }
+    LPROF_SITE *snapshot = malloc((count ? count : 1) * sizeof(LPROF_SITE));
+    if (snapshot == NULL)
+    {
+        return;
+    }
+    int n = 0;
+    for (LPROF_SITE *s = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); s != NULL && n < count; s = s->next)
+    {
+        LPROF_SITE *copy = &snapshot[n++];
+        copy->lock = s->lock;
+        copy->file = s->file;
+        copy->line = s->line;
+        copy->acquisitions = __atomic_load_n(&s->acquisitions, __ATOMIC_RELAXED);
+        copy->contended = __atomic_load_n(&s->contended, __ATOMIC_RELAXED);
+        copy->wait_ns = __atomic_load_n(&s->wait_ns, __ATOMIC_RELAXED);
+        copy->wait_max_ns = __atomic_load_n(&s->wait_max_ns, __ATOMIC_RELAXED);
+        copy->hold_ns = __atomic_load_n(&s->hold_ns, __ATOMIC_RELAXED);
+        copy->hold_max_ns = __atomic_load_n(&s->hold_max_ns, __ATOMIC_RELAXED);
+    }
+    qsort(snapshot, n, sizeof(LPROF_SITE), compare_wait);
+
+    fprintf(stderr, "%-24s %-28s %10s %10s %12s %10s %12s %10s\n",
+            "lock", "site", "acquired", "contended",
+            "wait_us", "wait_max", "hold_us", "hold_max");
+    for (int i = 0; i < n; i++)
+    {
+        LPROF_SITE *s = &snapshot[i];
+        char where[64];
+        snprintf(where, sizeof(where), "%s:%d", s->file, s->line);
+        fprintf(stderr, "%-24s %-28s %10lu %10lu %12lu %10lu %12lu %10lu\n",
+                s->lock, where, s->acquisitions, s->contended,
+                s->wait_ns / 1000, s->wait_max_ns / 1000,
+                s->hold_ns / 1000, s->hold_max_ns / 1000);
+    }
+    fflush(stderr);
+    free(snapshot);
+}
+
+static void sigusr1_handler(int signal_num)
+{
+    sem_post(&report_sem);
+}
+
+static void *report_thread_func(void *arg)
+{
+    while (1)
+    {
+        if (sem_wait(&report_sem) == 0)
+        {
+            lprof_report();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Install the SIGUSR1 handler and start the thread that writes reports.
+ * The report is not written by the handler itself, because formatting
+ * output is not async-signal-safe.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int lprof_init(void)
+{
+    jlog_trace("enter");
+
+    if (sem_init(&report_sem, 0, 0) != 0)
+    {
+        return -1;
+    }
+    if (pthread_create(&report_thread, NULL, report_thread_func, NULL) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(report_thread);
+
+    struct sigaction sa;
+    sa.sa_handler = sigusr1_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef LOCK_PROFILE_H
+#define LOCK_PROFILE_H
+
+/*
+ * Lock contention profiler.
+ *
+ * When the server is compiled with -DLOCK_PROFILE, every
+ * pthread_mutex_lock()/pthread_mutex_unlock() in a file that includes
+ * this header (after <pthread.h>) goes through the profiler instead.
+ * Statistics are kept per call site, and each site is labelled with the
+ * lock expression at that site (e.g. "cr->mutex", "&client->lock"), so
+ * sites can be grouped by the lock they take.  For each site the
+ * profiler counts acquisitions and contended acquisitions and
+ * accumulates the time spent waiting for the lock and the time it was
+ * held once acquired.  Sending the server SIGUSR1 writes a report to
+ * stderr with the sites sorted by total wait time.
+ *
+ * Without -DLOCK_PROFILE this header defines nothing and the mutex
+ * calls are untouched.
+ */
+
+#ifdef LOCK_PROFILE
+
+#include <pthread.h>
+
+#define LPROF_MAX_HELD 16
+
+typedef struct lprof_site {
+    const char *lock;               // Lock expression at the call site
+    const char *file;
+    int line;
+    int registered;
+    unsigned long acquisitions;
+    unsigned long contended;
+    unsigned long wait_ns;
+    unsigned long wait_max_ns;
+    unsigned long hold_ns;
+    unsigned long hold_max_ns;
+    struct lprof_site *next;
+} LPROF_SITE;
+
+int lprof_init(void);
+int lprof_mutex_lock(pthread_mutex_t *mutex, LPROF_SITE *site);
+int lprof_mutex_unlock(pthread_mutex_t *mutex);
+void lprof_report(void);
+
+#define pthread_mutex_lock(m) ({                                        \
+    static LPROF_SITE _lprof_site = { #m, __FILE__, __LINE__ };         \
+    lprof_mutex_lock((m), &_lprof_site);                                \
+})
+#define pthread_mutex_unlock(m) lprof_mutex_unlock(m)
+
+#endif
+
+#endif
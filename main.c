@@ -6,14 +6,34 @@
 #include <errno.h>
 #include <signal.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
 
-#include "debug.h"
 #include "protocol.h"
 #include "server.h"
 #include "client_registry.h"
 #include "player_registry.h"
+#include "rating_journal.h"
+#include "player_store.h"
+#include "game_log.h"
+#include "rating_worker.h"
+#include "glicko.h"
+#include "server_stats.h"
+#include "lock_profile.h"
+#include "jlog.h"
+#include "timer_wheel.h"
+#include "handoff.h"
+#include "matchmaking.h"
+#include "spectate.h"
+#include "tournament.h"
+#include "bot.h"
+#include "chat.h"
+#include "io_loop.h"
 #include "jeux_globals.h"
 #include "csapp.h"
 
@@ -22,19 +42,88 @@ int _debug_packets_ = 1;
 #endif
 
 static void terminate(int status);
+static void finalize_results(void);
 
 /*
  * "Jeux" game server.
  *
- * Usage: jeux <port>
+ * Usage: jeux -p <port> [-d <data_dir>] [-g <game_log_dir>] [-r elo|glicko2]
+ *             [-s <stats_file>] [-t <drain_seconds>] [-u <handoff_socket>]
+ *             [-l <local_socket>] [-i uring|epoll] [-c <shards>]
  */
 
+/*
+ * Time allowed for connections to drain after SIGHUP before they are
+ * cut off, and then for their sessions to end.
+ */
+#define DRAIN_TIMEOUT_SECONDS 30
+#define DRAIN_GRACE_SECONDS 2
+
+static volatile sig_atomic_t drain_requested;
+static int listenfd = -1;
+static int localfd = -1;
+static int drain_timeout = DRAIN_TIMEOUT_SECONDS;
+static int wakeup_pipe[2] = {-1, -1};
+
+/*
+ * SIGHUP starts a graceful shutdown.  Writing to the wakeup pipe wakes
+ * the main thread, whichever thread the signal was delivered to, and
+ * the main thread then calls terminate().  (The listening socket is not
+ * shut down, as it may be shared with a successor; see handoff.h.)
+ */
 void sighup_handler(int signal_num)
 {
-    exit(EXIT_SUCCESS);
+    int saved_errno = errno;
+    drain_requested = 1;
+    if (write(wakeup_pipe[1], "", 1) < 0)
+    {
+        // The pipe is already full, so the main thread will wake
+    }
+    errno = saved_errno;
 }
 
 static char *PORT_NUM;
+static char *DATA_DIR;
+static char *GAME_LOG_DIR;
+static char *RATING_SYSTEM;
+static char *STATS_FILE;
+static char *DRAIN_SECONDS;
+static char *HANDOFF_SOCKET;
+static char *LOCAL_SOCKET;
+static char *IO_BACKEND;
+static char *IO_SHARDS;
+
+/*
+ * Open a listening Unix domain socket for clients on the same host,
+ * replacing any stale socket at the path.  Connections accepted on it
+ * are served exactly like TCP connections.
+ *
+ * @return the socket, or -1 if it cannot be opened.
+ */
+static int open_local_listenfd(char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (SA *)&addr, sizeof(addr)) < 0 || listen(fd, LISTENQ) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 int main(int argc, char *argv[])
 {
     // Option processing should be performed here.
@@ -50,6 +139,78 @@ int main(int argc, char *argv[])
                 PORT_NUM = argv[i + 1];
             }
         }
+        // Option '-d <dir>' makes player ratings persistent across restarts.
+        else if (strcmp(argv[i], "-d") == 0)
+        {
+            if (argv[i + 1] != NULL)
+            {
+                DATA_DIR = argv[i + 1];
+            }
+        }
+        // Option '-g <dir>' records every finished game in a binary log.
+        else if (strcmp(argv[i], "-g") == 0)
+        {
+            if (argv[i + 1] != NULL)
+            {
+                GAME_LOG_DIR = argv[i + 1];
+            }
+        }
+        // Option '-r <system>' selects the rating system (default "elo").
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            if (argv[i + 1] != NULL)
+            {
+                RATING_SYSTEM = argv[i + 1];
+            }
+        }
+        // Option '-s <file>' periodically writes packet statistics to a file.
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            if (argv[i + 1] != NULL)
+            {
+                STATS_FILE = argv[i + 1];
+            }
+        }
+        // Option '-t <seconds>' bounds the time taken to drain on SIGHUP.
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            if (argv[i + 1] != NULL)
+            {
+                DRAIN_SECONDS = argv[i + 1];
+            }
+        }
+        // Option '-u <path>' enables hot restart through a Unix domain socket.
+        else if (strcmp(argv[i], "-u") == 0)
+        {
+            if (argv[i + 1] != NULL)
+            {
+                HANDOFF_SOCKET = argv[i + 1];
+            }
+        }
+        // Option '-l <path>' also accepts clients on a Unix domain socket.
+        else if (strcmp(argv[i], "-l") == 0)
+        {
+            if (argv[i + 1] != NULL)
+            {
+                LOCAL_SOCKET = argv[i + 1];
+            }
+        }
+        // Option '-i <backend>' selects the event loop's backend (io_loop.h).
+        else if (strcmp(argv[i], "-i") == 0)
+        {
+            if (argv[i + 1] != NULL)
+            {
+                IO_BACKEND = argv[i + 1];
+            }
+        }
+        // Option '-c <n>' runs n event loop shards instead of one per CPU.
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            if (argv[i + 1] != NULL)
+            {
+                IO_SHARDS = argv[i + 1];
+            }
+        }
     }
 
     // if there's no specified port number
@@ -57,6 +218,40 @@ int main(int argc, char *argv[])
     {
         exit(EXIT_FAILURE);
     }
+    if (RATING_SYSTEM != NULL && strcmp(RATING_SYSTEM, "elo") != 0 &&
+        strcmp(RATING_SYSTEM, "glicko2") != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (DRAIN_SECONDS != NULL && (drain_timeout = atoi(DRAIN_SECONDS)) <= 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    int io_shards = 0;
+    if (IO_SHARDS != NULL && (io_shards = atoi(IO_SHARDS)) <= 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (jlog_init() != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (pipe(wakeup_pipe) != 0 ||
+        fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK) != 0)
+    {
+        jlog_error("cannot create the wakeup pipe: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Take over from a running server, if there is one.  This returns
+    // once that server has made its ratings durable, so it must come
+    // before the modules below load them.
+    if (HANDOFF_SOCKET != NULL && handoff_receive(HANDOFF_SOCKET, &listenfd, &localfd) < 0)
+    {
+        jlog_error("cannot take over from the server at %s", HANDOFF_SOCKET);
+        exit(EXIT_FAILURE);
+    }
 
     // Install SIGHUP handler
     struct sigaction sa;
@@ -66,7 +261,7 @@ int main(int argc, char *argv[])
 
     if (sigaction(SIGHUP, &sa, NULL) == -1)
     {
-        // perror("Error: sigaction()");
+        jlog_error("cannot install the SIGHUP handler: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -75,46 +270,266 @@ int main(int argc, char *argv[])
     client_registry = creg_init();
     player_registry = preg_init();
 
-    // TODO: Set up the server socket and enter a loop to accept connections
-    // on this socket.  For each connection, a thread should be started to
-    // run function jeux_client_service().  In addition, you should install
-    // a SIGHUP handler, so that receipt of SIGHUP will perform a clean
-    // shutdown of the server.
+    if (DATA_DIR != NULL &&
+        (pstore_open(DATA_DIR) != 0 || rjournal_init(DATA_DIR, player_registry) != 0))
+    {
+        jlog_error("cannot load the ratings in %s", DATA_DIR);
+        exit(EXIT_FAILURE);
+    }
+    if (GAME_LOG_DIR != NULL && glog_init(GAME_LOG_DIR) != 0)
+    {
+        jlog_error("cannot open the game log in %s", GAME_LOG_DIR);
+        exit(EXIT_FAILURE);
+    }
+    if (RATING_SYSTEM != NULL && strcmp(RATING_SYSTEM, "glicko2") == 0 && glicko_init() != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (twheel_init() != 0)
+    {
+        jlog_error("cannot start the timer wheel");
+        exit(EXIT_FAILURE);
+    }
+    if (rworker_init() != 0)
+    {
+        jlog_error("cannot start the rating worker");
+        exit(EXIT_FAILURE);
+    }
+    if (mm_init() != 0)
+    {
+        jlog_error("cannot start matchmaking");
+        exit(EXIT_FAILURE);
+    }
+    if (spect_init() != 0)
+    {
+        jlog_error("cannot start spectating");
+        exit(EXIT_FAILURE);
+    }
+    if (tourney_init() != 0)
+    {
+        jlog_error("cannot start tournaments");
+        exit(EXIT_FAILURE);
+    }
+    if (bot_init() != 0)
+    {
+        jlog_error("cannot start the computer player");
+        exit(EXIT_FAILURE);
+    }
+    if (STATS_FILE != NULL && stats_init(STATS_FILE) != 0)
+    {
+        jlog_error("cannot write statistics to %s", STATS_FILE);
+        exit(EXIT_FAILURE);
+    }
+#ifdef LOCK_PROFILE
+    if (lprof_init() != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    // Set up the server sockets.  Connections on them are accepted and
+    // served by the event loop (see io_loop.h), while this thread waits
+    // for SIGHUP or a handoff.
+    if (listenfd < 0)
+    {
+        listenfd = open_listenfd(PORT_NUM);
+    }
+    if (listenfd < 0)
+    {
+        jlog_error("cannot listen on port %s", PORT_NUM);
+        exit(EXIT_FAILURE);
+    }
+    // A local socket received from a predecessor is kept only if wanted
+    if (localfd >= 0 && LOCAL_SOCKET == NULL)
+    {
+        close(localfd);
+        localfd = -1;
+    }
+    if (LOCAL_SOCKET != NULL && localfd < 0 &&
+        (localfd = open_local_listenfd(LOCAL_SOCKET)) < 0)
+    {
+        jlog_error("cannot listen on %s", LOCAL_SOCKET);
+        exit(EXIT_FAILURE);
+    }
+    if (ioloop_init(IO_BACKEND != NULL ? IO_BACKEND : "uring", io_shards) != 0)
+    {
+        jlog_error("cannot start the %s event loop", IO_BACKEND != NULL ? IO_BACKEND : "uring");
+        exit(EXIT_FAILURE);
+    }
+    if (HANDOFF_SOCKET != NULL)
+    {
+        if (handoff_listen(HANDOFF_SOCKET, listenfd, localfd, finalize_results) != 0)
+        {
+            jlog_error("cannot listen for a successor on %s", HANDOFF_SOCKET);
+            exit(EXIT_FAILURE);
+        }
+        handoff_restore();
+    }
+    int listenfds[2] = {listenfd, localfd};
+    if (ioloop_start(listenfds, localfd >= 0 ? 2 : 1) != 0)
+    {
+        jlog_error("cannot start accepting connections");
+        exit(EXIT_FAILURE);
+    }
 
-    int listenfd, *connfdp;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
-    listenfd = open_listenfd(PORT_NUM);
-    while (1)
+    // Poll ignores the handoff entry if there is no handoff listener (fd -1)
+    struct pollfd fds[2] = {
+        {.fd = wakeup_pipe[0], .events = POLLIN},
+        {.fd = handoff_pending_fd(), .events = POLLIN}
+    };
+    while (!drain_requested && !handoff_started())
     {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfdp = malloc(sizeof(int));
-        *connfdp = accept(listenfd,
-                          (SA *)&clientaddr, &clientlen);
-        pthread_create(&tid, NULL, jeux_client_service, connfdp);
+        poll(fds, 2, -1);
     }
 
-    terminate(EXIT_FAILURE);
+    if (handoff_started())
+    {
+        // The handoff thread sends everything to the successor and exits
+        ioloop_stop_accepting();
+        ioloop_hand_off();
+        handoff_accept_stopped();
+        while (1)
+        {
+            pause();
+        }
+    }
+    terminate(EXIT_SUCCESS);
 }
 
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static int drained;
+static int forced;
+
 /*
- * Function called to cleanly shut down the server.
+ * Make rating results and game records that have been produced so far
+ * durable.
+ */
+static void finalize_results(void)
+{
+    glog_fini();
+    rworker_fini();
+    glicko_fini();
+    rjournal_fini();
+    pstore_close();
+}
+
+static int wait_drained(int seconds)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+    int rc = 0;
+    pthread_mutex_lock(&drain_mutex);
+    while (!drained && rc != ETIMEDOUT)
+    {
+        rc = pthread_cond_timedwait(&drain_cond, &drain_mutex, &deadline);
+    }
+    int done = drained;
+    pthread_mutex_unlock(&drain_mutex);
+    return done;
+}
+
+/*
+ * Bound the time taken by terminate().  If the clients have not all gone
+ * after the drain timeout, their connections are cut off completely,
+ * which also ends sessions whose output a client is not reading.  If
+ * that does not finish the drain either, results are
+ * made durable and the process exits without waiting any longer.
+ */
+static void *drain_watchdog(void *arg)
+{
+    int status = *(int *)arg;
+    if (wait_drained(drain_timeout))
+    {
+        return NULL;
+    }
+    jlog_warn("drain timed out after %d s, closing remaining connections", drain_timeout);
+    pthread_mutex_lock(&client_registry->mutex);
+    for (CLIENT_NODE *p = client_registry->head; p != NULL; p = p->next)
+    {
+        shutdown(p->client->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&client_registry->mutex);
+
+    if (wait_drained(DRAIN_GRACE_SECONDS))
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&drain_mutex);
+    if (drained)
+    {
+        pthread_mutex_unlock(&drain_mutex);
+        return NULL;
+    }
+    forced = 1;
+    pthread_mutex_unlock(&drain_mutex);
+
+    jlog_error("sessions did not end, exiting");
+    finalize_results();
+    jlog_fini();
+    _exit(status);
+}
+
+/*
+ * Function called to cleanly shut down the server.  No new connections
+ * are accepted, reading is shut down on every client connection, and
+ * the packets that have already been received are handled before the
+ * event loop sees EOF and logs their clients out.  The
+ * whole drain is bounded by the drain timeout (see drain_watchdog()).
  */
 void terminate(int status)
 {
+    ioloop_stop_accepting();
+    if (listenfd >= 0)
+    {
+        close(listenfd);
+    }
+    if (localfd >= 0)
+    {
+        close(localfd);
+        unlink(LOCAL_SOCKET);
+    }
+
+    pthread_t watchdog;
+    if (pthread_create(&watchdog, NULL, drain_watchdog, &status) == 0)
+    {
+        pthread_detach(watchdog);
+    }
+
     // Shutdown all client connections.
-    // This will trigger the eventual termination of service threads.
+    // This will trigger the eventual end of their sessions.
     creg_shutdown_all(client_registry);
 
-    debug("%ld: Waiting for service threads to terminate...", pthread_self());
+    jlog_info("waiting for sessions to end");
     creg_wait_for_empty(client_registry);
-    debug("%ld: All service threads terminated.", pthread_self());
+    jlog_info("all sessions ended");
+
+    pthread_mutex_lock(&drain_mutex);
+    if (forced)
+    {
+        // The watchdog is finalizing and will exit
+        pthread_mutex_unlock(&drain_mutex);
+        pause();
+    }
+    drained = 1;
+    pthread_cond_broadcast(&drain_cond);
+    pthread_mutex_unlock(&drain_mutex);
 
     // Finalize modules.
+    ioloop_fini();
     creg_fini(client_registry);
+    mm_fini();
+    spect_fini();
+    tourney_fini();
+    bot_fini();
+    chat_fini();
+    twheel_fini();
+    stats_fini();
+    finalize_results();
     preg_fini(player_registry);
 
-    debug("%ld: Jeux server terminating", pthread_self());
+    jlog_info("server terminating with status %d", status);
+    jlog_fini();
     exit(status);
 }
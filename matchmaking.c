@@ -0,0 +1,438 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "matchmaking.h"
+#include "global.h"
+#include "jlog.h"
+
+#define MM_WORDS (MM_BUCKETS / 64)
+
+typedef struct seeker {
+    CLIENT *client;
+    int rating;
+    int bucket;
+    unsigned long since;            // When the client was queued, in ms
+    struct seeker *prev;            // Queue of all seekers, oldest first
+    struct seeker *next;
+    struct seeker *bucket_prev;     // Seekers in the same bucket, oldest first
+    struct seeker *bucket_next;
+    struct seeker *hash_next;       // Lookup by CLIENT, for mm_cancel()
+    struct seeker *partner;         // Set when paired
+} SEEKER;
+
+static struct {
+    SEEKER *head;
+    SEEKER *tail;
+    SEEKER *bucket_head[MM_BUCKETS];
+    SEEKER *bucket_tail[MM_BUCKETS];
+    uint64_t bits[MM_WORDS];        // Buckets that are not empty
+    uint64_t summary;               // Words of "bits" that are not zero
+    SEEKER *hash[MM_HASH_BUCKETS];
+    unsigned long count;
+    int running;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+} mm = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static unsigned long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static SEEKER **hash_slot(CLIENT *client)
+{
+    uintptr_t h = (uintptr_t)client;
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return &mm.hash[(h >> 32) & (MM_HASH_BUCKETS - 1)];
+}
+
+static void mark(int bucket)
+{
+    mm.bits[bucket >> 6] |= 1ULL << (bucket & 63);
+    mm.summary |= 1ULL << (bucket >> 6);
+}
+
+static void unmark(int bucket)
+{
+    mm.bits[bucket >> 6] &= ~(1ULL << (bucket & 63));
+    if (mm.bits[bucket >> 6] == 0)
+    {
+        mm.summary &= ~(1ULL << (bucket >> 6));
+    }
+}
+
+/*
+ * @return the lowest non-empty bucket at or above "bucket", or -1.
+ */
+static int next_bucket(int bucket)
+{
+    if (bucket >= MM_BUCKETS)
+    {
+        return -1;
+    }
+    int word = bucket >> 6;
+    uint64_t bits = mm.bits[word] & (~0ULL << (bucket & 63));
+    if (bits == 0)
+    {
+        uint64_t words = word == 63 ? 0 : mm.summary & (~0ULL << (word + 1));
+        if (words == 0)
+        {
+            return -1;
+        }
+        word = __builtin_ctzll(words);
+        bits = mm.bits[word];
+    }
+    return (word << 6) + __builtin_ctzll(bits);
+}
+
+/*
+ * @return the highest non-empty bucket at or below "bucket", or -1.
+ */
+static int prev_bucket(int bucket)
+{
+    if (bucket < 0)
+    {
+        return -1;
+    }
+    int word = bucket >> 6;
+    uint64_t bits = mm.bits[word] & (~0ULL >> (63 - (bucket & 63)));
+    if (bits == 0)
+    {
+        uint64_t words = mm.summary & ((1ULL << word) - 1);
+        if (words == 0)
+        {
+            return -1;
+        }
+        word = 63 - __builtin_clzll(words);
+        bits = mm.bits[word];
+    }
+    return (word << 6) + 63 - __builtin_clzll(bits);
+}
+
+// Called with mm.mutex held
+static void enqueue(SEEKER *s)
+{
+    s->next = NULL;
+    s->prev = mm.tail;
+    if (mm.tail != NULL)
+    {
+        mm.tail->next = s;
+    }
+    else
+    {
+        mm.head = s;
+    }
+    mm.tail = s;
+
+    s->bucket_next = NULL;
+    s->bucket_prev = mm.bucket_tail[s->bucket];
+    if (s->bucket_prev != NULL)
+    {
+        s->bucket_prev->bucket_next = s;
+    }
+    else
+    {
+        mm.bucket_head[s->bucket] = s;
+        mark(s->bucket);
+    }
+    mm.bucket_tail[s->bucket] = s;
+
+    SEEKER **slot = hash_slot(s->client);
+    s->hash_next = *slot;
+    *slot = s;
+    mm.count++;
+}
+
+// Called with mm.mutex held
+static void dequeue(SEEKER *s)
+{
+    if (s->prev != NULL)
+    {
+        s->prev->next = s->next;
+    }
+    else
+    {
+        mm.head = s->next;
+    }
+    if (s->next != NULL)
+    {
+        s->next->prev = s->prev;
+    }
+    else
+    {
+        mm.tail = s->prev;
+    }
+
+    if (s->bucket_prev != NULL)
+    {
+        s->bucket_prev->bucket_next = s->bucket_next;
+    }
+    else
+    {
+        mm.bucket_head[s->bucket] = s->bucket_next;
+    }
+    if (s->bucket_next != NULL)
+    {
+        s->bucket_next->bucket_prev = s->bucket_prev;
+    }
+    else
+    {
+        mm.bucket_tail[s->bucket] = s->bucket_prev;
+    }
+    if (mm.bucket_head[s->bucket] == NULL)
+    {
+        unmark(s->bucket);
+    }
+
+    SEEKER **link = hash_slot(s->client);
+    while (*link != s)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = s->hash_next;
+    mm.count--;
+}
+
+static int distance(SEEKER *a, SEEKER *b)
+{
+    return a->rating > b->rating ? a->rating - b->rating : b->rating - a->rating;
+}
+
+/*
+ * Find a partner for a seeker: the oldest seeker in its own bucket, or
+ * else in the nearest non-empty bucket above or below, if that is within
+ * the seeker's window.  Called with mm.mutex held.
+ */
+static SEEKER *find_partner(SEEKER *s, unsigned long now)
+{
+    unsigned long window = MM_WINDOW_INITIAL + MM_WINDOW_GROWTH * ((now - s->since) / 1000);
+    if (window > MM_WINDOW_MAX)
+    {
+        window = MM_WINDOW_MAX;
+    }
+
+    SEEKER *best = mm.bucket_head[s->bucket];
+    if (best == s)
+    {
+        best = s->bucket_next;
+    }
+    if (best == NULL)
+    {
+        int above = next_bucket(s->bucket + 1);
+        int below = prev_bucket(s->bucket - 1);
+        SEEKER *up = above >= 0 ? mm.bucket_head[above] : NULL;
+        SEEKER *down = below >= 0 ? mm.bucket_head[below] : NULL;
+        best = up;
+        if (best == NULL || (down != NULL && distance(s, down) < distance(s, up)))
+        {
+            best = down;
+        }
+    }
+    return best != NULL && (unsigned long)distance(s, best) <= window ? best : NULL;
+}
+
+/*
+ * Pair off the queue, oldest seeker first.
+ *
+ * @return the list of pairs, linked through "next", each with its
+ * partner, removed from the queue.
+ */
+static SEEKER *pair_seekers(void)
+{
+    SEEKER *pairs = NULL;
+    unsigned long now = now_ms();
+
+    pthread_mutex_lock(&mm.mutex);
+    SEEKER *s = mm.head;
+    while (s != NULL)
+    {
+        SEEKER *partner = find_partner(s, now);
+        if (partner == NULL)
+        {
+            s = s->next;
+            continue;
+        }
+        SEEKER *next = s->next == partner ? partner->next : s->next;
+        dequeue(s);
+        dequeue(partner);
+        s->partner = partner;
+        s->next = pairs;
+        pairs = s;
+        s = next;
+    }
+    pthread_mutex_unlock(&mm.mutex);
+    return pairs;
+}
+
+static void *matcher_thread(void *arg)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while (1)
+    {
+        pthread_mutex_lock(&mm.mutex);
+        while (!mm.stop)
+        {
+            if (pthread_cond_timedwait(&mm.cond, &mm.mutex, &deadline) != 0)
+            {
+                break;
+            }
+        }
+        int stop = mm.stop;
+        pthread_mutex_unlock(&mm.mutex);
+        if (stop)
+        {
+            break;
+        }
+        deadline.tv_nsec += MM_BATCH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        SEEKER *pairs = pair_seekers();
+        while (pairs != NULL)
+        {
+            SEEKER *first = pairs;
+            SEEKER *second = first->partner;
+            pairs = first->next;
+            if (client_start_game(first->client, second->client, NULL) != 0)
+            {
+                // One of them has logged out; the other keeps seeking
+                mm_seek(first->client);
+                mm_seek(second->client);
+            }
+            client_unref(first->client, "matched");
+            client_unref(second->client, "matched");
+            free(first);
+            free(second);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start the matcher thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int mm_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mm.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&mm.thread, NULL, matcher_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    mm.running = 1;
+    return 0;
+}
+
+/*
+ * Stop the matcher thread and empty the queue.
+ */
+void mm_fini(void)
+{
+    if (!mm.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&mm.mutex);
+    mm.stop = 1;
+    pthread_cond_signal(&mm.cond);
+    pthread_mutex_unlock(&mm.mutex);
+    pthread_join(mm.thread, NULL);
+    mm.running = 0;
+
+    while (mm.head != NULL)
+    {
+        SEEKER *s = mm.head;
+        dequeue(s);
+        client_unref(s->client, "matchmaking stopped");
+        free(s);
+    }
+}
+
+/*
+ * Queue a logged-in client to be paired for a game.
+ *
+ * @return 0 if the client has been queued, or -1 if it is not logged in
+ * or is already queued.
+ */
+int mm_seek(CLIENT *client)
+{
+    PLAYER *player = client_get_player(client);
+    if (player == NULL || !mm.running)
+    {
+        return -1;
+    }
+    SEEKER *s = calloc(1, sizeof(SEEKER));
+    if (s == NULL)
+    {
+        return -1;
+    }
+    s->client = client;
+    s->rating = player_get_rating(player);
+    s->bucket = s->rating < 0 ? 0 : s->rating / MM_BUCKET_WIDTH;
+    if (s->bucket >= MM_BUCKETS)
+    {
+        s->bucket = MM_BUCKETS - 1;
+    }
+    s->since = now_ms();
+
+    pthread_mutex_lock(&mm.mutex);
+    SEEKER *other = *hash_slot(client);
+    while (other != NULL && other->client != client)
+    {
+        other = other->hash_next;
+    }
+    if (other != NULL)
+    {
+        pthread_mutex_unlock(&mm.mutex);
+        free(s);
+        return -1;
+    }
+    client_ref(client, "seeking");
+    enqueue(s);
+    pthread_mutex_unlock(&mm.mutex);
+    jlog_debug("queued a seeker rated %d", s->rating);
+    return 0;
+}
+
+/*
+ * Remove a client from the queue, if it is queued.
+ */
+void mm_cancel(CLIENT *client)
+{
+    pthread_mutex_lock(&mm.mutex);
+    SEEKER *s = *hash_slot(client);
+    while (s != NULL && s->client != client)
+    {
+        s = s->hash_next;
+    }
+    if (s != NULL)
+    {
+        dequeue(s);
+    }
+    pthread_mutex_unlock(&mm.mutex);
+
+    if (s != NULL)
+    {
+        client_unref(client, "no longer seeking");
+        free(s);
+    }
+}
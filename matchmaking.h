@@ -0,0 +1,43 @@
+#ifndef MATCHMAKING_H
+#define MATCHMAKING_H
+
+#include "global.h"
+#include "server_stats.h"
+
+/*
+ * Matchmaking queue.
+ *
+ * A logged-in client that sends SEEK (no payload) is queued to be paired
+ * with another seeker of similar rating.  The queue is indexed by rating
+ * in buckets of MM_BUCKET_WIDTH points, with a two-level bitmap of the
+ * buckets that are not empty, so that the nearest seeker to a given
+ * rating is found with a couple of bit scans whatever the size of the
+ * queue.  A matcher thread pairs seekers in batches every MM_BATCH_MS,
+ * oldest first.  A seeker is paired with the oldest seeker in the nearest
+ * bucket, as long as their ratings differ by no more than its window,
+ * which starts at MM_WINDOW_INITIAL and widens by MM_WINDOW_GROWTH for
+ * every second waited, up to MM_WINDOW_MAX.  The older seeker of a pair
+ * plays first.  The game is started directly by client_start_game(),
+ * without INVITE and ACCEPT.
+ *
+ * A client leaves the queue when it is paired or logs out.  SEEK by a
+ * client that is already queued is refused.  The queue is not carried
+ * across a hot restart.
+ */
+
+#define JEUX_SEEK_PKT (JEUX_STATS_PKT + 1)
+
+#define MM_BUCKET_WIDTH 10
+#define MM_BUCKETS 4096                 // Must be a power of 64
+#define MM_HASH_BUCKETS 1024
+#define MM_BATCH_MS 100
+#define MM_WINDOW_INITIAL 50
+#define MM_WINDOW_GROWTH 25
+#define MM_WINDOW_MAX 400
+
+int mm_init(void);
+void mm_fini(void);
+int mm_seek(CLIENT *client);
+void mm_cancel(CLIENT *client);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Received payloads.
+ *
+ * A JEUX_PAYLOAD is a view of the payload of a received packet: "len"
+ * bytes at "data".  For a packet with no payload, "data" is NULL and
+ * "len" is 0.  Otherwise the bytes are followed by a NUL that is not
+ * counted in "len", so a payload that is text can be handed to
+ * functions that take a C string without being copied or scanned.  A
+ * payload may itself contain NULs; payload_text() yields the payload as
+ * a C string only if it does not, so a name such as "alice\0x" cannot
+ * pass for "alice".
+ *
+ * proto_recv_payload() checks the size in the header against
+ * PROTO_MAX_PAYLOAD before allocating anything, and fails, so that the
+ * connection is closed, if it is larger.  No packet of the protocol
+ * needs more.  proto_take_payload() makes a JEUX_PAYLOAD of data that
+ * was received some other way, such as by the event loop (io_loop.h).
+ */
+
+#define PROTO_MAX_PAYLOAD 1024
+
+typedef struct jeux_payload {
+    char *data;
+    size_t len;
+} JEUX_PAYLOAD;
+
+int proto_recv_payload(int fd, JEUX_PACKET_HEADER *hdr, JEUX_PAYLOAD *payload);
+int proto_take_payload(int fd, JEUX_PACKET_HEADER *hdr, char *data, JEUX_PAYLOAD *payload);
+char *payload_text(JEUX_PAYLOAD *payload);
+void payload_free(JEUX_PAYLOAD *payload);
+
+#endif
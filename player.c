@@ -4,12 +4,48 @@
 #include <math.h>
 #include <pthread.h>
 #include "player.h"
+#include "rating_journal.h"
+#include "player_store.h"
+#include "glicko.h"
 #include "global.h"
-#include "debug.h"
+#include "jlog.h"
+#include "lock_profile.h"
 
 /* Function prototypes */
 void update_rating(PLAYER *player, double score, double expected_score);
 
+/*
+ * Expected scores, indexed by rating difference (opponent's rating minus
+ * own rating) offset by EXPECTED_SCORE_RANGE.  Beyond that range the
+ * expected score is within 1% of 0 or 1 and the rating change no longer
+ * depends on the exact difference.
+ */
+#define EXPECTED_SCORE_RANGE 800
+static double expected_score_table[2 * EXPECTED_SCORE_RANGE + 1];
+static pthread_once_t expected_score_once = PTHREAD_ONCE_INIT;
+
+static void init_expected_scores(void)
+{
+    for (int d = -EXPECTED_SCORE_RANGE; d <= EXPECTED_SCORE_RANGE; d++)
+    {
+        expected_score_table[d + EXPECTED_SCORE_RANGE] = 1.0 / (1.0 + pow(10.0, (double)d / 400.0));
+    }
+}
+
+static double expected_score(int own_rating, int opponent_rating)
+{
+    int d = opponent_rating - own_rating;
+    if (d < -EXPECTED_SCORE_RANGE)
+    {
+        d = -EXPECTED_SCORE_RANGE;
+    }
+    else if (d > EXPECTED_SCORE_RANGE)
+    {
+        d = EXPECTED_SCORE_RANGE;
+    }
+    return expected_score_table[d + EXPECTED_SCORE_RANGE];
+}
+
 /*
  * made of the username that is passed.  The newly created PLAYER has
  * a reference count of one, corresponding to the reference that is
@@ -21,7 +57,7 @@ void update_rating(PLAYER *player, double score, double expected_score);
  */
 PLAYER *player_create(char *name)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     PLAYER *player = malloc(sizeof(PLAYER));
     if (player == NULL)
@@ -36,13 +72,13 @@ PLAYER *player_create(char *name)
     }
     player->rating = PLAYER_INITIAL_RATING;
     player->ref_count = 0;
-    player_ref(player, "newly created player");
     if (pthread_mutex_init(&player->lock, NULL) != 0)
     {
         free(player->name);
         free(player);
         return NULL;
     }
+    player_ref(player, "newly created player");
     return player;
 }
 
@@ -58,7 +94,7 @@ PLAYER *player_create(char *name)
  */
 PLAYER *player_ref(PLAYER *player, char *why)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     pthread_mutex_lock(&player->lock);
     player->ref_count++;
@@ -80,7 +116,7 @@ PLAYER *player_ref(PLAYER *player, char *why)
 /* Decreases the reference count of a player and frees the object if the count is zero */
 void player_unref(PLAYER *player, char *why)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     pthread_mutex_lock(&player->lock);
     player->ref_count--;
@@ -106,10 +142,10 @@ void player_unref(PLAYER *player, char *why)
 /* Returns the name of a player */
 char *player_get_name(PLAYER *player)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     if (player == NULL){
-        debug("player is null");
+        jlog_debug("player is null");
         return NULL;
     }
 
@@ -125,9 +161,9 @@ char *player_get_name(PLAYER *player)
  */
 int player_get_rating(PLAYER *player)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
-    return player->rating;
+    return __atomic_load_n(&player->rating, __ATOMIC_ACQUIRE);
 }
 
 /* Posts the result of a game between two players */
@@ -145,6 +181,11 @@ int player_get_rating(PLAYER *player)
  * Update the players ratings to R1' and R2' using the formula:
  *     R1' = R1 + 32*(S1-E1)
  *     R2' = R2 + 32*(S2-E2)
+ * E1 and E2 are taken from a table computed once, on first use.
+ * If the Glicko-2 engine has been selected instead, the result is only
+ * recorded, and ratings change when the current rating period ends.
+ * The new ratings are appended to the rating journal, but this function
+ * does not wait for them to become durable.
  *
  * @param player1  One of the PLAYERs that is to be updated.
  * @param player2  The other PLAYER that is to be updated.
@@ -152,13 +193,23 @@ int player_get_rating(PLAYER *player)
  */
 void player_post_result(PLAYER *player1, PLAYER *player2, int result)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
+
+    if (glicko_enabled())
+    {
+        glicko_post_result(player1, player2, result);
+        pstore_update(player1->name, player_get_rating(player1), 1);
+        pstore_update(player2->name, player_get_rating(player2), 1);
+        return;
+    }
+
+    pthread_once(&expected_score_once, init_expected_scores);
 
     double score1, score2, E1, E2;
-    int R1 = player1->rating;
-    int R2 = player2->rating;
-    E1 = 1.0 / (1.0 + pow(10.0, (double)(R2 - R1) / 400.0));
-    E2 = 1.0 / (1.0 + pow(10.0, (double)(R1 - R2) / 400.0));
+    int R1 = player_get_rating(player1);
+    int R2 = player_get_rating(player2);
+    E1 = expected_score(R1, R2);
+    E2 = expected_score(R2, R1);
     if (result == 0)
     {
         score1 = 0.5;
@@ -177,6 +228,13 @@ void player_post_result(PLAYER *player1, PLAYER *player2, int result)
 
     update_rating(player1, score1, E1);
     update_rating(player2, score2, E2);
+
+    pstore_update(player1->name, player_get_rating(player1), 1);
+    pstore_update(player2->name, player_get_rating(player2), 1);
+
+    // The caller is responsible for waiting for the records to be durable.
+    rjournal_append(player1->name, player_get_rating(player1));
+    rjournal_append(player2->name, player_get_rating(player2));
 }
 
 /* Updates the rating of a player
@@ -186,9 +244,10 @@ void player_post_result(PLAYER *player1, PLAYER *player2, int result)
  */
 void update_rating(PLAYER *player, double score, double expected_score)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     pthread_mutex_lock(&player->lock);
-    player->rating += (int)round(32.0 * (score - expected_score));
+    int rating = player->rating + (int)round(32.0 * (score - expected_score));
+    __atomic_store_n(&player->rating, rating, __ATOMIC_RELEASE);
     pthread_mutex_unlock(&player->lock);
 }
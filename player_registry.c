@@ -1,5 +1,7 @@
 #include "player_registry.h"
-#include "debug.h"
+#include "player_store.h"
+#include "jlog.h"
+#include "lock_profile.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,7 +17,7 @@
  */
 PLAYER_REGISTRY *preg_init(void)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     // Allocate memory for the registry
     PLAYER_REGISTRY *preg = malloc(sizeof(PLAYER_REGISTRY));
@@ -42,7 +44,7 @@ PLAYER_REGISTRY *preg_init(void)
  */
 void preg_fini(PLAYER_REGISTRY *preg)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     // acquire the registry's mutex lock
     pthread_mutex_lock(&preg->mutex);
@@ -52,22 +54,24 @@ void preg_fini(PLAYER_REGISTRY *preg)
     while (cur_node != NULL) {
         PLAYER_NODE *next_node = cur_node->next;
         player_unref(cur_node->player, "preg_fini");
-        free(cur_node->player->name);
         free(cur_node);
         cur_node = next_node;
     }
     
-    // free the registry itself
-    free(preg);
-    
     // release the registry's mutex lock
     pthread_mutex_unlock(&preg->mutex);
+
+    // free the registry itself
+    pthread_mutex_destroy(&preg->mutex);
+    free(preg);
 }
 
 /*
  * Register a player with a specified user name.  If there is already
  * a player registered under that user name, then the existing registered
- * player is returned, otherwise a new player is created.
+ * player is returned, otherwise a new player is created.  If the player
+ * store is open, a new player is created with the rating stored for that
+ * user name, and a store record is created for a first-time user.
  * If an existing player is returned, then its reference count is increased
  * by one to account for the returned pointer.  If a new player is
  * created, then the returned player has reference count equal to two:
@@ -80,7 +84,7 @@ void preg_fini(PLAYER_REGISTRY *preg)
  */
 PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name)
 {
-    debug("%d", __LINE__);
+    jlog_trace("enter");
 
     pthread_mutex_lock(&preg->mutex);
 
@@ -104,20 +108,76 @@ PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name)
         return NULL;
     }
 
-    player_ref(new_player, "registry"); // One for the registry, one for the caller
-    pthread_mutex_init(&new_player->lock, NULL);
+    // A returning player gets the rating kept in the player store.
+    int stored_rating;
+    if (pstore_attach(name, &stored_rating) == 0)
+    {
+        new_player->rating = stored_rating;
+    }
 
     PLAYER_NODE *new_node = malloc(sizeof(PLAYER_NODE));
-
+    if (new_node == NULL) {
+        player_unref(new_player, "registration failed");
+        pthread_mutex_unlock(&preg->mutex);
+        return NULL;
+    }
 
     new_node->player = new_player;
     new_node->next = preg->head;
     preg->head = new_node;
     preg->player_count++;
     player_ref(new_node->player, "reference being retained by player registry");
-    debug("enter here");
 
     pthread_mutex_unlock(&preg->mutex);
 
     return new_player;
 }
+
+/*
+ * Release a reference to a registered player, obtained from preg_register()
+ * or by player_ref() on a registered player.  If the player store is
+ * open and the registry's own reference is the only one left, the player
+ * is removed from the registry and freed: the store holds its rating,
+ * and a later preg_register() creates it again from there.
+ *
+ * @param preg  The registry in which the player is registered.
+ * @param player  The PLAYER, which must not be used by the caller again.
+ * @param why  A string describing the reason why the reference is being
+ * released, as for player_unref().
+ */
+void preg_release(PLAYER_REGISTRY *preg, PLAYER *player, char *why)
+{
+    jlog_trace("enter");
+
+    PLAYER_NODE *evicted = NULL;
+    if (pstore_enabled())
+    {
+        pthread_mutex_lock(&preg->mutex);
+        PLAYER_NODE **prev = &preg->head;
+        while (*prev != NULL && (*prev)->player != player)
+        {
+            prev = &(*prev)->next;
+        }
+        if (*prev != NULL)
+        {
+            // Only the caller and the registry hold references; while the
+            // registry mutex is held nobody else can look the player up.
+            pthread_mutex_lock(&player->lock);
+            if (player->ref_count == 2)
+            {
+                evicted = *prev;
+                *prev = evicted->next;
+                preg->player_count--;
+            }
+            pthread_mutex_unlock(&player->lock);
+        }
+        pthread_mutex_unlock(&preg->mutex);
+    }
+
+    if (evicted != NULL)
+    {
+        free(evicted);
+        player_unref(player, "evicted from player registry");
+    }
+    player_unref(player, why);
+}
@@ -0,0 +1,465 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "player_store.h"
+#include "global.h"
+#include "jlog.h"
+
+#define STORE_FILE "players.db"
+#define STORE_TMP_FILE "players.db.tmp"
+#define STORE_MAGIC "JEUXPDB2"
+
+/*
+ * State of the (single) player store.  The mapping consists of a
+ * PSTORE_HEADER followed by "capacity" PSTORE_RECORDs, where capacity
+ * is always a power of two.
+ */
+static struct {
+    int fd;
+    char *path;
+    char *tmp_path;
+    size_t map_size;
+    PSTORE_HEADER *header;
+    PSTORE_RECORD *records;
+    pthread_mutex_t mutex;
+} store = {
+    .fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* FNV-1a hash of a username. */
+static uint32_t name_hash(char *name)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned char *p = (unsigned char *)name; *p != '\0'; p++)
+    {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t store_size(uint64_t capacity)
+{
+    return sizeof(PSTORE_HEADER) + capacity * sizeof(PSTORE_RECORD);
+}
+
+/*
+ * Map a store file of a given capacity, creating and initializing it
+ * if it is new.  The file is extended with ftruncate(), so the unused
+ * part of the table occupies no disk blocks until it is written.
+ *
+ * @return the mapped header, or NULL on error.
+ */
+static PSTORE_HEADER *map_file(int fd, uint64_t capacity, int create)
+{
+    size_t size = store_size(capacity);
+    if (create && ftruncate(fd, size) != 0)
+    {
+        return NULL;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    PSTORE_HEADER *header = map;
+    if (create)
+    {
+        memcpy(header->magic, STORE_MAGIC, sizeof(header->magic));
+        header->capacity = capacity;
+        header->count = 0;
+        header->generation = 0;
+    }
+    return header;
+}
+
+/*
+ * Find the slot for a username in a table: either the slot holding it,
+ * or the empty slot at which it would be inserted.
+ */
+static PSTORE_RECORD *probe(PSTORE_RECORD *records, uint64_t capacity,
+                            char *name, uint32_t hash)
+{
+    uint64_t mask = capacity - 1;
+    for (uint64_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        PSTORE_RECORD *rec = &records[i];
+        if (rec->name[0] == '\0')
+        {
+            return rec;
+        }
+        if (rec->hash == hash && strncmp(rec->name, name, PSTORE_NAME_MAX) == 0)
+        {
+            return rec;
+        }
+    }
+}
+
+/*
+ * Double the capacity of the table.  The records are rehashed into a
+ * new file, which then atomically replaces the old one.
+ * The store mutex must be held by the caller.
+ */
+static int grow(void)
+{
+    uint64_t capacity = store.header->capacity * 2;
+    int fd = open(store.tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    PSTORE_HEADER *header = map_file(fd, capacity, 1);
+    if (header == NULL)
+    {
+        close(fd);
+        unlink(store.tmp_path);
+        return -1;
+    }
+    PSTORE_RECORD *records = (PSTORE_RECORD *)(header + 1);
+
+    for (uint64_t i = 0; i < store.header->capacity; i++)
+    {
+        PSTORE_RECORD *rec = &store.records[i];
+        if (rec->name[0] != '\0')
+        {
+            *probe(records, capacity, rec->name, rec->hash) = *rec;
+        }
+    }
+    header->count = store.header->count;
+    header->generation = store.header->generation;
+
+    if (msync(header, store_size(capacity), MS_SYNC) != 0 ||
+        rename(store.tmp_path, store.path) != 0)
+    {
+        munmap(header, store_size(capacity));
+        close(fd);
+        unlink(store.tmp_path);
+        return -1;
+    }
+
+    munmap(store.header, store.map_size);
+    close(store.fd);
+    store.fd = fd;
+    store.map_size = store_size(capacity);
+    store.header = header;
+    store.records = records;
+    jlog_info("player store grown to %lu slots", (unsigned long)capacity);
+    return 0;
+}
+
+/*
+ * Open (or create) the player store in a specified directory.
+ *
+ * @param dir  The directory in which the store file is kept.
+ * @return 0 if the store was successfully opened, otherwise -1.
+ */
+int pstore_open(char *dir)
+{
+    jlog_trace("enter");
+
+    size_t len = strlen(dir) + sizeof(STORE_TMP_FILE) + 2;
+    store.path = malloc(len);
+    store.tmp_path = malloc(len);
+    if (store.path == NULL || store.tmp_path == NULL)
+    {
+        goto fail;
+    }
+    snprintf(store.path, len, "%s/%s", dir, STORE_FILE);
+    snprintf(store.tmp_path, len, "%s/%s", dir, STORE_TMP_FILE);
+
+    store.fd = open(store.path, O_RDWR | O_CREAT, 0644);
+    if (store.fd < 0)
+    {
+        goto fail;
+    }
+    struct stat st;
+    if (fstat(store.fd, &st) != 0)
+    {
+        goto fail;
+    }
+
+    if (st.st_size == 0)
+    {
+        store.header = map_file(store.fd, PSTORE_INITIAL_CAPACITY, 1);
+    }
+    else
+    {
+        PSTORE_HEADER hdr;
+        if (pread(store.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            memcmp(hdr.magic, STORE_MAGIC, sizeof(hdr.magic)) != 0 ||
+            (size_t)st.st_size < store_size(hdr.capacity))
+        {
+            jlog_error("%s is not a %.8s player store, or is truncated", store.path, STORE_MAGIC);
+            goto fail;
+        }
+        store.header = map_file(store.fd, hdr.capacity, 0);
+    }
+    if (store.header == NULL)
+    {
+        goto fail;
+    }
+    store.map_size = store_size(store.header->capacity);
+    store.records = (PSTORE_RECORD *)(store.header + 1);
+    return 0;
+
+fail:
+    if (store.fd >= 0)
+    {
+        close(store.fd);
+        store.fd = -1;
+    }
+    free(store.path);
+    free(store.tmp_path);
+    store.header = NULL;
+    return -1;
+}
+
+/*
+ * Sync and unmap the player store.
+ */
+void pstore_close(void)
+{
+    jlog_trace("enter");
+
+    if (store.header == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&store.mutex);
+    msync(store.header, store.map_size, MS_SYNC);
+    munmap(store.header, store.map_size);
+    close(store.fd);
+    store.header = NULL;
+    store.fd = -1;
+    free(store.path);
+    free(store.tmp_path);
+    pthread_mutex_unlock(&store.mutex);
+}
+
+/*
+ * @return nonzero if the player store has been opened.
+ */
+int pstore_enabled(void)
+{
+    return store.header != NULL;
+}
+
+/*
+ * Look up the stored record of a player.
+ *
+ * @param name  The username of the player.
+ * @param ratingp  If non-NULL, the player's stored rating is put here.
+ * @param gamesp  If non-NULL, the player's number of games is put here.
+ * @return 0 if the player has a record in the store, otherwise -1.
+ */
+int pstore_lookup(char *name, int *ratingp, unsigned int *gamesp)
+{
+    if (store.header == NULL || strlen(name) >= PSTORE_NAME_MAX)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&store.mutex);
+    PSTORE_RECORD *rec = probe(store.records, store.header->capacity, name, name_hash(name));
+    int ret = -1;
+    if (rec->name[0] != '\0')
+    {
+        if (ratingp != NULL)
+        {
+            *ratingp = rec->rating;
+        }
+        if (gamesp != NULL)
+        {
+            *gamesp = rec->games;
+        }
+        ret = 0;
+    }
+    pthread_mutex_unlock(&store.mutex);
+    return ret;
+}
+
+/*
+ * Find the record of a player, creating one with the initial rating
+ * if the player has never been seen before.  Usernames that do not
+ * fit in a record are not stored.
+ *
+ * @param name  The username of the player.
+ * @param ratingp  Pointer to a variable into which the stored rating
+ * of the player is put.
+ * @return 0 if the player now has a record in the store, otherwise -1.
+ */
+int pstore_attach(char *name, int *ratingp)
+{
+    size_t len = strlen(name);
+    if (store.header == NULL || len == 0 || len >= PSTORE_NAME_MAX)
+    {
+        return -1;
+    }
+
+    uint32_t hash = name_hash(name);
+    pthread_mutex_lock(&store.mutex);
+    PSTORE_RECORD *rec = probe(store.records, store.header->capacity, name, hash);
+    if (rec->name[0] == '\0')
+    {
+        // Keep the load factor at or below 3/4.
+        if ((store.header->count + 1) * 4 > store.header->capacity * 3)
+        {
+            if (grow() != 0)
+            {
+                pthread_mutex_unlock(&store.mutex);
+                return -1;
+            }
+            rec = probe(store.records, store.header->capacity, name, hash);
+        }
+        rec->hash = hash;
+        rec->rating = PLAYER_INITIAL_RATING;
+        rec->games = 0;
+        rec->deviation = 0;
+        rec->volatility = 0;
+        rec->glicko_period = 0;
+        memcpy(rec->name, name, len + 1);
+        store.header->count++;
+    }
+    *ratingp = rec->rating;
+    pthread_mutex_unlock(&store.mutex);
+    return 0;
+}
+
+/*
+ * Update the stored rating of a player.
+ *
+ * @param name  The username of the player.
+ * @param rating  The player's new rating.
+ * @param games  The number of games to add to the player's game count.
+ * @return 0 if the player's record was updated, otherwise -1 (if the
+ * player has no record in the store).
+ */
+int pstore_update(char *name, int rating, int games)
+{
+    if (store.header == NULL || strlen(name) >= PSTORE_NAME_MAX)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&store.mutex);
+    PSTORE_RECORD *rec = probe(store.records, store.header->capacity, name, name_hash(name));
+    int ret = -1;
+    if (rec->name[0] != '\0')
+    {
+        rec->rating = rating;
+        rec->games += games;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&store.mutex);
+    return ret;
+}
+
+/*
+ * Get the stored Glicko-2 rating deviation and volatility of a player.
+ *
+ * @param name  The username of the player.
+ * @param deviationp  Pointer to a variable into which the deviation is put.
+ * @param volatilityp  Pointer to a variable into which the volatility is put.
+ * @param periodp  Pointer to a variable into which the rating period in
+ * which they were computed is put.
+ * @return 0 if the player has Glicko-2 parameters in the store, otherwise -1.
+ */
+int pstore_get_glicko(char *name, double *deviationp, double *volatilityp,
+                      unsigned long *periodp)
+{
+    if (store.header == NULL || strlen(name) >= PSTORE_NAME_MAX)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&store.mutex);
+    PSTORE_RECORD *rec = probe(store.records, store.header->capacity, name, name_hash(name));
+    int ret = -1;
+    if (rec->name[0] != '\0' && rec->deviation != 0)
+    {
+        *deviationp = rec->deviation / 100.0;
+        *volatilityp = rec->volatility / 100000.0;
+        *periodp = rec->glicko_period;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&store.mutex);
+    return ret;
+}
+
+/*
+ * Set the stored Glicko-2 rating deviation and volatility of a player.
+ * Values are kept with fixed precision and saturate at the limits of
+ * their fields.
+ *
+ * @param name  The username of the player.
+ * @param deviation  The player's rating deviation.
+ * @param volatility  The player's rating volatility.
+ * @param period  The rating period in which they were computed.
+ * @return 0 if the player's record was updated, otherwise -1.
+ */
+int pstore_set_glicko(char *name, double deviation, double volatility,
+                      unsigned long period)
+{
+    if (store.header == NULL || strlen(name) >= PSTORE_NAME_MAX)
+    {
+        return -1;
+    }
+
+    double d = deviation * 100.0 + 0.5;
+    double v = volatility * 100000.0 + 0.5;
+    pthread_mutex_lock(&store.mutex);
+    PSTORE_RECORD *rec = probe(store.records, store.header->capacity, name, name_hash(name));
+    int ret = -1;
+    if (rec->name[0] != '\0')
+    {
+        rec->deviation = d < 1.0 ? 1 : (d > UINT16_MAX ? UINT16_MAX : (uint16_t)d);
+        rec->volatility = v > UINT16_MAX ? UINT16_MAX : (uint16_t)v;
+        rec->glicko_period = period;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&store.mutex);
+    return ret;
+}
+
+/*
+ * Write all dirty records to disk and then mark the store as covering
+ * every rating journal older than a specified generation.  The records
+ * are synced before the header, so a crash in between leaves the old
+ * generation in place and the journal is simply replayed again.
+ *
+ * @param generation  The generation of the currently open journal.
+ * @return 0 if the sync succeeded, otherwise -1.
+ */
+int pstore_sync(unsigned long generation)
+{
+    if (store.header == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&store.mutex);
+    int ret = msync(store.header, store.map_size, MS_SYNC);
+    if (ret == 0)
+    {
+        store.header->generation = generation;
+        ret = msync(store.header, sysconf(_SC_PAGESIZE), MS_SYNC);
+    }
+    pthread_mutex_unlock(&store.mutex);
+    return ret == 0 ? 0 : -1;
+}
+
+/*
+ * @return the journal generation recorded by the last pstore_sync().
+ */
+unsigned long pstore_generation(void)
+{
+    return store.header == NULL ? 0 : store.header->generation;
+}
@@ -0,0 +1,50 @@
+#ifndef PLAYER_STORE_H
+#define PLAYER_STORE_H
+
+#include <stdint.h>
+
+/*
+ * Memory-mapped database of every player that has ever logged in.
+ *
+ * The file is an open-addressed hash table of fixed-size records keyed
+ * by username.  Opening it only maps the file, so startup time does not
+ * depend on the number of accounts, and only the pages of players that
+ * are actually looked up become resident.  A PLAYER object is created
+ * for an account the first time it is registered in the PLAYER_REGISTRY.
+ */
+
+#define PSTORE_NAME_MAX 48
+#define PSTORE_INITIAL_CAPACITY (1 << 16)
+
+typedef struct pstore_record {
+    char name[PSTORE_NAME_MAX];     // NUL-padded; empty slot if name[0] == 0
+    uint32_t hash;
+    int32_t rating;
+    uint32_t games;
+    uint16_t deviation;             // Glicko-2 rating deviation x 100, 0 if unset
+    uint16_t volatility;            // Glicko-2 volatility x 100000
+    uint32_t glicko_period;         // Rating period in which those were computed
+} PSTORE_RECORD;
+
+typedef struct pstore_header {
+    char magic[8];
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t generation;            // Journal generation covered by this file
+    char reserved[32];
+} PSTORE_HEADER;
+
+int pstore_open(char *dir);
+void pstore_close(void);
+int pstore_enabled(void);
+int pstore_lookup(char *name, int *ratingp, unsigned int *gamesp);
+int pstore_attach(char *name, int *ratingp);
+int pstore_update(char *name, int rating, int games);
+int pstore_get_glicko(char *name, double *deviationp, double *volatilityp,
+                      unsigned long *periodp);
+int pstore_set_glicko(char *name, double deviation, double volatility,
+                      unsigned long period);
+int pstore_sync(unsigned long generation);
+unsigned long pstore_generation(void);
+
+#endif
@@ -1,82 +1,294 @@
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "protocol.h"
+#include "payload.h"
+#include "compress.h"
+#include "io_loop.h"
 #include "global.h"
-#include "debug.h"
+#include "jlog.h"
 
-int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data)
+/*
+ * The functions here work on any connected stream socket: TCP, a Unix
+ * domain socket accepted on the local listener (see "-l" in main.c), or
+ * one end of a socketpair().  Nothing is assumed about how the kernel
+ * splits or joins writes.
+ *
+ * Packets to one client may be sent by several threads (its own service
+ * thread, its opponent's, and the spectator broadcaster), so each packet
+ * is written under a lock for its descriptor, which keeps its header and
+ * payload together on the wire.  A client served by the event loop
+ * (see io_loop.h) is an exception: its packets are queued for the loop
+ * to write.
+ */
+#define PROTO_SEND_LOCKS 256
+
+static pthread_mutex_t send_locks[PROTO_SEND_LOCKS] = {
+    [0 ... PROTO_SEND_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int send_packet(int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * Compress a payload for sending, if that makes it smaller.
+ *
+ * @return the compressed payload, which the caller must free, with
+ * "packed" set to its header, or NULL to send the payload as it is.
+ */
+static void *compress_payload(JEUX_PACKET_HEADER *hdr, void *data, JEUX_PACKET_HEADER *packed)
 {
-    // Convert multi-byte fields to network byte order
-    // hdr->type = htons(hdr->type);
-    // hdr->size = htonl(hdr->size);
+    uint16_t size = ntohs(hdr->size);
+    uint8_t *buf = malloc(size);
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+    // The original size, then a block that must leave the total smaller
+    size_t len = lz4_compress(data, size, buf + 2, size - 3);
+    if (len == 0)
+    {
+        free(buf);
+        return NULL;
+    }
+    buf[0] = size >> 8;
+    buf[1] = size & 0xff;
+    *packed = *hdr;
+    packed->type |= JEUX_COMPRESSED_FLAG;
+    packed->size = htons(len + 2);
+    return buf;
+}
 
+int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data)
+{
+    JEUX_PACKET_HEADER packed;
+    void *compressed = NULL;
+    if (data != NULL && ntohs(hdr->size) >= PROTO_COMPRESS_THRESHOLD && proto_compression(fd) &&
+        (compressed = compress_payload(hdr, data, &packed)) != NULL)
+    {
+        hdr = &packed;
+        data = compressed;
+    }
 
-    debug("sending... fd:%d", fd);
+    jlog_debug("sending... fd:%d", fd);
     uint16_t payload_size = ntohs(hdr->size);
 
-    // Write header to the wire
-    if (write(fd, (void *)hdr, sizeof(JEUX_PACKET_HEADER)) != sizeof(JEUX_PACKET_HEADER))
+    // Header and payload in one system call, so that the peer is woken
+    // once per packet rather than once per part
+    struct iovec iov[2] = {
+        {.iov_base = hdr, .iov_len = sizeof(JEUX_PACKET_HEADER)},
+        {.iov_base = data, .iov_len = payload_size}
+    };
+    int iovcnt = payload_size > 0 ? 2 : 1;
+    int ret = ioloop_queue(fd, iov, iovcnt);
+    if (ret == 0)
     {
-
-        debug("ERROR: %d", __LINE__);
-        return -1;
+        pthread_mutex_t *lock = &send_locks[(unsigned int)fd % PROTO_SEND_LOCKS];
+        pthread_mutex_lock(lock);
+        ret = send_packet(fd, iov, iovcnt);
+        pthread_mutex_unlock(lock);
     }
+    else
+    {
+        ret = ret > 0 ? 0 : -1;
+    }
+    free(compressed);
+    return ret;
+}
 
-    // Write payload data to the wire
-    if (payload_size > 0)
+/*
+ * Write all of an I/O vector, which is consumed, resuming after short
+ * writes.  A peer that has gone away fails the write rather than raising
+ * SIGPIPE.
+ */
+static int write_fully(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
     {
-        if (write(fd, data, payload_size) != payload_size)
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
         {
-            debug("ERROR: %d", __LINE__);
             return -1;
         }
+        for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+        {
+            n -= iov->iov_len;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
-
     return 0;
 }
 
-int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp)
+static int send_packet(int fd, struct iovec *iov, int iovcnt)
 {
+    size_t payload_size = iovcnt > 1 ? iov[1].iov_len : 0;
+    if (write_fully(fd, iov, iovcnt) != 0)
+    {
+        jlog_warn("cannot write packet with %zu-byte payload to fd %d", payload_size, fd);
+        return -1;
+    }
 
-    // Read header from the wire
-    size_t read_size = read(fd, (void *)hdr, sizeof(JEUX_PACKET_HEADER));
+    return 0;
+}
 
-    uint16_t size = ntohs(hdr->size);
-    debug("hdr->size: %hu", size);
+// Read exactly "size" bytes, unless the connection ends or fails first
+static ssize_t read_fully(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = read(fd, (char *)buf + done, size - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return n < 0 ? -1 : (ssize_t)done;
+        }
+        done += n;
+    }
+    return done;
+}
 
-    if (read_size != sizeof(JEUX_PACKET_HEADER))
+/*
+ * Replace a compressed payload, which is freed, by the original, and
+ * clear the flag in the header.
+ *
+ * @return the original payload, with room for a NUL after it, or NULL
+ * if the compressed payload is malformed or the original is too large.
+ */
+static char *decompress_payload(int fd, JEUX_PACKET_HEADER *hdr, char *data, uint16_t *sizep)
+{
+    uint8_t *packed = (uint8_t *)data;
+    uint16_t size = *sizep >= 2 ? packed[0] << 8 | packed[1] : 0;
+    char *original = size > 0 && size <= PROTO_MAX_PAYLOAD ? malloc(size + 1) : NULL;
+    if (original == NULL || lz4_decompress(packed + 2, *sizep - 2, original, size) != size)
     {
-        debug("ERROR: %d, %ld", __LINE__, read_size);
-        debug("ERROR: %d, %hu", __LINE__, size);
+        jlog_warn("bad compressed payload from fd %d", fd);
+        free(original);
+        free(data);
+        return NULL;
+    }
+    free(data);
+    hdr->type &= ~JEUX_COMPRESSED_FLAG;
+    hdr->size = htons(size);
+    *sizep = size;
+    return original;
+}
 
-        return -1;
+/*
+ * Make a payload of the received data of a packet, decompressing it if
+ * it is compressed.
+ *
+ * @param data  The payload as received, in a buffer with room for a NUL
+ * after it, which is taken over; NULL if there is none.
+ * @return 0 if successful, otherwise -1, with the data freed.
+ */
+int proto_take_payload(int fd, JEUX_PACKET_HEADER *hdr, char *data, JEUX_PAYLOAD *payload)
+{
+    payload->data = NULL;
+    payload->len = 0;
+    if (data == NULL)
+    {
+        return 0;
     }
 
-    // Allocate memory for payload data
-    if (size > 0)
+    uint16_t size = ntohs(hdr->size);
+    if (hdr->type & JEUX_COMPRESSED_FLAG)
     {
-        *payloadp = malloc(size);
-        if (*payloadp == NULL)
+        data = decompress_payload(fd, hdr, data, &size);
+        if (data == NULL)
         {
-            debug("ERROR: %d", __LINE__);
             return -1;
         }
+    }
+    data[size] = '\0';
+    payload->data = data;
+    payload->len = size;
+    return 0;
+}
 
-        // Read payload data from the wire
-        if (read(fd, (void *)*payloadp, size) != size)
-        {
-            free(*payloadp);
-            debug("ERROR: %d, %hu", __LINE__, size);
-            return -1;
-        }
-        *(((char*)(*payloadp)) + size) =  0;
+int proto_recv_payload(int fd, JEUX_PACKET_HEADER *hdr, JEUX_PAYLOAD *payload)
+{
+    payload->data = NULL;
+    payload->len = 0;
+
+    // Read header from the wire
+    ssize_t read_size = read_fully(fd, hdr, sizeof(JEUX_PACKET_HEADER));
+    if (read_size != sizeof(JEUX_PACKET_HEADER))
+    {
+        jlog_debug("short read of header from fd %d: %ld", fd, (long)read_size);
+        return -1;
     }
-    else
+
+    uint16_t size = ntohs(hdr->size);
+    jlog_debug("hdr->size: %hu", size);
+    if (size == 0)
     {
-        *payloadp = NULL;
+        return 0;
     }
+    if (size > PROTO_MAX_PAYLOAD)
+    {
+        jlog_warn("%hu-byte payload from fd %d is over the limit", size, fd);
+        return -1;
+    }
+
+    // One more byte for the NUL that lets text be used as a C string
+    char *data = malloc(size + 1);
+    if (data == NULL)
+    {
+        jlog_error("cannot allocate %hu-byte payload", size);
+        return -1;
+    }
+    if (read_fully(fd, data, size) != size)
+    {
+        free(data);
+        jlog_debug("short read of %hu-byte payload from fd %d", size, fd);
+        return -1;
+    }
+    return proto_take_payload(fd, hdr, data, payload);
+}
+
+/*
+ * @return the payload as a C string, or NULL if there is none or it
+ * contains a NUL.
+ */
+char *payload_text(JEUX_PAYLOAD *payload)
+{
+    if (payload->data == NULL || memchr(payload->data, '\0', payload->len) != NULL)
+    {
+        return NULL;
+    }
+    return payload->data;
+}
+
+void payload_free(JEUX_PAYLOAD *payload)
+{
+    free(payload->data);
+    payload->data = NULL;
+    payload->len = 0;
+}
 
+int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp)
+{
+    JEUX_PAYLOAD payload;
+    if (proto_recv_payload(fd, hdr, &payload) != 0)
+    {
+        return -1;
+    }
+    *payloadp = payload.data;
     return 0;
 }
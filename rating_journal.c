@@ -0,0 +1,592 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "rating_journal.h"
+#include "player_store.h"
+#include "global.h"
+#include "jlog.h"
+
+#define JOURNAL_FILE "ratings.journal"
+#define JOURNAL_OLD_FILE "ratings.journal.old"
+#define SNAPSHOT_FILE "ratings.snapshot"
+#define SNAPSHOT_TMP_FILE "ratings.snapshot.tmp"
+
+/*
+ * State of the (single) rating journal.  Records are appended to "buf"
+ * by arbitrary threads; the flusher thread swaps "buf" with "spare",
+ * writes the batch out and syncs it, then advances "durable_seq".
+ * "failed" is set while batches can be neither written nor covered by
+ * a snapshot.
+ */
+static struct {
+    int enabled;
+    int stop;
+    int failed;
+    int fd;
+    char *dir;
+    PLAYER_REGISTRY *preg;
+    char *buf;
+    size_t len;
+    size_t cap;
+    char *spare;
+    size_t spare_cap;
+    unsigned long appended_seq;
+    unsigned long durable_seq;
+    unsigned long flushed_seq;      // Last record the flusher has tried to make durable
+    unsigned long since_snapshot;
+    unsigned long generation;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t durable_cond;
+    pthread_t flusher;
+} journal = {
+    .fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .durable_cond = PTHREAD_COND_INITIALIZER
+};
+
+static char *journal_path(char *file)
+{
+    size_t len = strlen(journal.dir) + strlen(file) + 2;
+    char *path = malloc(len);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    snprintf(path, len, "%s/%s", journal.dir, file);
+    return path;
+}
+
+static int write_all(int fd, char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Restore the rating of a single player.  Players that have a record in
+ * the player store are updated there without creating a PLAYER object;
+ * any others are registered in the player registry.  Glicko-2 parameters
+ * (a deviation of 0 if the record has none) are only kept in the store.
+ */
+static int apply_record(char *name, int rating, double deviation, double volatility,
+                        unsigned long period)
+{
+    int stored;
+    if (pstore_attach(name, &stored) == 0)
+    {
+        if (deviation > 0.0)
+        {
+            pstore_set_glicko(name, deviation, volatility, period);
+        }
+        return pstore_update(name, rating, 0);
+    }
+
+    PLAYER *player = preg_register(journal.preg, name);
+    if (player == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&player->lock);
+    player->rating = rating;
+    pthread_mutex_unlock(&player->lock);
+    preg_release(journal.preg, player, "journal replay");
+    return 0;
+}
+
+/*
+ * Apply every complete "<username>\t<rating>\n" or
+ * "<username>\t<rating>\t<deviation>/<volatility>/<period>\n" record found
+ * in a file to the player registry.  A trailing record without a newline is the
+ * remains of a torn write and is ignored.  The first line of each file
+ * is a "#<generation>" header; a file whose generation is older than
+ * the loaded snapshot is already covered by it and is skipped.
+ *
+ * @param file  The name of the file within the journal directory.
+ * @param min_gen  The oldest generation that still needs to be replayed.
+ * @param genp  Pointer to a variable into which the generation of the
+ * file is stored.
+ * @return the number of records applied, or -1 if the file does not exist.
+ */
+static long replay_file(char *file, unsigned long min_gen, unsigned long *genp)
+{
+    *genp = 0;
+    char *path = journal_path(file);
+    if (path == NULL)
+    {
+        return -1;
+    }
+    FILE *f = fopen(path, "r");
+    free(path);
+    if (f == NULL)
+    {
+        return -1;
+    }
+
+    long count = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    if ((n = getline(&line, &line_cap, f)) > 0 && line[0] == '#' && strchr(line, '\t') == NULL)
+    {
+        *genp = strtoul(line + 1, NULL, 10);
+    }
+    else
+    {
+        rewind(f);
+    }
+    if (*genp < min_gen)
+    {
+        jlog_info("skipping %s: it is older than the snapshot", file);
+        n = 0;
+    }
+    while (n > 0 && (n = getline(&line, &line_cap, f)) > 0)
+    {
+        if (line[n - 1] != '\n')
+        {
+            jlog_warn("ignoring a torn record at the end of %s", file);
+            break;
+        }
+        line[n - 1] = '\0';
+        char *tab = strrchr(line, '\t');
+        if (tab == NULL || tab == line)
+        {
+            continue;
+        }
+        *tab = '\0';
+        double deviation = 0.0, volatility = 0.0;
+        unsigned long period = 0;
+        if (strchr(tab + 1, '/') != NULL)
+        {
+            // The rating is the field before the Glicko-2 parameters
+            sscanf(tab + 1, "%lf/%lf/%lu", &deviation, &volatility, &period);
+            tab = strrchr(line, '\t');
+            if (tab == NULL || tab == line)
+            {
+                continue;
+            }
+            *tab = '\0';
+        }
+
+        if (apply_record(line, atoi(tab + 1), deviation, volatility, period) == 0)
+        {
+            count++;
+        }
+    }
+    free(line);
+    fclose(f);
+    return count;
+}
+
+/*
+ * Make renames in the journal directory durable.
+ */
+static int sync_dir(void)
+{
+    int fd = open(journal.dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+/*
+ * Write the ratings of all registered players to a new snapshot, then
+ * discard the journal that preceded it.  The journal is rotated before
+ * the registry is read, so every record in the rotated journal is already
+ * reflected in the in-memory ratings that go into the snapshot.
+ * Only the flusher thread (or rjournal_init() before it starts) calls this.
+ */
+static int take_snapshot(void)
+{
+    char *journal_file = journal_path(JOURNAL_FILE);
+    char *old_file = journal_path(JOURNAL_OLD_FILE);
+    char *snap_file = journal_path(SNAPSHOT_FILE);
+    char *tmp_file = journal_path(SNAPSHOT_TMP_FILE);
+    int ret = -1;
+    if (journal_file == NULL || old_file == NULL || snap_file == NULL || tmp_file == NULL)
+    {
+        goto out;
+    }
+
+    pthread_mutex_lock(&journal.mutex);
+    if (journal.fd >= 0)
+    {
+        close(journal.fd);
+    }
+    rename(journal_file, old_file);
+    unsigned long gen = ++journal.generation;
+    journal.fd = open(journal_file, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    journal.since_snapshot = 0;
+    if (journal.fd >= 0)
+    {
+        dprintf(journal.fd, "#%lu\n", gen);
+        fdatasync(journal.fd);
+    }
+    pthread_mutex_unlock(&journal.mutex);
+    if (journal.fd < 0)
+    {
+        jlog_error("cannot reopen journal %s: %s", journal_file, strerror(errno));
+        goto out;
+    }
+
+    FILE *f = fopen(tmp_file, "w");
+    if (f == NULL)
+    {
+        jlog_error("cannot create snapshot %s: %s", tmp_file, strerror(errno));
+        goto out;
+    }
+    // The snapshot covers every journal older than the one just opened.
+    fprintf(f, "#%lu\n", gen);
+    pthread_mutex_lock(&journal.preg->mutex);
+    for (PLAYER_NODE *node = journal.preg->head; node != NULL; node = node->next)
+    {
+        // Ratings held in the player store are checkpointed by syncing it.
+        if (pstore_lookup(player_get_name(node->player), NULL, NULL) == 0)
+        {
+            continue;
+        }
+        fprintf(f, "%s\t%d\n", player_get_name(node->player),
+                player_get_rating(node->player));
+    }
+    pthread_mutex_unlock(&journal.preg->mutex);
+
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+    {
+        jlog_error("cannot write snapshot %s: %s", tmp_file, strerror(errno));
+        fclose(f);
+        goto out;
+    }
+    fclose(f);
+    if (rename(tmp_file, snap_file) != 0 || sync_dir() != 0)
+    {
+        jlog_error("cannot install snapshot %s: %s", snap_file, strerror(errno));
+        goto out;
+    }
+    if (pstore_enabled() && pstore_sync(gen) != 0)
+    {
+        jlog_error("cannot sync the player store for snapshot %lu", gen);
+        goto out;
+    }
+    unlink(old_file);
+    ret = 0;
+
+out:
+    free(journal_file);
+    free(old_file);
+    free(snap_file);
+    free(tmp_file);
+    return ret;
+}
+
+/*
+ * Thread function for the journal flusher.  Each iteration takes every
+ * record appended since the last iteration, writes them with a single
+ * write() and fdatasync(), and then wakes up the threads waiting in
+ * rjournal_commit() for those records.  If the batch cannot be written,
+ * a snapshot is taken instead: the records are already applied to the
+ * in-memory ratings, so the snapshot covers them, and it starts a new
+ * journal file in place of the one that may now end in a torn record.
+ * Only if that fails too is the batch left undurable and the journal
+ * marked as failed, until a later batch succeeds in the same way.
+ */
+static void *flusher_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&journal.mutex);
+        while (!journal.stop && journal.len == 0)
+        {
+            pthread_cond_wait(&journal.work_cond, &journal.mutex);
+        }
+        if (journal.stop && journal.len == 0)
+        {
+            pthread_mutex_unlock(&journal.mutex);
+            break;
+        }
+
+        char *batch = journal.buf;
+        size_t batch_len = journal.len;
+        size_t batch_cap = journal.cap;
+        unsigned long batch_seq = journal.appended_seq;
+        journal.buf = journal.spare;
+        journal.cap = journal.spare_cap;
+        journal.len = 0;
+        int fd = journal.fd;
+        int failed = journal.failed;
+        pthread_mutex_unlock(&journal.mutex);
+
+        int ok = !failed && write_all(fd, batch, batch_len) == 0 && fdatasync(fd) == 0;
+        if (!ok)
+        {
+            if (!failed)
+            {
+                jlog_error("journal write failed: %s", strerror(errno));
+            }
+            ok = take_snapshot() == 0;
+            if (ok && failed)
+            {
+                jlog_warn("journal recovered by a snapshot");
+            }
+            else if (!ok && !failed)
+            {
+                jlog_error("ratings are not durable until a snapshot succeeds");
+            }
+        }
+
+        pthread_mutex_lock(&journal.mutex);
+        journal.spare = batch;
+        journal.spare_cap = batch_cap;
+        journal.failed = !ok;
+        journal.flushed_seq = batch_seq;
+        if (ok)
+        {
+            journal.since_snapshot += batch_seq - journal.durable_seq;
+            journal.durable_seq = batch_seq;
+        }
+        int need_snapshot = ok && journal.since_snapshot >= RJOURNAL_SNAPSHOT_INTERVAL;
+        pthread_cond_broadcast(&journal.durable_cond);
+        pthread_mutex_unlock(&journal.mutex);
+
+        if (need_snapshot)
+        {
+            take_snapshot();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Open the rating journal in a specified directory and restore the
+ * ratings it holds into a player registry.  The most recent snapshot is
+ * loaded first, then the journal tail written after it is replayed.
+ * Recovered state is compacted into a fresh snapshot before the server
+ * starts, so each restart begins with an empty journal.
+ *
+ * @param dir  The directory holding the journal and snapshot files.
+ * @param preg  The PLAYER_REGISTRY into which ratings are restored.
+ * @return 0 if the journal was opened successfully, otherwise -1.
+ */
+int rjournal_init(char *dir, PLAYER_REGISTRY *preg)
+{
+    jlog_trace("enter");
+
+    journal.dir = strdup(dir);
+    if (journal.dir == NULL)
+    {
+        return -1;
+    }
+    journal.preg = preg;
+
+    // A leftover rotated journal means we crashed while taking a snapshot;
+    // it only matters if that snapshot never made it to disk.
+    unsigned long snap_gen, old_gen, gen;
+    replay_file(SNAPSHOT_FILE, 0, &snap_gen);
+    if (pstore_enabled() && pstore_generation() < snap_gen)
+    {
+        snap_gen = pstore_generation();
+    }
+    replay_file(JOURNAL_OLD_FILE, snap_gen, &old_gen);
+    replay_file(JOURNAL_FILE, snap_gen, &gen);
+    journal.generation = snap_gen;
+    if (old_gen > journal.generation)
+    {
+        journal.generation = old_gen;
+    }
+    if (gen > journal.generation)
+    {
+        journal.generation = gen;
+    }
+
+    if (take_snapshot() != 0)
+    {
+        if (journal.fd >= 0)
+        {
+            close(journal.fd);
+            journal.fd = -1;
+        }
+        free(journal.dir);
+        return -1;
+    }
+
+    journal.cap = journal.spare_cap = 4096;
+    journal.buf = malloc(journal.cap);
+    journal.spare = malloc(journal.spare_cap);
+    if (journal.buf == NULL || journal.spare == NULL)
+    {
+        free(journal.buf);
+        free(journal.spare);
+        close(journal.fd);
+        free(journal.dir);
+        return -1;
+    }
+
+    journal.enabled = 1;
+    pthread_create(&journal.flusher, NULL, flusher_thread, NULL);
+    return 0;
+}
+
+/*
+ * Flush all outstanding records, write a final snapshot and close the
+ * journal.  Must be called before the player registry is finalized.
+ */
+void rjournal_fini(void)
+{
+    jlog_trace("enter");
+
+    if (!journal.enabled)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&journal.mutex);
+    journal.stop = 1;
+    pthread_cond_signal(&journal.work_cond);
+    pthread_mutex_unlock(&journal.mutex);
+    pthread_join(journal.flusher, NULL);
+
+    take_snapshot();
+    journal.enabled = 0;
+    close(journal.fd);
+    free(journal.buf);
+    free(journal.spare);
+    free(journal.dir);
+}
+
+/*
+ * Buffer a record consisting of a username followed by "tail".
+ */
+static unsigned long append_record(char *name, char *record, int tail_len)
+{
+    if (!journal.enabled || strchr(name, '\n') != NULL)
+    {
+        return 0;
+    }
+
+    size_t name_len = strlen(name);
+
+    pthread_mutex_lock(&journal.mutex);
+    size_t need = journal.len + name_len + tail_len;
+    if (need > journal.cap)
+    {
+        size_t cap = journal.cap;
+        while (cap < need)
+        {
+            cap *= 2;
+        }
+        char *buf = realloc(journal.buf, cap);
+        if (buf == NULL)
+        {
+            pthread_mutex_unlock(&journal.mutex);
+            return 0;
+        }
+        journal.buf = buf;
+        journal.cap = cap;
+    }
+    memcpy(journal.buf + journal.len, name, name_len);
+    memcpy(journal.buf + journal.len + name_len, record, tail_len);
+    journal.len = need;
+    unsigned long seq = ++journal.appended_seq;
+    pthread_cond_signal(&journal.work_cond);
+    pthread_mutex_unlock(&journal.mutex);
+
+    return seq;
+}
+
+/*
+ * Append a rating record to the journal.  The record is only buffered;
+ * use rjournal_commit() to wait until it is durable.
+ *
+ * @param name  The username of the player.
+ * @param rating  The player's new rating.
+ * @return  A sequence number identifying the record, or 0 if the
+ * journal is not enabled or the record could not be buffered.
+ */
+unsigned long rjournal_append(char *name, int rating)
+{
+    char record[64];
+    int tail_len = snprintf(record, sizeof(record), "\t%d\n", rating);
+    return append_record(name, record, tail_len);
+}
+
+/*
+ * Append a record of a player's rating together with its Glicko-2 rating
+ * deviation and volatility and the rating period they were computed in,
+ * as for rjournal_append().
+ *
+ * @param name  The username of the player.
+ * @param rating  The player's rating.
+ * @param deviation  The player's rating deviation.
+ * @param volatility  The player's rating volatility.
+ * @param period  The rating period that has just been closed.
+ * @return  A sequence number identifying the record, or 0.
+ */
+unsigned long rjournal_append_glicko(char *name, int rating, double deviation,
+                                     double volatility, unsigned long period)
+{
+    char record[96];
+    int tail_len = snprintf(record, sizeof(record), "\t%d\t%.2f/%.5f/%lu\n",
+                            rating, deviation, volatility, period);
+    return append_record(name, record, tail_len);
+}
+
+/*
+ * Block until the journal record with a specified sequence number (and
+ * therefore every record appended before it) has been synced to disk.
+ * Concurrent callers share the same fdatasync().
+ *
+ * @param seq  The sequence number returned by rjournal_append().
+ * @return 0 if the record is durable (or there is none), or -1 if the
+ * journal failed to make it durable.
+ */
+int rjournal_commit(unsigned long seq)
+{
+    if (seq == 0)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal.mutex);
+    while (journal.enabled && journal.flushed_seq < seq)
+    {
+        pthread_cond_wait(&journal.durable_cond, &journal.mutex);
+    }
+    int ret = journal.enabled && journal.durable_seq < seq ? -1 : 0;
+    pthread_mutex_unlock(&journal.mutex);
+    return ret;
+}
+
+/*
+ * Block until every record appended so far has been synced to disk.
+ *
+ * @return 0 if they are durable, or -1 if the journal has failed.
+ */
+int rjournal_commit_all(void)
+{
+    pthread_mutex_lock(&journal.mutex);
+    unsigned long seq = journal.appended_seq;
+    pthread_mutex_unlock(&journal.mutex);
+    return rjournal_commit(seq);
+}
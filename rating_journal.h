@@ -0,0 +1,34 @@
+#ifndef RATING_JOURNAL_H
+#define RATING_JOURNAL_H
+
+#include "player_registry.h"
+
+/*
+ * Persistent storage of player ratings.
+ *
+ * Every rating change is appended to a journal file as a line of the form
+ * "<username>\t<rating>\n" (the same format as the payload of a USERS ACK).
+ * Records carry absolute ratings, so replaying them is idempotent.  The
+ * Glicko-2 engine appends
+ * "<username>\t<rating>\t<deviation>/<volatility>/<period>\n" records,
+ * whose parameters are restored into the player store.
+ * Appends are group-committed by a background thread which batches all
+ * records accumulated since the previous fdatasync() into a single write.
+ * Every RJOURNAL_SNAPSHOT_INTERVAL records the registry is written out as
+ * a compacted snapshot and the journal is truncated, which bounds the
+ * amount of work needed for recovery.  A batch that cannot be written is
+ * covered by taking a snapshot instead; if that fails as well, commits
+ * report the failure until a later snapshot succeeds.
+ */
+
+#define RJOURNAL_SNAPSHOT_INTERVAL 4096
+
+int rjournal_init(char *dir, PLAYER_REGISTRY *preg);
+void rjournal_fini(void);
+unsigned long rjournal_append(char *name, int rating);
+unsigned long rjournal_append_glicko(char *name, int rating, double deviation,
+                                     double volatility, unsigned long period);
+int rjournal_commit(unsigned long seq);
+int rjournal_commit_all(void);
+
+#endif
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "rating_worker.h"
+#include "rating_journal.h"
+#include "global.h"
+#include "jeux_globals.h"
+#include "jlog.h"
+
+typedef struct result_node {
+    PLAYER *player1;
+    PLAYER *player2;
+    int result;
+    struct result_node *next;
+} RESULT_NODE;
+
+static struct {
+    int running;
+    int stop;
+    RESULT_NODE *head;
+    RESULT_NODE *tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+} worker = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Thread function for the rating worker.  Each iteration detaches the
+ * whole queue, so that results posted while a batch is being applied
+ * are picked up together in the next one.
+ */
+static void *worker_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&worker.mutex);
+        while (!worker.stop && worker.head == NULL)
+        {
+            pthread_cond_wait(&worker.cond, &worker.mutex);
+        }
+        RESULT_NODE *batch = worker.head;
+        worker.head = worker.tail = NULL;
+        int stop = worker.stop;
+        pthread_mutex_unlock(&worker.mutex);
+
+        if (batch == NULL && stop)
+        {
+            break;
+        }
+
+        while (batch != NULL)
+        {
+            RESULT_NODE *node = batch;
+            batch = batch->next;
+            player_post_result(node->player1, node->player2, node->result);
+            preg_release(player_registry, node->player1, "rating update applied");
+            preg_release(player_registry, node->player2, "rating update applied");
+            free(node);
+        }
+        if (rjournal_commit_all() != 0)
+        {
+            jlog_warn("rating updates applied but not durable: the journal has failed");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start the rating worker thread.
+ *
+ * @return 0 if the worker was started, otherwise -1.
+ */
+int rworker_init(void)
+{
+    jlog_trace("enter");
+
+    if (pthread_create(&worker.thread, NULL, worker_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    worker.running = 1;
+    return 0;
+}
+
+/*
+ * Apply all results that are still queued, then stop the rating worker.
+ */
+void rworker_fini(void)
+{
+    jlog_trace("enter");
+
+    if (!worker.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&worker.mutex);
+    worker.stop = 1;
+    pthread_cond_signal(&worker.cond);
+    pthread_mutex_unlock(&worker.mutex);
+    pthread_join(worker.thread, NULL);
+    worker.running = 0;
+}
+
+/*
+ * Queue the result of a game between two players, to be posted by the
+ * rating worker.  A reference to each PLAYER is retained until the
+ * result has been applied.  If the worker is not running, the result
+ * is posted immediately by the calling thread.
+ *
+ * @param player1  One of the PLAYERs that is to be updated.
+ * @param player2  The other PLAYER that is to be updated.
+ * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
+ * @return 0 if the result was queued or posted, otherwise -1.
+ */
+int rworker_post_result(PLAYER *player1, PLAYER *player2, int result)
+{
+    if (!worker.running)
+    {
+        player_post_result(player1, player2, result);
+        if (rjournal_commit_all() != 0)
+        {
+            jlog_warn("rating update applied but not durable: the journal has failed");
+        }
+        return 0;
+    }
+
+    RESULT_NODE *node = malloc(sizeof(RESULT_NODE));
+    if (node == NULL)
+    {
+        return -1;
+    }
+    node->player1 = player_ref(player1, "queued rating update");
+    node->player2 = player_ref(player2, "queued rating update");
+    node->result = result;
+    node->next = NULL;
+
+    pthread_mutex_lock(&worker.mutex);
+    if (worker.tail == NULL)
+    {
+        worker.head = node;
+    }
+    else
+    {
+        worker.tail->next = node;
+    }
+    worker.tail = node;
+    pthread_cond_signal(&worker.cond);
+    pthread_mutex_unlock(&worker.mutex);
+    return 0;
+}
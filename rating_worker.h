@@ -0,0 +1,17 @@
+#ifndef RATING_WORKER_H
+#define RATING_WORKER_H
+
+#include "player.h"
+
+/*
+ * Rating updates are taken off the thread that finishes a game: the
+ * result is queued and a dedicated worker thread applies queued results
+ * in the order in which they were posted, then waits once for the whole
+ * batch to be made durable in the rating journal.
+ */
+
+int rworker_init(void);
+void rworker_fini(void);
+int rworker_post_result(PLAYER *player1, PLAYER *player2, int result);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "reaper.h"
+#include "timer_wheel.h"
+#include "global.h"
+#include "jlog.h"
+
+struct reaper_conn {
+    int fd;
+    int logged_in;
+    unsigned long last_active;      // twheel_now() at the last packet
+    TWHEEL_TIMER *timer;
+};
+
+/*
+ * Timer callback for a connection.  The timer is only ever pushed back
+ * here, when it turns out that the connection has been active since it
+ * was scheduled.
+ */
+static unsigned long connection_timeout(void *arg)
+{
+    REAPER_CONN *conn = arg;
+    unsigned long limit = __atomic_load_n(&conn->logged_in, __ATOMIC_RELAXED) ?
+                          REAPER_IDLE_TIMEOUT_MS : REAPER_LOGIN_TIMEOUT_MS;
+    unsigned long idle = twheel_now() - __atomic_load_n(&conn->last_active, __ATOMIC_RELAXED);
+    if (idle < limit)
+    {
+        return limit - idle;
+    }
+    jlog_info("reaping fd %d after %lu ms without a packet", conn->fd, idle);
+    shutdown(conn->fd, SHUT_RDWR);
+    return 0;
+}
+
+/*
+ * Start watching a new connection, which must log in within
+ * REAPER_LOGIN_TIMEOUT_MS.
+ *
+ * @param fd  The connection's socket.
+ * @return  The handle to be used with the other reaper functions, or
+ * NULL if the connection could not be watched.
+ */
+REAPER_CONN *reaper_watch(int fd)
+{
+    REAPER_CONN *conn = malloc(sizeof(REAPER_CONN));
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->logged_in = 0;
+    conn->last_active = twheel_now();
+    conn->timer = twheel_timer_create(connection_timeout, conn);
+    if (conn->timer == NULL)
+    {
+        free(conn);
+        return NULL;
+    }
+    twheel_timer_schedule(conn->timer, REAPER_LOGIN_TIMEOUT_MS);
+    return conn;
+}
+
+/*
+ * Record activity on a connection.
+ */
+void reaper_touch(REAPER_CONN *conn)
+{
+    if (conn != NULL)
+    {
+        __atomic_store_n(&conn->last_active, twheel_now(), __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Switch a connection from the login deadline to the idle deadline.
+ */
+void reaper_logged_in(REAPER_CONN *conn)
+{
+    if (conn != NULL)
+    {
+        __atomic_store_n(&conn->logged_in, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Stop watching a connection and free its handle.  Once this returns,
+ * the connection's timer callback is not running and will not run.
+ */
+void reaper_unwatch(REAPER_CONN *conn)
+{
+    if (conn == NULL)
+    {
+        return;
+    }
+    twheel_timer_free(conn->timer);
+    free(conn);
+}
+
+/*
+ * The timeout of an open invitation.  An entry holds a reference to the
+ * invitation until it is removed by reaper_forget_invitation().
+ */
+typedef struct reaper_invitation {
+    INVITATION *inv;
+    TWHEEL_TIMER *timer;
+    struct reaper_invitation *next;
+} REAPER_INVITATION;
+
+static struct {
+    REAPER_INVITATION *buckets[REAPER_INVITATION_BUCKETS];
+    pthread_mutex_t mutex;
+} invitations = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static REAPER_INVITATION **bucket(INVITATION *inv)
+{
+    uintptr_t h = (uintptr_t)inv;
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return &invitations.buckets[(h >> 32) & (REAPER_INVITATION_BUCKETS - 1)];
+}
+
+static unsigned long invitation_timeout(void *arg)
+{
+    REAPER_INVITATION *ri = arg;
+    // The entry may be freed by withdrawing the invitation
+    INVITATION *inv = inv_ref(ri->inv, "invitation timeout");
+
+    if (client_withdraw_invitation(inv, NULL) == 0)
+    {
+        jlog_info("invitation %p expired", (void *)inv);
+    }
+    // If it was accepted instead, the accepting thread may not have got here yet
+    reaper_forget_invitation(inv);
+
+    inv_unref(inv, "invitation timeout");
+    return 0;
+}
+
+/*
+ * Withdraw an invitation if it is still open after
+ * REAPER_INVITATION_TIMEOUT_MS: the target is sent REVOKED and the
+ * source is sent DECLINED.  The timeout must be cancelled with
+ * reaper_forget_invitation() once the invitation is accepted or closed.
+ *
+ * @return 0 if the timeout was set, otherwise -1.
+ */
+int reaper_watch_invitation(INVITATION *inv)
+{
+    REAPER_INVITATION *ri = malloc(sizeof(REAPER_INVITATION));
+    if (ri == NULL)
+    {
+        return -1;
+    }
+    ri->timer = twheel_timer_create(invitation_timeout, ri);
+    if (ri->timer == NULL)
+    {
+        free(ri);
+        return -1;
+    }
+    ri->inv = inv_ref(inv, "invitation timeout");
+
+    pthread_mutex_lock(&invitations.mutex);
+    REAPER_INVITATION **head = bucket(inv);
+    ri->next = *head;
+    *head = ri;
+    pthread_mutex_unlock(&invitations.mutex);
+
+    twheel_timer_schedule(ri->timer, REAPER_INVITATION_TIMEOUT_MS);
+    return 0;
+}
+
+/*
+ * Cancel the timeout of an invitation that has been accepted or closed,
+ * and drop its reference to the invitation.  Once this returns, the
+ * timeout is not running (unless this is called from it) and will not
+ * run.  Does nothing if the invitation is not watched.
+ */
+void reaper_forget_invitation(INVITATION *inv)
+{
+    pthread_mutex_lock(&invitations.mutex);
+    REAPER_INVITATION **link = bucket(inv);
+    while (*link != NULL && (*link)->inv != inv)
+    {
+        link = &(*link)->next;
+    }
+    REAPER_INVITATION *ri = *link;
+    if (ri != NULL)
+    {
+        *link = ri->next;
+    }
+    pthread_mutex_unlock(&invitations.mutex);
+
+    if (ri != NULL)
+    {
+        twheel_timer_free(ri->timer);
+        inv_unref(ri->inv, "invitation timeout");
+        free(ri);
+    }
+}
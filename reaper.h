@@ -0,0 +1,36 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include "global.h"
+
+/*
+ * Reaping of idle connections and stale invitations.
+ *
+ * Each connection has a timer on the shared timer wheel.  The service
+ * thread stamps the connection with the wheel time on every packet it
+ * receives, which is a single store; the timer callback compares the
+ * stamp against the deadline that applies and either pushes itself back
+ * or shuts the connection down.  Shutting down the socket makes the
+ * service thread see EOF, so the connection is then cleaned up by the
+ * normal logout path.  Invitations that are still open after
+ * REAPER_INVITATION_TIMEOUT_MS are withdrawn: the target is sent REVOKED
+ * and the source is sent DECLINED.  The timeout of an invitation is
+ * cancelled as soon as it is accepted or closed, so that it does not keep
+ * the invitation and its clients alive.
+ */
+
+#define REAPER_LOGIN_TIMEOUT_MS (15 * 1000)
+#define REAPER_IDLE_TIMEOUT_MS (30 * 60 * 1000)
+#define REAPER_INVITATION_TIMEOUT_MS (5 * 60 * 1000)
+#define REAPER_INVITATION_BUCKETS 1024
+
+typedef struct reaper_conn REAPER_CONN;
+
+REAPER_CONN *reaper_watch(int fd);
+void reaper_touch(REAPER_CONN *conn);
+void reaper_logged_in(REAPER_CONN *conn);
+void reaper_unwatch(REAPER_CONN *conn);
+int reaper_watch_invitation(INVITATION *inv);
+void reaper_forget_invitation(INVITATION *inv);
+
+#endif
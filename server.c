@@ -3,354 +3,596 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
 
 #include "client_registry.h"
 #include "jeux_globals.h"
-#include "debug.h"
+#include "jlog.h"
 // #include "server.h"
 // #include "protocol.h"
 #include "player_registry.h"
+#include "player_store.h"
+#include "server_stats.h"
+#include "reaper.h"
+#include "game_clock.h"
+#include "handoff.h"
+#include "payload.h"
+#include "compress.h"
+#include "matchmaking.h"
+#include "spectate.h"
+#include "tournament.h"
+#include "chat.h"
+#include "bot.h"
+#include "io_loop.h"
 // #include "game.h"
 #include "global.h"
 #include "string.h"
 
-
-
 /*
- * Thread function for the thread that handles a particular client.
- *
- * @param  Pointer to a variable that holds the file descriptor for
- * the client connection.  This pointer must be freed once the file
- * descriptor has been retrieved.
- * @return  NULL
+ * The state of a client connection between packets.
  *
- * This function executes a "service loop" that receives packets from
- * the client and dispatches to appropriate functions to carry out
- * the client's requests.  It also maintains information about whether
- * the client has logged in or not.  Until the client has logged in,
- * only LOGIN packets will be honored.  Once a client has logged in,
- * LOGIN packets will no longer be honored, but other packets will be.
- * The service loop ends when the network connection shuts down and
- * EOF is seen.  This could occur either as a result of the client
- * explicitly closing the connection, a timeout in the network causing
- * the connection to be closed, or the main thread of the server shutting
- * down the connection as part of graceful termination.
+ * A session takes the place of a thread running a service loop for the
+ * client: the event loop (io_loop.h) receives packets from the client
+ * and passes each to jeux_session_packet(), which dispatches to the
+ * functions that carry out the client's requests.  The session records
+ * whether the client has logged in.  It ends when the network connection
+ * shuts down and EOF is seen, whether as a result of the client
+ * explicitly closing the connection, a timeout, or the main thread of
+ * the server shutting down the connection as part of graceful
+ * termination; or when the connection is handed off to a successor
+ * server.
  */
+struct jeux_session {
+    CLIENT *client;
+    REAPER_CONN *reaper;
+    int logged_in;
+};
 
+/*
+ * Start handling a client connection.
+ *
+ * @param client  The registered CLIENT.
+ * @param logged_in  Nonzero if it is already logged in.
+ * @return the session, or NULL if there is no memory, in which case
+ * the client has been unregistered.
+ */
+JEUX_SESSION *jeux_session_open(CLIENT *client, int logged_in) {
+    JEUX_SESSION *session = malloc(sizeof(JEUX_SESSION));
+    if (session == NULL) {
+        shutdown(client_get_fd(client), SHUT_RDWR);
+        creg_unregister(client_registry, client);
+        return NULL;
+    }
+    session->client = client;
+    session->logged_in = logged_in;
 
+    // close the connection if it does not log in, or later goes idle
+    session->reaper = reaper_watch(client_get_fd(client));
+    if (logged_in) {
+        reaper_logged_in(session->reaper);
+    }
+    return session;
+}
 
-void *jeux_client_service(void *arg) {
-    int fd = *(int *)arg;
-    free(arg);
-
-    // detach thread
-    pthread_detach(pthread_self());
-
-    // CLIENT_REGISTRY *client_registry = creg_init();
-
-    // // register client file descriptor with the client registry
-    CLIENT *client = creg_register(client_registry, fd);
-
-    // service loop
-    int logged_in = 0;
-    // int source_id = -1;
-
-    // int invitation_ID = 0;
-
-    // PLAYER *player = NULL;
-    // GAME *game = NULL;
-    while (1) {
-        JEUX_PACKET_HEADER* hdr = malloc(sizeof(JEUX_PACKET_HEADER));
-        void *payload;
-        if (proto_recv_packet(fd, hdr, &payload)) {
-            free(hdr);
-            break;
-        }
-            debug("payload: %s", (char*)payload);
-
-        switch (hdr->type) {
-            /*
-            LOGIN:  The payload portion of the packet contains the player username
-            (not null-terminated) given by the user.
-            Upon receipt of a LOGIN packet, the client_login() function should be called.
-            In case of a successful LOGIN an ACK packet with no payload should be
-            sent back to the client.  In case of an unsuccessful LOGIN, a NACK packet
-            (also with no payload) should be sent back to the client.
-
-            Until a LOGIN has been successfully processed, other packets sent by the
-            client should elicit a NACK response from the server.
-            Once a LOGIN has been successfully processed, other packets should be
-            processed normally, and LOGIN packets should result in a NACK.
-            */
-
-            case JEUX_LOGIN_PKT:
-                debug("packet");
-                if (logged_in) {
-                    // JEUX_PACKET_HEADER *header = malloc(sizeof(JEUX_PACKET_HEADER));
-                    // header->type = JEUX_NACK_PKT;
-                    // header->size = 0;
-                    // proto_send_packet(fd, header, NULL);
-
-                    client_send_nack(client);
-                    
-                    break;
-                }
-                
-                logged_in = 1;
-
-                
+/*
+ * Carry out the request in a packet received from the client.  Until
+ * the client has logged in, only LOGIN packets are honored; once it
+ * has, LOGIN packets are no longer honored, but other packets are.
+ */
+void jeux_session_packet(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, JEUX_PAYLOAD *payload) {
+    CLIENT *client = session->client;
+    int fd = client_get_fd(client);
+    REAPER_CONN *reaper = session->reaper;
+    int logged_in = session->logged_in;
+
+    // The payload as a C string, or NULL if there is none or it is not text
+    char *text = payload_text(payload);
+    struct timespec received;
+    clock_gettime(CLOCK_MONOTONIC, &received);
+    reaper_touch(reaper);
+    jlog_debug("payload: %s", text);
+
+    switch (hdr->type) {
+        /*
+        LOGIN:  The payload portion of the packet contains the player username
+        (not null-terminated) given by the user.
+        Upon receipt of a LOGIN packet, the client_login() function should be called.
+        In case of a successful LOGIN an ACK packet with no payload should be
+        sent back to the client.  In case of an unsuccessful LOGIN, a NACK packet
+        (also with no payload) should be sent back to the client.
+
+        Until a LOGIN has been successfully processed, other packets sent by the
+        client should elicit a NACK response from the server.
+        Once a LOGIN has been successfully processed, other packets should be
+        processed normally, and LOGIN packets should result in a NACK.
+        */
+
+        case JEUX_LOGIN_PKT:
+            jlog_debug("packet");
+            // A name must fit in a player store record
+            if (logged_in || text == NULL || bot_is_name(text) ||
+                strlen(text) >= PSTORE_NAME_MAX) {
                 // JEUX_PACKET_HEADER *header = malloc(sizeof(JEUX_PACKET_HEADER));
-                // header->type = JEUX_ACK_PKT;
+                // header->type = JEUX_NACK_PKT;
                 // header->size = 0;
                 // proto_send_packet(fd, header, NULL);
-                PLAYER *player = preg_register(player_registry, (char*)payload);
-                client_login(client, player);
 
-                client_send_ack(client, NULL, 0);
+                client_send_nack(client);
+                
                 break;
+            }
+            
+            session->logged_in = logged_in = 1;
 
+            
+            // JEUX_PACKET_HEADER *header = malloc(sizeof(JEUX_PACKET_HEADER));
+            // header->type = JEUX_ACK_PKT;
+            // header->size = 0;
+            // proto_send_packet(fd, header, NULL);
+            PLAYER *player = preg_register(player_registry, text);
+            client_login(client, player);
+            if (player != NULL)
+            {
+                preg_release(player_registry, player, "client logged in");
+            }
+            reaper_logged_in(reaper);
+
+            // Agree to compress large payloads if the client can take them
+            JEUX_PACKET_HEADER login_hdr = {0};
+            login_hdr.type = JEUX_ACK_PKT;
+            login_hdr.id = hdr->id & JEUX_LOGIN_COMPRESS;
+            client_send_packet(client, &login_hdr, NULL);
+            proto_set_compression(fd, login_hdr.id & JEUX_LOGIN_COMPRESS);
+            break;
 
-            /*
-            USERS:  This type of packet has no payload.  The server responds by
-            sending an ACK packet whose payload consists of a text string in which
-            each line gives the username of a currently logged in player, followed by
-            a single TAB character, followed by the player's current rating.
-            */
 
-            case JEUX_USERS_PKT:
-                debug("packet");
+        /*
+        USERS:  This type of packet has no payload.  The server responds by
+        sending an ACK packet whose payload consists of a text string in which
+        each line gives the username of a currently logged in player, followed by
+        a single TAB character, followed by the player's current rating.
+        */
 
-                if (!logged_in) {
-                    client_send_nack(client);
-                    break;
-                }
-                
-                // Create an empty response string
-                char response_str[9000] = {0};
+        case JEUX_USERS_PKT:
+            jlog_debug("packet");
 
-                // Loop through all logged-in players and append their usernames and ratings
-                PLAYER **players = creg_all_players(client_registry);
+            if (!logged_in) {
+                client_send_nack(client);
+                break;
+            }
+            
+            // Create an empty response string
+            char response_str[9000] = {0};
 
+            // Loop through all logged-in players and append their usernames and ratings
+            PLAYER **players = creg_all_players(client_registry);
 
-                for (int i = 0; players[i] != NULL; i++) {
-                    debug("in the loop");
-                    // Get the player's username and rating
-                    const char *username = player_get_name(players[i]);
-                    debug("%s", username);
-                    int rating = player_get_rating(players[i]);
 
-                    // Append the username and rating to the response string
-                    snprintf(response_str + strlen(response_str), sizeof(response_str) - strlen(response_str), "%s\t%d\n", username, rating);
-                }
+            for (int i = 0; players[i] != NULL; i++) {
+                jlog_debug("in the loop");
+                // Get the player's username and rating
+                const char *username = player_get_name(players[i]);
+                jlog_debug("%s", username);
+                int rating = player_get_rating(players[i]);
 
-                // Send an ACK packet with the response string as the payload
-                // JEUX_PACKET_HEADER *header = malloc(sizeof(JEUX_PACKET_HEADER));
-                // header->type = JEUX_ACK_PKT;
-                // proto_send_packet(fd, header, response_str);
-                debug("%s", response_str);
-                
-                client_send_ack(client, response_str, strlen(response_str));
+                // Append the username and rating to the response string
+                snprintf(response_str + strlen(response_str), sizeof(response_str) - strlen(response_str), "%s\t%d\n", username, rating);
+            }
+
+            // Send an ACK packet with the response string as the payload
+            // JEUX_PACKET_HEADER *header = malloc(sizeof(JEUX_PACKET_HEADER));
+            // header->type = JEUX_ACK_PKT;
+            // proto_send_packet(fd, header, response_str);
+            jlog_debug("%s", response_str);
+            
+            client_send_ack(client, response_str, strlen(response_str));
+
+            for (int i = 0; players[i] != NULL; i++) {
+                preg_release(player_registry, players[i], "users listed");
+            }
+            free(players);
+            break;
+
+        /*
+        INVITE:  The payload of this type of packet is the username of another
+        player, who is invited to play a game.  The sender of the INVITE is the
+        "source" of the invitation; the invited player is the "target".
+        The role field of the header contains an integer value that specifies the
+        role in the game to which the player is invited (1 for first player to move,
+        2 for second player to move).
+        The server responds either by sending an ACK with no payload in case of
+        success or a NACK with no payload in case of error.  In case of an ACK,
+        the id field of the ACK packet will contain the integer ID that the
+        source client can use to identify that invitation in the future.
+        An INVITED packet will be sent to the target as a notification that the
+        invitation has been made.  This id field of this packet gives an ID that
+        the target can use to identify the invitation.  Note that, in general,
+        the IDs used by the source and target to refer to an invitation will be
+        different from each other.
+        The username may be followed by a TAB and a time control
+        "<base>+<increment>" in seconds (see game_clock.h).
+        */
+
+        case JEUX_INVITE_PKT:
+            jlog_debug("packet");
+
+            if (!logged_in) {
+                client_send_nack(client);
+                break;
+            }
+            
+            int role = hdr->role;
 
-                free(players);
+            if ((role != 1 && role != 2) || text == NULL) {
+                client_send_nack(client);
                 break;
+            }
 
-            /*
-            INVITE:  The payload of this type of packet is the username of another
-            player, who is invited to play a game.  The sender of the INVITE is the
-            "source" of the invitation; the invited player is the "target".
-            The role field of the header contains an integer value that specifies the
-            role in the game to which the player is invited (1 for first player to move,
-            2 for second player to move).
-            The server responds either by sending an ACK with no payload in case of
-            success or a NACK with no payload in case of error.  In case of an ACK,
-            the id field of the ACK packet will contain the integer ID that the
-            source client can use to identify that invitation in the future.
-            An INVITED packet will be sent to the target as a notification that the
-            invitation has been made.  This id field of this packet gives an ID that
-            the target can use to identify the invitation.  Note that, in general,
-            the IDs used by the source and target to refer to an invitation will be
-            different from each other.
-            */
-
-            case JEUX_INVITE_PKT:
-                debug("packet");
-
-                if (!logged_in) {
+            TIME_CONTROL tc;
+            char *time_control = strchr(text, '\t');
+            if (time_control != NULL) {
+                *time_control++ = '\0';
+                if (gclock_parse(time_control, &tc)) {
                     client_send_nack(client);
                     break;
                 }
-                
-                int role = hdr->role;
+            }
 
-                if (role != 1 && role != 2) {
+            if (bot_is_name(text)) {
+                if (bot_play(client, role == 1 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE) != 0) {
                     client_send_nack(client);
                     break;
                 }
+                client_send_ack(client, NULL, 0);
+                break;
+            }
+
+            CLIENT* target = creg_lookup(client_registry, text);
+
+            int inv_id = client_make_timed_invitation(
+                client, target, 
+            role == 1? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE,
+            role == 1? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE,
+            time_control != NULL ? &tc : NULL
+            );
+            if (target != NULL) {
+                client_unref(target, "invited");
+            }
+            if (inv_id < 0) {
+                client_send_nack(client);
+                break;
+            }
 
-                CLIENT* target = creg_lookup(client_registry, (char*)payload);
+            JEUX_PACKET_HEADER invite_hdr = {0};
+            invite_hdr.type = JEUX_ACK_PKT;
+            invite_hdr.id = inv_id;
+            client_send_packet(client, &invite_hdr, NULL);
+        
+            break;
 
-                client_make_invitation(
-                    client, target, 
-                role == 1? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE,
-                role == 1? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE
-                );
 
-                
+        /*
+        REVOKE:  This type of packet has no payload.  The id field of the header
+        contains the ID of the invitation to be revoked.  The revoking player must
+        be the source of that invitation.  The server responds by
+        attempting to revoke the invitation.  If successful, an ACK with no payload
+        sent, otherwise a NACK with no payload is sent.  A successful revocation causes
+        a REVOKED packet to be sent to notify the invitation target.
+        */
+        case JEUX_REVOKE_PKT:
+            jlog_debug("packet");
+
+            if (!logged_in) {
+                client_send_nack(client);
+                break;
+            }
+            if (client_revoke_invitation(client, hdr->id)){
+                client_send_nack(client);
+                break;
+            }
+            client_send_ack(client, NULL, 0);
+            break;
+
+        /*
+          This type of packet is similar to REVOKE, except that it is
+            sent by the target of an invitation in order to decline it.  The server's
+            response is either an ACK or NACK as for REVOKE.  If the invitation is
+            successfully declined, a DECLINED packet is sent to notify the source.
+        */
+        case JEUX_DECLINE_PKT:
+            jlog_debug("packet");
+
+            if (!logged_in) {
+                client_send_nack(client);
+                break;
+            }
+            if (client_decline_invitation(client, hdr->id)){
+                client_send_nack(client);
+                break;
+            }
+            client_send_ack(client, NULL, 0);
+           
+            break;
+        
+        /*
+          This type of packet is sent by the target of an invitation in
+            order to accept it.  The id field of the header contains the ID of the invitation
+            to be accepted.  If the invitation has been revoked or previously accepted,
+            a NACK is sent by the server.  Otherwise a new game is created and an ACK
+            is sent by the server.  If the target's role in the game is that of first player
+            to move, then the payload of the ACK will contain a string describing the
+            initial game state.  In addition, the source of the invitation will be sent an
+            ACCEPTED packet, the id field of which contains the source's ID for the
+            invitation.  If the source's role is that of the first player to move, then
+            the payload of the ACCEPTED packet will contain a string describing the
+            initial game state.
+        */
+        case JEUX_ACCEPT_PKT:
+            jlog_debug("packet");
+            char* msg = NULL;
+
+            if (!logged_in) {
+                client_send_nack(client);
+                break;
+            }
+            if (client_accept_invitation(client, hdr->id, &msg)){
+                client_send_nack(client);
+                break;
+            }
+            if (msg != NULL){
+                client_send_ack(client, msg, strlen(msg));
+                free(msg);
+            }
+            else{
                 client_send_ack(client, NULL, 0);
-            
+            }
+           
+            break;
+        
+        /*
+        This type of packet is sent by a client to make a move in a game
+        in progress.  The id field of the header contains the client's ID for the
+        invitation that resulted in the game.  The payload of the packet contains a
+        string describing the move.  For the tic-tac-toe game, a move string may
+        consist either of a single digit in the range ['1' - '9'], or a string consisting
+        of such a digit, followed either by "<-X" or "<-O".  The latter forms specify
+        the role of the player making the move as well as the square to be occupied
+        by the player's mark.  The server will respond with ACK with no payload if
+        the move is legal and is successfully applied to the game state, otherwise
+        with NACK with no payload.  In addition, the opponent of the player making
+        the move will be sent a MOVED packet, the id field of which contains the
+        opponent's ID for the game and the payload of which contains a string that
+        describes the new game state after the move.
+        */
+        case JEUX_MOVE_PKT:
+            jlog_debug("packet");
+
+            if (!logged_in) {
+                client_send_nack(client);
+                break;
+            }
+            if (text == NULL || client_make_move(client, hdr->id, text)){
+                client_send_nack(client);
                 break;
+            }
+            client_send_ack(client, NULL, 0);
 
+            break;
 
-            /*
-            REVOKE:  This type of packet has no payload.  The id field of the header
-            contains the ID of the invitation to be revoked.  The revoking player must
-            be the source of that invitation.  The server responds by
-            attempting to revoke the invitation.  If successful, an ACK with no payload
-            sent, otherwise a NACK with no payload is sent.  A successful revocation causes
-            a REVOKED packet to be sent to notify the invitation target.
-            */
-            case JEUX_REVOKE_PKT:
-                debug("packet");
 
-                if (!logged_in) {
-                    client_send_nack(client);
-                    break;
-                }
-                client_revoke_invitation(client, hdr->id);
-                client_send_ack(client, NULL, 0);
+        /*
+        This type of packet is sent by a client to resign a game in
+        progress.  The id field of the header contains the client's ID for the
+        invitation that resulted in the game.  There is no payload.
+        If the resignation is successful, then the server responds with ACK,
+        otherwise with NACK.  In addition, the opponent of the player who is
+        resigning is sent a RESIGNED packet, the id field of which contains the
+        opponent's ID for the game.
+        */
+        case JEUX_RESIGN_PKT:
+            jlog_debug("packet");
 
-               
+            if (!logged_in) {
+                client_send_nack(client);
+                break;
+            }
+            if (client_resign_game(client, hdr->id)){
+                client_send_nack(client);
+                break;
+            }
+            client_send_ack(client, NULL, 0);
+           
+            break;
+        
+        /*
+        STATS:  This type of packet has no payload.  The server responds by
+        sending an ACK packet whose payload is the report produced by
+        stats_report(): per packet type, the number of packets received and
+        the time taken to respond to them.
+        */
+        case JEUX_STATS_PKT:
+            jlog_debug("packet");
+
+            if (!logged_in) {
+                client_send_nack(client);
                 break;
+            }
 
-            /*
-              This type of packet is similar to REVOKE, except that it is
-                sent by the target of an invitation in order to decline it.  The server's
-                response is either an ACK or NACK as for REVOKE.  If the invitation is
-                successfully declined, a DECLINED packet is sent to notify the source.
-            */
-            case JEUX_DECLINE_PKT:
-                debug("packet");
+            char report[STATS_REPORT_MAX];
+            size_t report_len = stats_report(report, sizeof(report));
+            client_send_ack(client, report, report_len);
+            break;
 
-                if (!logged_in) {
-                    client_send_nack(client);
-                    break;
-                }
-                if (client_decline_invitation(client, hdr->id)){
-                    client_send_nack(client);
-                    break;
-                }
-                client_send_ack(client, NULL, 0);
-               
-                break;
-            
-            /*
-              This type of packet is sent by the target of an invitation in
-                order to accept it.  The id field of the header contains the ID of the invitation
-                to be accepted.  If the invitation has been revoked or previously accepted,
-                a NACK is sent by the server.  Otherwise a new game is created and an ACK
-                is sent by the server.  If the target's role in the game is that of first player
-                to move, then the payload of the ACK will contain a string describing the
-                initial game state.  In addition, the source of the invitation will be sent an
-                ACCEPTED packet, the id field of which contains the source's ID for the
-                invitation.  If the source's role is that of the first player to move, then
-                the payload of the ACCEPTED packet will contain a string describing the
-                initial game state.
-            */
-            case JEUX_ACCEPT_PKT:
-                debug("packet");
-                char* msg = NULL;
-
-                if (!logged_in) {
-                    client_send_nack(client);
-                    break;
-                }
-                if (client_accept_invitation(client, hdr->id, &msg)){
-                    client_send_nack(client);
-                    break;
-                }
-                if (msg != NULL){
-                    client_send_ack(client, msg, strlen(msg));
-                    free(msg);
-                }
-                else{
-                    client_send_ack(client, NULL, 0);
-                }
-               
+        /*
+        SEEK:  This type of packet has no payload.  The client is queued
+        to be paired with another player of similar rating, and is sent an
+        ACK, or a NACK if it is already queued.  When it is paired, it is
+        sent ACCEPTED with its ID for the game and its role.
+        */
+        case JEUX_SEEK_PKT:
+            jlog_debug("packet");
+
+            if (!logged_in || mm_seek(client) != 0) {
+                client_send_nack(client);
                 break;
-            
-            /*
-            This type of packet is sent by a client to make a move in a game
-            in progress.  The id field of the header contains the client's ID for the
-            invitation that resulted in the game.  The payload of the packet contains a
-            string describing the move.  For the tic-tac-toe game, a move string may
-            consist either of a single digit in the range ['1' - '9'], or a string consisting
-            of such a digit, followed either by "<-X" or "<-O".  The latter forms specify
-            the role of the player making the move as well as the square to be occupied
-            by the player's mark.  The server will respond with ACK with no payload if
-            the move is legal and is successfully applied to the game state, otherwise
-            with NACK with no payload.  In addition, the opponent of the player making
-            the move will be sent a MOVED packet, the id field of which contains the
-            opponent's ID for the game and the payload of which contains a string that
-            describes the new game state after the move.
-            */
-            case JEUX_MOVE_PKT:
-                debug("packet");
-
-                if (!logged_in) {
-                    client_send_nack(client);
-                    break;
-                }
-                if (client_make_move(client, hdr->id, payload)){
-                    client_send_nack(client);
-                    break;
-                }
-                client_send_ack(client, NULL, 0);
+            }
+            client_send_ack(client, NULL, 0);
+            break;
 
+        /*
+        WATCH:  The payload is the username of a player.  The client starts
+        watching that player's game in progress, and is sent an ACK whose ID
+        identifies the game and whose payload is the current state, or a
+        NACK if the player is not playing.  The game's MOVED and ENDED
+        packets are then also sent to the client, with that ID.
+        */
+        case JEUX_WATCH_PKT:
+            jlog_debug("packet");
+
+            char *watch_state;
+            int watch_id;
+            if (!logged_in || text == NULL ||
+                (watch_id = spect_watch(client, text, &watch_state)) < 0) {
+                client_send_nack(client);
                 break;
+            }
+            JEUX_PACKET_HEADER watch_hdr = {0};
+            watch_hdr.type = JEUX_ACK_PKT;
+            watch_hdr.id = watch_id;
+            watch_hdr.size = strlen(watch_state);
+            client_send_packet(client, &watch_hdr, watch_state);
+            free(watch_state);
+            break;
 
+        /*
+        UNWATCH:  The client stops watching the game with the ID in the
+        header.
+        */
+        case JEUX_UNWATCH_PKT:
+            jlog_debug("packet");
 
-            /*
-            This type of packet is sent by a client to resign a game in
-            progress.  The id field of the header contains the client's ID for the
-            invitation that resulted in the game.  There is no payload.
-            If the resignation is successful, then the server responds with ACK,
-            otherwise with NACK.  In addition, the opponent of the player who is
-            resigning is sent a RESIGNED packet, the id field of which contains the
-            opponent's ID for the game.
-            */
-            case JEUX_RESIGN_PKT:
-                debug("packet");
+            if (!logged_in || spect_unwatch(client, hdr->id) != 0) {
+                client_send_nack(client);
+                break;
+            }
+            client_send_ack(client, NULL, 0);
+            break;
 
-                if (!logged_in) {
-                    client_send_nack(client);
-                    break;
-                }
-                if (client_resign_game(client, hdr->id)){
+        /*
+        TOURNEY:  The payload is a tournament command (see tournament.h).
+        The client is sent an ACK whose ID is that of the tournament, or
+        a NACK if the command fails.
+        */
+        case JEUX_TOURNEY_PKT:
+            jlog_debug("packet");
+
+            int tourney_id;
+            if (!logged_in ||
+                (tourney_id = tourney_command(client, hdr->id, text)) < 0) {
+                client_send_nack(client);
+                break;
+            }
+            JEUX_PACKET_HEADER tourney_hdr = {0};
+            tourney_hdr.type = JEUX_ACK_PKT;
+            tourney_hdr.id = tourney_id;
+            client_send_packet(client, &tourney_hdr, NULL);
+            break;
+
+        /*
+        ROOM:  The payload is the name of a room, which the client joins.
+        It is sent an ACK whose ID identifies the room, followed by the
+        room's recent messages as SAY packets, or a NACK.  With no payload,
+        the client leaves the room with the ID in the header, and is sent
+        an ACK or a NACK.
+        */
+        case JEUX_ROOM_PKT:
+            jlog_debug("packet");
+
+            if (!logged_in) {
+                client_send_nack(client);
+                break;
+            }
+            if (payload->len > 0) {
+                // chat_join() sends the ACK, before the history
+                if (chat_join(client, text) < 0) {
                     client_send_nack(client);
-                    break;
                 }
-                client_send_ack(client, NULL, 0);
-               
                 break;
-            
-            case JEUX_ENDED_PKT:
+            }
+            if (chat_leave(client, hdr->id) != 0) {
+                client_send_nack(client);
                 break;
-            default:
+            }
+            client_send_ack(client, NULL, 0);
+            break;
+
+        /*
+        SAY:  The payload is text, which is sent to every member of the
+        room with the ID in the header, the client included, as SAY with
+        that ID and the client's username and a TAB before the text.  The
+        client is sent an ACK, or a NACK if it is not in the room.
+        */
+        case JEUX_SAY_PKT:
+            jlog_debug("packet");
+
+            if (!logged_in || chat_say(client, hdr->id, text) != 0) {
                 client_send_nack(client);
                 break;
+            }
+            client_send_ack(client, NULL, 0);
+            break;
 
+        /*
+        WHISPER:  The payload is a username, a TAB and text, which is sent
+        to that user alone as WHISPER, with the client's username in place
+        of the target's.  The client is sent an ACK, or a NACK if the user
+        is not logged in.
+        */
+        case JEUX_WHISPER_PKT:
+            jlog_debug("packet");
 
-        }
-        free(payload);
-        free(hdr);
+            if (!logged_in || chat_whisper(client, text) != 0) {
+                client_send_nack(client);
+                break;
+            }
+            client_send_ack(client, NULL, 0);
+            break;
 
-    }
+        case JEUX_ENDED_PKT:
+            break;
+        default:
+            client_send_nack(client);
+            break;
 
-    if (client_get_player(client) != NULL){
-        client_logout(client);
-    }
-    creg_unregister(client_registry, client);
 
-    return NULL;
+    }
+    struct timespec responded;
+    clock_gettime(CLOCK_MONOTONIC, &responded);
+    stats_record(hdr->type,
+                 (responded.tv_sec - received.tv_sec) * 1000000000UL +
+                 responded.tv_nsec - received.tv_nsec);
+    payload_free(payload);
 }
 
+/*
+ * Stop handling a client connection, logging the client out and
+ * unregistering it unless its connection was handed off to a successor
+ * server.
+ */
+void jeux_session_close(JEUX_SESSION *session, int handed_off) {
+    CLIENT *client = session->client;
+
+    reaper_unwatch(session->reaper);
+    free(session);
+
+    if (!handed_off) {
+        if (client_get_player(client) != NULL){
+            client_logout(client);
+        }
+        // The descriptor is closed with the CLIENT, so no one else reuses it meanwhile
+        proto_set_compression(client_get_fd(client), 0);
+        shutdown(client_get_fd(client), SHUT_RDWR);
+        creg_unregister(client_registry, client);
+    }
+}
@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "server_stats.h"
+#include "histogram.h"
+#include "chat.h"
+#include "jlog.h"
+
+typedef struct histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long sum;
+    unsigned long max;
+} HISTOGRAM;
+
+static const char *type_names[STATS_NUM_TYPES] = {
+    "NONE", "LOGIN", "USERS", "INVITE", "REVOKE", "DECLINE", "ACCEPT",
+    "MOVE", "RESIGN", "ACK", "NACK", "INVITED", "REVOKED", "DECLINED",
+    "ACCEPTED", "MOVED", "RESIGNED", "ENDED", "STATS",
+    [JEUX_SEEK_PKT] = "SEEK", "WATCH", "UNWATCH", "TOURNEY",
+    "SAY", "WHISPER", "ROOM"
+};
+
+static HISTOGRAM histograms[STATS_NUM_TYPES];
+static HISTOGRAM unknown;
+
+static struct {
+    int running;
+    int stop;
+    char *dump_file;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+} dumper = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Record the time taken to handle one packet.
+ *
+ * @param type  The type of the packet received.
+ * @param nsec  Time from receipt of the packet to the response, in
+ * nanoseconds.
+ */
+void stats_record(int type, unsigned long nsec)
+{
+    HISTOGRAM *h = (type >= 0 && type < STATS_NUM_TYPES && type_names[type] != NULL) ?
+                   &histograms[type] : &unknown;
+    __atomic_fetch_add(&h->counts[hist_index(nsec)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, nsec, __ATOMIC_RELAXED);
+
+    unsigned long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (nsec > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, nsec, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static size_t report_line(char *buf, size_t size, const char *name, HISTOGRAM *h)
+{
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    unsigned long sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    unsigned long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    int n = snprintf(buf, size, "%s\t%lu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+                     name, total, sum / (double)total / 1000.0,
+                     hist_percentile(counts, total, 50.0) / 1000.0,
+                     hist_percentile(counts, total, 99.0) / 1000.0,
+                     hist_percentile(counts, total, 99.9) / 1000.0,
+                     max / 1000.0);
+    if (n < 0 || (size_t)n >= size)
+    {
+        return 0;
+    }
+    return n;
+}
+
+/*
+ * Format the current counters and latencies.
+ *
+ * @param buf  Buffer to receive the report as a NUL-terminated string.
+ * @param size  Size of the buffer; lines that do not fit are omitted.
+ * @return  Length of the report, not counting the NUL.
+ */
+size_t stats_report(char *buf, size_t size)
+{
+    size_t len = 0;
+    if (size == 0)
+    {
+        return 0;
+    }
+    buf[0] = '\0';
+    for (int type = 0; type < STATS_NUM_TYPES; type++)
+    {
+        if (type_names[type] == NULL)
+        {
+            continue;
+        }
+        len += report_line(buf + len, size - len, type_names[type], &histograms[type]);
+    }
+    len += report_line(buf + len, size - len, "UNKNOWN", &unknown);
+    return len;
+}
+
+/*
+ * Write the report to the dump file.  It is written to a temporary file
+ * which is then renamed, so that readers never see a partial report.
+ */
+static void dump_report(void)
+{
+    char report[STATS_REPORT_MAX];
+    char tmp[4096];
+    size_t len = stats_report(report, sizeof(report));
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dumper.dump_file);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+    {
+        jlog_warn("cannot open %s", tmp);
+        return;
+    }
+    fprintf(f, "# type\tcount\tmean_us\tp50_us\tp99_us\tp999_us\tmax_us\n");
+    fwrite(report, 1, len, f);
+    if (fclose(f) != 0 || rename(tmp, dumper.dump_file) != 0)
+    {
+        jlog_warn("cannot write %s", dumper.dump_file);
+        unlink(tmp);
+    }
+}
+
+static void *dump_thread(void *arg)
+{
+    pthread_mutex_lock(&dumper.mutex);
+    while (!dumper.stop)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += STATS_DUMP_INTERVAL;
+        int rc = 0;
+        while (!dumper.stop && rc != ETIMEDOUT)
+        {
+            rc = pthread_cond_timedwait(&dumper.cond, &dumper.mutex, &deadline);
+        }
+        pthread_mutex_unlock(&dumper.mutex);
+        dump_report();
+        pthread_mutex_lock(&dumper.mutex);
+    }
+    pthread_mutex_unlock(&dumper.mutex);
+    return NULL;
+}
+
+/*
+ * Start writing the report to a file every STATS_DUMP_INTERVAL seconds.
+ * Counters are collected whether or not this has been called.
+ *
+ * @param dump_file  Pathname of the file to write.
+ * @return 0 if successful, otherwise -1.
+ */
+int stats_init(char *dump_file)
+{
+    jlog_trace("enter");
+
+    dumper.dump_file = dump_file;
+    if (pthread_create(&dumper.thread, NULL, dump_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    dumper.running = 1;
+    return 0;
+}
+
+/*
+ * Stop the periodic dump, after writing the report a final time.
+ */
+void stats_fini(void)
+{
+    jlog_trace("enter");
+
+    if (!dumper.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&dumper.mutex);
+    dumper.stop = 1;
+    pthread_cond_signal(&dumper.cond);
+    pthread_mutex_unlock(&dumper.mutex);
+    pthread_join(dumper.thread, NULL);
+    dumper.running = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <stddef.h>
+#include "protocol.h"
+
+/*
+ * Per-packet-type counters and latency histograms.
+ *
+ * The service loop records, for every packet it receives, the time from
+ * the packet having been read to its ACK or NACK having been sent.  Each
+ * packet type has its own histogram in nanoseconds, with the buckets of
+ * histogram.h.  Buckets are updated with atomic increments, so recording
+ * never takes a lock.
+ *
+ * A STATS packet (no payload) is answered with an ACK whose payload is
+ * the current report, one line per packet type that has been seen:
+ * "<type>\t<count>\t<mean>\t<p50>\t<p99>\t<p999>\t<max>\n", with times
+ * in microseconds.
+ */
+
+#define JEUX_STATS_PKT (JEUX_ENDED_PKT + 1)
+
+// Packet types after STATS are defined by the modules that handle them
+#define STATS_NUM_TYPES 32
+
+#define STATS_DUMP_INTERVAL 10
+#define STATS_REPORT_MAX 4096
+
+int stats_init(char *dump_file);
+void stats_fini(void);
+void stats_record(int type, unsigned long nsec);
+size_t stats_report(char *buf, size_t size);
+
+#endif
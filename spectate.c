@@ -0,0 +1,594 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "spectate.h"
+#include "jeux_globals.h"
+#include "global.h"
+#include "jlog.h"
+
+/*
+ * A packet to be sent to every watcher of a game, shared by reference.
+ * The header is in network byte order.
+ */
+typedef struct spect_buffer {
+    int refs;
+    JEUX_PACKET_HEADER hdr;
+    char payload[];
+} SPECT_BUFFER;
+
+typedef struct watcher {
+    CLIENT *client;
+    struct channel *channel;        // NULL once the watcher has been detached
+    int index;                      // In channel->watchers
+    SPECT_BUFFER *pending;          // Latest packet not yet sent
+    int queued;                     // In spect.backlog
+    int detached;                   // To be freed once off the backlog
+    struct watcher *client_next;    // Watchers of the same client's bucket
+} WATCHER;
+
+/*
+ * The subscribers of a watched GAME.  "latest", "dirty", "ended" and
+ * "dirty_next" are protected by spect.publish_mutex, the rest by
+ * spect.mutex.
+ */
+typedef struct channel {
+    GAME *game;
+    int id;
+    WATCHER **watchers;
+    int nwatchers;
+    int capacity;
+    SPECT_BUFFER *latest;
+    int dirty;
+    int ended;
+    struct channel *dirty_next;
+    struct channel *hash_next;
+} CHANNEL;
+
+/*
+ * Lock order: spect.mutex, then spect.publish_mutex.  Moving threads take
+ * only spect.publish_mutex, which is never held for long.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    WATCHER *by_client[SPECTATE_BUCKETS];
+    WATCHER **backlog;              // Watchers with a pending packet
+    int nbacklog;
+    int backlog_capacity;
+    int next_id;
+
+    pthread_mutex_t publish_mutex;
+    pthread_cond_t cond;
+    CHANNEL *by_game[SPECTATE_BUCKETS];
+    CHANNEL *dirty;
+    int running;
+    int stop;
+    pthread_t thread;
+} spect = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .publish_mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static unsigned int hash_pointer(void *p)
+{
+    uintptr_t h = (uintptr_t)p;
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & (SPECTATE_BUCKETS - 1);
+}
+
+static SPECT_BUFFER *buffer_new(JEUX_PACKET_TYPE type, int id, GAME_ROLE role,
+                                char *payload, size_t len)
+{
+    SPECT_BUFFER *buf = malloc(sizeof(SPECT_BUFFER) + len);
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+    buf->refs = 1;
+    memset(&buf->hdr, 0, sizeof(buf->hdr));
+    buf->hdr.type = type;
+    buf->hdr.id = id;
+    buf->hdr.role = role;
+    buf->hdr.size = htons(len);
+    if (len > 0)
+    {
+        memcpy(buf->payload, payload, len);
+    }
+    return buf;
+}
+
+static SPECT_BUFFER *buffer_ref(SPECT_BUFFER *buf)
+{
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+static void buffer_unref(SPECT_BUFFER *buf)
+{
+    if (buf != NULL && __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(buf);
+    }
+}
+
+// Called with spect.publish_mutex held
+static CHANNEL **channel_slot(GAME *game)
+{
+    CHANNEL **link = &spect.by_game[hash_pointer(game)];
+    while (*link != NULL && (*link)->game != game)
+    {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+// Called with spect.publish_mutex held
+static void publish(CHANNEL *ch, SPECT_BUFFER *buf)
+{
+    buffer_unref(ch->latest);
+    ch->latest = buf;
+    if (!ch->dirty)
+    {
+        ch->dirty = 1;
+        ch->dirty_next = spect.dirty;
+        spect.dirty = ch;
+        pthread_cond_signal(&spect.cond);
+    }
+}
+
+// Called with spect.mutex held
+static void backlog_add(WATCHER *w)
+{
+    if (w->queued)
+    {
+        return;
+    }
+    if (spect.nbacklog == spect.backlog_capacity)
+    {
+        int capacity = spect.backlog_capacity ? 2 * spect.backlog_capacity : 64;
+        WATCHER **backlog = realloc(spect.backlog, capacity * sizeof(WATCHER *));
+        if (backlog == NULL)
+        {
+            return;
+        }
+        spect.backlog = backlog;
+        spect.backlog_capacity = capacity;
+    }
+    spect.backlog[spect.nbacklog++] = w;
+    w->queued = 1;
+}
+
+static void watcher_free(WATCHER *w)
+{
+    buffer_unref(w->pending);
+    client_unref(w->client, "no longer watching");
+    free(w);
+}
+
+/*
+ * Remove a watcher from its channel and its client's list.  It is freed
+ * now, or by the broadcaster once it is off the backlog.  Called with
+ * spect.mutex held.
+ */
+static void watcher_detach(WATCHER *w)
+{
+    CHANNEL *ch = w->channel;
+    if (ch != NULL)
+    {
+        WATCHER *last = ch->watchers[--ch->nwatchers];
+        ch->watchers[w->index] = last;
+        last->index = w->index;
+        w->channel = NULL;
+    }
+    WATCHER **link = &spect.by_client[hash_pointer(w->client)];
+    while (*link != NULL && *link != w)
+    {
+        link = &(*link)->client_next;
+    }
+    if (*link != NULL)
+    {
+        *link = w->client_next;
+    }
+    w->detached = 1;
+    if (!w->queued)
+    {
+        watcher_free(w);
+    }
+}
+
+/*
+ * Free a channel that has ended, or that nobody watches any more and has
+ * nothing left to send.  Called with both locks held.
+ */
+static void channel_release(CHANNEL *ch)
+{
+    while (ch->nwatchers > 0)
+    {
+        watcher_detach(ch->watchers[0]);
+    }
+    *channel_slot(ch->game) = ch->hash_next;
+    buffer_unref(ch->latest);
+    game_unref(ch->game, "no longer watched");
+    free(ch->watchers);
+    free(ch);
+}
+
+/*
+ * Hand the latest packet of every channel that has changed to each of
+ * its watchers.  Called with spect.mutex held.
+ */
+static void fan_out(void)
+{
+    pthread_mutex_lock(&spect.publish_mutex);
+    CHANNEL *ch = spect.dirty;
+    spect.dirty = NULL;
+    while (ch != NULL)
+    {
+        CHANNEL *next = ch->dirty_next;
+        ch->dirty = 0;
+        for (int i = 0; i < ch->nwatchers && ch->latest != NULL; i++)
+        {
+            WATCHER *w = ch->watchers[i];
+            buffer_unref(w->pending);
+            w->pending = buffer_ref(ch->latest);
+            backlog_add(w);
+        }
+        if (ch->ended || ch->nwatchers == 0)
+        {
+            channel_release(ch);
+        }
+        ch = next;
+    }
+    pthread_mutex_unlock(&spect.publish_mutex);
+}
+
+/*
+ * Send the pending packet of each watcher on the backlog whose socket is
+ * writable.  A small packet sent to a socket that polls writable does not
+ * block.  Called with spect.mutex held.
+ */
+static void send_backlog(void)
+{
+    if (spect.nbacklog == 0)
+    {
+        return;
+    }
+    struct pollfd *fds = malloc(spect.nbacklog * sizeof(struct pollfd));
+    if (fds == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < spect.nbacklog; i++)
+    {
+        fds[i].fd = client_get_fd(spect.backlog[i]->client);
+        fds[i].events = POLLOUT;
+        fds[i].revents = 0;
+    }
+    poll(fds, spect.nbacklog, 0);
+
+    int kept = 0;
+    for (int i = 0; i < spect.nbacklog; i++)
+    {
+        WATCHER *w = spect.backlog[i];
+        if (fds[i].revents == 0)
+        {
+            spect.backlog[kept++] = w;
+            continue;
+        }
+        SPECT_BUFFER *buf = w->pending;
+        w->pending = NULL;
+        w->queued = 0;
+        if (buf != NULL && !(fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)))
+        {
+            proto_send_packet(fds[i].fd, &buf->hdr, buf->payload);
+        }
+        buffer_unref(buf);
+        if (w->detached)
+        {
+            watcher_free(w);
+        }
+    }
+    spect.nbacklog = kept;
+    free(fds);
+}
+
+static void *broadcaster_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&spect.mutex);
+        int backlog = spect.nbacklog > 0;
+        pthread_mutex_unlock(&spect.mutex);
+
+        pthread_mutex_lock(&spect.publish_mutex);
+        if (!spect.stop && spect.dirty == NULL)
+        {
+            if (backlog)
+            {
+                struct timespec deadline;
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_nsec += SPECTATE_RETRY_MS * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&spect.cond, &spect.publish_mutex, &deadline);
+            }
+            else
+            {
+                pthread_cond_wait(&spect.cond, &spect.publish_mutex);
+            }
+        }
+        int stop = spect.stop;
+        pthread_mutex_unlock(&spect.publish_mutex);
+        if (stop)
+        {
+            break;
+        }
+
+        pthread_mutex_lock(&spect.mutex);
+        fan_out();
+        send_backlog();
+        pthread_mutex_unlock(&spect.mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Start the broadcaster thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int spect_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&spect.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&spect.thread, NULL, broadcaster_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    spect.running = 1;
+    return 0;
+}
+
+/*
+ * Stop the broadcaster thread and drop all watchers.
+ */
+void spect_fini(void)
+{
+    if (!spect.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&spect.publish_mutex);
+    spect.stop = 1;
+    pthread_cond_signal(&spect.cond);
+    pthread_mutex_unlock(&spect.publish_mutex);
+    pthread_join(spect.thread, NULL);
+    spect.running = 0;
+
+    pthread_mutex_lock(&spect.mutex);
+    pthread_mutex_lock(&spect.publish_mutex);
+    for (int i = 0; i < SPECTATE_BUCKETS; i++)
+    {
+        while (spect.by_game[i] != NULL)
+        {
+            channel_release(spect.by_game[i]);
+        }
+    }
+    for (int i = 0; i < spect.nbacklog; i++)
+    {
+        watcher_free(spect.backlog[i]);
+    }
+    spect.nbacklog = 0;
+    free(spect.backlog);
+    spect.backlog = NULL;
+    pthread_mutex_unlock(&spect.publish_mutex);
+    pthread_mutex_unlock(&spect.mutex);
+}
+
+// Get a reference to the game in progress of a logged-in player
+static GAME *find_game(char *username)
+{
+    CLIENT *player = creg_lookup(client_registry, username);
+    if (player == NULL)
+    {
+        return NULL;
+    }
+    GAME *game = NULL;
+    pthread_mutex_lock(&player->lock);
+    for (INVITATION_NODE *node = player->invitations; node != NULL; node = node->next)
+    {
+        GAME *g = inv_get_game(node->invitation);
+        if (g != NULL && !game_is_over(g))
+        {
+            game = game_ref(g, "being watched");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&player->lock);
+    client_unref(player, "found game to watch");
+    return game;
+}
+
+/*
+ * Start watching the game in progress of a player.
+ *
+ * @param client  The logged-in CLIENT that is to watch.
+ * @param username  The name of a player in the game.
+ * @param statep  Set to the current state of the game, which the caller
+ * must free.
+ * @return the watcher's ID for the game, or -1 if the player is not
+ * playing, or the client is already watching the game.
+ */
+int spect_watch(CLIENT *client, char *username, char **statep)
+{
+    if (client_get_player(client) == NULL || !spect.running)
+    {
+        return -1;
+    }
+    GAME *game = find_game(username);
+    if (game == NULL)
+    {
+        return -1;
+    }
+    WATCHER *w = calloc(1, sizeof(WATCHER));
+    char *state = game_unparse_state(game);
+    if (w == NULL || state == NULL)
+    {
+        free(w);
+        free(state);
+        game_unref(game, "not watched");
+        return -1;
+    }
+
+    int id = -1;
+    pthread_mutex_lock(&spect.mutex);
+    pthread_mutex_lock(&spect.publish_mutex);
+    CHANNEL *ch = *channel_slot(game);
+    if (ch == NULL && !game_is_over(game) && (ch = calloc(1, sizeof(CHANNEL))) != NULL)
+    {
+        ch->game = game_ref(game, "watched");
+        ch->id = ++spect.next_id;
+        ch->hash_next = NULL;
+        *channel_slot(game) = ch;
+    }
+    int watching = 0;
+    for (WATCHER *other = spect.by_client[hash_pointer(client)]; other != NULL; other = other->client_next)
+    {
+        watching |= other->client == client && other->channel == ch;
+    }
+    if (ch != NULL && !ch->ended && !watching)
+    {
+        if (ch->nwatchers == ch->capacity)
+        {
+            int capacity = ch->capacity ? 2 * ch->capacity : 4;
+            WATCHER **watchers = realloc(ch->watchers, capacity * sizeof(WATCHER *));
+            if (watchers != NULL)
+            {
+                ch->watchers = watchers;
+                ch->capacity = capacity;
+            }
+        }
+        if (ch->nwatchers < ch->capacity)
+        {
+            w->client = client_ref(client, "watching");
+            w->channel = ch;
+            w->index = ch->nwatchers;
+            ch->watchers[ch->nwatchers++] = w;
+            WATCHER **head = &spect.by_client[hash_pointer(client)];
+            w->client_next = *head;
+            *head = w;
+            id = ch->id;
+        }
+    }
+    if (ch != NULL && ch->nwatchers == 0 && !ch->dirty)
+    {
+        channel_release(ch);
+    }
+    pthread_mutex_unlock(&spect.publish_mutex);
+    pthread_mutex_unlock(&spect.mutex);
+    game_unref(game, "being watched");
+
+    if (id < 0)
+    {
+        free(w);
+        free(state);
+        return -1;
+    }
+    *statep = state;
+    return id;
+}
+
+/*
+ * Stop watching a game.
+ *
+ * @param client  The watching CLIENT.
+ * @param id  The ID returned by spect_watch().
+ * @return 0 if successful, or -1 if the client was not watching the game.
+ */
+int spect_unwatch(CLIENT *client, int id)
+{
+    int rc = -1;
+    pthread_mutex_lock(&spect.mutex);
+    for (WATCHER *w = spect.by_client[hash_pointer(client)]; w != NULL; w = w->client_next)
+    {
+        if (w->client == client && w->channel != NULL && w->channel->id == id)
+        {
+            watcher_detach(w);
+            rc = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spect.mutex);
+    return rc;
+}
+
+/*
+ * Stop all watching by a client that is logging out.
+ */
+void spect_client_gone(CLIENT *client)
+{
+    pthread_mutex_lock(&spect.mutex);
+    WATCHER *w = spect.by_client[hash_pointer(client)];
+    while (w != NULL)
+    {
+        WATCHER *next = w->client_next;
+        if (w->client == client)
+        {
+            watcher_detach(w);
+        }
+        w = next;
+    }
+    pthread_mutex_unlock(&spect.mutex);
+}
+
+/*
+ * Publish the state of a game after a move, if it is being watched.
+ *
+ * @param game  The game.
+ * @param state  The state of the game, as sent in MOVED to the opponent.
+ */
+void spect_moved(GAME *game, char *state)
+{
+    pthread_mutex_lock(&spect.publish_mutex);
+    CHANNEL *ch = *channel_slot(game);
+    if (ch != NULL && !ch->ended)
+    {
+        SPECT_BUFFER *buf = buffer_new(JEUX_MOVED_PKT, ch->id, NULL_ROLE, state, strlen(state));
+        if (buf != NULL)
+        {
+            publish(ch, buf);
+        }
+    }
+    pthread_mutex_unlock(&spect.publish_mutex);
+}
+
+/*
+ * Tell the watchers of a game that it is over, and stop their watching.
+ */
+void spect_ended(GAME *game, GAME_ROLE winner)
+{
+    pthread_mutex_lock(&spect.publish_mutex);
+    CHANNEL *ch = *channel_slot(game);
+    if (ch != NULL && !ch->ended)
+    {
+        SPECT_BUFFER *buf = buffer_new(JEUX_ENDED_PKT, ch->id, winner, NULL, 0);
+        if (buf != NULL)
+        {
+            ch->ended = 1;
+            publish(ch, buf);
+        }
+    }
+    pthread_mutex_unlock(&spect.publish_mutex);
+}
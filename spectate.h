@@ -0,0 +1,43 @@
+#ifndef SPECTATE_H
+#define SPECTATE_H
+
+#include "global.h"
+#include "matchmaking.h"
+
+/*
+ * Spectators.
+ *
+ * A logged-in client sends WATCH with the username of a player as the
+ * payload to watch that player's game in progress.  It is sent an ACK
+ * whose ID identifies the game to the watcher and whose payload is the
+ * current state of the game.  After each move it is sent MOVED with that
+ * ID and the new state, and when the game is over, ENDED with that ID
+ * and the winner's role, after which it is no longer watching.  UNWATCH
+ * with the ID stops watching.
+ *
+ * Each watched GAME has a channel holding its subscribers.  A move is
+ * encoded once, as a complete packet in a reference-counted buffer, and
+ * the moving thread only swaps that buffer into the channel and wakes
+ * the broadcaster thread, so it does not depend on the number or speed
+ * of the watchers.  The broadcaster gives each watcher a reference to
+ * the latest buffer and writes it to those watchers whose sockets are
+ * writable.  A watcher that falls behind is not queued every move: it
+ * is sent only the latest state once its socket drains.  Watchers are
+ * not carried across a hot restart.
+ */
+
+#define JEUX_WATCH_PKT (JEUX_SEEK_PKT + 1)
+#define JEUX_UNWATCH_PKT (JEUX_WATCH_PKT + 1)
+
+#define SPECTATE_BUCKETS 1024
+#define SPECTATE_RETRY_MS 50
+
+int spect_init(void);
+void spect_fini(void);
+int spect_watch(CLIENT *client, char *username, char **statep);
+int spect_unwatch(CLIENT *client, int id);
+void spect_client_gone(CLIENT *client);
+void spect_moved(GAME *game, char *state);
+void spect_ended(GAME *game, GAME_ROLE winner);
+
+#endif
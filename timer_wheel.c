@@ -0,0 +1,386 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timer_wheel.h"
+#include "jlog.h"
+
+typedef enum {
+    TIMER_IDLE,
+    TIMER_PENDING,
+    TIMER_RUNNING
+} TIMER_STATE;
+
+struct twheel_timer {
+    struct twheel_timer *next;
+    struct twheel_timer **pprev;    // Link that points to this timer
+    unsigned long expires;          // Tick at which the timer fires
+    TWHEEL_CALLBACK callback;
+    void *arg;
+    TIMER_STATE state;
+    int cancelled;                  // Cancelled while its callback was running
+    unsigned long reschedule;       // Ticks, if rescheduled while running
+    int one_shot;                   // Freed by the wheel once it is done
+};
+
+static struct {
+    int running;
+    int stop;
+    unsigned long now;              // Current tick
+    struct timespec start;
+    TWHEEL_TIMER *slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;            // Signalled to stop the wheel thread
+    pthread_cond_t done;            // Broadcast when a callback returns
+    pthread_t thread;
+} wheel = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+static unsigned long ms_to_ticks(unsigned long ms)
+{
+    unsigned long ticks = (ms + TWHEEL_TICK_MS - 1) / TWHEEL_TICK_MS;
+    return ticks > 0 ? ticks : 1;
+}
+
+static void unlink_timer(TWHEEL_TIMER *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/*
+ * Put a timer in the slot for its expiry time.  The level is chosen by
+ * how far in the future that is; timers beyond the range of the top
+ * level are clamped to its end and simply fire early.  A timer that
+ * expires at the current tick (which only happens while cascading)
+ * goes into the level 0 slot that is about to be collected.
+ */
+static void insert_timer(TWHEEL_TIMER *timer)
+{
+    if (timer->expires < wheel.now)
+    {
+        timer->expires = wheel.now;
+    }
+    unsigned long delta = timer->expires - wheel.now;
+    int level = 0;
+    while (level < TWHEEL_LEVELS - 1 && delta >= 1UL << (TWHEEL_SLOT_BITS * (level + 1)))
+    {
+        level++;
+    }
+    if (delta >= 1UL << (TWHEEL_SLOT_BITS * TWHEEL_LEVELS))
+    {
+        timer->expires = wheel.now + (1UL << (TWHEEL_SLOT_BITS * TWHEEL_LEVELS)) - 1;
+    }
+    int index = (timer->expires >> (TWHEEL_SLOT_BITS * level)) & (TWHEEL_SLOTS - 1);
+
+    TWHEEL_TIMER **head = &wheel.slots[level][index];
+    timer->next = *head;
+    if (*head != NULL)
+    {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->state = TIMER_PENDING;
+}
+
+static void schedule_ticks(TWHEEL_TIMER *timer, unsigned long ticks)
+{
+    timer->expires = wheel.now + ticks;
+    insert_timer(timer);
+}
+
+/*
+ * Advance the wheel by one tick and return the list of timers that have
+ * expired.  When level 0 wraps, the current slot of each level whose
+ * lower levels have all wrapped is redistributed, highest level first
+ * so that its timers can land in the slot of the level below that is
+ * about to be cascaded too.
+ */
+static TWHEEL_TIMER *advance(void)
+{
+    __atomic_store_n(&wheel.now, wheel.now + 1, __ATOMIC_RELAXED);
+
+    int top = 0;
+    while (top < TWHEEL_LEVELS - 1 &&
+           (wheel.now & ((1UL << (TWHEEL_SLOT_BITS * (top + 1))) - 1)) == 0)
+    {
+        top++;
+    }
+    for (int level = top; level > 0; level--)
+    {
+        int index = (wheel.now >> (TWHEEL_SLOT_BITS * level)) & (TWHEEL_SLOTS - 1);
+        TWHEEL_TIMER *list = wheel.slots[level][index];
+        wheel.slots[level][index] = NULL;
+        while (list != NULL)
+        {
+            TWHEEL_TIMER *timer = list;
+            list = list->next;
+            insert_timer(timer);
+        }
+    }
+
+    int index = wheel.now & (TWHEEL_SLOTS - 1);
+    TWHEEL_TIMER *expired = wheel.slots[0][index];
+    wheel.slots[0][index] = NULL;
+    return expired;
+}
+
+/*
+ * Run the callbacks of expired timers.  Called and returns with the
+ * wheel lock held, but releases it around each callback.
+ */
+static void run_expired(TWHEEL_TIMER *expired)
+{
+    while (expired != NULL)
+    {
+        TWHEEL_TIMER *timer = expired;
+        expired = expired->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        timer->state = TIMER_RUNNING;
+        timer->cancelled = 0;
+        timer->reschedule = 0;
+
+        pthread_mutex_unlock(&wheel.mutex);
+        unsigned long delay = timer->callback(timer->arg);
+        pthread_mutex_lock(&wheel.mutex);
+
+        timer->state = TIMER_IDLE;
+        if (timer->cancelled)
+        {
+            timer->cancelled = 0;
+        }
+        else if (timer->reschedule > 0 && !(timer->one_shot && delay == 0))
+        {
+            schedule_ticks(timer, timer->reschedule);
+        }
+        else if (delay > 0)
+        {
+            schedule_ticks(timer, ms_to_ticks(delay));
+        }
+        if (timer->state == TIMER_IDLE && timer->one_shot)
+        {
+            free(timer);
+        }
+        pthread_cond_broadcast(&wheel.done);
+    }
+}
+
+static unsigned long elapsed_ticks(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long ms = (now.tv_sec - wheel.start.tv_sec) * 1000UL +
+                       (now.tv_nsec - wheel.start.tv_nsec) / 1000000L;
+    return ms / TWHEEL_TICK_MS;
+}
+
+static void *wheel_thread(void *arg)
+{
+    pthread_mutex_lock(&wheel.mutex);
+    while (!wheel.stop)
+    {
+        unsigned long target = elapsed_ticks();
+        while (!wheel.stop && wheel.now < target)
+        {
+            run_expired(advance());
+        }
+
+        struct timespec deadline = wheel.start;
+        unsigned long next_ms = (wheel.now + 1) * TWHEEL_TICK_MS;
+        deadline.tv_sec += next_ms / 1000;
+        deadline.tv_nsec += (next_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        int rc = 0;
+        while (!wheel.stop && rc != ETIMEDOUT)
+        {
+            rc = pthread_cond_timedwait(&wheel.wake, &wheel.mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+    return NULL;
+}
+
+/*
+ * Start the wheel thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int twheel_init(void)
+{
+    jlog_trace("enter");
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel.wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    clock_gettime(CLOCK_MONOTONIC, &wheel.start);
+    if (pthread_create(&wheel.thread, NULL, wheel_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    wheel.running = 1;
+    return 0;
+}
+
+/*
+ * Stop the wheel thread.  Timers that have not fired are abandoned.
+ */
+void twheel_fini(void)
+{
+    jlog_trace("enter");
+
+    if (!wheel.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&wheel.mutex);
+    wheel.stop = 1;
+    pthread_cond_signal(&wheel.wake);
+    pthread_mutex_unlock(&wheel.mutex);
+    pthread_join(wheel.thread, NULL);
+    wheel.running = 0;
+}
+
+/*
+ * @return  The current time of the wheel in milliseconds, with a
+ * resolution of TWHEEL_TICK_MS.  This does not take the wheel lock.
+ */
+unsigned long twheel_now(void)
+{
+    return __atomic_load_n(&wheel.now, __ATOMIC_RELAXED) * TWHEEL_TICK_MS;
+}
+
+/*
+ * Create a timer, which is not scheduled.
+ *
+ * @param callback  Function to be called when the timer fires.
+ * @param arg  Argument to be passed to the callback.
+ * @return  The new timer, or NULL if it could not be allocated.
+ */
+TWHEEL_TIMER *twheel_timer_create(TWHEEL_CALLBACK callback, void *arg)
+{
+    TWHEEL_TIMER *timer = calloc(1, sizeof(TWHEEL_TIMER));
+    if (timer == NULL)
+    {
+        return NULL;
+    }
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->state = TIMER_IDLE;
+    return timer;
+}
+
+/*
+ * Schedule a timer to fire after a delay, replacing any earlier
+ * schedule.  If the callback is currently running, the new delay takes
+ * precedence over the one the callback returns (except that a timer from
+ * twheel_start() still ends if its callback returns 0).
+ */
+void twheel_timer_schedule(TWHEEL_TIMER *timer, unsigned long delay_ms)
+{
+    pthread_mutex_lock(&wheel.mutex);
+    if (timer->state == TIMER_RUNNING)
+    {
+        timer->cancelled = 0;
+        timer->reschedule = ms_to_ticks(delay_ms);
+    }
+    else
+    {
+        if (timer->state == TIMER_PENDING)
+        {
+            unlink_timer(timer);
+        }
+        schedule_ticks(timer, ms_to_ticks(delay_ms));
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+}
+
+/*
+ * Cancel a timer.  If its callback is running on the wheel thread, wait
+ * for it to return (unless called from that callback), so that once this
+ * returns the callback is not running and will not run again.
+ */
+void twheel_timer_cancel(TWHEEL_TIMER *timer)
+{
+    pthread_mutex_lock(&wheel.mutex);
+    if (timer->state == TIMER_PENDING)
+    {
+        unlink_timer(timer);
+        timer->state = TIMER_IDLE;
+    }
+    else if (timer->state == TIMER_RUNNING)
+    {
+        timer->cancelled = 1;
+        timer->reschedule = 0;
+        if (!pthread_equal(pthread_self(), wheel.thread))
+        {
+            while (timer->state == TIMER_RUNNING)
+            {
+                pthread_cond_wait(&wheel.done, &wheel.mutex);
+            }
+        }
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+}
+
+/*
+ * Cancel a timer and free it.  If this is called from the timer's own
+ * callback, the timer is freed once the callback returns.
+ */
+void twheel_timer_free(TWHEEL_TIMER *timer)
+{
+    if (timer == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&wheel.mutex);
+    if (timer->state == TIMER_RUNNING && pthread_equal(pthread_self(), wheel.thread))
+    {
+        // Only one callback runs at a time, so this is the timer's own
+        timer->cancelled = 1;
+        timer->reschedule = 0;
+        timer->one_shot = 1;
+        pthread_mutex_unlock(&wheel.mutex);
+        return;
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+    twheel_timer_cancel(timer);
+    free(timer);
+}
+
+/*
+ * Start a timer that is owned by the wheel: it is freed once its
+ * callback returns 0, even if it was rescheduled while the callback was
+ * running.  The returned handle may be passed to twheel_timer_schedule()
+ * only as long as the caller knows that the callback has not yet
+ * returned 0, and must not be cancelled or freed.
+ *
+ * @return  The timer, or NULL if it could not be created.
+ */
+TWHEEL_TIMER *twheel_start(unsigned long delay_ms, TWHEEL_CALLBACK callback, void *arg)
+{
+    TWHEEL_TIMER *timer = twheel_timer_create(callback, arg);
+    if (timer == NULL)
+    {
+        return NULL;
+    }
+    timer->one_shot = 1;
+    twheel_timer_schedule(timer, delay_ms);
+    return timer;
+}
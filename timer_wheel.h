@@ -0,0 +1,39 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/*
+ * Hierarchical timer wheel shared by the modules that need timeouts.
+ *
+ * Time advances in ticks of TWHEEL_TICK_MS.  Level 0 has one slot per
+ * tick for the next TWHEEL_SLOTS ticks, and each higher level has slots
+ * TWHEEL_SLOTS times as wide; when level 0 wraps, the next slot of the
+ * level above is cascaded down.  Scheduling and cancelling a timer are
+ * O(1).  Callbacks run on the wheel thread without the wheel lock held,
+ * so they may take other locks and send packets.  A callback returns the
+ * delay in milliseconds after which it should run again, or 0 if the
+ * timer is done.
+ *
+ * For timeouts that are pushed back on every event (such as idle
+ * timeouts), record the time of the event with twheel_now() and let the
+ * callback compute the remaining delay, rather than rescheduling on
+ * every event.
+ */
+
+#define TWHEEL_TICK_MS 100
+#define TWHEEL_SLOT_BITS 6
+#define TWHEEL_SLOTS (1 << TWHEEL_SLOT_BITS)
+#define TWHEEL_LEVELS 4
+
+typedef struct twheel_timer TWHEEL_TIMER;
+typedef unsigned long (*TWHEEL_CALLBACK)(void *arg);
+
+int twheel_init(void);
+void twheel_fini(void);
+unsigned long twheel_now(void);
+TWHEEL_TIMER *twheel_timer_create(TWHEEL_CALLBACK callback, void *arg);
+void twheel_timer_schedule(TWHEEL_TIMER *timer, unsigned long delay_ms);
+void twheel_timer_cancel(TWHEEL_TIMER *timer);
+void twheel_timer_free(TWHEEL_TIMER *timer);
+TWHEEL_TIMER *twheel_start(unsigned long delay_ms, TWHEEL_CALLBACK callback, void *arg);
+
+#endif
@@ -0,0 +1,678 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "tournament.h"
+#include "global.h"
+#include "jlog.h"
+
+typedef enum { TOURNEY_SWISS, TOURNEY_ROUND_ROBIN } TOURNEY_FORMAT;
+
+typedef struct entrant {
+    CLIENT *client;
+    int rating;                     // At the start, for seeding
+    int score;                      // In half-points
+    int firsts;                     // Games played as the first player
+    int had_bye;
+    int *met;                       // Swiss: opponents so far, by index
+    int nmet;
+} ENTRANT;
+
+typedef struct match {
+    struct tourney *tourney;
+    int first;                      // Entrant indices
+    int second;
+    GAME *game;                     // Set while the game is in progress
+    struct match *hash_next;
+} MATCH;
+
+/*
+ * Once a tournament has started, its entrants are in seed order and an
+ * entrant's index is its seed.
+ */
+typedef struct tourney {
+    int id;
+    TOURNEY_FORMAT format;
+    CLIENT *organizer;
+    ENTRANT *entrants;
+    int nentrants;
+    int capacity;
+    int rounds;                     // 0 for a Swiss tournament until started
+    int round;                      // Rounds paired so far
+    int started;
+    MATCH *matches;                 // Of the current round
+    int nmatches;
+    int pending;                    // Games of the current round not over
+    int *order;                     // Scratch space for pairing
+    int *counts;
+    char *paired;
+    int ready;                      // On tourn.ready
+    struct tourney *ready_next;
+    struct tourney *next;
+} TOURNEY;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    TOURNEY *all;
+    TOURNEY *ready;                 // Waiting for the scheduler
+    MATCH *by_game[TOURNEY_BUCKETS];
+    int next_id;
+    int running;
+    int stop;
+    pthread_t thread;
+} tourn = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static unsigned int hash_pointer(void *p)
+{
+    uintptr_t h = (uintptr_t)p;
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & (TOURNEY_BUCKETS - 1);
+}
+
+// Called with tourn.mutex held
+static MATCH **match_slot(GAME *game)
+{
+    MATCH **link = &tourn.by_game[hash_pointer(game)];
+    while (*link != NULL && (*link)->game != game)
+    {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+// Called with tourn.mutex held
+static TOURNEY *find_tourney(int id)
+{
+    TOURNEY *t = tourn.all;
+    while (t != NULL && t->id != id)
+    {
+        t = t->next;
+    }
+    return t;
+}
+
+// Called with tourn.mutex held
+static void make_ready(TOURNEY *t)
+{
+    if (!t->ready)
+    {
+        t->ready = 1;
+        t->ready_next = tourn.ready;
+        tourn.ready = t;
+        pthread_cond_signal(&tourn.cond);
+    }
+}
+
+/*
+ * Score a game of the current round, in half-points, and hand the
+ * tournament to the scheduler once the round is over.  Called with
+ * tourn.mutex held.
+ */
+static void record(TOURNEY *t, MATCH *m, int first_points, int second_points)
+{
+    t->entrants[m->first].score += first_points;
+    t->entrants[m->second].score += second_points;
+    if (--t->pending == 0)
+    {
+        make_ready(t);
+    }
+}
+
+static void record_winner(TOURNEY *t, MATCH *m, GAME_ROLE winner)
+{
+    record(t, m, winner == FIRST_PLAYER_ROLE ? 2 : winner == NULL_ROLE ? 1 : 0,
+           winner == SECOND_PLAYER_ROLE ? 2 : winner == NULL_ROLE ? 1 : 0);
+}
+
+// Called with tourn.mutex held
+static void add_match(TOURNEY *t, int a, int b)
+{
+    ENTRANT *ea = &t->entrants[a];
+    ENTRANT *eb = &t->entrants[b];
+    MATCH *m = &t->matches[t->nmatches++];
+    m->tourney = t;
+    m->first = ea->firsts <= eb->firsts ? a : b;
+    m->second = m->first == a ? b : a;
+    m->game = NULL;
+    m->hash_next = NULL;
+    t->entrants[m->first].firsts++;
+    if (t->format == TOURNEY_SWISS)
+    {
+        ea->met[ea->nmet++] = b;
+        eb->met[eb->nmet++] = a;
+    }
+}
+
+static int have_met(ENTRANT *e, int other)
+{
+    for (int i = 0; i < e->nmet; i++)
+    {
+        if (e->met[i] == other)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pair a Swiss round.  Entrants are ordered by score, then seed, with a
+ * counting sort over the possible scores; each unpaired entrant in turn
+ * is paired with the first unpaired entrant below it that it has not
+ * met, looking no further than TOURNEY_LOOKAHEAD candidates.  Called
+ * with tourn.mutex held.
+ */
+static void pair_swiss(TOURNEY *t)
+{
+    int n = t->nentrants;
+    int max = 2 * t->round;
+    memset(t->counts, 0, (max + 2) * sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        t->counts[max - t->entrants[i].score + 1]++;
+    }
+    for (int s = 1; s <= max + 1; s++)
+    {
+        t->counts[s] += t->counts[s - 1];
+    }
+    for (int i = 0; i < n; i++)
+    {
+        t->order[t->counts[max - t->entrants[i].score]++] = i;
+    }
+
+    if (n > 0)
+    {
+        memset(t->paired, 0, (size_t)n);
+    }
+    if (n % 2 == 1)
+    {
+        // The bye goes to the lowest entrant that has not had one
+        int bye = t->order[n - 1];
+        for (int i = n - 1; i >= 0; i--)
+        {
+            if (!t->entrants[t->order[i]].had_bye)
+            {
+                bye = t->order[i];
+                break;
+            }
+        }
+        t->paired[bye] = 1;
+        t->entrants[bye].had_bye = 1;
+        t->entrants[bye].score += 2;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        int a = t->order[i];
+        if (t->paired[a])
+        {
+            continue;
+        }
+        int pick = -1;
+        int fallback = -1;
+        int seen = 0;
+        for (int j = i + 1; j < n && seen < TOURNEY_LOOKAHEAD; j++)
+        {
+            int b = t->order[j];
+            if (t->paired[b])
+            {
+                continue;
+            }
+            if (fallback < 0)
+            {
+                fallback = b;
+            }
+            seen++;
+            if (!have_met(&t->entrants[a], b))
+            {
+                pick = b;
+                break;
+            }
+        }
+        if (pick < 0)
+        {
+            pick = fallback;
+        }
+        if (pick < 0)
+        {
+            break;
+        }
+        t->paired[a] = 1;
+        t->paired[pick] = 1;
+        add_match(t, a, pick);
+    }
+}
+
+/*
+ * Pair a round-robin round by the circle method: entrant 0 stays put and
+ * the others rotate one place each round.  With an odd number of
+ * entrants, whoever meets the extra slot has a bye.  Called with
+ * tourn.mutex held.
+ */
+static void pair_round_robin(TOURNEY *t)
+{
+    int n = t->nentrants;
+    int slots = n + n % 2;
+    for (int i = 0; i < slots / 2; i++)
+    {
+        int k = slots - 1 - i;
+        int a = i == 0 ? 0 : 1 + (i - 1 + t->round) % (slots - 1);
+        int b = 1 + (k - 1 + t->round) % (slots - 1);
+        if (a < n && b < n)
+        {
+            add_match(t, a, b);
+        }
+    }
+}
+
+// Called with tourn.mutex held
+static void pair_round(TOURNEY *t)
+{
+    t->nmatches = 0;
+    if (t->format == TOURNEY_SWISS)
+    {
+        pair_swiss(t);
+    }
+    else
+    {
+        pair_round_robin(t);
+    }
+    t->round++;
+    t->pending = t->nmatches;
+    if (t->pending == 0)
+    {
+        make_ready(t);
+    }
+    jlog_info("tournament %d: round %d of %d, %d games",
+              t->id, t->round, t->rounds, t->nmatches);
+}
+
+/*
+ * Start the games of the round that has just been paired.  Called by the
+ * scheduler without tourn.mutex held, since client_start_game() takes the
+ * locks of both clients, and a game may end at any time after it starts.
+ */
+static void play_round(TOURNEY *t)
+{
+    for (int i = 0; i < t->nmatches; i++)
+    {
+        MATCH *m = &t->matches[i];
+        CLIENT *first = t->entrants[m->first].client;
+        CLIENT *second = t->entrants[m->second].client;
+        GAME *game = NULL;
+        if (client_start_game(first, second, &game) != 0)
+        {
+            // An entrant that has logged out forfeits
+            int first_here = client_get_player(first) != NULL;
+            int second_here = client_get_player(second) != NULL;
+            pthread_mutex_lock(&tourn.mutex);
+            record(t, m, first_here && !second_here ? 2 : 0,
+                   second_here && !first_here ? 2 : 0);
+            pthread_mutex_unlock(&tourn.mutex);
+            continue;
+        }
+
+        pthread_mutex_lock(&tourn.mutex);
+        if (game_is_over(game))
+        {
+            // It ended before it could be looked up
+            record_winner(t, m, game_get_winner(game));
+            pthread_mutex_unlock(&tourn.mutex);
+            game_unref(game, "tournament game over");
+            continue;
+        }
+        m->game = game;
+        MATCH **slot = match_slot(game);
+        m->hash_next = *slot;
+        *slot = m;
+        pthread_mutex_unlock(&tourn.mutex);
+    }
+}
+
+static int compare_seed(const void *a, const void *b)
+{
+    const ENTRANT *ea = a;
+    const ENTRANT *eb = b;
+    return eb->rating - ea->rating;
+}
+
+static void tourney_free(TOURNEY *t)
+{
+    for (int i = 0; i < t->nentrants; i++)
+    {
+        client_unref(t->entrants[i].client, "left tournament");
+        free(t->entrants[i].met);
+    }
+    free(t->entrants);
+    free(t->matches);
+    free(t->order);
+    free(t->counts);
+    free(t->paired);
+    free(t);
+}
+
+/*
+ * Send each entrant still logged in its final place and score, and free
+ * the tournament.  Called by the scheduler without tourn.mutex held, once
+ * the tournament is no longer on tourn.all.
+ */
+static void finish(TOURNEY *t)
+{
+    int n = t->nentrants;
+    int max = 2 * t->rounds;
+    int *better = calloc(max + 2, sizeof(int));
+    if (better != NULL)
+    {
+        // better[s] is the number of entrants with a score above s
+        for (int i = 0; i < n; i++)
+        {
+            int s = t->entrants[i].score;
+            better[s > max ? max : s]++;
+        }
+        int above = 0;
+        for (int s = max; s >= 0; s--)
+        {
+            int here = better[s];
+            better[s] = above;
+            above += here;
+        }
+    }
+    jlog_info("tournament %d: over after %d rounds", t->id, t->round);
+
+    for (int i = 0; i < n && better != NULL; i++)
+    {
+        ENTRANT *e = &t->entrants[i];
+        if (client_get_player(e->client) == NULL)
+        {
+            continue;
+        }
+        int s = e->score > max ? max : e->score;
+        char msg[100];
+        snprintf(msg, sizeof(msg), "Tournament #%d is over\nPlace %d of %d with %d%s points",
+                 t->id, better[s] + 1, n, e->score / 2, e->score % 2 ? ".5" : "");
+        JEUX_PACKET_HEADER hdr = {0};
+        hdr.type = JEUX_TOURNEY_PKT;
+        hdr.id = t->id;
+        hdr.size = strlen(msg);
+        client_send_packet(e->client, &hdr, msg);
+    }
+    free(better);
+    tourney_free(t);
+}
+
+static void *scheduler_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&tourn.mutex);
+        while (!tourn.stop && tourn.ready == NULL)
+        {
+            pthread_cond_wait(&tourn.cond, &tourn.mutex);
+        }
+        if (tourn.stop)
+        {
+            pthread_mutex_unlock(&tourn.mutex);
+            break;
+        }
+        TOURNEY *t = tourn.ready;
+        tourn.ready = t->ready_next;
+        t->ready = 0;
+
+        if (t->round == t->rounds)
+        {
+            TOURNEY **link = &tourn.all;
+            while (*link != t)
+            {
+                link = &(*link)->next;
+            }
+            *link = t->next;
+            pthread_mutex_unlock(&tourn.mutex);
+            finish(t);
+            continue;
+        }
+        pair_round(t);
+        pthread_mutex_unlock(&tourn.mutex);
+        play_round(t);
+    }
+    return NULL;
+}
+
+/*
+ * Start the scheduler thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int tourney_init(void)
+{
+    if (pthread_create(&tourn.thread, NULL, scheduler_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    tourn.running = 1;
+    return 0;
+}
+
+/*
+ * Stop the scheduler thread and abandon all tournaments.
+ */
+void tourney_fini(void)
+{
+    if (!tourn.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&tourn.mutex);
+    tourn.stop = 1;
+    pthread_cond_signal(&tourn.cond);
+    pthread_mutex_unlock(&tourn.mutex);
+    pthread_join(tourn.thread, NULL);
+    tourn.running = 0;
+
+    for (int i = 0; i < TOURNEY_BUCKETS; i++)
+    {
+        while (tourn.by_game[i] != NULL)
+        {
+            MATCH *m = tourn.by_game[i];
+            tourn.by_game[i] = m->hash_next;
+            game_unref(m->game, "tournament abandoned");
+        }
+    }
+    while (tourn.all != NULL)
+    {
+        TOURNEY *t = tourn.all;
+        tourn.all = t->next;
+        tourney_free(t);
+    }
+    tourn.ready = NULL;
+}
+
+// Called with tourn.mutex held
+static int join(TOURNEY *t, CLIENT *client)
+{
+    if (t->started)
+    {
+        return -1;
+    }
+    for (int i = 0; i < t->nentrants; i++)
+    {
+        if (t->entrants[i].client == client)
+        {
+            return -1;
+        }
+    }
+    if (t->nentrants == t->capacity)
+    {
+        int capacity = t->capacity ? 2 * t->capacity : 16;
+        ENTRANT *entrants = realloc(t->entrants, capacity * sizeof(ENTRANT));
+        if (entrants == NULL)
+        {
+            return -1;
+        }
+        t->entrants = entrants;
+        t->capacity = capacity;
+    }
+    ENTRANT *e = &t->entrants[t->nentrants++];
+    memset(e, 0, sizeof(ENTRANT));
+    e->client = client_ref(client, "entered tournament");
+    return 0;
+}
+
+static int create(CLIENT *client, TOURNEY_FORMAT format, int rounds)
+{
+    TOURNEY *t = calloc(1, sizeof(TOURNEY));
+    if (t == NULL)
+    {
+        return -1;
+    }
+    t->format = format;
+    t->rounds = rounds;
+    t->organizer = client;
+
+    pthread_mutex_lock(&tourn.mutex);
+    if (join(t, client) != 0)
+    {
+        pthread_mutex_unlock(&tourn.mutex);
+        free(t);
+        return -1;
+    }
+    t->id = ++tourn.next_id;
+    t->next = tourn.all;
+    tourn.all = t;
+    pthread_mutex_unlock(&tourn.mutex);
+    jlog_info("tournament %d: created", t->id);
+    return t->id;
+}
+
+/*
+ * Seed the entrants by rating, size the tournament and hand it to the
+ * scheduler for its first round.
+ */
+static int start(TOURNEY *t, CLIENT *client)
+{
+    int n = t->nentrants;
+    if (t->started || client != t->organizer || n < 2)
+    {
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        PLAYER *player = client_get_player(t->entrants[i].client);
+        t->entrants[i].rating = player != NULL ? player_get_rating(player) : 0;
+    }
+    qsort(t->entrants, n, sizeof(ENTRANT), compare_seed);
+
+    if (t->format == TOURNEY_ROUND_ROBIN)
+    {
+        t->rounds = n % 2 ? n : n - 1;
+    }
+    else
+    {
+        if (t->rounds == 0)
+        {
+            while ((1 << t->rounds) < n)
+            {
+                t->rounds++;
+            }
+        }
+        if (t->rounds > n - 1)
+        {
+            t->rounds = n - 1;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if ((t->entrants[i].met = malloc(t->rounds * sizeof(int))) == NULL)
+            {
+                return -1;
+            }
+        }
+    }
+    t->matches = malloc((n / 2) * sizeof(MATCH));
+    t->order = malloc(n * sizeof(int));
+    t->counts = malloc((2 * t->rounds + 2) * sizeof(int));
+    t->paired = malloc(n);
+    if (t->matches == NULL || t->order == NULL || t->counts == NULL || t->paired == NULL)
+    {
+        return -1;
+    }
+    t->started = 1;
+    make_ready(t);
+    jlog_info("tournament %d: started with %d entrants", t->id, n);
+    return 0;
+}
+
+/*
+ * Carry out a TOURNEY command from a logged-in client.
+ *
+ * @param client  The CLIENT that sent the command.
+ * @param id  The ID in the header of the packet.
+ * @param command  The payload: "swiss [<rounds>]", "roundrobin", "join"
+ * or "start".
+ * @return the ID of the tournament concerned, or -1 if the command is
+ * malformed or cannot be carried out.
+ */
+int tourney_command(CLIENT *client, int id, char *command)
+{
+    if (client_get_player(client) == NULL || !tourn.running || command == NULL)
+    {
+        return -1;
+    }
+    if (strncmp(command, "swiss", 5) == 0 && (command[5] == '\0' || command[5] == ' '))
+    {
+        int rounds = 0;
+        char extra;
+        if (command[5] == ' ' &&
+            (sscanf(command + 6, "%d %c", &rounds, &extra) != 1 ||
+             rounds < 1 || rounds > TOURNEY_MAX_ROUNDS))
+        {
+            return -1;
+        }
+        return create(client, TOURNEY_SWISS, rounds);
+    }
+    if (strcmp(command, "roundrobin") == 0)
+    {
+        return create(client, TOURNEY_ROUND_ROBIN, 0);
+    }
+
+    int rc = -1;
+    pthread_mutex_lock(&tourn.mutex);
+    TOURNEY *t = find_tourney(id);
+    if (t != NULL && strcmp(command, "join") == 0)
+    {
+        rc = join(t, client);
+    }
+    else if (t != NULL && strcmp(command, "start") == 0)
+    {
+        rc = start(t, client);
+    }
+    pthread_mutex_unlock(&tourn.mutex);
+    return rc == 0 ? id : -1;
+}
+
+/*
+ * Score a game that has ended, if it is a tournament game.  Called
+ * wherever a game in progress ends, after its result is known.
+ */
+void tourney_game_ended(GAME *game, GAME_ROLE winner)
+{
+    pthread_mutex_lock(&tourn.mutex);
+    MATCH **slot = match_slot(game);
+    MATCH *m = *slot;
+    if (m != NULL)
+    {
+        *slot = m->hash_next;
+        m->game = NULL;
+        record_winner(m->tourney, m, winner);
+    }
+    pthread_mutex_unlock(&tourn.mutex);
+    if (m != NULL)
+    {
+        game_unref(game, "tournament game over");
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef TOURNAMENT_H
+#define TOURNAMENT_H
+
+#include "global.h"
+#include "spectate.h"
+
+/*
+ * Tournaments.
+ *
+ * A logged-in client sends TOURNEY with a command as the payload:
+ *
+ *   "swiss [<rounds>]"  creates a Swiss tournament, of ceil(log2(n))
+ *                       rounds for n entrants unless a number is given;
+ *   "roundrobin"        creates a round-robin tournament;
+ *   "join"              enters the tournament whose ID is in the header;
+ *   "start"             starts the tournament whose ID is in the header.
+ *
+ * Each is answered with an ACK whose ID is that of the tournament, or a
+ * NACK.  The client that created a tournament enters it, and is the only
+ * one that may start it.  Entrants cannot join once it has started.
+ *
+ * Each round is started in bulk by a scheduler thread: every game of the
+ * round is created at once with client_start_game(), without INVITE and
+ * ACCEPT, so each entrant is sent ACCEPTED for its game.  Once every game
+ * of the round is over, the scheduler starts the next round.  An entrant
+ * that has logged out forfeits its games.  A win scores 2 half-points
+ * and a draw 1; in a Swiss tournament a bye scores as a win, and in a
+ * round robin it scores nothing.  When the last round is over, each
+ * entrant is sent TOURNEY with the tournament's ID and its final place
+ * and score as the payload.  Results are rated as for any other game.
+ *
+ * A Swiss round pairs entrants in order of score, then seed (rating at
+ * the start), after sorting them by score with a counting sort, so a
+ * round takes time proportional to the number of entrants.  Entrants who
+ * have met before are not paired again if an opponent can be found among
+ * the next TOURNEY_LOOKAHEAD entrants in order.  Round robin uses the
+ * circle method.  Pairing takes only the tournament lock: no client or
+ * registry lock is held.  Tournaments are not carried across a hot
+ * restart.
+ */
+
+#define JEUX_TOURNEY_PKT (JEUX_UNWATCH_PKT + 1)
+
+#define TOURNEY_BUCKETS 4096
+#define TOURNEY_LOOKAHEAD 8
+#define TOURNEY_MAX_ROUNDS 64          // For Swiss tournaments
+
+int tourney_init(void);
+void tourney_fini(void);
+int tourney_command(CLIENT *client, int id, char *command);
+void tourney_game_ended(GAME *game, GAME_ROLE winner);
+
+#endif